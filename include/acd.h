@@ -0,0 +1,58 @@
+#ifndef ACD_H
+#define ACD_H
+
+/*
+ * Call queues (automatic call distribution).
+ *
+ * When the server runs with call queueing turned on (-q), a caller who dials a
+ * busy phone or a hunt group with nobody free isn't simply given a busy signal
+ * and left to redial.  It goes to the TU_BUSY_SIGNAL state as before, but is
+ * told "QUEUED <position>" instead, and waits in a first-in, first-out queue
+ * belonging to the phone or the group.  As soon as the phone (or a member of
+ * the group) goes back on hook, the caller at the head of the queue is
+ * connected to it exactly as if it had dialed it then: it goes to TU_RING_BACK
+ * and the phone starts ringing.  Callers further back are sent their new
+ * position whenever it changes.  Hanging up leaves the queue.
+ *
+ * A queue is served by a single thread of its own, woken whenever a queue
+ * with callers in it may be able to make progress, so the threads changing TU
+ * states never do more than note that the queue needs looking at.
+ *
+ * ACD_QUEUE and ACD_WAITER are opaque, like PBX and TU.
+ */
+#include "pbx.h"
+
+typedef struct acd_queue ACD_QUEUE;
+typedef struct acd_waiter ACD_WAITER;
+
+/*
+ * Find a TU that a queued caller could be connected to right now, for a queue's
+ * owner.  Returns it with a reference that the queue releases, or NULL if there
+ * is nobody.  Called with the queue locked, so it must not lock any TU.
+ */
+typedef TU *ACD_PICK(void *owner);
+
+/*
+ * Counters kept by a queue.
+ */
+typedef struct acd_stats {
+    int waiting;          //Callers in the queue
+    long queued;          //Callers ever queued
+    long connected;       //Callers connected from the queue
+    long abandoned;       //Callers who hung up while queued
+} ACD_STATS;
+
+ACD_QUEUE *acd_queue_create(ACD_PICK *pick, void *owner);
+void acd_queue_ref(ACD_QUEUE *queue);
+void acd_queue_unref(ACD_QUEUE *queue);
+void acd_queue_close(ACD_QUEUE *queue);
+int acd_waiting(ACD_QUEUE *queue);
+int acd_get_stats(ACD_QUEUE *queue, ACD_STATS *stats);
+void acd_kick(ACD_QUEUE *queue);
+
+ACD_WAITER *acd_enqueue(ACD_QUEUE *queue, TU *tu, int *position);
+void acd_remove(ACD_WAITER *waiter, int connected);
+ACD_QUEUE *acd_waiter_queue(ACD_WAITER *waiter);
+void acd_waiter_free(ACD_WAITER *waiter);
+
+#endif
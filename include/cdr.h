@@ -0,0 +1,71 @@
+#ifndef CDR_H
+#define CDR_H
+
+/*
+ * Call detail records.
+ *
+ * When the server is given a CDR file (-d), every call between two phones that
+ * gets as far as ringing is recorded when it ends: who called whom, when it was
+ * set up, answered (if it was) and hung up, and how many chats and bytes of chat
+ * went over it.
+ *
+ * The threads serving clients never touch the file.  The record of a call in
+ * progress is filled in with both phones locked, as part of the transitions it
+ * records (chats, which only lock the sender, are counted atomically), and when
+ * the call ends it is copied into a lock-free ring with room for CDR_RING_SIZE
+ * records that any number of threads can add to.  A single writer thread
+ * empties the ring every CDR_FLUSH_MS (or as soon as it is half full), formats
+ * everything it finds as CSV, and writes it in large batches.  The file is
+ * rotated once it reaches CDR_ROTATE_BYTES: FILE becomes FILE.1, FILE.1
+ * becomes FILE.2, and so on up to FILE.<CDR_KEEP>.  If the writer ever
+ * falls behind so far that the ring is full, records are dropped and counted
+ * rather than making a hangup wait.
+ */
+#include <stdint.h>
+
+#define CDR_RING_SIZE 32768
+#define CDR_FLUSH_MS 100
+#define CDR_ROTATE_BYTES (64 * 1024 * 1024)
+#define CDR_KEEP 4
+
+/*
+ * First line of every CDR file, naming the fields of each record.
+ */
+#define CDR_CSV_HEADER "call_id,caller,callee,setup_us,answer_us,hangup_us,chats,bytes\n"
+
+/*
+ * One call.  Times are microseconds since the epoch; answer_us is 0 for a call
+ * that was never answered.
+ */
+typedef struct cdr {
+    uint32_t call_id;     //Same as in the event trace
+    int32_t caller;
+    int32_t callee;
+    uint32_t chats;
+    uint64_t bytes;
+    uint64_t setup_us;
+    uint64_t answer_us;
+    uint64_t hangup_us;
+} CDR;
+
+/*
+ * Counters kept by the CDR writer.
+ */
+typedef struct cdr_stats {
+    long recorded;        //Calls that ended while CDRs were being kept
+    long written;         //Records written to the file
+    long dropped;         //Records lost because the ring was full
+    long batches;         //Writes to the file
+    long rotations;
+} CDR_STATS;
+
+int cdr_init(const char *path);
+CDR *cdr_begin(uint32_t call_id, int caller, int callee);
+CDR *cdr_resume(const CDR *rec);
+void cdr_answer(CDR *cdr);
+void cdr_chat(CDR *cdr, size_t bytes);
+void cdr_end(CDR *cdr);
+int cdr_flush(void);
+int cdr_get_stats(CDR_STATS *stats);
+
+#endif
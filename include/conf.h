@@ -0,0 +1,53 @@
+#ifndef CONF_H
+#define CONF_H
+
+/*
+ * Conference bridges.
+ *
+ * A bridge is an extension number (taken from the PBX's allocator, so it never
+ * clashes with a phone) that any number of TUs can be connected to at once.
+ * The "conf" command creates a bridge and connects the TU issuing it; other TUs
+ * join by dialing the bridge's extension, and leave by hanging up.  A chat from
+ * a member goes to every other member as "CHAT <ext>: <text>".
+ *
+ * Each chat is formatted once into a reference-counted buffer that is shared by
+ * all of its recipients.  The sender writes it to each member without blocking;
+ * members whose connections can't take it right away get the buffer queued, and
+ * a relay thread finishes sending when they become writable.  A member that falls
+ * more than CONF_BACKLOG messages behind misses messages rather than holding up
+ * the bridge.
+ *
+ * CONF_BRIDGE is opaque, like PBX and TU.
+ */
+#include "pbx.h"
+
+typedef struct conf_bridge CONF_BRIDGE;
+
+/*
+ * Most chats queued for one slow member before further ones are dropped.
+ */
+#define CONF_BACKLOG 32
+
+/*
+ * Counters kept by a bridge.
+ */
+typedef struct conf_stats {
+    int members;          //TUs currently connected
+    long messages;        //Chats fanned out
+    long sent;            //Deliveries completed by the sending thread
+    long queued;          //Deliveries handed to the relay thread
+    long dropped;         //Deliveries dropped because the member was too far behind
+} CONF_STATS;
+
+int conf_create(PBX *pbx, TU *tu);
+CONF_BRIDGE *conf_lookup(int ext);
+int conf_join(CONF_BRIDGE *bridge, TU *tu);
+int conf_leave(CONF_BRIDGE *bridge, TU *tu);
+int conf_chat(CONF_BRIDGE *bridge, TU *from, char *msg);
+int conf_extension(CONF_BRIDGE *bridge);
+unsigned int conf_call_id(CONF_BRIDGE *bridge);
+int conf_get_stats(CONF_BRIDGE *bridge, CONF_STATS *stats);
+void conf_ref(CONF_BRIDGE *bridge);
+void conf_unref(CONF_BRIDGE *bridge);
+
+#endif
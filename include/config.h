@@ -0,0 +1,63 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/*
+ * Run-time configuration of the PBX server.
+ * The defaults are filled in statically and main() overrides them from the
+ * command line before calling pbx_init().
+ */
+struct pbx_config {
+    int ext_first;        //First extension number handed out to clients
+    int ext_count;        //Number of extensions in the range
+    int reuse_delay_ms;   //Time a released extension stays unassigned
+    int capacity;         //Most TUs that may be registered at once
+    size_t stack_size;    //Stack size for client service threads (0 = system default)
+    int shards;           //Number of independently locked shards in the registry
+    int queue_calls;      //Queue callers to busy phones and groups instead of a busy signal
+    int resume_grace_ms;  //How long a phone whose connection drops is held for its client (0 = never)
+    int idle_timeout_ms;  //How long a client may send nothing before it is disconnected (0 = forever)
+    int ring_timeout_ms;  //How long a phone may ring before the call is given up (0 = forever)
+    int coroutines;       //Serve clients on coroutines instead of a thread each
+    int io_uring;         //Drive the coroutines with io_uring rather than epoll
+    int admit_rate;       //Connections a second from any one source (0 = no limit)
+    int admit_burst;      //Connections at once from any one source
+    int command_rate;     //Commands a second from any one connection (0 = no limit)
+    int command_burst;    //Commands at once from any one connection
+};
+
+/*
+ * Default extension numbering: extensions 1 through PBX_MAX_EXTENSIONS,
+ * reused as soon as they are released.
+ */
+#define PBX_DEFAULT_EXT_FIRST 1
+#define PBX_DEFAULT_REUSE_DELAY_MS 0
+
+/*
+ * Capacity mode.  Asking for more than PBX_MAX_EXTENSIONS registered TUs
+ * (the old FD_SETSIZE limit) switches client service threads to small stacks,
+ * since at that scale the default 8 MB stacks would reserve most of the
+ * address space.  PBX_MAX_CAPACITY is the most that can be asked for.
+ * A registered TU then costs about 9 KiB resident: its 256-byte struct tu,
+ * about 21 bytes of registry slot and allocator entry per extension in the
+ * range, and the 8 KiB or so of its thread's stack that the service loop
+ * touches.  Its socket's kernel state comes on top and isn't counted.
+ */
+#define PBX_LARGE_STACK_SIZE (64 * 1024)
+#define PBX_MAX_CAPACITY (4 * 1024 * 1024)
+
+/*
+ * The registry is split into this many shards unless told otherwise.
+ */
+#define PBX_DEFAULT_SHARDS 16
+#define PBX_MAX_SHARDS 4096
+
+extern struct pbx_config pbx_config;
+
+int config_parse_range(char *spec, int *first, int *count);
+int config_parse_int(char *spec, int min, int max, int *value);
+int config_set_capacity(int capacity);
+int config_parse_rate(char *spec, int *rate, int *burst);
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef CORO_H
+#define CORO_H
+
+/*
+ * Coroutines for serving clients without a thread each.
+ *
+ * With -l, each client connection is served by a coroutine instead of a
+ * thread.  The coroutine runs the same service loop, pbx_client_service()'s,
+ * and reads its connection through coro_read(), which, when nothing has
+ * arrived yet, registers the connection with an epoll scheduler and switches
+ * back to it rather than blocking.  The scheduler's thread then runs whichever
+ * coroutine has input, so one thread serves every client.
+ *
+ * With -u, the scheduler is driven by io_uring instead (see uring.h), and
+ * does the I/O itself rather than just waiting for it.  It accepts
+ * connections on the listening socket with a multishot accept, starting a
+ * coroutine for each, and receives from every connection with a multishot
+ * receive into a shared ring of provided buffers, which coro_read() then
+ * reads out of.  What the coroutines write to their connections through
+ * coro_writev() is queued, and at the end of each round the scheduler sends
+ * it all, as linked sends, in the same io_uring_enter() that waits for the
+ * next round's completions.  Where io_uring or any of those features is
+ * missing, coro_listen() fails and the server falls back to epoll.
+ *
+ * Coroutine stacks are CORO_STACK_SIZE each, carved out of slabs of
+ * CORO_SLAB, and go back to a pool when their coroutine finishes.  Only the
+ * pages a coroutine actually touches are ever backed by memory.
+ *
+ * Only waiting for input yields.  Everything else a coroutine does, including
+ * sending notifications to other clients, happens with TUs locked, and a
+ * coroutine that switched away with a TU locked would stop any other coroutine
+ * that needed the TU, along with the scheduler thread it runs on.  Under
+ * epoll, those writes block as they do with a thread per client: they are
+ * small, and the socket's buffer takes them.  Under io_uring they are queued,
+ * and a connection with more than CORO_SEND_MAX bytes waiting to go out is
+ * taken to be stuck and is shut down.
+ *
+ * Every wait for input, on a coroutine or (through coro_read() and
+ * coro_poll()) on a thread, can be interrupted at once with coro_interrupt(),
+ * so that the whole server can be brought to a stop between commands (see
+ * upgrade.h).  Threads wait in poll() on an eventfd alongside their
+ * connection for this; the schedulers wake every coroutine they have.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Stack size of a coroutine, including the coroutine itself, which sits at
+ * the top.  There are no guard pages, since at 100k coroutines they would take
+ * more mappings than the kernel allows; instead the bottom of each stack is
+ * checked, each time the coroutine switches away, to see it is still untouched.
+ */
+#define CORO_STACK_SIZE (32 * 1024)
+#define CORO_SLAB 64
+
+/*
+ * Most events the scheduler takes from epoll at once.
+ */
+#define CORO_EVENTS 256
+
+/*
+ * The io_uring scheduler: size of its submission queue, number and size of
+ * the provided buffers receives go into, and how many of those a connection
+ * can have waiting to be read before more input is copied aside instead.
+ */
+#define CORO_URING_ENTRIES 4096
+#define CORO_RECV_BUFS 1024
+#define CORO_RECV_BUF_SIZE 512
+#define CORO_IN_BUFS 4
+
+/*
+ * Most bytes that can be waiting to be sent on a connection under io_uring,
+ * the most sends linked in one chain, and how long a connection being closed
+ * is given to send what it still has waiting.
+ */
+#define CORO_SEND_MAX (256 * 1024)
+#define CORO_SEND_LINKS 16
+#define CORO_CLOSE_MS 1000
+
+/*
+ * Most listening sockets the io_uring scheduler can accept on at once.
+ */
+#define CORO_LISTENERS 4
+
+/*
+ * Flag for coro_writev(): fail with EAGAIN rather than wait for room.
+ */
+#define CORO_NOWAIT 1
+
+typedef void CORO_FN(void *arg);
+
+typedef struct coro_stats {
+    long running;     //Coroutines started and not yet finished
+    long spawned;     //Coroutines started since startup
+    long switches;    //Times a coroutine was switched to
+    long stacks;      //Stacks allocated, in use or pooled
+    long enters;      //io_uring_enter() calls
+    long completions; //io_uring completions handled
+    long sends;       //Sends submitted through io_uring
+} CORO_STATS;
+
+int coro_spawn(CORO_FN *fn, void *arg);
+int coro_listen(int listenfd, CORO_FN *fn);
+int coro_active(void);
+ssize_t coro_read(int fd, void *buf, size_t len);
+ssize_t coro_peek(int fd, void *buf, size_t len, int timeout_ms);
+int coro_poll(int fd, int timeout_ms);
+ssize_t coro_writev(int fd, const struct iovec *iov, int iovcnt, int flags);
+int coro_close(int fd);
+ssize_t coro_release(int fd, void *buf, size_t size);
+int coro_rejoin(int fd, const void *input, size_t len);
+int coro_unread(int fd, const void *input, size_t len);
+int coro_adopt(int fd, CORO_FN *fn, const void *input, size_t len);
+int coro_pause_listen(int listenfd, int pause);
+void coro_interrupt(int on);
+void coro_park(void);
+int coro_get_stats(CORO_STATS *stats);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef EXTALLOC_H
+#define EXTALLOC_H
+
+/*
+ * Extension allocator.
+ *
+ * Hands out extension numbers from a fixed range [first, first + count),
+ * independently of the file descriptors of the underlying network connections.
+ * Released numbers are queued in FIFO order and are not handed out again until
+ * a configurable reuse delay has elapsed, so that a number that was just given
+ * up is not immediately redialed into a different telephone.
+ *
+ * Allocation and release are O(1) and lock-free in the common case: a bitmap
+ * records which numbers are in use, and released numbers wait in a bounded
+ * lock-free ring until they are reused.  Numbers that have never been handed
+ * out are taken from a simple atomic cursor.
+ *
+ * EXT_ALLOC is opaque, like PBX and TU.
+ */
+typedef struct ext_alloc EXT_ALLOC;
+
+EXT_ALLOC *ext_alloc_create(int first, int count, int reuse_delay_ms);
+void ext_alloc_destroy(EXT_ALLOC *ea);
+int ext_alloc_get(EXT_ALLOC *ea);
+int ext_alloc_claim(EXT_ALLOC *ea, int ext);
+int ext_alloc_put(EXT_ALLOC *ea, int ext);
+int ext_alloc_owns(EXT_ALLOC *ea, int ext);
+int ext_alloc_in_use(EXT_ALLOC *ea, int ext);
+int ext_alloc_used(EXT_ALLOC *ea);
+
+#endif
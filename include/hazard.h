@@ -0,0 +1,48 @@
+#ifndef HAZARD_H
+#define HAZARD_H
+
+/*
+ * Hazard pointers, for memory that other threads may be looking at when the
+ * last reference to it goes.
+ *
+ * A thread about to use a pointer it has no reference of its own for (a TU's
+ * peer, which it is about to let go of its own lock to wait for) first
+ * publishes it in one of its HAZARD_SLOTS slots.  Memory whose last reference
+ * has gone is retired rather than freed, and is only freed once no slot of
+ * any thread holds it.  Retired memory is checked in batches, so that a
+ * retirement costs O(1) amortized however many threads there are.
+ *
+ * Slots belong to threads, not coroutines: one must be cleared again before
+ * the coroutine that set it can switch away (see coro.h), which it only does
+ * when it reads.
+ */
+
+#define HAZARD_SLOTS 2
+
+/*
+ * Slots, by what they are used for.
+ */
+#define HAZARD_PEER 0   //A TU's peer, while the TU's lock is let go to lock both in order
+
+/*
+ * Retired memory waits until there is at least this much of it, plus two
+ * for every slot of every thread, before the slots are checked.
+ */
+#define HAZARD_SCAN_AT 64
+
+typedef void HAZARD_FREE_FN(void *ptr);
+
+typedef struct hazard_stats {
+    long threads;    //Threads that have had slots (slots of exited threads are reused)
+    long retired;    //Pointers retired since startup
+    long freed;      //Retired pointers freed since startup
+    long scans;      //Times the slots were checked
+} HAZARD_STATS;
+
+int hazard_protect(int slot, void *ptr);
+void hazard_clear(int slot);
+void hazard_retire(void *ptr, HAZARD_FREE_FN *fn);
+void hazard_reclaim(void);
+int hazard_get_stats(HAZARD_STATS *stats);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+/*
+ * Chat history of a call.
+ *
+ * While sessions can be resumed (-g), each call between two phones gets a ring
+ * buffer of its most recent chats when it is answered, from a pool of them, and
+ * gives it back when it is hung up.  Every chat goes into the ring as well as to
+ * the peer, so that a phone whose connection dropped can be sent the chats it
+ * missed when its client comes back (see resume.h).  The ring holds the last
+ * HISTORY_BYTES of chat; anything older is forgotten.
+ *
+ * A history is only ever touched with one of its two TUs locked.  A chat is
+ * added with only its sender locked, so the two TUs may be adding at once, and
+ * the history has a lock of its own for that.
+ */
+#include <stddef.h>
+
+#include "pbx.h"
+
+#define HISTORY_BYTES 4096
+
+/*
+ * Histories are carved out of slabs of this many at a time.
+ */
+#define HISTORY_SLAB 16
+
+typedef struct call_history CALL_HISTORY;
+
+CALL_HISTORY *history_get(TU *a, TU *b);
+void history_put(CALL_HISTORY *history);
+void history_add(CALL_HISTORY *history, TU *to, const char *msg, size_t len);
+void history_mark(CALL_HISTORY *history, TU *tu);
+char *history_missed(CALL_HISTORY *history, TU *tu, size_t *len);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef HUNT_H
+#define HUNT_H
+
+/*
+ * Hunt groups.
+ *
+ * A hunt group is an extension number (taken from the PBX's allocator, like a
+ * conference bridge) standing for a set of member TUs.  Dialing it rings
+ * whichever member has been on hook the longest; if none is on hook, the caller
+ * gets a busy signal as if it had dialed a busy phone.  The "hunt" command
+ * creates a group with the TU issuing it as its first member, "hunt <ext>" joins
+ * an existing group, and a TU leaves its group when it is unregistered.  The
+ * group goes away when its last member leaves.
+ *
+ * Each group keeps its members on two lists under its own lock: the idle list,
+ * in the order the members went on hook, and the busy list.  A member moves
+ * between them whenever its TU goes on or off hook, so picking the member to
+ * ring is a look at the head of the idle list, whatever the size of the group.
+ *
+ * HUNT_GROUP and HUNT_MEMBER are opaque, like PBX and TU.
+ */
+#include "pbx.h"
+
+typedef struct hunt_group HUNT_GROUP;
+typedef struct hunt_member HUNT_MEMBER;
+
+/*
+ * Counters kept by a group.
+ */
+typedef struct hunt_stats {
+    int members;          //TUs in the group
+    int idle;             //Members currently on hook
+    long calls;           //Dials to the group
+    long busy;            //Dials that found no member on hook
+} HUNT_STATS;
+
+int hunt_create(PBX *pbx, TU *tu);
+HUNT_GROUP *hunt_lookup(int ext);
+int hunt_join(int ext, TU *tu);
+int hunt_leave(TU *tu);
+int hunt_dial(HUNT_GROUP *group, TU *tu);
+int hunt_extension(HUNT_GROUP *group);
+int hunt_get_stats(HUNT_GROUP *group, HUNT_STATS *stats);
+void hunt_unref(HUNT_GROUP *group);
+
+void hunt_member_set_idle(HUNT_MEMBER *member, int idle);
+
+#endif
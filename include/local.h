@@ -0,0 +1,31 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+
+/*
+ * Listening on a Unix domain socket, for clients on the same host.
+ *
+ * With -U <path>, the server listens on a stream socket at that path as well
+ * as on its TCP port, and serves the connections it accepts there with the
+ * same service loop, in whichever way TCP connections are served (threads,
+ * -l or -u).  Local clients skip the TCP stack altogether.  A stale socket
+ * left at the path by an earlier server is replaced; the socket is removed
+ * again on shutdown.
+ *
+ * With -R <uid>[,<uid>...], only processes running as one of those users
+ * (as the kernel reports them with SO_PEERCRED) may connect there.  Anyone
+ * else's connection is closed before a TU is made for it.  Connections on
+ * the TCP port are never checked: they carry no credentials.
+ */
+#include <sys/types.h>
+
+/*
+ * Most users that can be allowed with -R.
+ */
+#define LOCAL_MAX_ALLOW 16
+
+int local_init(const char *path, const char *allow);
+int local_inherit(int fd, const char *path, const char *allow);
+void local_fini(void);
+int local_peer_allowed(int fd);
+
+#endif
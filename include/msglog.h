@@ -0,0 +1,92 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+/*
+ * Store-and-forward messages.
+ *
+ * "msg <ext> <text>" leaves a message for an extension, whether or not a phone
+ * is registered there.  The sender is told "STORED <ext>" once the message is
+ * safely in the log (or "NOT STORED <ext>" if it can't be taken).  The next time
+ * a phone registers at that extension or picks up there, it is sent everything
+ * left for it since, oldest first, as lines of the form "MSG <from>: <text>",
+ * all in one write.
+ *
+ * Messages are kept in an append-only log that is memory-mapped, so storing one
+ * is a copy into the map.  The records for an extension are chained back from
+ * its latest, so its pending messages form a segment of their own that can be
+ * found without scanning the log, and taking them appends a record saying they
+ * have been delivered.  Once nothing is left to deliver, the log starts over
+ * from the beginning.
+ *
+ * With a log file (-m), senders wait for their message to reach the disk, but
+ * never for a sync of their own: one commit thread syncs everything appended
+ * since the last sync, and wakes all the senders waiting on it, so a burst of
+ * messages costs a handful of syncs rather than one each.  When the server
+ * starts, undelivered messages are recovered from the file.  Without a log file
+ * the log is only kept in memory.
+ */
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * Most of the log that is ever mapped, and so the most that can be stored at
+ * once.  Messages are refused while the log is full.
+ */
+#define MSGLOG_MAX_SIZE (64 * 1024 * 1024)
+
+/*
+ * Most messages waiting for any one extension.
+ */
+#define MSGLOG_MAX_PER_EXT 256
+
+/*
+ * Layout of the log file: a MSGLOG_FILE_HEADER, then records, each a
+ * MSGLOG_RECORD followed by its text and padded to a multiple of 8 bytes.
+ * Records are only valid if they carry the generation in the header, which goes
+ * up every time the log starts over, so whatever is left beyond the end from
+ * before is ignored.  All values are in the byte order of the host.
+ */
+#define MSGLOG_MAGIC "PBXMSGS"
+#define MSGLOG_VERSION 1
+#define MSGLOG_RECORD_MAGIC 0x4d534731
+
+typedef struct msglog_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;
+} MSGLOG_FILE_HEADER;
+
+#define MSGLOG_MESSAGE 1    //A message for an extension
+#define MSGLOG_DELIVERED 2  //Everything before it for the extension has been delivered
+
+typedef struct msglog_record {
+    uint32_t magic;       //MSGLOG_RECORD_MAGIC
+    uint32_t generation;
+    uint16_t type;
+    uint16_t len;         //Length of the text
+    uint32_t sum;         //Checksum of the text
+    int32_t to;
+    int32_t from;
+    uint64_t prev;        //Offset of the extension's previous pending message, or 0
+} MSGLOG_RECORD;
+
+/*
+ * Counters kept by the log.
+ */
+typedef struct msglog_stats {
+    long stored;          //Messages stored
+    long delivered;       //Messages delivered
+    long pending;         //Messages waiting to be delivered
+    long commits;         //Syncs of the log file
+    size_t used;          //Bytes of the log in use
+    int durable;          //Kept in a file, rather than only in memory
+} MSGLOG_STATS;
+
+int msglog_init(const char *path);
+int msglog_append(int to, int from, const char *text);
+int msglog_send(TU *tu, int ext, const char *text);
+char *msglog_take(int ext, size_t *len);
+int msglog_get_stats(MSGLOG_STATS *stats);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PBX_EXTRA_H
+#define PBX_EXTRA_H
+
+/*
+ * Additional PBX operations, beyond the interface given in pbx.h.
+ */
+#include <stdint.h>
+
+#include "pbx.h"
+#include "tu_extra.h"
+
+/*
+ * Counters kept by the registry, summed over its shards.
+ */
+typedef struct pbx_stats {
+    int shards;           //Number of shards in the registry
+    int registered;       //TUs currently registered
+    int max_shard;        //Most TUs registered in any one shard
+    long registrations;   //Registrations since startup
+    long dials;           //Calls to pbx_dial()
+    long misses;          //Dials to an extension with no TU registered
+} PBX_STATS;
+
+/*
+ * Function pbx_for_each() calls on each TU, which returns a negative number
+ * to stop there.
+ */
+typedef int PBX_VISIT_FN(TU *tu, void *arg);
+
+int pbx_register_auto(PBX *pbx, TU *tu);
+int pbx_get_stats(PBX *pbx, PBX_STATS *stats);
+int pbx_reserve_extension(PBX *pbx);
+int pbx_release_extension(PBX *pbx, int ext);
+TU *pbx_lookup(PBX *pbx, int ext);
+int pbx_hold(PBX *pbx, TU *tu);
+TU *pbx_rebind(PBX *pbx, int fd, uint64_t token);
+TU *pbx_resume(PBX *pbx, TU *tu, uint64_t token);
+int pbx_register_kept(PBX *pbx, TU *tu, uint64_t token);
+int pbx_adopt(PBX *pbx, TU *tu, int ext, int proto);
+int pbx_move_out(PBX *pbx, TU *tu);
+int pbx_claim_extension(PBX *pbx, int ext);
+int pbx_for_each(PBX *pbx, PBX_VISIT_FN *fn, void *arg);
+int pbx_restore(PBX *pbx, TU *tu, const TU_SNAPSHOT *snap);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+/*
+ * Presence: watching the state of other extensions.
+ *
+ * "watch <ext>" subscribes a TU to the state of an extension, and is answered
+ * straight away with its current state as "WATCH <ext> <state>" (the state being
+ * one of the usual state names, or "UNREGISTERED" if no phone is plugged in
+ * there).  After that the watcher is sent a line in the same form whenever the
+ * state changes, until it disconnects.
+ *
+ * Changes are coalesced: every TU transition just records the new state
+ * against each subscription to that extension, and a presence thread sends
+ * each watcher the latest state of everything that changed, in one write, at
+ * most once every PRESENCE_INTERVAL_MS.  A phone that flaps between states in
+ * between costs its watchers one line, and a switchboard watching thousands of
+ * phones gets a bounded number of writes however busy they are.
+ */
+#include "pbx.h"
+
+/*
+ * Shortest time between two updates sent to the same watcher.
+ */
+#define PRESENCE_INTERVAL_MS 100
+
+/*
+ * The state reported for an extension with no phone registered.
+ */
+#define PRESENCE_UNREGISTERED (-1)
+
+int presence_watch(PBX *pbx, TU *watcher, int ext);
+void presence_forget(TU *watcher);
+void presence_publish(int ext, int state);
+int presence_subscriptions(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+/*
+ * Binary framing, for automated clients that would rather not parse text.
+ *
+ * Every connection starts out speaking the text protocol, and gets its
+ * "ON HOOK <ext>" line (and "RESUME <token>" line, with -g) as usual.  A client
+ * whose first byte is PROTO_MAGIC switches its connection to binary framing:
+ * the server answers with PROTO_MAGIC, and from then on the client sends
+ * PROTO_CMD frames and is sent PROTO_EVENT frames, each an 8-byte header
+ * followed by len bytes of payload.  PROTO_MAGIC never appears in UTF-8 text,
+ * and telnet's option negotiation starts with 0xFF, so a telnet client never
+ * switches by accident.  A binary client skips whatever text comes before the
+ * PROTO_MAGIC answering its own.
+ *
+ * Commands carry the TU_COMMAND or TU_EXTRA_COMMAND value and, where the text
+ * command would have one, the extension (0 for none) or the text (chat, msg)
+ * as payload.  "resume" has the token as an 8-byte payload.  Payloads longer
+ * than PROTO_MAX_PAYLOAD are cut short, as an overlong text line would be.
+ *
+ * State changes come as PROTO_EV_STATE with the TU_STATE and the extension the
+ * text line would show (0 for none), and a peer's chat as PROTO_EV_CHAT with
+ * the message as payload.  Everything else (positions in a queue, presence,
+ * messages, conference chats, chats missed while held) comes as PROTO_EV_TEXT
+ * carrying exactly the text the connection would otherwise have been sent.
+ *
+ * Multi-byte fields are in network byte order.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PROTO_MAGIC 0xC0
+
+/*
+ * What a connection is speaking.
+ */
+#define PROTO_TEXT 0
+#define PROTO_BINARY 1
+
+#define PROTO_MAX_PAYLOAD 1023
+
+/*
+ * Kinds of PROTO_EVENT.
+ */
+#define PROTO_EV_STATE 1
+#define PROTO_EV_CHAT 2
+#define PROTO_EV_TEXT 3
+
+typedef struct proto_cmd {
+    uint8_t cmd;       //TU_COMMAND or TU_EXTRA_COMMAND
+    uint8_t pad;
+    uint16_t len;      //Bytes of payload that follow
+    uint32_t ext;      //Extension the command is about, 0 if none
+} PROTO_CMD;
+
+typedef struct proto_event {
+    uint8_t kind;      //PROTO_EV_STATE, PROTO_EV_CHAT or PROTO_EV_TEXT
+    uint8_t state;     //TU_STATE, for PROTO_EV_STATE
+    uint16_t len;      //Bytes of payload that follow
+    uint32_t ext;      //Extension shown with the state, 0 if none
+} PROTO_EVENT;
+
+_Static_assert(sizeof(PROTO_CMD) == 8 && sizeof(PROTO_EVENT) == 8, "Frame headers must be 8 bytes");
+
+void proto_event(PROTO_EVENT *ev, int kind, int state, int ext, size_t len);
+ssize_t proto_read_cmd(int fd, PROTO_CMD *cmd, char *payload, size_t size);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/*
+ * Admission control and command rate limiting, with token buckets.
+ *
+ * With -A RATE[/BURST], each source address may open RATE connections a
+ * second, with up to BURST at once (RATE if not given).  A connection over
+ * the limit is closed as soon as it is accepted, before a thread, coroutine
+ * or TU is made for it.  IPv4 sources are limited by address and IPv6
+ * sources by /64 prefix, since that is what a single host is usually given.
+ * Local (-U) clients are not limited: -R is how to keep them out.
+ *
+ * With -C RATE[/BURST], each connection may send RATE commands a second, with
+ * up to BURST at once.  A command over the limit is answered with "THROTTLED"
+ * and otherwise ignored, without going anywhere near the PBX, so that one
+ * client in a tight loop can't keep the registry and its peers' locks busy.
+ *
+ * The buckets are kept in two fixed-size tables, one for sources and one for
+ * connections, so a flood of sources costs no memory.  Each table is split
+ * into sets of RATELIMIT_WAYS buckets, a key always going to the same set,
+ * and the sets are covered by RATELIMIT_STRIPES locks.  When a set is full,
+ * the bucket used longest ago is given to the new key, which starts out with
+ * a full bucket.  Tokens are counted in thousandths, so that refilling is
+ * integer arithmetic on the milliseconds since the bucket was last used.
+ */
+#include <sys/socket.h>
+
+#define RATELIMIT_SETS 1024
+#define RATELIMIT_WAYS 4
+#define RATELIMIT_STRIPES 64
+
+typedef struct ratelimit_stats {
+    long admitted;     //Connections let in while -A is on
+    long refused;      //Connections closed for going over -A
+    long commands;     //Commands let through while -C is on
+    long throttled;    //Commands refused for going over -C
+    long evicted;      //Buckets given to another key because their set was full
+} RATELIMIT_STATS;
+
+int ratelimit_admit(const struct sockaddr *addr);
+void ratelimit_connected(int fd);
+int ratelimit_command(int fd);
+int ratelimit_get_stats(RATELIMIT_STATS *stats);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef REGMAP_H
+#define REGMAP_H
+
+/*
+ * Keeping extensions across a restart (-k <file>).
+ *
+ * Each phone's client is sent "RESUME <token>" after its "ON HOOK" line, as
+ * with -g.  The token is the client's identity: a file that is memory-mapped
+ * shared records, for every extension in the range, the token of the phone
+ * registered there.  Registering a phone stores its token into the map, and
+ * unregistering one clears it; neither makes a system call, since the kernel
+ * writes the pages back by itself.  So the map is always up to date, and
+ * survives the server being killed or shut down (the phones unregistered by a
+ * shutdown aren't cleared), though not the machine going down.
+ *
+ * When a server starts with a map left by an earlier one, every extension
+ * that still has a token is kept out of the allocator for its client to come
+ * back to, for REGMAP_KEEP_MS.  A client that connects and sends
+ * "resume <token>" as its first line (or later, while still on hook) gets its
+ * old extension and token back, and the server carries on recording it.
+ * Finding a token's extension doesn't scan anything: the file also holds an
+ * open-addressing index of the tokens, which is used as it is.  A token that
+ * isn't kept is answered with "NOT RESUMED", as with -g.  Whatever isn't
+ * claimed in time is handed out again.
+ *
+ * The map belongs to one server at a time (an upgrade in place hands it on,
+ * see upgrade.h).  A map made for a different range of extensions is started
+ * afresh.  -k can't be used with -w.
+ */
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * How long extensions from before a restart are kept for their clients.
+ */
+#define REGMAP_KEEP_MS 60000
+
+/*
+ * Most slots of the index that are looked at for any one token.  A phone whose
+ * token can't be indexed within that many isn't kept.
+ */
+#define REGMAP_MAX_PROBES 32
+
+/*
+ * Layout of the file: a REGMAP_FILE_HEADER, then a REGMAP_ENTRY for each
+ * extension in the range, then the index: a power of two, at least twice the
+ * number of extensions, of 32-bit slots, each 0 (never used), REGMAP_GONE, or
+ * 1 + the offset of an extension in the range.  An entry is kept from before
+ * if it has a token and a run other than the header's.  All values are in
+ * the byte order of the host.
+ */
+#define REGMAP_MAGIC "PBXREGS"
+#define REGMAP_VERSION 1
+#define REGMAP_GONE UINT32_MAX
+
+typedef struct regmap_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t run;         //Goes up every time a server starts with the file
+    int32_t first;        //The range of extensions
+    int32_t count;
+    uint32_t index_size;
+    uint32_t pad;
+} REGMAP_FILE_HEADER;
+
+typedef struct regmap_entry {
+    uint64_t token;       //0 if nobody is registered
+    uint32_t run;         //The run it was registered in
+    uint32_t pad;
+} REGMAP_ENTRY;
+
+typedef struct regmap_stats {
+    long kept;            //Extensions kept from before the server started
+    long claimed;         //...that their clients came back for
+    long expired;         //...that were handed out again instead
+    long unindexed;       //Phones not recorded, because the index was too full
+} REGMAP_STATS;
+
+int regmap_init(const char *path, int first, int count, int new_run);
+void regmap_fini(void);
+int regmap_enabled(void);
+int regmap_reserve(PBX *pbx);
+void regmap_store(int ext, uint64_t token);
+void regmap_clear(int ext);
+int regmap_claim(uint64_t token);
+int regmap_get_stats(REGMAP_STATS *stats);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+/*
+ * Resuming sessions after a dropped connection.
+ *
+ * When the server is started with a grace period (-g <seconds>), each phone is
+ * sent "RESUME <token>" right after the "ON HOOK" line that gives it its
+ * extension, the token being 16 hex digits that stay the same for as long as
+ * the phone is registered.  If its connection then drops, the phone isn't
+ * unregistered and its call, if any, isn't hung up.  The TU is held, with no
+ * connection, for the grace period, keeping its extension, state and peer.
+ * Nobody else notices anything, and whatever chats are sent to it are kept in
+ * the call's history (see history.h).
+ *
+ * A client that connects again within the grace period and sends
+ * "resume <token>" as its first line takes the held phone back.  No new TU is
+ * made or registered: the new connection is handed to the held TU, and the
+ * client is sent, in one write, the phone's current state (with its own
+ * extension or its peer's, as usual) followed by the chats it missed.  The
+ * server waits up to RESUME_PEEK_MS for that line before registering a new
+ * phone as usual.  A client that sends "resume <token>" after registering gets
+ * the held phone back too, and its new one is unplugged.  If the token doesn't
+ * match a held phone, the reply is "NOT RESUMED" and the client carries on as
+ * the new phone.  A phone that isn't resumed in time is unregistered, hanging
+ * up its call, just as it would have been when its connection dropped.
+ *
+ * Phones in a conference aren't held, since the conference relay keeps hold of
+ * their connections.
+ */
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * How often held phones are checked for having run out of time.
+ */
+#define RESUME_TICK_MS 100
+
+/*
+ * How long a new connection is given to send "resume <token>" before it is
+ * registered as a new phone.
+ */
+#define RESUME_PEEK_MS 50
+
+int resume_token(TU *tu, uint64_t *token);
+int resume_keep(TU *tu, uint64_t token);
+int resume_hold(PBX *pbx, TU *tu, int grace_ms);
+TU *resume_claim(uint64_t token);
+void resume_forget(TU *tu);
+void resume_release_all(PBX *pbx);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SERVER_EXTRA_H
+#define SERVER_EXTRA_H
+
+#include <stddef.h>
+
+/*
+ * Commands beyond those defined in server.h.  Their values follow on from the
+ * special values used in grading, so that they can be recorded alongside the
+ * TU_COMMAND values (for instance in the event trace) without clashing.
+ */
+typedef enum tu_extra_command {
+    TU_CONF_CMD = 200,
+    TU_HUNT_CMD,
+    TU_WATCH_CMD,
+    TU_MSG_CMD,
+    TU_RESUME_CMD
+} TU_EXTRA_COMMAND;
+
+#define TU_EXTRA_CMD_FIRST TU_CONF_CMD
+
+/*
+ * Printable names of the extra commands, indexed by (command - TU_EXTRA_CMD_FIRST).
+ * Used when parsing commands received from a client.
+ */
+#define TU_EXTRA_COMMAND_NAMES { \
+    "conf", \
+    "hunt", \
+    "watch", \
+    "msg", \
+    "resume" \
+}
+
+/*
+ * Longest command line a text client can send, with its NUL.  Anything after
+ * that on the same line is dropped.
+ */
+#define PBX_CLIENT_LINE_MAX 1024
+
+/*
+ * Parsing of text clients' commands, as pbx_client_service() does it; exposed
+ * so that the fuzzer can check it against what the client sent.
+ */
+int pbx_client_line(char *line, size_t *len, char c);
+int pbx_client_extension(char *arg, char **rest);
+
+/*
+ * Coroutine function for a coroutine that handles interaction with a client TU,
+ * used with -l instead of a thread per client.  The argument is as for
+ * pbx_client_service().
+ */
+void pbx_client_coroutine(void *arg);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+/*
+ * Running the PBX as several worker processes (-w N).
+ *
+ * The process that is started forks N workers and then only supervises.
+ * Each worker has a listening socket of its own on the port, the kernel
+ * spreading connections between them (SO_REUSEPORT); a -U socket is shared.
+ * Each worker is a complete PBX of its own, with its own registry, allocator
+ * and threads (or coroutines), and hands out extensions from its own slice of
+ * the range given with -e: worker k has the k-th of N equal parts (the last
+ * one taking what is left over).  That slice is the worker's "home" for those
+ * numbers.  A worker that crashes takes only its own clients with it, and is
+ * started again.
+ *
+ * A call is only ever set up inside one worker.  When a client in DIAL TONE
+ * dials an extension that is being served by another worker, its connection
+ * is handed over to that worker, with SCM_RIGHTS over the worker's inbox (a
+ * SOCK_SEQPACKET socketpair made before the fork), together with its
+ * extension, what it speaks and any input that had been read ahead of the
+ * dial.  The other worker registers it quietly, still in DIAL TONE, and
+ * dials for it, so that from then on the call, its chats and its hangup are
+ * all local there.  The client never notices: it just gets its RING BACK.
+ *
+ * Where each extension is being served is kept in a table shared by all the
+ * workers (a shared memfd mapping, one byte per extension): 0 for "at
+ * home", otherwise one more than the worker it has moved to.  An extension
+ * stays taken in its home allocator all the while it is away, and when a
+ * client that moved disconnects, its new worker sends its home a RELEASE
+ * through the inbox, so the number can be handed out again.  If the worker
+ * dies instead, the supervisor sends those on its behalf.
+ *
+ * Only dialing crosses workers.  A conference bridge or hunt group lives in
+ * the worker whose slice its number came from, so dialing it works from
+ * anywhere; but joining a hunt group, watching an extension, queueing for it
+ * (-q) and leaving it a message only work within one worker.  -g and -m can't
+ * be used with -w.  Rate limits (-A, -C) apply in each worker separately.
+ *
+ * SIGUSR1 to the supervisor upgrades the workers and then the supervisor.
+ * It passes the signal on, and each worker upgrades itself as a server on
+ * its own would (see upgrade.h), handing its inbox and the shared memory to
+ * the new process along with its clients, or refuses to and carries on.  The
+ * supervisor is a subreaper, so the new worker is handed to it when the old
+ * one exits, having left its pid in the shared memory; the supervisor
+ * supervises it from then on.  Once one worker has come up on the new
+ * binary, the supervisor starts the new binary in its own place (exec), with
+ * the workers, sockets and memory it has described in SHARD_SUPERVISOR_ENV.
+ */
+#include <sys/types.h>
+
+#include "pbx.h"
+
+#define SHARD_MAX_WORKERS 64
+
+/*
+ * How many times one dial may be handed on before it is carried out where it
+ * is (the extension dialed may itself be moving at the time).
+ */
+#define SHARD_MAX_HOPS 4
+
+/*
+ * Most input read ahead of a dial that can go along with the connection.
+ */
+#define SHARD_MAX_CARRY 4096
+
+/*
+ * How soon a worker that has died is started again.
+ */
+#define SHARD_RESTART_MS 100
+
+/*
+ * Environment variables that tell a process started by an upgrade which
+ * worker it takes over from, and a supervisor that has been upgraded what it
+ * was supervising.
+ */
+#define SHARD_WORKER_ENV "PBX_SHARD_WORKER"
+#define SHARD_SUPERVISOR_ENV "PBX_SHARD_SUPERVISOR"
+
+/*
+ * Function a worker serves a connection handed to it with, given input that
+ * was read from it but not used.  On failure, it closes the connection.
+ */
+typedef int SHARD_SERVE_FN(int fd, const void *input, size_t len);
+
+typedef struct shard_stats {
+    int workers;          //Number of workers, 0 if not running as one
+    int worker;           //Which one this is, -1 if not running as one
+    long moved_out;       //Clients handed to another worker
+    long moved_in;        //Clients taken over from another worker
+    long released;        //Extensions given back to us after their clients moved away
+    long dropped;         //Clients lost while moving
+} SHARD_STATS;
+
+int shard_inherited(int *localfd);
+int shard_start(int workers, char *port, char *argv[], int localfd);
+int shard_rejoin(int workers);
+int shard_export(int *fds, int size);
+int shard_import(const int *fds, int nfds);
+void shard_upgraded(pid_t pid);
+int shard_serve(PBX *pbx, SHARD_SERVE_FN *serve);
+int shard_worker(void);
+int shard_route(TU *tu, int ext, int hops);
+int shard_move(PBX *pbx, TU *tu, int fd, int ext, int hops);
+int shard_adopt(PBX *pbx, int fd, TU **tu, int *dial, int *hops);
+void shard_release(PBX *pbx, int ext);
+int shard_get_stats(SHARD_STATS *stats);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/*
+ * Timeouts, kept on a single hierarchical timer wheel.
+ *
+ * Every timeout in the server (idle connections, phones left ringing) is a
+ * timer on one wheel, serviced by one thread, rather than a timer or a socket
+ * option per connection.  The wheel has TIMER_LEVELS levels of TIMER_SLOTS
+ * slots each.  The first level has a slot per tick of TIMER_TICK_MS, and each
+ * slot of a higher level spans a whole turn of the level below, so a timer
+ * goes straight into the slot for when it expires and is moved down a level
+ * at most TIMER_LEVELS - 1 times before it fires.  Arming and cancelling a
+ * timer are O(1), whatever the number armed.
+ *
+ * Timers are identified by handles: nonzero numbers that stay unique for as
+ * long as the timer could still be cancelled, so that cancelling one that has
+ * already fired (and whose slot has been reused) does nothing.  The callback
+ * of a timer runs on the wheel's thread, with nothing locked.  If it returns a
+ * number of milliseconds, the same timer, with the same handle, is armed again
+ * for that long; if it returns 0 the timer is done with.
+ */
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10
+#define TIMER_SLOTS 64
+#define TIMER_LEVELS 4
+
+/*
+ * The longest a timer can be armed for; anything longer is cut down to this
+ * (about 46 hours), and its callback can arm it again for the rest.
+ */
+#define TIMER_MAX_MS ((int64_t)TIMER_TICK_MS * (((int64_t)1 << (6 * TIMER_LEVELS)) - 1))
+
+/*
+ * The most timers that can be armed at once.
+ */
+#define TIMER_MAX_TIMERS ((1 << 20) - 1)
+
+typedef int TIMER_FN(void *arg);
+
+typedef struct timer_stats {
+    long armed;      //Timers armed right now
+    long fired;      //Callbacks run since startup
+    long cancelled;  //Timers cancelled before they fired
+    long cascaded;   //Times a timer was moved down a level
+} TIMER_STATS;
+
+uint32_t timer_arm(int ms, TIMER_FN *fn, void *arg);
+uint32_t timer_running(void);
+int timer_cancel(uint32_t handle);
+void timer_cancel_wait(uint32_t handle);
+void timer_pause(void);
+void timer_resume(void);
+int timer_get_stats(TIMER_STATS *stats);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Event trace.
+ *
+ * Every TU state transition is recorded in a small binary ring owned by the
+ * thread that made it, so recording is a handful of stores with no locking and
+ * no sharing between threads.  The trace is always on, independently of debug().
+ * The rings of all threads (including ones that have exited, whose rings are
+ * recycled by new threads) can be written to a file at any time with trace_dump(),
+ * which is safe to call from a signal handler; trace_init() arranges for that to
+ * happen on SIGUSR2 and when the server crashes.  util/pbx_trace.c decodes the
+ * file into a timeline.
+ */
+#include <stdint.h>
+
+/*
+ * Each thread keeps its last TRACE_RING_EVENTS events (a power of two).
+ */
+#define TRACE_RING_EVENTS 64
+
+/*
+ * One recorded transition.  The command is a TU_COMMAND from server.h
+ * (TU_CONNECT_CMD for the transition made when a TU is registered).
+ */
+typedef struct trace_event {
+    uint64_t ts_ns;       //CLOCK_MONOTONIC time of the transition
+    int32_t tid;          //Thread that made the transition
+    int32_t ext;          //Extension of the TU that changed state
+    int32_t peer_ext;     //Extension of its peer, or -1 if none
+    uint32_t call_id;     //Call the transition belongs to, or 0 if none
+    uint8_t old_state;
+    uint8_t new_state;
+    uint8_t cmd;
+    uint8_t pad[5];
+} TRACE_EVENT;
+
+/*
+ * Layout of a dump file: a TRACE_FILE_HEADER followed by one TRACE_RING_HEADER
+ * and TRACE_RING_EVENTS events for each ring.  A ring's events are stored by
+ * slot; the oldest is at slot (head % TRACE_RING_EVENTS) if head has wrapped,
+ * otherwise at slot 0.  All values are in the byte order of the dumping host.
+ */
+#define TRACE_MAGIC "PBXTRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;   //sizeof(TRACE_EVENT)
+    uint32_t ring_events;  //TRACE_RING_EVENTS
+    uint32_t num_rings;
+} TRACE_FILE_HEADER;
+
+typedef struct trace_ring_header {
+    int32_t tid;           //Thread currently owning the ring (0 if none)
+    uint32_t pad;
+    uint64_t head;         //Total number of events ever written to the ring
+} TRACE_RING_HEADER;
+
+int trace_init(const char *path);
+void trace_event(int ext, int old_state, int new_state, int cmd, int peer_ext, uint32_t call_id);
+uint32_t trace_new_call_id(void);
+uint32_t trace_last_call_id(void);
+void trace_resume_call_ids(uint32_t last);
+int trace_dump(int fd);
+int trace_dump_file(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef TU_EXTRA_H
+#define TU_EXTRA_H
+
+/*
+ * Additional TU operations, beyond the interface given in tu.h.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pbx.h"
+#include "conf.h"
+#include "hunt.h"
+#include "acd.h"
+#include "cdr.h"
+
+/*
+ * What a TU is doing, as handed to a new server process when the server is
+ * upgraded (see upgrade.h).  It goes over the wire as it is.
+ */
+typedef struct tu_snapshot {
+    int32_t ext;
+    int32_t fd;           //Its connection, in the process it was taken in
+    int32_t peer;         //Extension of its peer, 0 if it has none
+    uint32_t call_id;
+    uint8_t state;
+    uint8_t proto;
+    uint8_t has_cdr;
+    CDR cdr;              //Record of its call so far, if has_cdr
+    uint64_t token;       //Its client's token, if registrations are kept (see regmap.h)
+} TU_SNAPSHOT;
+
+ssize_t tu_send(TU *tu, const void *buf, size_t len);
+TU_STATE tu_get_state(TU *tu);
+int tu_join_bridge(TU *tu, CONF_BRIDGE *bridge);
+int tu_join_hunt(TU *tu, HUNT_MEMBER *member, int group_ext);
+HUNT_MEMBER *tu_leave_hunt(TU *tu);
+int tu_wait_queue(TU *tu, ACD_QUEUE *queue);
+int tu_connect_waiting(TU *caller, TU *target, ACD_QUEUE *queue);
+void tu_notify_queued(TU *tu, ACD_QUEUE *queue, int position);
+void tu_queue_cancelled(TU *tu, ACD_QUEUE *queue);
+void tu_close_queue(TU *tu);
+int tu_hold(TU *tu);
+int tu_detach(TU *tu);
+void tu_rebind(TU *tu, int fd, int proto);
+int tu_set_binary(TU *tu);
+int tu_get_proto(TU *tu);
+void tu_adopt(TU *tu, int ext, int proto);
+int tu_snapshot(TU *tu, TU_SNAPSHOT *snap);
+void tu_restore(TU *tu, const TU_SNAPSHOT *snap);
+void tu_restore_call(TU *tu, TU *peer, const TU_SNAPSHOT *snap);
+
+#endif
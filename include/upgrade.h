@@ -0,0 +1,127 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+ * Upgrading the server in place, without dropping anyone (SIGUSR1).
+ *
+ * On SIGUSR1 the server starts whatever binary is now at the path it was
+ * started from, with the same arguments, as a child process, and hands
+ * everything over to it: the listening sockets, every client's connection,
+ * and what each client's TU is doing -- its extension, its state, what it
+ * speaks, and the call it is in (its peer, call id and the record of the call
+ * so far).  Everything goes over a SOCK_SEQPACKET socketpair, the connections
+ * with SCM_RIGHTS, UPGRADE_BATCH at a time, each with whatever had been read
+ * from it and not yet acted on (a command read halfway, or input io_uring had
+ * read ahead).  Clients don't notice: they keep their connections, extensions
+ * and calls, and the next command they send is answered by the new process.
+ *
+ * The old process waits for the new one to say it is ready (HELLO) before
+ * stopping anything, so a slow start costs nobody anything.  It then stops
+ * accepting, interrupts every client's wait for input (coro_interrupt()) and
+ * waits for each to stop between commands (upgrade_park()), with anything it
+ * had read put aside.  Then it pauses its timers, takes a snapshot of the
+ * registry, sends it, and exits once the new process says it has taken
+ * everything over (DONE).  If anything goes wrong before then -- the new
+ * binary doesn't start, a client doesn't stop in time, the new process gives
+ * up or dies -- the new process is killed, and the old one lets everyone go
+ * and carries on as if nothing had happened.
+ *
+ * Not carried over: extensions waiting out their reuse delay (-r), which are
+ * free at once; rate limit buckets (-A, -C), which start full; and idle and
+ * ring timers, which start again from the beginning, as does the time
+ * extensions are kept for clients to come back to (-k).  An upgrade is refused
+ * (the server carries on, and says why on stderr) while anyone is in a
+ * conference, a hunt group or a call queue (-q), or watching an extension;
+ * with -g; or with messages waiting in a log kept only in memory (no -m).
+ *
+ * With workers (-w), SIGUSR1 goes to the supervisor, and each worker is
+ * upgraded like this in turn, the new process taking over the worker's slice
+ * as well (see shard.h).  Each decides for itself whether to refuse, so a
+ * worker with a watch going on is left as it is while the others upgrade.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pbx.h"
+#include "tu_extra.h"
+
+/*
+ * Environment variable that tells a new process the descriptor of its socket
+ * to the process it takes over from.
+ */
+#define UPGRADE_ENV "PBX_UPGRADE_FD"
+
+#define UPGRADE_MAGIC 0x50425855  //"PBXU"
+#define UPGRADE_VERSION 3
+
+/*
+ * Kinds of UPGRADE_MSG.
+ */
+#define UPGRADE_HELLO 1    //New to old: ready to take over
+#define UPGRADE_STATE 2    //Old to new: the listening sockets (and a worker's), and how many clients will follow
+#define UPGRADE_CLIENTS 3  //Old to new: a batch of UPGRADE_CLIENTs, each followed by its input
+#define UPGRADE_DONE 4     //New to old: everything has been taken over
+
+/*
+ * Most connections in one UPGRADE_CLIENTS message (the kernel allows 253),
+ * and most bytes in one.
+ */
+#define UPGRADE_BATCH 250
+#define UPGRADE_BATCH_BYTES (64 * 1024)
+
+/*
+ * Most input that can go along with a client; one that has more read ahead
+ * than that is disconnected.
+ */
+#define UPGRADE_MAX_INPUT 4096
+
+/*
+ * How long the old process waits for the new one to start, for its clients to
+ * stop, and for the new one to take them over.
+ */
+#define UPGRADE_HELLO_MS 5000
+#define UPGRADE_PARK_MS 2000
+#define UPGRADE_DONE_MS 5000
+
+typedef struct upgrade_msg {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;        //UPGRADE_HELLO, UPGRADE_STATE, UPGRADE_CLIENTS or UPGRADE_DONE
+    uint32_t count;       //STATE: clients in all; CLIENTS: clients in this message
+    uint32_t call_id;     //STATE: the last call id handed out
+    uint32_t local;       //STATE: whether the local socket (-U) follows the TCP one
+    uint32_t shard;       //STATE: how many of a worker's descriptors follow those (shard_export())
+    uint64_t stopped_ns;  //STATE: when clients stopped being served (CLOCK_MONOTONIC)
+} UPGRADE_MSG;
+
+typedef struct upgrade_client {
+    TU_SNAPSHOT tu;
+    uint32_t input;       //Bytes of input that follow
+    uint8_t fresh;        //Nothing has been read from it yet (so it may still switch to binary)
+} UPGRADE_CLIENT;
+
+/*
+ * Function the new process serves a client taken over with, given its input.
+ * On failure, it closes the connection.
+ */
+typedef int UPGRADE_SERVE_FN(int fd, const void *input, size_t len);
+
+typedef struct upgrade_stats {
+    long started;         //Upgrades asked for with SIGUSR1
+    long refused;         //...that were refused or called off
+    int clients;          //Clients this process took over when it started, -1 if it wasn't upgraded to
+    long cutover_us;      //How long they went unserved
+} UPGRADE_STATS;
+
+int upgrade_init(char *argv[], int listenfd, int localfd);
+int upgrade_inherited(void);
+int upgrade_join(PBX *pbx, int *listenfd, int *localfd);
+int upgrade_resume(UPGRADE_SERVE_FN *serve);
+void upgrade_starting(int fd);
+void upgrade_enter(int fd);
+void upgrade_leave(int fd);
+int upgrade_park(int fd, const void *prefix, size_t len, int fresh);
+int upgrade_adopt(int fd, TU **tu, int *fresh);
+int upgrade_get_stats(UPGRADE_STATS *stats);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * The little of io_uring the server needs, on the bare system calls.
+ *
+ * A URING is a submission queue and a completion queue shared with the
+ * kernel.  Requests are written into the submission queue with uring_sqe(),
+ * handed over, and their completions waited for, with one uring_submit(), and
+ * read back with uring_cqe() and uring_cqe_seen().  A URING belongs to one
+ * thread; nothing here is locked.
+ *
+ * A URING can also have a ring of provided buffers (group URING_BUF_GROUP),
+ * which receives pick from as data arrives, rather than each having a buffer
+ * of its own waiting.  A completion says which buffer it filled; the buffer is
+ * handed back with uring_buf_put() once its data has been used.
+ */
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define URING_BUF_GROUP 0
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;             //Next entry to fill in; entries up to here not yet handed over
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *bufs; //Provided buffers, if any
+    char *buf_mem;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_tail;
+} URING;
+
+int uring_init(URING *ring, unsigned entries);
+void uring_fini(URING *ring);
+struct io_uring_sqe *uring_sqe(URING *ring);
+unsigned uring_sq_space(URING *ring);
+int uring_submit(URING *ring, unsigned wait);
+struct io_uring_cqe *uring_cqe(URING *ring);
+void uring_cqe_seen(URING *ring);
+int uring_bufs_init(URING *ring, unsigned count, unsigned size);
+char *uring_buf(URING *ring, unsigned bid);
+void uring_buf_put(URING *ring, unsigned bid);
+
+#endif
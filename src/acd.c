@@ -0,0 +1,362 @@
+/*
+ * Call queues: callers to a busy phone or hunt group wait their turn.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "pbx.h"
+#include "tu_extra.h"
+#include "acd.h"
+#include "debug.h"
+
+/*
+ * How many times the queue thread tries to connect the caller at the head of a
+ * queue to somebody who turns out to have become busy again in the meantime,
+ * before leaving the queue until it is next woken.
+ */
+#define ACD_MAX_ATTEMPTS 8
+
+/*
+ * A caller's place in a queue.  While it is linked into the queue, its TU
+ * points to it; it is freed by whoever takes it back from the TU, with the TU
+ * locked.  It holds a reference to its queue.
+ */
+struct acd_waiter {
+    ACD_QUEUE* queue;
+    TU* tu;
+    struct acd_waiter* prev;
+    struct acd_waiter* next;
+    int linked;
+    int position; //Last position the caller was told, guarded by the queue lock
+};
+
+struct acd_queue {
+    sem_t mutex; //Protects everything below it, up to refs
+    ACD_WAITER head; //Sentinel of the circular list of callers, first come first
+    int closed; //Set when the owner goes away; nobody can queue after that
+    int dirty; //Somebody left from the middle, so positions need resending
+    long queued, connected, abandoned;
+    ACD_PICK* pick;
+    void* owner;
+    _Atomic int waiting; //Length of the list, readable without the lock
+    _Atomic int refs; //One for the owner, one for each waiter, one while on the work list
+    int pending; //On the work list, guarded by work_mutex
+    struct acd_queue* next_work;
+};
+
+/*
+ * Queues that need looking at, served in order by the queue thread.
+ * The lock order is TU, then queue, then hunt group, then the work list.
+ */
+static ACD_QUEUE* work_head;
+static ACD_QUEUE* work_tail;
+static sem_t work_mutex;
+static sem_t work_items;
+static pthread_once_t acd_once = PTHREAD_ONCE_INIT;
+
+static void *acd_thread(void *arg);
+
+static void acd_setup(void) {
+    sem_init(&work_mutex, 0, 1);
+    sem_init(&work_items, 0, 0);
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, acd_thread, NULL) != 0){
+        //Queued callers then wait until they give up and hang up
+        debug("Call queue thread could not be started");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/*
+ * Create an empty queue.
+ *
+ * @param pick  The function that finds somebody free to take a call for the owner.
+ * @param owner  The phone or group the queue belongs to, passed to pick.
+ * @return the queue, with one reference for the owner, or NULL if it couldn't be
+ * created.
+ */
+ACD_QUEUE *acd_queue_create(ACD_PICK *pick, void *owner) {
+    pthread_once(&acd_once, acd_setup);
+    ACD_QUEUE *queue = calloc(1, sizeof(ACD_QUEUE));
+    if(queue == NULL){
+        return NULL;
+    }
+    sem_init(&queue->mutex, 0, 1);
+    queue->head.next = queue->head.prev = &queue->head;
+    queue->pick = pick;
+    queue->owner = owner;
+    atomic_init(&queue->waiting, 0);
+    atomic_init(&queue->refs, 1);
+    return queue;
+}
+
+void acd_queue_ref(ACD_QUEUE *queue) {
+    atomic_fetch_add(&queue->refs, 1);
+}
+
+void acd_queue_unref(ACD_QUEUE *queue) {
+    if(queue == NULL){
+        return;
+    }
+    if(atomic_fetch_sub(&queue->refs, 1) == 1){
+        sem_destroy(&queue->mutex);
+        free(queue);
+    }
+}
+
+/*
+ * Get the number of callers in a queue, without locking it.
+ */
+int acd_waiting(ACD_QUEUE *queue) {
+    return atomic_load(&queue->waiting);
+}
+
+/*
+ * Ask the queue thread to look at a queue: to connect its first caller if
+ * somebody has become free, and to send callers their new positions.
+ * Never blocks for long, so it may be called with TUs locked.
+ *
+ * @param queue  The queue.
+ */
+void acd_kick(ACD_QUEUE *queue) {
+    sem_wait(&work_mutex);
+    if(queue->pending){
+        sem_post(&work_mutex);
+        return;
+    }
+    queue->pending = 1;
+    acd_queue_ref(queue);
+    queue->next_work = NULL;
+    if(work_tail != NULL){
+        work_tail->next_work = queue;
+    }else{
+        work_head = queue;
+    }
+    work_tail = queue;
+    sem_post(&work_mutex);
+    sem_post(&work_items);
+}
+
+/*
+ * Add a caller to the end of a queue.
+ * Must be called with the caller locked, and the caller must point to the
+ * returned waiter before it is unlocked.
+ *
+ * @param queue  The queue.
+ * @param tu  The caller.
+ * @param position  Set to the caller's position in the queue, counting from 1.
+ * @return the caller's place in the queue, or NULL if the queue has closed.
+ */
+ACD_WAITER *acd_enqueue(ACD_QUEUE *queue, TU *tu, int *position) {
+    ACD_WAITER *waiter = calloc(1, sizeof(ACD_WAITER));
+    if(waiter == NULL){
+        return NULL;
+    }
+    sem_wait(&queue->mutex);
+    if(queue->closed){
+        sem_post(&queue->mutex);
+        free(waiter);
+        return NULL;
+    }
+    waiter->queue = queue;
+    waiter->tu = tu;
+    waiter->prev = queue->head.prev;
+    waiter->next = &queue->head;
+    queue->head.prev->next = waiter;
+    queue->head.prev = waiter;
+    waiter->linked = 1;
+    queue->queued++;
+    *position = waiter->position = atomic_fetch_add(&queue->waiting, 1) + 1;
+    acd_queue_ref(queue);
+    sem_post(&queue->mutex);
+    return waiter;
+}
+
+/*
+ * Take a caller out of its queue, if it hasn't been already.
+ * Must be called with the caller locked.
+ *
+ * @param waiter  The caller's place in the queue.
+ * @param connected  Nonzero if the caller is leaving because it has been
+ * connected, zero if it gave up.
+ */
+void acd_remove(ACD_WAITER *waiter, int connected) {
+    ACD_QUEUE *queue = waiter->queue;
+    sem_wait(&queue->mutex);
+    if(!waiter->linked){
+        sem_post(&queue->mutex);
+        return;
+    }
+    //Everybody behind it moves up one
+    int behind = waiter->next != &queue->head;
+    waiter->prev->next = waiter->next;
+    waiter->next->prev = waiter->prev;
+    waiter->linked = 0;
+    atomic_fetch_sub(&queue->waiting, 1);
+    if(connected){
+        queue->connected++;
+    }else{
+        queue->abandoned++;
+    }
+    queue->dirty |= behind;
+    sem_post(&queue->mutex);
+    if(behind){
+        acd_kick(queue);
+    }
+}
+
+ACD_QUEUE *acd_waiter_queue(ACD_WAITER *waiter) {
+    return waiter->queue;
+}
+
+/*
+ * Dispose of a caller's place in a queue once it has been taken out of it.
+ */
+void acd_waiter_free(ACD_WAITER *waiter) {
+    acd_queue_unref(waiter->queue);
+    free(waiter);
+}
+
+/*
+ * Get references to all the callers in a queue, in order.
+ * Must be called with the queue locked.
+ *
+ * @param count  Set to the number of TUs in the array.
+ * @return an array of TUs that must be unreferenced and freed, or NULL if the
+ * queue is empty or memory runs out.
+ */
+static TU **acd_callers(ACD_QUEUE *queue, int *count) {
+    *count = 0;
+    int n = atomic_load(&queue->waiting);
+    TU **tus = n > 0 ? malloc(n * sizeof(TU *)) : NULL;
+    if(tus == NULL){
+        return NULL;
+    }
+    for(ACD_WAITER *w = queue->head.next; w != &queue->head && *count < n; w = w->next){
+        tu_ref(w->tu, "Caller in queue");
+        tus[(*count)++] = w->tu;
+    }
+    return tus;
+}
+
+/*
+ * Close a queue when its owner goes away.  Callers still waiting are taken
+ * out of it and given their busy signal after all.
+ *
+ * @param queue  The queue.
+ */
+void acd_queue_close(ACD_QUEUE *queue) {
+    if(queue == NULL){
+        return;
+    }
+    sem_wait(&queue->mutex);
+    queue->closed = 1;
+    int count;
+    TU **tus = acd_callers(queue, &count);
+    for(ACD_WAITER *w = queue->head.next; w != &queue->head; w = w->next){
+        w->linked = 0;
+    }
+    queue->head.next = queue->head.prev = &queue->head;
+    atomic_store(&queue->waiting, 0);
+    sem_post(&queue->mutex);
+    for(int i = 0; i < count; i++){
+        tu_queue_cancelled(tus[i], queue);
+        tu_unref(tus[i], "Queue closed");
+    }
+    free(tus);
+}
+
+/*
+ * Connect as many callers from the front of a queue as there are people free
+ * to take them, then let the rest know where they stand.
+ */
+static void acd_serve(ACD_QUEUE *queue) {
+    int attempts = 0;
+    while(attempts < ACD_MAX_ATTEMPTS){
+        sem_wait(&queue->mutex);
+        if(queue->closed || queue->head.next == &queue->head){
+            sem_post(&queue->mutex);
+            break;
+        }
+        TU *caller = queue->head.next->tu;
+        tu_ref(caller, "First in queue");
+        TU *target = queue->pick(queue->owner);
+        sem_post(&queue->mutex);
+        if(target == NULL){
+            tu_unref(caller, "Nobody free");
+            break;
+        }
+        int ret = tu_connect_waiting(caller, target, queue);
+        tu_unref(target, "Done connecting from queue");
+        tu_unref(caller, "Done connecting from queue");
+        if(ret < 0){
+            attempts++; //They were busy after all
+        }
+    }
+
+    sem_wait(&queue->mutex);
+    if(!queue->dirty || queue->closed){
+        sem_post(&queue->mutex);
+        return;
+    }
+    queue->dirty = 0;
+    //Only callers who have moved up are told
+    int n = atomic_load(&queue->waiting), count = 0, position = 0;
+    struct { TU *tu; int position; } *moved = n > 0 ? malloc(n * sizeof(*moved)) : NULL;
+    for(ACD_WAITER *w = queue->head.next; moved != NULL && w != &queue->head; w = w->next){
+        if(++position != w->position){
+            w->position = position;
+            tu_ref(w->tu, "Caller moved up");
+            moved[count].tu = w->tu;
+            moved[count++].position = position;
+        }
+    }
+    sem_post(&queue->mutex);
+    for(int i = 0; i < count; i++){
+        tu_notify_queued(moved[i].tu, queue, moved[i].position);
+        tu_unref(moved[i].tu, "Position sent");
+    }
+    free(moved);
+}
+
+static void *acd_thread(void *arg) {
+    while(1){
+        sem_wait(&work_items);
+        sem_wait(&work_mutex);
+        ACD_QUEUE *queue = work_head;
+        work_head = queue->next_work;
+        if(work_head == NULL){
+            work_tail = NULL;
+        }
+        queue->pending = 0;
+        sem_post(&work_mutex);
+        acd_serve(queue);
+        acd_queue_unref(queue);
+    }
+    return NULL;
+}
+
+/*
+ * Get the counters of a queue.
+ *
+ * @param queue  The queue.
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int acd_get_stats(ACD_QUEUE *queue, ACD_STATS *stats) {
+    if(queue == NULL || stats == NULL){
+        return -1;
+    }
+    sem_wait(&queue->mutex);
+    stats->waiting = atomic_load(&queue->waiting);
+    stats->queued = queue->queued;
+    stats->connected = queue->connected;
+    stats->abandoned = queue->abandoned;
+    sem_post(&queue->mutex);
+    return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * Call detail records, written in batches by a thread of their own.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "cdr.h"
+#include "debug.h"
+
+_Static_assert((CDR_RING_SIZE & (CDR_RING_SIZE - 1)) == 0, "CDR_RING_SIZE must be a power of two");
+
+/*
+ * A slot of the ring.  Its sequence number says whose turn it is: equal to a
+ * position, the slot is free for the producer that claims that position; one
+ * more than it, the record for that position is ready for the writer.
+ */
+typedef struct cdr_slot {
+    _Atomic uint64_t seq;
+    CDR rec;
+} CDR_SLOT;
+
+static CDR_SLOT* ring;
+static _Atomic uint64_t ring_tail; //Next position to be claimed by a producer
+static _Atomic uint64_t ring_head; //Next position the writer will take
+static _Atomic long recorded, dropped;
+static _Atomic long written, batches, rotations;
+static sem_t wake; //Posted when the ring is half full, or someone wants a flush
+
+static char cdr_path[PATH_MAX];
+static int cdr_fd = -1;
+static size_t cdr_bytes; //Size of the current file, only touched by the writer
+
+/*
+ * Size of the writer's batches.  A record is at most this long as CSV.
+ */
+#define CDR_BATCH (64 * 1024)
+#define CDR_LINE_MAX 160
+
+static uint64_t cdr_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Open a fresh file (or carry on with the one there), writing the header if it's new.
+ */
+static int cdr_open(void) {
+    cdr_fd = open(cdr_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(cdr_fd < 0){
+        return -1;
+    }
+    off_t size = lseek(cdr_fd, 0, SEEK_END);
+    cdr_bytes = size > 0 ? size : 0;
+    if(cdr_bytes == 0){
+        cdr_bytes = write(cdr_fd, CDR_CSV_HEADER, strlen(CDR_CSV_HEADER));
+    }
+    return 0;
+}
+
+/*
+ * Move FILE to FILE.1 (and FILE.1 to FILE.2, and so on) and start a new FILE.
+ */
+static void cdr_rotate(void) {
+    char from[PATH_MAX + 16], to[PATH_MAX + 16];
+    close(cdr_fd);
+    for(int i = CDR_KEEP - 1; i >= 0; i--){
+        if(i == 0){
+            snprintf(from, sizeof(from), "%s", cdr_path);
+        }else{
+            snprintf(from, sizeof(from), "%s.%d", cdr_path, i);
+        }
+        snprintf(to, sizeof(to), "%s.%d", cdr_path, i + 1);
+        rename(from, to);
+    }
+    atomic_fetch_add(&rotations, 1);
+    if(cdr_open() < 0){
+        debug("CDR file %s could not be reopened", cdr_path);
+    }
+}
+
+static void cdr_write(char *buf, size_t len) {
+    size_t off = 0;
+    while(off < len && cdr_fd >= 0){
+        ssize_t n = write(cdr_fd, buf + off, len - off);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            debug("CDR write failed: %s", strerror(errno));
+            return;
+        }
+        off += n;
+    }
+    cdr_bytes += off;
+    atomic_fetch_add(&batches, 1);
+    if(cdr_bytes >= CDR_ROTATE_BYTES){
+        cdr_rotate();
+    }
+}
+
+/*
+ * Take everything that's ready from the ring and write it out.
+ *
+ * @return the number of records written.
+ */
+static long cdr_drain(char *buf) {
+    size_t len = 0;
+    long n = 0;
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    while(1){
+        CDR_SLOT *slot = &ring[head & (CDR_RING_SIZE - 1)];
+        if(atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1){
+            break; //Empty, or claimed but not filled in yet
+        }
+        CDR *rec = &slot->rec;
+        len += snprintf(buf + len, CDR_LINE_MAX, "%u,%d,%d,%llu,%llu,%llu,%u,%llu\n",
+                        rec->call_id, rec->caller, rec->callee,
+                        (unsigned long long)rec->setup_us, (unsigned long long)rec->answer_us,
+                        (unsigned long long)rec->hangup_us, rec->chats, (unsigned long long)rec->bytes);
+        //Hand the slot back to producers for its next lap
+        atomic_store_explicit(&slot->seq, head + CDR_RING_SIZE, memory_order_release);
+        head++;
+        n++;
+        if(len + CDR_LINE_MAX > CDR_BATCH){
+            cdr_write(buf, len);
+            len = 0;
+        }
+    }
+    if(len > 0){
+        cdr_write(buf, len);
+    }
+    atomic_fetch_add(&written, n);
+    atomic_store_explicit(&ring_head, head, memory_order_release);
+    return n;
+}
+
+static void *cdr_thread(void *arg) {
+    char *buf = malloc(CDR_BATCH);
+    if(buf == NULL){
+        return NULL;
+    }
+    while(1){
+        cdr_drain(buf);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CDR_FLUSH_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        sem_timedwait(&wake, &ts);
+    }
+    return NULL;
+}
+
+/*
+ * Start keeping CDRs.  Until this is called, calls aren't recorded at all.
+ *
+ * @param path  The CDR file, which is appended to if it exists.
+ * @return 0 if successful, otherwise -1.
+ */
+int cdr_init(const char *path) {
+    if(path == NULL || strlen(path) >= sizeof(cdr_path) || ring != NULL){
+        return -1;
+    }
+    snprintf(cdr_path, sizeof(cdr_path), "%s", path);
+    if(cdr_open() < 0){
+        return -1;
+    }
+    CDR_SLOT *slots = malloc(CDR_RING_SIZE * sizeof(CDR_SLOT));
+    if(slots == NULL){
+        return -1;
+    }
+    for(uint64_t i = 0; i < CDR_RING_SIZE; i++){
+        atomic_init(&slots[i].seq, i);
+    }
+    sem_init(&wake, 0, 0);
+    ring = slots;
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, cdr_thread, NULL) != 0){
+        ring = NULL;
+        free(slots);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * Start the record of a call, when it starts ringing.
+ *
+ * @param call_id  The call's id.
+ * @param caller  The extension of the caller.
+ * @param callee  The extension of the phone it rang.
+ * @return the record, to be passed to the other cdr_ functions and finally to
+ * cdr_end(); or NULL if CDRs aren't being kept, in which case those functions
+ * do nothing.
+ */
+CDR *cdr_begin(uint32_t call_id, int caller, int callee) {
+    if(ring == NULL){
+        return NULL;
+    }
+    CDR *cdr = malloc(sizeof(CDR));
+    if(cdr == NULL){
+        atomic_fetch_add(&dropped, 1);
+        return NULL;
+    }
+    memset(cdr, 0, sizeof(CDR));
+    cdr->call_id = call_id;
+    cdr->caller = caller;
+    cdr->callee = callee;
+    cdr->setup_us = cdr_now_us();
+    return cdr;
+}
+
+/*
+ * Carry on with the record of a call that was set up by another server
+ * process (see upgrade.h).
+ *
+ * @param rec  The record so far.
+ * @return a record of our own with the same contents, or NULL if CDRs
+ * aren't being kept.
+ */
+CDR *cdr_resume(const CDR *rec) {
+    CDR *cdr = cdr_begin(rec->call_id, rec->caller, rec->callee);
+    if(cdr != NULL){
+        *cdr = *rec;
+    }
+    return cdr;
+}
+
+/*
+ * Note that a call has been answered.
+ */
+void cdr_answer(CDR *cdr) {
+    if(cdr != NULL){
+        cdr->answer_us = cdr_now_us();
+    }
+}
+
+/*
+ * Count a chat sent over a call.  Only the sender is locked, so both phones
+ * may be counting at once.
+ */
+void cdr_chat(CDR *cdr, size_t bytes) {
+    if(cdr != NULL){
+        __atomic_fetch_add(&cdr->chats, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cdr->bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Finish the record of a call when it is hung up, and hand it to the writer.
+ * Never blocks: if the ring is full, the record is dropped.
+ *
+ * @param cdr  The record, which is freed.
+ */
+void cdr_end(CDR *cdr) {
+    if(cdr == NULL){
+        return;
+    }
+    cdr->hangup_us = cdr_now_us();
+    atomic_fetch_add_explicit(&recorded, 1, memory_order_relaxed);
+    uint64_t pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    CDR_SLOT *slot;
+    while(1){
+        slot = &ring[pos & (CDR_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }else if(diff < 0){
+            //The writer hasn't emptied this slot since the last lap
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            free(cdr);
+            return;
+        }else{
+            pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        }
+    }
+    slot->rec = *cdr;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    free(cdr);
+    //Wake the writer early rather than let the ring fill up
+    if(pos - atomic_load_explicit(&ring_head, memory_order_relaxed) == CDR_RING_SIZE / 2){
+        sem_post(&wake);
+    }
+}
+
+/*
+ * Wait until every call that has ended so far has been written to the file.
+ * Used at shutdown, and by tests.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int cdr_flush(void) {
+    if(ring == NULL){
+        return -1;
+    }
+    uint64_t tail = atomic_load(&ring_tail);
+    while(atomic_load(&ring_head) < tail){
+        sem_post(&wake);
+        usleep(1000);
+    }
+    return 0;
+}
+
+/*
+ * Get the counters of the CDR writer.
+ *
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int cdr_get_stats(CDR_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->recorded = atomic_load(&recorded);
+    stats->written = atomic_load(&written);
+    stats->dropped = atomic_load(&dropped);
+    stats->batches = atomic_load(&batches);
+    stats->rotations = atomic_load(&rotations);
+    return 0;
+}
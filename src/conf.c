@@ -0,0 +1,450 @@
+/*
+ * Conference bridges: many TUs on one extension, with chats fanned out to all.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "conf.h"
+#include "trace.h"
+#include "debug.h"
+
+/*
+ * A formatted chat line, shared by every member it is queued for.
+ */
+typedef struct conf_msg {
+    _Atomic int refs;
+    size_t len;
+    char data[];
+} CONF_MSG;
+
+/*
+ * A member's backlog holds the messages its connection couldn't take yet, oldest
+ * first.  None of them has started to go out: tu_send() finishes a line it has
+ * started before anything else is written to the connection.  A member with a
+ * backlog is armed: its descriptor is registered with the relay thread's epoll
+ * instance, which calls back when it can be written again.
+ */
+typedef struct conf_member {
+    TU* tu;
+    int fd;
+    int armed;
+    int head;
+    int count;
+    CONF_MSG* backlog[CONF_BACKLOG];
+} CONF_MEMBER;
+
+struct conf_bridge {
+    sem_t mutex; //Protects everything below it
+    CONF_MEMBER* members;
+    int num_members;
+    int max_members; //Allocated size of members
+    int closed; //Set when the last member leaves; the bridge can't be joined after that
+    long messages, sent, queued, dropped;
+    int ext;
+    unsigned int call_id;
+    PBX* pbx;
+    _Atomic int refs; //One for the table while the bridge is open, one for each member TU
+    struct conf_bridge* next; //Next in the same bucket of the table
+};
+
+/*
+ * Open bridges are found by extension in a small hash table.  It is only used
+ * to create, join and close bridges, never while chatting, so one lock is enough.
+ * The lock order is bridge, then table, then TU.
+ */
+#define CONF_BUCKETS 256
+
+static CONF_BRIDGE* conf_table[CONF_BUCKETS];
+static sem_t conf_table_mutex;
+static int relay_epfd = -1;
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+static void *conf_relay(void *arg);
+
+static void conf_setup(void) {
+    sem_init(&conf_table_mutex, 0, 1);
+    relay_epfd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_t tid;
+    if(relay_epfd < 0 || pthread_create(&tid, NULL, conf_relay, NULL) != 0){
+        //Without the relay thread, slow members just stay queued until they overflow
+        debug("Conference relay thread could not be started");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static CONF_MSG *conf_msg_new(int from_ext, char *msg) {
+    size_t max = strlen(msg) + 16;
+    CONF_MSG *m = malloc(sizeof(CONF_MSG) + max);
+    if(m == NULL){
+        return NULL;
+    }
+    atomic_init(&m->refs, 1);
+    m->len = snprintf(m->data, max, "CHAT %d: %s\n", from_ext, msg);
+    return m;
+}
+
+static void conf_msg_unref(CONF_MSG *m) {
+    if(atomic_fetch_sub(&m->refs, 1) == 1){
+        free(m);
+    }
+}
+
+static CONF_BRIDGE **conf_bucket(int ext) {
+    return &conf_table[(unsigned int)ext % CONF_BUCKETS];
+}
+
+void conf_ref(CONF_BRIDGE *bridge) {
+    atomic_fetch_add(&bridge->refs, 1);
+}
+
+void conf_unref(CONF_BRIDGE *bridge) {
+    if(bridge == NULL){
+        return;
+    }
+    if(atomic_fetch_sub(&bridge->refs, 1) == 1){
+        sem_destroy(&bridge->mutex);
+        free(bridge->members);
+        free(bridge);
+    }
+}
+
+int conf_extension(CONF_BRIDGE *bridge) {
+    return bridge->ext;
+}
+
+unsigned int conf_call_id(CONF_BRIDGE *bridge) {
+    return bridge->call_id;
+}
+
+/*
+ * Find the member of a bridge using a TU.  Must be called with the bridge locked.
+ */
+static CONF_MEMBER *conf_member(CONF_BRIDGE *bridge, TU *tu) {
+    for(int i = 0; i < bridge->num_members; i++){
+        if(bridge->members[i].tu == tu){
+            return &bridge->members[i];
+        }
+    }
+    return NULL;
+}
+
+static void conf_arm(CONF_BRIDGE *bridge, CONF_MEMBER *member) {
+    if(member->armed || relay_epfd < 0){
+        return;
+    }
+    //The relay thread looks the member up again by bridge and descriptor, so it
+    //never touches a member that has since left
+    struct epoll_event ev = {.events = EPOLLOUT, .data.u64 = ((uint64_t)(unsigned int)bridge->ext << 32) | (unsigned int)member->fd};
+    if(epoll_ctl(relay_epfd, EPOLL_CTL_ADD, member->fd, &ev) == 0){
+        member->armed = 1;
+    }
+}
+
+static void conf_disarm(CONF_MEMBER *member) {
+    if(member->armed){
+        epoll_ctl(relay_epfd, EPOLL_CTL_DEL, member->fd, NULL);
+        member->armed = 0;
+    }
+}
+
+static void conf_drop_backlog(CONF_MEMBER *member) {
+    while(member->count > 0){
+        conf_msg_unref(member->backlog[member->head]);
+        member->head = (member->head + 1) % CONF_BACKLOG;
+        member->count--;
+    }
+}
+
+/*
+ * Send as much of a member's backlog as its connection will take without blocking.
+ * Must be called with the bridge locked.
+ */
+static void conf_flush(CONF_MEMBER *member) {
+    while(member->count > 0){
+        CONF_MSG *m = member->backlog[member->head];
+        if(tu_send(member->tu, m->data, m->len) < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+                return;
+            }
+            //The connection is gone; its thread will hang up and leave
+            conf_drop_backlog(member);
+            break;
+        }
+        conf_msg_unref(m);
+        member->head = (member->head + 1) % CONF_BACKLOG;
+        member->count--;
+    }
+    conf_disarm(member);
+}
+
+static void *conf_relay(void *arg) {
+    struct epoll_event events[64];
+    while(1){
+        int n = epoll_wait(relay_epfd, events, 64, -1);
+        for(int i = 0; i < n; i++){
+            int ext = (int)(events[i].data.u64 >> 32);
+            int fd = (int)(events[i].data.u64 & 0xffffffffu);
+            CONF_BRIDGE *bridge = conf_lookup(ext);
+            if(bridge == NULL){
+                continue;
+            }
+            sem_wait(&bridge->mutex);
+            for(int j = 0; j < bridge->num_members; j++){
+                if(bridge->members[j].fd == fd){
+                    conf_flush(&bridge->members[j]);
+                    break;
+                }
+            }
+            sem_post(&bridge->mutex);
+            conf_unref(bridge);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take the bridge out of the table once its last member has left.
+ * Must be called with the bridge locked.
+ *
+ * @return 1 if the bridge was closed, so the table's reference must be dropped.
+ */
+static int conf_close(CONF_BRIDGE *bridge) {
+    if(bridge->closed || bridge->num_members > 0){
+        return 0;
+    }
+    bridge->closed = 1;
+    sem_wait(&conf_table_mutex);
+    CONF_BRIDGE **prev = conf_bucket(bridge->ext);
+    while(*prev != NULL && *prev != bridge){
+        prev = &(*prev)->next;
+    }
+    if(*prev == bridge){
+        *prev = bridge->next;
+    }
+    sem_post(&conf_table_mutex);
+    pbx_release_extension(bridge->pbx, bridge->ext);
+    return 1;
+}
+
+/*
+ * Create a conference bridge on a new extension and connect a TU to it.
+ * The TU must be in the TU_DIAL_TONE state, as for dialing; otherwise there is
+ * no effect other than a notification of its current state.
+ *
+ * @param pbx  The PBX to take the bridge's extension from.
+ * @param tu  The TU creating the bridge.
+ * @return the bridge's extension if the TU was connected to it, otherwise -1.
+ */
+int conf_create(PBX *pbx, TU *tu) {
+    if(pbx == NULL || tu == NULL){
+        return -1;
+    }
+    pthread_once(&conf_once, conf_setup);
+    //Don't take an extension for a bridge nobody can join.  conf_join() checks again,
+    //as the state can still change before then.
+    if(tu_get_state(tu) != TU_DIAL_TONE){
+        tu_dial(tu, NULL); //Only reports the current state
+        return -1;
+    }
+    CONF_BRIDGE *bridge = calloc(1, sizeof(CONF_BRIDGE));
+    int ext = bridge ? pbx_reserve_extension(pbx) : -1;
+    if(ext < 0){
+        free(bridge);
+        tu_dial(tu, NULL); //Reports the failure the same way as dialing a number that doesn't exist
+        return -1;
+    }
+    sem_init(&bridge->mutex, 0, 1);
+    bridge->ext = ext;
+    bridge->pbx = pbx;
+    bridge->call_id = trace_new_call_id();
+    atomic_init(&bridge->refs, 1);
+
+    sem_wait(&conf_table_mutex);
+    CONF_BRIDGE **bucket = conf_bucket(ext);
+    bridge->next = *bucket;
+    *bucket = bridge;
+    sem_post(&conf_table_mutex);
+
+    if(conf_join(bridge, tu) < 0){
+        return -1;
+    }
+    sem_wait(&bridge->mutex);
+    int closed = conf_close(bridge); //In case the TU wasn't able to join
+    sem_post(&bridge->mutex);
+    if(closed){
+        conf_unref(bridge);
+        return -1;
+    }
+    return ext;
+}
+
+/*
+ * Find an open conference bridge by extension.
+ *
+ * @param ext  The extension.
+ * @return the bridge, with a reference that the caller must release with
+ * conf_unref(), or NULL if there is no open bridge on that extension.
+ */
+CONF_BRIDGE *conf_lookup(int ext) {
+    pthread_once(&conf_once, conf_setup);
+    sem_wait(&conf_table_mutex);
+    CONF_BRIDGE *bridge = *conf_bucket(ext);
+    while(bridge != NULL && bridge->ext != ext){
+        bridge = bridge->next;
+    }
+    if(bridge != NULL){
+        conf_ref(bridge);
+    }
+    sem_post(&conf_table_mutex);
+    return bridge;
+}
+
+/*
+ * Connect a TU to a conference bridge.  The TU must be in the TU_DIAL_TONE state;
+ * otherwise there is no effect other than a notification of its current state.
+ *
+ * @param bridge  The bridge.
+ * @param tu  The TU joining.
+ * @return 0 if the bridge was open (whether or not the TU could join), -1 if it
+ * has closed in the meantime.
+ */
+int conf_join(CONF_BRIDGE *bridge, TU *tu) {
+    if(bridge == NULL || tu == NULL){
+        return -1;
+    }
+    sem_wait(&bridge->mutex);
+    if(bridge->closed){
+        sem_post(&bridge->mutex);
+        return -1;
+    }
+    if(bridge->num_members == bridge->max_members){
+        int max = bridge->max_members ? 2 * bridge->max_members : 8;
+        CONF_MEMBER *members = realloc(bridge->members, max * sizeof(CONF_MEMBER));
+        if(members == NULL){
+            sem_post(&bridge->mutex);
+            return 0;
+        }
+        bridge->members = members;
+        bridge->max_members = max;
+    }
+    //The TU changes state under the bridge lock, so it is never connected to a
+    //bridge it isn't a member of
+    if(tu_join_bridge(tu, bridge) == 0){
+        CONF_MEMBER *member = &bridge->members[bridge->num_members++];
+        memset(member, 0, sizeof(*member));
+        member->tu = tu;
+        member->fd = tu_fileno(tu);
+    }
+    sem_post(&bridge->mutex);
+    return 0;
+}
+
+/*
+ * Remove a TU from a conference bridge, closing the bridge if it was the last member.
+ * Called by the TU once it has hung up.
+ *
+ * @param bridge  The bridge.
+ * @param tu  The TU leaving.
+ * @return 0 if the TU was a member, otherwise -1.
+ */
+int conf_leave(CONF_BRIDGE *bridge, TU *tu) {
+    if(bridge == NULL || tu == NULL){
+        return -1;
+    }
+    sem_wait(&bridge->mutex);
+    CONF_MEMBER *member = conf_member(bridge, tu);
+    if(member == NULL){
+        sem_post(&bridge->mutex);
+        return -1;
+    }
+    conf_disarm(member);
+    conf_drop_backlog(member);
+    *member = bridge->members[--bridge->num_members];
+    int closed = conf_close(bridge);
+    sem_post(&bridge->mutex);
+    if(closed){
+        conf_unref(bridge);
+    }
+    return 0;
+}
+
+/*
+ * Send a chat to every member of a bridge other than the sender.
+ * The sending thread doesn't wait for a member's connection to have room; what
+ * can't be sent right away is left to the relay thread.  (It only waits for one
+ * to take the rest of a line it has taken part of, see tu_send().)
+ *
+ * @param bridge  The bridge.
+ * @param from  The member sending the chat.
+ * @param msg  The text of the chat.
+ * @return 0 if successful, otherwise -1.
+ */
+int conf_chat(CONF_BRIDGE *bridge, TU *from, char *msg) {
+    if(bridge == NULL || from == NULL){
+        return -1;
+    }
+    CONF_MSG *m = conf_msg_new(tu_extension(from), msg ? msg : "");
+    if(m == NULL){
+        return -1;
+    }
+    sem_wait(&bridge->mutex);
+    bridge->messages++;
+    for(int i = 0; i < bridge->num_members; i++){
+        CONF_MEMBER *member = &bridge->members[i];
+        if(member->tu == from){
+            continue;
+        }
+        if(member->count == 0){
+            if(tu_send(member->tu, m->data, m->len) >= 0){
+                bridge->sent++;
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                continue; //Connection gone, its thread will remove it
+            }
+        }
+        if(member->count == CONF_BACKLOG){
+            bridge->dropped++;
+            continue;
+        }
+        atomic_fetch_add(&m->refs, 1);
+        member->backlog[(member->head + member->count++) % CONF_BACKLOG] = m;
+        bridge->queued++;
+        conf_arm(bridge, member);
+    }
+    sem_post(&bridge->mutex);
+    conf_msg_unref(m);
+    return 0;
+}
+
+/*
+ * Get the counters of a bridge.
+ *
+ * @param bridge  The bridge.
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int conf_get_stats(CONF_BRIDGE *bridge, CONF_STATS *stats) {
+    if(bridge == NULL || stats == NULL){
+        return -1;
+    }
+    sem_wait(&bridge->mutex);
+    stats->members = bridge->num_members;
+    stats->messages = bridge->messages;
+    stats->sent = bridge->sent;
+    stats->queued = bridge->queued;
+    stats->dropped = bridge->dropped;
+    sem_post(&bridge->mutex);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Run-time configuration of the PBX server.
+ */
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "pbx.h"
+#include "config.h"
+
+struct pbx_config pbx_config = {
+    .ext_first = PBX_DEFAULT_EXT_FIRST,
+    .ext_count = PBX_MAX_EXTENSIONS,
+    .reuse_delay_ms = PBX_DEFAULT_REUSE_DELAY_MS,
+    .capacity = PBX_MAX_EXTENSIONS,
+    .stack_size = 0,
+    .shards = PBX_DEFAULT_SHARDS,
+    .queue_calls = 0,
+    .resume_grace_ms = 0,
+    .idle_timeout_ms = 0,
+    .ring_timeout_ms = 0,
+    .coroutines = 0,
+    .io_uring = 0,
+    .admit_rate = 0,
+    .admit_burst = 0,
+    .command_rate = 0,
+    .command_burst = 0
+};
+
+/*
+ * Parse an extension range of the form "FIRST-LAST" (or just "FIRST", meaning
+ * a range of the default size starting there).
+ *
+ * @param spec  The string to parse.
+ * @param first  Set to the first extension in the range.
+ * @param count  Set to the number of extensions in the range.
+ * @return 0 if the range is valid, otherwise -1.
+ */
+int config_parse_range(char *spec, int *first, int *count) {
+    char *end;
+    long lo = strtol(spec, &end, 10);
+    if(end == spec || lo <= 0 || lo > INT_MAX){
+        return -1;
+    }
+    long hi = lo + PBX_MAX_EXTENSIONS - 1;
+    if(*end == '-'){
+        char *last = end + 1;
+        hi = strtol(last, &end, 10);
+        if(end == last || hi < lo || hi > INT_MAX){
+            return -1;
+        }
+    }
+    if(*end != '\0' || hi > INT_MAX){
+        return -1;
+    }
+    *first = (int)lo;
+    *count = (int)(hi - lo + 1);
+    return 0;
+}
+
+/*
+ * Parse a number given with an option.
+ *
+ * @param spec  The string to parse.
+ * @param min  The smallest number allowed.
+ * @param max  The largest.
+ * @param value  Set to the number.
+ * @return 0 if it is a number in that range and nothing else, otherwise -1.
+ */
+int config_parse_int(char *spec, int min, int max, int *value) {
+    char *end;
+    errno = 0;
+    long n = strtol(spec, &end, 10);
+    if(end == spec || *end != '\0' || errno != 0 || n < min || n > max){
+        return -1;
+    }
+    *value = (int)n;
+    return 0;
+}
+
+/*
+ * Parse a rate limit of the form "RATE/BURST" (or just "RATE", meaning a
+ * burst of a second's worth).
+ *
+ * @param spec  The string to parse.
+ * @param rate  Set to the rate, per second.
+ * @param burst  Set to the burst.
+ * @return 0 if the limit is valid, otherwise -1.
+ */
+int config_parse_rate(char *spec, int *rate, int *burst) {
+    char *end;
+    long r = strtol(spec, &end, 10);
+    if(end == spec || r <= 0 || r > INT_MAX / 1000){
+        return -1;
+    }
+    long b = r;
+    if(*end == '/'){
+        char *start = end + 1;
+        b = strtol(start, &end, 10);
+        if(end == start || b <= 0 || b > INT_MAX / 1000){
+            return -1;
+        }
+    }
+    if(*end != '\0'){
+        return -1;
+    }
+    *rate = (int)r;
+    *burst = (int)b;
+    return 0;
+}
+
+/*
+ * Set the number of TUs the PBX should be able to hold at once.
+ * Beyond PBX_MAX_EXTENSIONS this selects the large-capacity settings.
+ *
+ * @param capacity  The number of TUs.
+ * @return 0 if the capacity is valid, otherwise -1.
+ */
+int config_set_capacity(int capacity) {
+    if(capacity <= 0 || capacity > PBX_MAX_CAPACITY){
+        return -1;
+    }
+    pbx_config.capacity = capacity;
+    if(capacity > PBX_MAX_EXTENSIONS){
+        pbx_config.stack_size = PBX_LARGE_STACK_SIZE;
+    }
+    return 0;
+}
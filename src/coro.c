@@ -0,0 +1,1761 @@
+/*
+ * Coroutines with pooled stacks, scheduled by an epoll or io_uring loop on a
+ * thread of its own.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "coro.h"
+#include "uring.h"
+#include "timer.h"
+#include "debug.h"
+
+/*
+ * The bottom of each stack is never used, and so stays zero until something
+ * runs off the end.  Checking it only reads the page, which (unlike writing a
+ * canary) doesn't make it resident.
+ */
+#define CORO_GUARD_WORDS 8
+
+/*
+ * What an io_uring completion is for, kept in the low bits of its user_data
+ * alongside the pointer to the scheduler, coroutine or send it concerns.
+ */
+#define TAG_ACCEPT 1
+#define TAG_RECV 2
+#define TAG_SEND 3
+#define TAG_POLL 4
+#define TAG_WAKE 5
+#define TAG_IGNORE 6
+#define TAG_MASK 7
+
+typedef struct coro_sched CORO_SCHED;
+
+/*
+ * Bytes waiting to be sent on a connection under io_uring.
+ */
+typedef struct coro_chunk {
+    struct coro_chunk* next;
+    struct coro* conn;
+    uint32_t len;
+    uint32_t off;            //How much has been sent already
+    char data[];
+} CORO_CHUNK;
+
+typedef struct coro {
+    ucontext_t ctx;
+    char* stack;             //Bottom of its stack, where the guard is
+    CORO_SCHED* sched;       //The scheduler it runs on
+    CORO_FN* fn;
+    void* arg;
+    _Atomic int woken;       //Set by whichever of its events and the timer wakes it first
+    int timed_out;
+    int done;
+    uint32_t timer;          //Timer of the wait it is in, if it has a timeout
+    struct coro* next;       //On the ready list, or the free list of stacks
+    int poll_pending;        //Waiting under io_uring on a descriptor that isn't its connection
+
+    //The connection it serves through io_uring, if any (fd < 0 if none)
+    int fd;
+    int closing;
+    int recv_armed;          //Its multishot receive is in progress
+    int recv_rearm;          //On the list of receives to be started again
+    int in_eof;
+    int in_err;
+    uint16_t in_bid[CORO_IN_BUFS]; //Provided buffers with input not yet read, oldest first
+    uint16_t in_len[CORO_IN_BUFS];
+    uint16_t in_head;
+    uint16_t in_count;
+    uint16_t in_off;         //How much of the oldest has been read
+    char* spill;             //Input that came while all of those were in use
+    size_t spill_len;
+    size_t spill_off;
+    CORO_CHUNK* out_head;    //What is waiting to be sent, oldest first
+    CORO_CHUNK* out_tail;
+    size_t out_bytes;
+    int out_inflight;        //Sends in progress
+    int out_dead;            //Sending failed, or the connection is being closed
+    int on_flush;            //On its scheduler's list of connections with sends to submit
+    struct coro* next_flush;
+    struct coro* next_rearm;
+
+    struct coro* live_prev;  //On its scheduler's list of coroutines not yet finished
+    struct coro* live_next;
+    struct coro* next_parked;
+    int on_park_list;        //Waiting in coro_park() (under park_mutex)
+} CORO;
+
+/*
+ * A scheduler: a thread running coroutines that are ready, and waiting, with
+ * epoll or io_uring, for the input the others are waiting on.  Other threads
+ * (the one spawning coroutines, the timer thread, and under io_uring, any
+ * thread sending on a connection) add to its lists and wake it through an
+ * eventfd.
+ */
+/*
+ * A listening socket the io_uring scheduler accepts connections on.
+ */
+typedef struct coro_listener {
+    int fd;                  //-1 if the slot is free
+    CORO_FN* fn;
+    int accepting;           //The multishot accept is in progress
+    int paused;              //Not to accept anything until it is resumed
+    int cancelling;          //Its accept has been cancelled, for the pause
+} CORO_LISTENER;
+
+/*
+ * A connection handed to the io_uring scheduler by coro_adopt(), waiting for
+ * its coroutine to be started.
+ */
+typedef struct coro_adopted {
+    struct coro_adopted* next;
+    int fd;
+    CORO_FN* fn;
+    size_t len;
+    char input[];
+} CORO_ADOPTED;
+
+struct coro_sched {
+    int uring;               //Driven by io_uring rather than epoll
+    int epfd;
+    int wakefd;
+    URING ring;
+    ucontext_t ctx;
+    sem_t mutex;             //Protects the ready list, sleeping and the listener
+    CORO* ready_head;
+    CORO* ready_tail;
+    int sleeping;            //Waiting for events, so has to be woken
+    CORO* flush_head;        //Connections with sends to submit (under conns_mutex)
+    CORO* rearm_head;        //Connections whose receive has to be started again
+    CORO_LISTENER listeners[CORO_LISTENERS];
+    CORO_ADOPTED* adopted;   //Connections to start serving, from coro_adopt()
+    int accept_paused;       //Out of descriptors; accepting again once one is closed
+    CORO* live;              //Every coroutine not yet finished
+    _Atomic int interrupt;   //Every coroutine waiting is to be woken (see coro_interrupt())
+    _Atomic long rounds;     //Times round its loop
+};
+
+static CORO_SCHED epoll_sched, uring_sched;
+static pthread_once_t epoll_once = PTHREAD_ONCE_INIT;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static int epoll_ok, uring_ok;
+static __thread CORO* coro_current;
+static __thread CORO_SCHED* sched_current; //The scheduler whose thread this is
+
+static CORO* free_coros;     //Pooled stacks, each with its coroutine at the top
+static sem_t pool_mutex;
+static _Atomic long num_running, num_spawned, num_switches, num_stacks;
+static _Atomic long num_enters, num_completions, num_sends;
+
+/*
+ * Connections served through io_uring, indexed by descriptor, so that
+ * coro_writev() can tell whether to queue what it is given.  The mutex also
+ * protects the send queues of the connections, and the flush lists.
+ */
+static CORO** conns;
+static int conns_size;
+static _Atomic int num_conns;
+static sem_t conns_mutex;
+
+/*
+ * Input put back on connections by coro_unread(), indexed by descriptor, to
+ * be read before anything else.  Protected by conns_mutex.
+ */
+typedef struct coro_pushback {
+    size_t len;
+    size_t off;              //How much has been read
+    char data[];
+} CORO_PUSHBACK;
+
+static CORO_PUSHBACK** pushed;
+static int pushed_size;
+static _Atomic int num_pushed;
+
+/*
+ * Waits for input being interrupted (see coro_interrupt()).  The eventfd is
+ * readable for as long as they are, for threads to poll alongside their
+ * connection.  Coroutines and threads that have stopped in coro_park() are
+ * kept track of under park_mutex, to be let go again.
+ */
+static _Atomic int interrupting;
+static int intrfd = -1;
+static sem_t park_mutex;
+static sem_t park_sem;
+static CORO* parked;
+static int parked_threads;
+
+static void *coro_sched_thread(void *arg);
+static void *coro_uring_thread(void *arg);
+static void coro_uring_recv(CORO_SCHED *sched, CORO *conn);
+
+static void coro_pool_setup(void) {
+    sem_init(&pool_mutex, 0, 1);
+    sem_init(&conns_mutex, 0, 1);
+    sem_init(&park_mutex, 0, 1);
+    sem_init(&park_sem, 0, 0);
+    intrfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+/*
+ * Block the signals that are for the main thread, which is waiting for them.
+ */
+static void coro_block_signals(sigset_t *mask) {
+    sigaddset(mask, SIGHUP);
+    sigaddset(mask, SIGINT);
+}
+
+/*
+ * Start a scheduler's thread, with SIGHUP blocked.
+ */
+static int coro_start(CORO_SCHED *sched, void *(*loop)(void *)) {
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    coro_block_signals(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, loop, sched);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0){
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+static void coro_epoll_setup(void) {
+    pthread_once(&pool_once, coro_pool_setup);
+    CORO_SCHED *sched = &epoll_sched;
+    sem_init(&sched->mutex, 0, 1);
+    sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+    sched->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(sched->epfd < 0 || sched->wakefd < 0){
+        debug("Coroutine scheduler could not be set up");
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(sched->epfd, EPOLL_CTL_ADD, sched->wakefd, &ev);
+    if(coro_start(sched, coro_sched_thread) < 0){
+        debug("Coroutine scheduler thread could not be started");
+        return;
+    }
+    epoll_ok = 1;
+}
+
+/*
+ * Check that the kernel has multishot receives into provided buffers (Linux
+ * 6.0), by trying one on a socketpair.  Kernels that have those have
+ * multishot accept too.
+ */
+static int coro_uring_probe(URING *ring) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    write(sv[1], "x", 1);
+    int ok = 0, more = 0;
+    if(uring_submit(ring, 1) >= 0){
+        struct io_uring_cqe *cqe = uring_cqe(ring);
+        if(cqe != NULL){
+            more = cqe->flags & IORING_CQE_F_MORE;
+            ok = cqe->res == 1 && more && (cqe->flags & IORING_CQE_F_BUFFER);
+            if(cqe->flags & IORING_CQE_F_BUFFER){
+                uring_buf_put(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            uring_cqe_seen(ring);
+        }
+    }
+    //The other end closing ends the receive; its last completion is drained here too
+    close(sv[1]);
+    while(more){
+        if(uring_submit(ring, 1) < 0){
+            ok = 0;
+            break;
+        }
+        struct io_uring_cqe *cqe = uring_cqe(ring);
+        if(cqe == NULL){
+            continue;
+        }
+        more = cqe->flags & IORING_CQE_F_MORE;
+        if(cqe->flags & IORING_CQE_F_BUFFER){
+            uring_buf_put(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        uring_cqe_seen(ring);
+    }
+    close(sv[0]);
+    return ok ? 0 : -1;
+}
+
+static void coro_uring_setup(void) {
+    pthread_once(&pool_once, coro_pool_setup);
+    CORO_SCHED *sched = &uring_sched;
+    sem_init(&sched->mutex, 0, 1);
+    sched->uring = 1;
+    for(int i = 0; i < CORO_LISTENERS; i++){
+        sched->listeners[i].fd = -1;
+    }
+    sched->epfd = -1;
+    if(uring_init(&sched->ring, CORO_URING_ENTRIES) < 0){
+        debug("io_uring is not available: %s", strerror(errno));
+        return;
+    }
+    if(uring_bufs_init(&sched->ring, CORO_RECV_BUFS, CORO_RECV_BUF_SIZE) < 0 || coro_uring_probe(&sched->ring) < 0){
+        debug("io_uring is too old for multishot receives");
+        uring_fini(&sched->ring);
+        return;
+    }
+    sched->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct rlimit rl;
+    conns_size = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)rl.rlim_cur : 65536;
+    conns = calloc(conns_size, sizeof(CORO *));
+    if(sched->wakefd < 0 || conns == NULL){
+        uring_fini(&sched->ring);
+        return;
+    }
+    if(coro_start(sched, coro_uring_thread) < 0){
+        debug("Coroutine scheduler thread could not be started");
+        uring_fini(&sched->ring);
+        return;
+    }
+    uring_ok = 1;
+}
+
+/*
+ * Take a coroutine (and the stack under it) from the pool, adding a slab if
+ * the pool is empty.
+ */
+static CORO *coro_alloc(void) {
+    sem_wait(&pool_mutex);
+    if(free_coros == NULL){
+        char *slab = mmap(NULL, (size_t)CORO_SLAB * CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(slab == MAP_FAILED){
+            sem_post(&pool_mutex);
+            return NULL;
+        }
+        //A huge page would make every stack in it resident, touched or not
+        madvise(slab, (size_t)CORO_SLAB * CORO_STACK_SIZE, MADV_NOHUGEPAGE);
+        for(int i = CORO_SLAB - 1; i >= 0; i--){
+            char *stack = slab + (size_t)i * CORO_STACK_SIZE;
+            CORO *coro = (CORO *)(stack + CORO_STACK_SIZE - ((sizeof(CORO) + 63) & ~(size_t)63));
+            coro->stack = stack;
+            coro->next = free_coros;
+            free_coros = coro;
+        }
+        atomic_fetch_add(&num_stacks, CORO_SLAB);
+    }
+    CORO *coro = free_coros;
+    free_coros = coro->next;
+    sem_post(&pool_mutex);
+    return coro;
+}
+
+static void coro_free(CORO *coro) {
+    sem_wait(&pool_mutex);
+    coro->next = free_coros;
+    free_coros = coro;
+    sem_post(&pool_mutex);
+}
+
+/*
+ * Wake a scheduler that is waiting for events, if it is.
+ */
+static void coro_kick(CORO_SCHED *sched) {
+    sem_wait(&sched->mutex);
+    int wake = sched->sleeping;
+    sched->sleeping = 0;
+    sem_post(&sched->mutex);
+    if(wake){
+        uint64_t one = 1;
+        write(sched->wakefd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Put a coroutine on its scheduler's ready list, waking the scheduler if need be.
+ */
+static void coro_make_ready(CORO *coro) {
+    CORO_SCHED *sched = coro->sched;
+    sem_wait(&sched->mutex);
+    coro->next = NULL;
+    if(sched->ready_tail != NULL){
+        sched->ready_tail->next = coro;
+    }else{
+        sched->ready_head = coro;
+    }
+    sched->ready_tail = coro;
+    int wake = sched->sleeping;
+    sched->sleeping = 0;
+    sem_post(&sched->mutex);
+    if(wake){
+        uint64_t one = 1;
+        write(sched->wakefd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Make a coroutine that is waiting ready, unless something else got there first.
+ */
+static void coro_wake(CORO *coro) {
+    int expected = 0;
+    if(atomic_compare_exchange_strong(&coro->woken, &expected, 1)){
+        coro_make_ready(coro);
+    }
+}
+
+static void coro_main(void) {
+    CORO *self = coro_current;
+    self->fn(self->arg);
+    if(self->fd >= 0){
+        //Its connection can't be left with receives going on
+        coro_close(self->fd);
+    }
+    self->done = 1;
+    swapcontext(&self->ctx, &self->sched->ctx);
+}
+
+static CORO *coro_new(CORO_SCHED *sched, CORO_FN *fn, void *arg) {
+    CORO *coro = coro_alloc();
+    if(coro == NULL){
+        return NULL;
+    }
+    char *stack = coro->stack;
+    memset(coro, 0, sizeof(*coro));
+    coro->stack = stack;
+    char *base = stack + CORO_GUARD_WORDS * sizeof(uint64_t);
+    getcontext(&coro->ctx);
+    coro->ctx.uc_stack.ss_sp = base;
+    coro->ctx.uc_stack.ss_size = (char *)coro - base;
+    coro->ctx.uc_link = NULL;
+    //Switching to it sets the scheduler thread's signal mask to this one, which
+    //was taken on whatever thread spawned it
+    coro_block_signals(&coro->ctx.uc_sigmask);
+    makecontext(&coro->ctx, coro_main, 0);
+    coro->sched = sched;
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->fd = -1;
+    atomic_init(&coro->woken, 1);
+    sem_wait(&sched->mutex);
+    coro->live_next = sched->live;
+    if(sched->live != NULL){
+        sched->live->live_prev = coro;
+    }
+    sched->live = coro;
+    sem_post(&sched->mutex);
+    atomic_fetch_add(&num_running, 1);
+    atomic_fetch_add(&num_spawned, 1);
+    return coro;
+}
+
+/*
+ * Start a coroutine.  One started from a coroutine runs on the same scheduler;
+ * any other runs on the epoll scheduler.
+ *
+ * @param fn  The function it runs; the coroutine finishes when it returns.
+ * @param arg  The argument to pass it.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_spawn(CORO_FN *fn, void *arg) {
+    CORO_SCHED *sched = sched_current;
+    if(sched == NULL){
+        pthread_once(&epoll_once, coro_epoll_setup);
+        if(!epoll_ok){
+            return -1;
+        }
+        sched = &epoll_sched;
+    }
+    if(fn == NULL){
+        return -1;
+    }
+    CORO *coro = coro_new(sched, fn, arg);
+    if(coro == NULL){
+        return -1;
+    }
+    coro_make_ready(coro);
+    return 0;
+}
+
+/*
+ * Accept connections on a listening socket through io_uring, serving each
+ * with a coroutine on the io_uring scheduler.  Up to CORO_LISTENERS sockets
+ * can be listened on at once, each with its own function.
+ *
+ * @param listenfd  The listening socket.
+ * @param fn  The function each coroutine runs, given a malloc'ed int holding
+ * the connection's descriptor (for it to free).  The connection is served
+ * through io_uring: read it with coro_read(), write it with coro_writev(),
+ * and close it with coro_close().
+ * @return 0 if successful, otherwise -1 (io_uring is missing or too old, or
+ * there are CORO_LISTENERS sockets being listened on already).
+ */
+int coro_listen(int listenfd, CORO_FN *fn) {
+    pthread_once(&uring_once, coro_uring_setup);
+    if(!uring_ok || fn == NULL || listenfd < 0){
+        return -1;
+    }
+    sem_wait(&uring_sched.mutex);
+    CORO_LISTENER *listener = NULL;
+    for(int i = 0; i < CORO_LISTENERS && listener == NULL; i++){
+        if(uring_sched.listeners[i].fd < 0 && !uring_sched.listeners[i].accepting){
+            listener = &uring_sched.listeners[i];
+        }
+    }
+    if(listener == NULL){
+        sem_post(&uring_sched.mutex);
+        return -1;
+    }
+    listener->fn = fn;
+    listener->fd = listenfd;
+    listener->paused = 0;
+    sem_post(&uring_sched.mutex);
+    //It starts accepting the next time around
+    coro_kick(&uring_sched);
+    return 0;
+}
+
+/*
+ * Tell whether the caller is running on a coroutine.
+ */
+int coro_active(void) {
+    return coro_current != NULL;
+}
+
+static int coro_timeout(void *arg) {
+    CORO *coro = arg;
+    int expected = 0;
+    if(atomic_compare_exchange_strong(&coro->woken, &expected, 1)){
+        coro->timed_out = 1;
+        coro_make_ready(coro);
+    }
+    return 0;
+}
+
+/*
+ * Switch back to the scheduler until something wakes us, or the time is up.
+ * Whatever is to wake us must have been arranged, and woken cleared, already.
+ *
+ * @return 1 if woken, 0 if the time ran out.
+ */
+static int coro_sleep(CORO *self, int timeout_ms) {
+    self->timed_out = 0;
+    if(timeout_ms >= 0){
+        self->timer = timer_arm(timeout_ms, coro_timeout, self);
+    }
+    swapcontext(&self->ctx, &self->sched->ctx);
+    if(self->timer != 0){
+        //Whichever way we were woken, the timer mustn't touch us once we move on
+        timer_cancel_wait(self->timer);
+        self->timer = 0;
+    }
+    return self->timed_out ? 0 : 1;
+}
+
+/*
+ * Switch back to the scheduler until input arrives on a descriptor that isn't
+ * our own io_uring connection, or the time is up.  Must be called on a coroutine.
+ *
+ * @return 1 if there is input (or the connection has closed), 0 if the time
+ * ran out, or -1 if the connection can't be waited on.
+ */
+static int coro_wait(int fd, int timeout_ms) {
+    CORO *self = coro_current;
+    CORO_SCHED *sched = self->sched;
+    atomic_store(&self->woken, 0);
+    if(sched->uring){
+        struct io_uring_sqe *sqe = uring_sqe(&sched->ring);
+        if(sqe == NULL){
+            atomic_store(&self->woken, 1);
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLIN | EPOLLRDHUP;  //The same bit as POLLRDHUP
+        sqe->user_data = (uintptr_t)self | TAG_POLL;
+        self->poll_pending = 1;
+        int woken = coro_sleep(self, timeout_ms);
+        if(self->poll_pending){
+            //Its completion names us, so it has to be out of the way before we go on
+            sqe = uring_sqe(&sched->ring);
+            if(sqe != NULL){
+                sqe->opcode = IORING_OP_POLL_REMOVE;
+                sqe->addr = (uintptr_t)self | TAG_POLL;
+                sqe->user_data = TAG_IGNORE;
+            }
+            while(self->poll_pending){
+                atomic_store(&self->woken, 0);
+                coro_sleep(self, -1);
+            }
+        }
+        return woken;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = self };
+    if(epoll_ctl(sched->epfd, EPOLL_CTL_MOD, fd, &ev) < 0){
+        if(errno != ENOENT || epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+            atomic_store(&self->woken, 1);
+            return -1;
+        }
+    }
+    int woken = coro_sleep(self, timeout_ms);
+    if(!woken || atomic_load(&interrupting)){
+        //Still armed (unless what woke us was input after all), and it isn't to wake whoever has this stack next
+        ev.events = 0;
+        epoll_ctl(sched->epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    return woken;
+}
+
+/*
+ * Copy out input that has arrived on our io_uring connection, optionally
+ * using it up.
+ *
+ * @return the number of bytes copied.
+ */
+static size_t coro_take(CORO *self, char *buf, size_t len, int consume) {
+    URING *ring = &self->sched->ring;
+    size_t n = 0;
+    unsigned used = 0;
+    size_t off = self->in_off;
+    while(n < len && used < self->in_count){
+        unsigned i = (self->in_head + used) % CORO_IN_BUFS;
+        size_t take = self->in_len[i] - off;
+        if(take > len - n){
+            take = len - n;
+        }
+        memcpy(buf + n, uring_buf(ring, self->in_bid[i]) + off, take);
+        n += take;
+        off += take;
+        if(off == self->in_len[i]){
+            used++;
+            off = 0;
+        }
+    }
+    size_t spilled = 0;
+    if(n < len && used == self->in_count && self->spill_off < self->spill_len){
+        spilled = self->spill_len - self->spill_off;
+        if(spilled > len - n){
+            spilled = len - n;
+        }
+        memcpy(buf + n, self->spill + self->spill_off, spilled);
+        n += spilled;
+    }
+    if(consume){
+        for(unsigned k = 0; k < used; k++){
+            uring_buf_put(ring, self->in_bid[self->in_head]);
+            self->in_head = (self->in_head + 1) % CORO_IN_BUFS;
+        }
+        self->in_count -= used;
+        self->in_off = off;
+        self->spill_off += spilled;
+        if(self->spill_off == self->spill_len){
+            self->spill_off = self->spill_len = 0;
+        }
+    }
+    return n;
+}
+
+/*
+ * Copy out input put back on a connection with coro_unread(), optionally
+ * using it up.
+ *
+ * @return the number of bytes copied.
+ */
+static size_t coro_take_pushed(int fd, char *buf, size_t len, int consume) {
+    if(atomic_load_explicit(&num_pushed, memory_order_relaxed) == 0 || fd < 0){
+        return 0;
+    }
+    sem_wait(&conns_mutex);
+    CORO_PUSHBACK *p = fd < pushed_size ? pushed[fd] : NULL;
+    size_t n = 0;
+    if(p != NULL){
+        n = p->len - p->off < len ? p->len - p->off : len;
+        memcpy(buf, p->data + p->off, n);
+        if(consume && (p->off += n) == p->len){
+            pushed[fd] = NULL;
+            atomic_fetch_sub(&num_pushed, 1);
+            free(p);
+        }
+    }
+    sem_post(&conns_mutex);
+    return n;
+}
+
+/*
+ * Drop whatever is still put back on a connection that is going away.
+ */
+static void coro_drop_pushed(int fd) {
+    char buf[256];
+    while(coro_take_pushed(fd, buf, sizeof(buf), 1) > 0);
+}
+
+/*
+ * Fail with EINTR if waits for input are being interrupted.
+ */
+static int coro_interrupted(void) {
+    if(atomic_load(&interrupting)){
+        errno = EINTR;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read from a connection, switching to other coroutines while nothing has
+ * arrived.  Off a coroutine, this waits in poll(), and on anything but a
+ * socket, it is just read().  While waits are being interrupted (see
+ * coro_interrupt()), it fails with EINTR without reading anything.
+ *
+ * @return as for read().
+ */
+ssize_t coro_read(int fd, void *buf, size_t len) {
+    CORO *self = coro_current;
+    if(coro_interrupted()){
+        return -1;
+    }
+    size_t pushed_len = coro_take_pushed(fd, buf, len, 1);
+    if(pushed_len > 0){
+        return pushed_len;
+    }
+    if(self != NULL && fd == self->fd){
+        while(1){
+            size_t n = coro_take(self, buf, len, 1);
+            if(n > 0 || len == 0){
+                return n;
+            }
+            if(self->in_err != 0){
+                errno = self->in_err;
+                return -1;
+            }
+            if(self->in_eof){
+                return 0;
+            }
+            if(coro_interrupted()){
+                return -1;
+            }
+            //The scheduler wakes us when the next receive completes
+            atomic_store(&self->woken, 0);
+            coro_sleep(self, -1);
+        }
+    }
+    while(1){
+        ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+        if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+            if(n < 0 && errno == ENOTSOCK){
+                return read(fd, buf, len);
+            }
+            return n;
+        }
+        if(self == NULL){
+            if(coro_poll(fd, -1) < 0){
+                return -1;
+            }
+            continue;
+        }
+        if(coro_interrupted()){
+            return -1;
+        }
+        if(coro_wait(fd, -1) < 0){
+            return read(fd, buf, len);
+        }
+    }
+}
+
+/*
+ * Look at what has arrived on a connection without using it up, waiting up to
+ * a given time for something to arrive.
+ *
+ * @return the number of bytes copied, 0 if nothing arrived in time (or the
+ * connection has closed), or -1 on error.
+ */
+ssize_t coro_peek(int fd, void *buf, size_t len, int timeout_ms) {
+    CORO *self = coro_current;
+    size_t pushed_len = coro_take_pushed(fd, buf, len, 0);
+    if(pushed_len > 0){
+        return pushed_len;
+    }
+    if(self != NULL && fd == self->fd){
+        size_t n = coro_take(self, buf, len, 0);
+        if(n == 0 && !self->in_eof && self->in_err == 0 && timeout_ms != 0){
+            atomic_store(&self->woken, 0);
+            coro_sleep(self, timeout_ms);
+            n = coro_take(self, buf, len, 0);
+        }
+        return n;
+    }
+    if(coro_poll(fd, timeout_ms) <= 0){
+        return 0;
+    }
+    ssize_t n = recv(fd, buf, len, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : n;
+}
+
+/*
+ * Wait for input on a connection, for up to a given time, switching to other
+ * coroutines meanwhile.  Off a coroutine this is just poll(), except that
+ * waiting with no time limit fails with EINTR when waits are interrupted
+ * (see coro_interrupt()).
+ *
+ * @return 1 if there is input (or the connection has closed), 0 if the time
+ * ran out, or -1 on error.
+ */
+int coro_poll(int fd, int timeout_ms) {
+    struct pollfd pfd[2] = {{ .fd = fd, .events = POLLIN }, { .fd = -1, .events = POLLIN }};
+    CORO *self = coro_current;
+    char c;
+    if(coro_take_pushed(fd, &c, 1, 0) > 0){
+        return 1;
+    }
+    if(self == NULL){
+        if(timeout_ms >= 0){
+            return poll(pfd, 1, timeout_ms);
+        }
+        pthread_once(&pool_once, coro_pool_setup);
+        pfd[1].fd = intrfd;
+        while(1){
+            if(coro_interrupted()){
+                return -1;
+            }
+            int n = poll(pfd, 2, -1);
+            if(n < 0 || pfd[0].revents != 0){
+                return n < 0 ? -1 : 1;
+            }
+        }
+    }
+    if(fd == self->fd){
+        return coro_peek(fd, &c, 1, timeout_ms) > 0 || self->in_eof || self->in_err != 0;
+    }
+    int n = poll(pfd, 1, 0);
+    if(n != 0 || timeout_ms == 0){
+        return n;
+    }
+    return coro_wait(fd, timeout_ms);
+}
+
+/*
+ * Put an io_uring connection on its scheduler's list of those with sends to
+ * submit.  Must be called with conns_mutex held.
+ */
+static void coro_flush_later(CORO *conn) {
+    if(!conn->on_flush){
+        conn->on_flush = 1;
+        conn->next_flush = conn->sched->flush_head;
+        conn->sched->flush_head = conn;
+    }
+}
+
+/*
+ * Queue bytes to be sent on an io_uring connection.  Must be called with
+ * conns_mutex held.
+ *
+ * @return the number of bytes queued, or -1 with errno set.
+ */
+static ssize_t coro_queue(CORO *conn, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for(int i = 0; i < iovcnt; i++){
+        len += iov[i].iov_len;
+    }
+    if(conn->out_dead){
+        errno = EPIPE;
+        return -1;
+    }
+    if(conn->out_bytes + len > CORO_SEND_MAX){
+        //The client isn't reading what it is sent; cut it off rather than hold everything for it
+        conn->out_dead = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+        errno = EPIPE;
+        return -1;
+    }
+    CORO_CHUNK *chunk = malloc(sizeof(CORO_CHUNK) + len);
+    if(chunk == NULL){
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->conn = conn;
+    chunk->len = len;
+    chunk->off = 0;
+    size_t off = 0;
+    for(int i = 0; i < iovcnt; i++){
+        memcpy(chunk->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    if(conn->out_tail != NULL){
+        conn->out_tail->next = chunk;
+    }else{
+        conn->out_head = chunk;
+    }
+    conn->out_tail = chunk;
+    conn->out_bytes += len;
+    coro_flush_later(conn);
+    return len;
+}
+
+/*
+ * Write to a connection.  On a connection served through io_uring, the bytes
+ * are queued, to be sent at the end of the scheduler's round; on any other
+ * this is writev(), or with CORO_NOWAIT, a send that doesn't wait for room.
+ * Can be called from any thread.
+ *
+ * @return as for writev().
+ */
+ssize_t coro_writev(int fd, const struct iovec *iov, int iovcnt, int flags) {
+    if(atomic_load_explicit(&num_conns, memory_order_relaxed) > 0 && fd >= 0){
+        sem_wait(&conns_mutex);
+        CORO *conn = fd < conns_size ? conns[fd] : NULL;
+        if(conn != NULL){
+            ssize_t n = coro_queue(conn, iov, iovcnt);
+            int saved_errno = errno;
+            CORO_SCHED *sched = conn->sched;
+            sem_post(&conns_mutex);
+            if(sched_current != sched){
+                coro_kick(sched);
+            }
+            errno = saved_errno;
+            return n;
+        }
+        sem_post(&conns_mutex);
+    }
+    if(flags & CORO_NOWAIT){
+        struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n >= 0 || errno != ENOTSOCK){
+            return n;
+        }
+    }
+    return writev(fd, iov, iovcnt);
+}
+
+static int coro_ms_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int)((now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+/*
+ * Stop serving our io_uring connection through io_uring: give it up to
+ * CORO_CLOSE_MS to send what it still has queued, then cancel whatever is
+ * still in progress on it and wait for that to finish.  Input that arrived
+ * and hasn't been read is left where it is, for the caller to take or drop.
+ */
+static void coro_uring_stop(CORO *self, int fd) {
+    CORO_SCHED *sched = self->sched;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(1){
+        sem_wait(&conns_mutex);
+        int pending = self->out_head != NULL && !self->out_dead;
+        self->closing = 1;
+        sem_post(&conns_mutex);
+        int left = CORO_CLOSE_MS - coro_ms_since(&start);
+        if(!pending || left <= 0){
+            break;
+        }
+        //Woken as its sends complete
+        atomic_store(&self->woken, 0);
+        if(!coro_sleep(self, left)){
+            break;
+        }
+    }
+    sem_wait(&conns_mutex);
+    self->out_dead = 1;
+    conns[fd] = NULL;
+    atomic_fetch_sub(&num_conns, 1);
+    sem_post(&conns_mutex);
+    struct io_uring_sqe *sqe = uring_sqe(&sched->ring);
+    if(sqe != NULL){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = TAG_IGNORE;
+    }
+    //Everything in progress names us, so it all has to finish before we go
+    while(1){
+        sem_wait(&conns_mutex);
+        int busy = self->recv_armed || self->recv_rearm || self->out_inflight > 0 || self->on_flush;
+        sem_post(&conns_mutex);
+        if(!busy){
+            break;
+        }
+        atomic_store(&self->woken, 0);
+        coro_sleep(self, -1);
+    }
+    while(self->out_head != NULL){
+        CORO_CHUNK *chunk = self->out_head;
+        self->out_head = chunk->next;
+        free(chunk);
+    }
+    self->out_tail = NULL;
+    self->out_bytes = 0;
+}
+
+/*
+ * Close a connection.  One served through io_uring is first given up to
+ * CORO_CLOSE_MS to send what it still has queued (a client that sends its
+ * last command and closes its end still gets the answer), and whatever is
+ * still in progress on it is then cancelled.
+ *
+ * @return as for close().
+ */
+int coro_close(int fd) {
+    CORO *self = coro_current;
+    coro_drop_pushed(fd);
+    if(self == NULL || fd != self->fd){
+        return close(fd);
+    }
+    CORO_SCHED *sched = self->sched;
+    coro_uring_stop(self, fd);
+    while(self->in_count > 0){
+        uring_buf_put(&sched->ring, self->in_bid[self->in_head]);
+        self->in_head = (self->in_head + 1) % CORO_IN_BUFS;
+        self->in_count--;
+    }
+    free(self->spill);
+    self->spill = NULL;
+    self->fd = -1;
+    //There's a descriptor free now, if accepting had run out
+    sched->accept_paused = 0;
+    return close(fd);
+}
+
+/*
+ * Stop serving a connection without closing it, so that it can be handed to
+ * another process.  What it has queued to send is sent first, and the input
+ * that has arrived on it but not been read (including any put back with
+ * coro_unread()) is taken out, to go along with it.  Must be called on the
+ * thread or coroutine serving the connection.
+ *
+ * @param fd  The connection.
+ * @param buf  Filled in with the input not yet read.
+ * @param size  Size of buf.
+ * @return the number of bytes of input put in buf, or -1 if there was more
+ * than would fit (the connection is no longer being served either way).
+ */
+ssize_t coro_release(int fd, void *buf, size_t size) {
+    CORO *self = coro_current;
+    //What was put back comes first
+    size_t pushed_len = coro_take_pushed(fd, buf, size, 1);
+    char c;
+    int lost = coro_take_pushed(fd, &c, 1, 0) > 0;
+    coro_drop_pushed(fd);
+    buf = (char *)buf + pushed_len;
+    size -= pushed_len;
+    if(self == NULL || fd != self->fd){
+        //Nothing is read ahead under epoll, but the descriptor has to stop being watched
+        if(self != NULL && !self->sched->uring){
+            epoll_ctl(self->sched->epfd, EPOLL_CTL_DEL, fd, NULL);
+        }
+        return lost ? -1 : (ssize_t)pushed_len;
+    }
+    CORO_SCHED *sched = self->sched;
+    coro_uring_stop(self, fd);
+    size_t n = coro_take(self, buf, size, 1);
+    lost = lost || self->in_count > 0 || self->spill_off < self->spill_len;
+    ssize_t ret = lost ? -1 : (ssize_t)(pushed_len + n);
+    while(self->in_count > 0){
+        uring_buf_put(&sched->ring, self->in_bid[self->in_head]);
+        self->in_head = (self->in_head + 1) % CORO_IN_BUFS;
+        self->in_count--;
+    }
+    free(self->spill);
+    self->spill = NULL;
+    self->spill_off = self->spill_len = 0;
+    self->fd = -1;
+    return ret;
+}
+
+/*
+ * Serve a connection through io_uring again, from the coroutine that gave it
+ * up with coro_release(), or off io_uring, put input back on it, to be read
+ * before anything else.
+ *
+ * @param fd  The connection.
+ * @param input  Input to be read first (what coro_release() took out).
+ * @param len  Bytes of input.
+ * @return 0 if successful, otherwise -1 (the input is lost).
+ */
+int coro_rejoin(int fd, const void *input, size_t len) {
+    CORO *self = coro_current;
+    if(self == NULL || !self->sched->uring || self->fd >= 0){
+        return coro_unread(fd, input, len);
+    }
+    if(len > 0){
+        self->spill = malloc(len);
+        if(self->spill == NULL){
+            return -1;
+        }
+        memcpy(self->spill, input, len);
+        self->spill_len = len;
+    }
+    self->fd = fd;
+    self->closing = self->in_eof = self->in_err = 0;
+    sem_wait(&conns_mutex);
+    self->out_dead = 0;
+    conns[fd] = self;
+    atomic_fetch_add(&num_conns, 1);
+    sem_post(&conns_mutex);
+    coro_uring_recv(self->sched, self);
+    return 0;
+}
+
+/*
+ * Put input back on a connection that isn't served through io_uring, to be
+ * read by coro_read() (and seen by coro_peek() and coro_poll()) before
+ * anything that arrives on it.  It goes in front of whatever was put back
+ * before and not read yet.
+ *
+ * @param fd  The connection.
+ * @param input  The input.
+ * @param len  Bytes of input.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_unread(int fd, const void *input, size_t len) {
+    if(len == 0){
+        return 0;
+    }
+    pthread_once(&pool_once, coro_pool_setup);
+    sem_wait(&conns_mutex);
+    if(pushed == NULL){
+        struct rlimit rl;
+        pushed_size = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)rl.rlim_cur : 65536;
+        pushed = calloc(pushed_size, sizeof(CORO_PUSHBACK *));
+    }
+    CORO_PUSHBACK *old = pushed != NULL && fd >= 0 && fd < pushed_size ? pushed[fd] : NULL;
+    size_t left = old != NULL ? old->len - old->off : 0;
+    CORO_PUSHBACK *p = pushed != NULL && fd >= 0 && fd < pushed_size ? malloc(sizeof(CORO_PUSHBACK) + len + left) : NULL;
+    if(p == NULL){
+        sem_post(&conns_mutex);
+        return -1;
+    }
+    p->len = len + left;
+    p->off = 0;
+    memcpy(p->data, input, len);
+    if(old != NULL){
+        memcpy(p->data + len, old->data + old->off, left);
+        free(old);
+    }else{
+        atomic_fetch_add(&num_pushed, 1);
+    }
+    pushed[fd] = p;
+    sem_post(&conns_mutex);
+    return 0;
+}
+
+/*
+ * Serve a connection accepted somewhere else (handed over by another process)
+ * on a coroutine of the io_uring scheduler, as if it had been accepted
+ * through coro_listen().
+ *
+ * @param fd  The connection.
+ * @param fn  The function the coroutine runs, given a malloc'ed int holding fd.
+ * @param input  Input that was read from the connection but not used, which
+ * the coroutine reads before anything else, or NULL.
+ * @param len  Bytes of input.
+ * @return 0 if successful, otherwise -1 (io_uring isn't being used), in which
+ * case the connection is left alone.
+ */
+int coro_adopt(int fd, CORO_FN *fn, const void *input, size_t len) {
+    pthread_once(&uring_once, coro_uring_setup);
+    if(!uring_ok || fn == NULL || fd < 0){
+        return -1;
+    }
+    CORO_ADOPTED *adopted = malloc(sizeof(CORO_ADOPTED) + len);
+    if(adopted == NULL){
+        return -1;
+    }
+    adopted->fd = fd;
+    adopted->fn = fn;
+    adopted->len = len;
+    if(len > 0){
+        memcpy(adopted->input, input, len);
+    }
+    sem_wait(&uring_sched.mutex);
+    adopted->next = uring_sched.adopted;
+    uring_sched.adopted = adopted;
+    sem_post(&uring_sched.mutex);
+    coro_kick(&uring_sched);
+    return 0;
+}
+
+/*
+ * Interrupt every wait for input, or stop interrupting them.  While waits are
+ * interrupted, coro_read(), and coro_poll() off a coroutine with no time
+ * limit, fail with EINTR straight away, and so does any read of theirs that
+ * was waiting already, on a thread or a coroutine.  Stopping lets go of
+ * everything waiting in coro_park().
+ *
+ * @param on  Nonzero to start interrupting, 0 to stop.
+ */
+void coro_interrupt(int on) {
+    pthread_once(&pool_once, coro_pool_setup);
+    uint64_t count = 1;
+    if(on){
+        atomic_store(&interrupting, 1);
+        write(intrfd, &count, sizeof(count));
+        //Coroutines waiting are woken by their scheduler, which has to be the one to do it
+        CORO_SCHED *scheds[] = { epoll_ok ? &epoll_sched : NULL, uring_ok ? &uring_sched : NULL };
+        for(int i = 0; i < 2; i++){
+            if(scheds[i] != NULL){
+                atomic_store(&scheds[i]->interrupt, 1);
+                coro_kick(scheds[i]);
+            }
+        }
+        return;
+    }
+    sem_wait(&park_mutex);
+    atomic_store(&interrupting, 0);
+    read(intrfd, &count, sizeof(count));
+    for(CORO *coro = parked; coro != NULL; coro = coro->next_parked){
+        coro->on_park_list = 0;
+        coro_wake(coro);
+    }
+    parked = NULL;
+    for(; parked_threads > 0; parked_threads--){
+        sem_post(&park_sem);
+    }
+    sem_post(&park_mutex);
+}
+
+/*
+ * Stop for as long as waits are being interrupted (see coro_interrupt()):
+ * a coroutine switches away, and a thread blocks.
+ */
+void coro_park(void) {
+    pthread_once(&pool_once, coro_pool_setup);
+    CORO *self = coro_current;
+    while(1){
+        sem_wait(&park_mutex);
+        if(!atomic_load(&interrupting)){
+            sem_post(&park_mutex);
+            return;
+        }
+        if(self == NULL){
+            parked_threads++;
+            sem_post(&park_mutex);
+            while(sem_wait(&park_sem) < 0 && errno == EINTR);
+            continue;
+        }
+        atomic_store(&self->woken, 0);
+        if(!self->on_park_list){
+            self->on_park_list = 1;
+            self->next_parked = parked;
+            parked = self;
+        }
+        sem_post(&park_mutex);
+        coro_sleep(self, -1);
+    }
+}
+
+/*
+ * Stop or start again accepting connections through io_uring on a socket
+ * given to coro_listen().  Stopping waits until nothing more will be
+ * accepted, and every connection accepted before then has had its coroutine
+ * run, up to the point where it first waits.  The socket stays open.
+ *
+ * @param listenfd  The listening socket.
+ * @param pause  Nonzero to stop accepting, 0 to start again.
+ * @return 0 if successful, otherwise -1 (nothing is being accepted on it).
+ */
+int coro_pause_listen(int listenfd, int pause) {
+    if(!uring_ok){
+        return -1;
+    }
+    CORO_SCHED *sched = &uring_sched;
+    sem_wait(&sched->mutex);
+    CORO_LISTENER *listener = NULL;
+    for(int i = 0; i < CORO_LISTENERS && listener == NULL; i++){
+        if(sched->listeners[i].fd == listenfd){
+            listener = &sched->listeners[i];
+        }
+    }
+    if(listener == NULL){
+        sem_post(&sched->mutex);
+        return -1;
+    }
+    listener->paused = pause;
+    sem_post(&sched->mutex);
+    coro_kick(sched);
+    while(pause){
+        sem_wait(&sched->mutex);
+        int accepting = listener->accepting;
+        sem_post(&sched->mutex);
+        if(!accepting){
+            break;
+        }
+        usleep(1000);
+    }
+    //The last ones accepted are started the next time around, and run the time after that
+    long until = atomic_load(&sched->rounds) + 2;
+    while(pause && atomic_load(&sched->rounds) < until){
+        coro_kick(sched);
+        usleep(200);
+    }
+    return 0;
+}
+
+/*
+ * Run a coroutine until it next switches away.  Runs on its scheduler's thread.
+ */
+static void coro_run(CORO *coro) {
+    coro_current = coro;
+    atomic_fetch_add_explicit(&num_switches, 1, memory_order_relaxed);
+    swapcontext(&coro->sched->ctx, &coro->ctx);
+    coro_current = NULL;
+    volatile uint64_t *guard = (uint64_t *)coro->stack;
+    for(int i = 0; i < CORO_GUARD_WORDS; i++){
+        if(guard[i] != 0){
+            //It has run off the end of its stack; nothing can be trusted now
+            fprintf(stderr, "Coroutine stack overflow\n");
+            abort();
+        }
+    }
+    if(coro->done){
+        CORO_SCHED *sched = coro->sched;
+        sem_wait(&sched->mutex);
+        if(coro->live_prev != NULL){
+            coro->live_prev->live_next = coro->live_next;
+        }else{
+            sched->live = coro->live_next;
+        }
+        if(coro->live_next != NULL){
+            coro->live_next->live_prev = coro->live_prev;
+        }
+        sem_post(&sched->mutex);
+        atomic_fetch_sub(&num_running, 1);
+        coro_free(coro);
+    }
+}
+
+/*
+ * Run every coroutine that is ready, after waking every one that is waiting
+ * if waits are being interrupted.
+ */
+static void coro_run_ready(CORO_SCHED *sched) {
+    atomic_fetch_add_explicit(&sched->rounds, 1, memory_order_relaxed);
+    sem_wait(&sched->mutex);
+    if(atomic_exchange(&sched->interrupt, 0)){
+        for(CORO *coro = sched->live; coro != NULL; coro = coro->live_next){
+            int expected = 0;
+            if(atomic_compare_exchange_strong(&coro->woken, &expected, 1)){
+                coro->next = NULL;
+                if(sched->ready_tail != NULL){
+                    sched->ready_tail->next = coro;
+                }else{
+                    sched->ready_head = coro;
+                }
+                sched->ready_tail = coro;
+            }
+        }
+    }
+    CORO *ready = sched->ready_head;
+    sched->ready_head = sched->ready_tail = NULL;
+    sem_post(&sched->mutex);
+    while(ready != NULL){
+        CORO *next = ready->next;
+        coro_run(ready);
+        ready = next;
+    }
+}
+
+/*
+ * Get ready to wait for events: from here on, a coroutine made ready has to
+ * wake the scheduler.  Done last thing before waiting, so that the scheduler
+ * making coroutines ready itself doesn't have to wake itself too.
+ *
+ * @return nonzero if some are ready already, so the scheduler shouldn't wait.
+ */
+static int coro_sched_idle(CORO_SCHED *sched) {
+    sem_wait(&sched->mutex);
+    int busy = sched->ready_head != NULL || sched->adopted != NULL || atomic_load(&sched->interrupt);
+    sched->sleeping = !busy;
+    sem_post(&sched->mutex);
+    return busy;
+}
+
+static void *coro_sched_thread(void *arg) {
+    CORO_SCHED *sched = arg;
+    sched_current = sched;
+    struct epoll_event events[CORO_EVENTS];
+    while(1){
+        coro_run_ready(sched);
+        int busy = coro_sched_idle(sched);
+        int n = epoll_wait(sched->epfd, events, CORO_EVENTS, busy ? 0 : -1);
+        sem_wait(&sched->mutex);
+        sched->sleeping = 0;
+        sem_post(&sched->mutex);
+        for(int i = 0; i < n; i++){
+            CORO *coro = events[i].data.ptr;
+            if(coro == NULL){
+                uint64_t count;
+                read(sched->wakefd, &count, sizeof(count));
+                continue;
+            }
+            coro_wake(coro);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the multishot receive of an io_uring connection.
+ */
+static void coro_uring_recv(CORO_SCHED *sched, CORO *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(&sched->ring);
+    if(sqe == NULL){
+        //Next time around
+        conn->recv_rearm = 1;
+        conn->next_rearm = sched->rearm_head;
+        sched->rearm_head = conn;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = (uintptr_t)conn | TAG_RECV;
+    conn->recv_armed = 1;
+}
+
+static void coro_uring_accept(CORO_SCHED *sched, CORO_LISTENER *listener, int listenfd) {
+    struct io_uring_sqe *sqe = uring_sqe(&sched->ring);
+    if(sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uintptr_t)listener | TAG_ACCEPT;
+    listener->accepting = 1;
+}
+
+static void coro_uring_wake_poll(CORO_SCHED *sched) {
+    struct io_uring_sqe *sqe = uring_sqe(&sched->ring);
+    if(sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sched->wakefd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t)sched | TAG_WAKE;
+}
+
+/*
+ * Submit what every connection on the flush list has queued.  Each
+ * connection's sends are linked, so they go out in order, and none are
+ * submitted while any earlier ones are still in progress.
+ */
+static void coro_uring_flush(CORO_SCHED *sched) {
+    URING *ring = &sched->ring;
+    sem_wait(&conns_mutex);
+    CORO *list = sched->flush_head;
+    sched->flush_head = NULL;
+    while(list != NULL){
+        CORO *conn = list;
+        list = conn->next_flush;
+        conn->on_flush = 0;
+        if(conn->out_dead){
+            if(conn->closing){
+                coro_wake(conn);
+            }
+            continue;
+        }
+        if(conn->out_inflight > 0 || conn->out_head == NULL){
+            continue; //Its completions put it back on the list
+        }
+        int links = 0;
+        for(CORO_CHUNK *c = conn->out_head; c != NULL && links < CORO_SEND_LINKS; c = c->next){
+            links++;
+        }
+        //A chain has to go in one submission
+        if(uring_sq_space(ring) < (unsigned)links){
+            uring_submit(ring, 0);
+            if(uring_sq_space(ring) < (unsigned)links){
+                coro_flush_later(conn);
+                continue;
+            }
+        }
+        CORO_CHUNK *chunk = conn->out_head;
+        for(int i = 0; i < links; i++, chunk = chunk->next){
+            struct io_uring_sqe *sqe = uring_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->fd;
+            sqe->addr = (uintptr_t)(chunk->data + chunk->off);
+            sqe->len = chunk->len - chunk->off;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->flags = i + 1 < links ? IOSQE_IO_LINK : 0;
+            sqe->user_data = (uintptr_t)chunk | TAG_SEND;
+            conn->out_inflight++;
+        }
+        atomic_fetch_add_explicit(&num_sends, links, memory_order_relaxed);
+    }
+    sem_post(&conns_mutex);
+}
+
+/*
+ * A send on an io_uring connection has completed.
+ */
+static void coro_uring_sent(CORO_CHUNK *chunk, int res) {
+    CORO *conn = chunk->conn;
+    sem_wait(&conns_mutex);
+    conn->out_inflight--;
+    if(res >= 0){
+        chunk->off += res;
+        if(chunk->off == chunk->len){
+            //Sends complete in order, so it is the oldest
+            conn->out_head = chunk->next;
+            if(conn->out_head == NULL){
+                conn->out_tail = NULL;
+            }
+            conn->out_bytes -= chunk->len;
+            free(chunk);
+        }
+    }else if(res != -ECANCELED){
+        //The connection is gone; its coroutine will see EOF
+        conn->out_dead = 1;
+    }
+    //Whatever is left (after a short send, the rest of its chain was cancelled) goes again
+    if(conn->out_inflight == 0 && conn->out_head != NULL){
+        coro_flush_later(conn);
+    }
+    if(conn->closing && conn->out_inflight == 0){
+        coro_wake(conn);
+    }
+    sem_post(&conns_mutex);
+}
+
+/*
+ * Input has arrived on an io_uring connection (or it has ended).
+ */
+static void coro_uring_received(CORO_SCHED *sched, CORO *conn, struct io_uring_cqe *cqe) {
+    int res = cqe->res;
+    if(!(cqe->flags & IORING_CQE_F_MORE)){
+        conn->recv_armed = 0;
+    }
+    if(res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)){
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(conn->in_count < CORO_IN_BUFS && conn->spill_len == 0){
+            unsigned i = (conn->in_head + conn->in_count) % CORO_IN_BUFS;
+            conn->in_bid[i] = bid;
+            conn->in_len[i] = res;
+            conn->in_count++;
+        }else{
+            //It isn't keeping up; keep the input aside and free the buffer for others
+            char *spill = realloc(conn->spill, conn->spill_len + res);
+            if(spill != NULL){
+                conn->spill = spill;
+                memcpy(spill + conn->spill_len, uring_buf(&sched->ring, bid), res);
+                conn->spill_len += res;
+            }else{
+                conn->in_err = ENOMEM;
+            }
+            uring_buf_put(&sched->ring, bid);
+        }
+        if(!conn->recv_armed && !conn->closing){
+            coro_uring_recv(sched, conn);
+        }
+    }else if(res == 0){
+        conn->in_eof = 1;
+    }else if(res == -ENOBUFS){
+        //Every buffer is waiting to be read; start again once some have been
+        if(!conn->recv_armed && !conn->recv_rearm && !conn->closing){
+            conn->recv_rearm = 1;
+            conn->next_rearm = sched->rearm_head;
+            sched->rearm_head = conn;
+        }
+    }else if(res != -ECANCELED){
+        conn->in_err = -res;
+    }else if(!conn->closing){
+        conn->in_eof = 1;
+    }
+    coro_wake(conn);
+}
+
+/*
+ * A connection has been accepted (or adopted); start a coroutine to serve it,
+ * running fn.
+ */
+static void coro_uring_accepted(CORO_SCHED *sched, CORO_FN *fn, int fd, CORO_ADOPTED *adopted) {
+    int *connfdp = malloc(sizeof(int));
+    CORO *coro = connfdp != NULL && fd < conns_size ? coro_new(sched, fn, connfdp) : NULL;
+    if(coro == NULL){
+        free(connfdp);
+        close(fd);
+        return;
+    }
+    if(adopted != NULL && adopted->len > 0){
+        //Read before anything received from now on, which goes after it
+        coro->spill = malloc(adopted->len);
+        if(coro->spill != NULL){
+            memcpy(coro->spill, adopted->input, adopted->len);
+            coro->spill_len = adopted->len;
+        }else{
+            coro->in_err = ENOMEM;
+        }
+    }
+    //Connections carry small interactive messages; don't hold them back for ACKs
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    *connfdp = fd;
+    coro->fd = fd;
+    sem_wait(&conns_mutex);
+    conns[fd] = coro;
+    atomic_fetch_add(&num_conns, 1);
+    sem_post(&conns_mutex);
+    coro_uring_recv(sched, coro);
+    coro_make_ready(coro);
+}
+
+static void coro_uring_complete(CORO_SCHED *sched, struct io_uring_cqe *cqe) {
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+    switch(cqe->user_data & TAG_MASK){
+        case TAG_ACCEPT: {
+            CORO_LISTENER *listener = ptr;
+            if(cqe->res >= 0){
+                coro_uring_accepted(sched, listener->fn, cqe->res, NULL);
+            }
+            if(!(cqe->flags & IORING_CQE_F_MORE)){
+                sem_wait(&sched->mutex);
+                listener->accepting = 0;
+                listener->cancelling = 0;
+                if(cqe->res == -EMFILE || cqe->res == -ENFILE){
+                    //Trying again at once would just fail again; wait for a close
+                    sched->accept_paused = 1;
+                }else if(cqe->res == -EBADF || cqe->res == -EINVAL || cqe->res == -ENOTSOCK){
+                    listener->fd = -1;
+                }
+                sem_post(&sched->mutex);
+            }
+            break;
+        }
+        case TAG_RECV:
+            coro_uring_received(sched, ptr, cqe);
+            break;
+        case TAG_SEND:
+            coro_uring_sent(ptr, cqe->res);
+            break;
+        case TAG_POLL:
+            ((CORO *)ptr)->poll_pending = 0;
+            coro_wake(ptr);
+            break;
+        case TAG_WAKE: {
+            uint64_t count;
+            read(sched->wakefd, &count, sizeof(count));
+            if(!(cqe->flags & IORING_CQE_F_MORE)){
+                coro_uring_wake_poll(sched);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void *coro_uring_thread(void *arg) {
+    CORO_SCHED *sched = arg;
+    sched_current = sched;
+    coro_uring_wake_poll(sched);
+    while(1){
+        coro_run_ready(sched);
+        //Start receives that ran out of buffers, now that the coroutines have read some
+        CORO *rearm = sched->rearm_head;
+        sched->rearm_head = NULL;
+        while(rearm != NULL){
+            CORO *conn = rearm;
+            rearm = conn->next_rearm;
+            conn->recv_rearm = 0;
+            if(conn->closing){
+                coro_wake(conn);
+            }else if(!conn->recv_armed){
+                coro_uring_recv(sched, conn);
+            }
+        }
+        coro_uring_flush(sched);
+        sem_wait(&sched->mutex);
+        CORO_ADOPTED *adopted = sched->adopted;
+        sched->adopted = NULL;
+        sem_post(&sched->mutex);
+        while(adopted != NULL){
+            CORO_ADOPTED *next = adopted->next;
+            coro_uring_accepted(sched, adopted->fn, adopted->fd, adopted);
+            free(adopted);
+            adopted = next;
+        }
+        sem_wait(&sched->mutex);
+        for(int i = 0; i < CORO_LISTENERS; i++){
+            CORO_LISTENER *listener = &sched->listeners[i];
+            if(listener->paused){
+                if(listener->accepting && !listener->cancelling){
+                    struct io_uring_sqe *sqe = uring_sqe(&sched->ring);
+                    if(sqe != NULL){
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = (uintptr_t)listener | TAG_ACCEPT;
+                        sqe->user_data = TAG_IGNORE;
+                        listener->cancelling = 1;
+                    }
+                }
+            }else if(listener->fd >= 0 && !listener->accepting && !sched->accept_paused){
+                coro_uring_accept(sched, listener, listener->fd);
+            }
+        }
+        sem_post(&sched->mutex);
+        //Everything submitted, and the next completions waited for, in one call
+        int busy = coro_sched_idle(sched);
+        atomic_fetch_add_explicit(&num_enters, 1, memory_order_relaxed);
+        uring_submit(&sched->ring, busy ? 0 : 1);
+        sem_wait(&sched->mutex);
+        sched->sleeping = 0;
+        sem_post(&sched->mutex);
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_cqe(&sched->ring)) != NULL){
+            struct io_uring_cqe copy = *cqe;
+            uring_cqe_seen(&sched->ring);
+            atomic_fetch_add_explicit(&num_completions, 1, memory_order_relaxed);
+            coro_uring_complete(sched, &copy);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Get the counters of the coroutine schedulers.
+ *
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_get_stats(CORO_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->running = atomic_load(&num_running);
+    stats->spawned = atomic_load(&num_spawned);
+    stats->switches = atomic_load(&num_switches);
+    stats->stacks = atomic_load(&num_stacks);
+    stats->enters = atomic_load(&num_enters);
+    stats->completions = atomic_load(&num_completions);
+    stats->sends = atomic_load(&num_sends);
+    return 0;
+}
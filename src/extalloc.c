@@ -0,0 +1,368 @@
+/*
+ * Extension allocator: maps connections to extension numbers drawn from a
+ * configured range, instead of using whatever file descriptor the kernel hands out.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "extalloc.h"
+#include "debug.h"
+
+#define CACHE_LINE 64
+
+/*
+ * One slot of the ring of released extensions.  This is the bounded MPMC queue
+ * described by Vyukov: the sequence number tells producers and consumers whether
+ * the slot is ready to be written or read for a given ring position.
+ */
+typedef struct ext_slot {
+    _Atomic uint32_t seq;
+    uint32_t idx;
+} EXT_SLOT;
+
+/*
+ * The allocator lives in a single block of memory.  The variable-sized arrays
+ * follow the header and are located by offsets rather than pointers, so the
+ * whole thing stays position independent.
+ */
+struct ext_alloc {
+    int first;                  //First extension number in the range
+    uint32_t count;             //Number of extensions in the range
+    uint32_t mask;              //Ring size - 1 (ring size is a power of two >= count)
+    uint32_t reuse_delay_ms;    //Minimum time a released number stays unused
+    size_t in_use_off;          //Bitmap: extension is currently handed out
+    size_t queued_off;          //Bitmap: extension has an entry in the release ring
+    size_t freed_at_off;        //Per-extension release time (ms), for the reuse delay
+    size_t ring_off;            //Ring of released extensions, oldest first
+    _Atomic uint32_t used;      //Number of extensions currently handed out
+
+    //The cursors are written by every allocation/release, so keep them on their own lines.
+    _Alignas(CACHE_LINE) _Atomic uint32_t fresh;   //Next never-used index
+    _Alignas(CACHE_LINE) _Atomic uint32_t enq_pos; //Ring producer position
+    _Alignas(CACHE_LINE) _Atomic uint32_t deq_pos; //Ring consumer position
+};
+
+#define IN_USE(ea)   ((_Atomic uint64_t *)((char *)(ea) + (ea)->in_use_off))
+#define QUEUED(ea)   ((_Atomic uint64_t *)((char *)(ea) + (ea)->queued_off))
+#define FREED_AT(ea) ((_Atomic uint32_t *)((char *)(ea) + (ea)->freed_at_off))
+#define RING(ea)     ((EXT_SLOT *)((char *)(ea) + (ea)->ring_off))
+
+static size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+/*
+ * Coarse monotonic clock in milliseconds.  Only the difference between two
+ * readings is ever used, so wrapping at 2^32 ms is harmless.
+ */
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Atomically set bit idx, returning nonzero if it was already set. */
+static int bit_test_and_set(_Atomic uint64_t *map, uint32_t idx) {
+    uint64_t bit = (uint64_t)1 << (idx & 63);
+    return (atomic_fetch_or(&map[idx >> 6], bit) & bit) != 0;
+}
+
+/* Atomically clear bit idx, returning nonzero if it was set.  Release ordering, so
+ * whoever sees the bit clear also sees what was written before clearing it. */
+static int bit_test_and_clear(_Atomic uint64_t *map, uint32_t idx) {
+    uint64_t bit = (uint64_t)1 << (idx & 63);
+    return (atomic_fetch_and_explicit(&map[idx >> 6], ~bit, memory_order_release) & bit) != 0;
+}
+
+/* When the number at idx was last released. */
+static uint32_t freed_at(EXT_ALLOC *ea, uint32_t idx) {
+    return atomic_load_explicit(&FREED_AT(ea)[idx], memory_order_relaxed);
+}
+
+static int bit_test(_Atomic uint64_t *map, uint32_t idx) {
+    return (atomic_load_explicit(&map[idx >> 6], memory_order_relaxed) >> (idx & 63)) & 1;
+}
+
+/*
+ * Append a released index to the ring.  The queued bitmap guarantees that an index
+ * has at most one entry in the ring, and the ring has at least one slot per index,
+ * so this can never find the ring full.
+ */
+static void ring_push(EXT_ALLOC *ea, uint32_t idx) {
+    EXT_SLOT *ring = RING(ea);
+    uint32_t pos = atomic_load_explicit(&ea->enq_pos, memory_order_relaxed);
+    while(1){
+        EXT_SLOT *slot = &ring[pos & ea->mask];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t dif = (int32_t)(seq - pos);
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(&ea->enq_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                slot->idx = idx;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return;
+            }
+        } else {
+            pos = atomic_load_explicit(&ea->enq_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Take the oldest released index from the ring, provided that its reuse delay has
+ * elapsed.  Returns the index, or -1 if the ring is empty or the oldest entry is
+ * still cooling down.
+ */
+static int64_t ring_pop(EXT_ALLOC *ea, uint32_t now) {
+    EXT_SLOT *ring = RING(ea);
+    uint32_t pos = atomic_load_explicit(&ea->deq_pos, memory_order_relaxed);
+    while(1){
+        EXT_SLOT *slot = &ring[pos & ea->mask];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t dif = (int32_t)(seq - (pos + 1));
+        if(dif == 0){
+            uint32_t idx = slot->idx;
+            //Peek before committing: entries are in release order, so if this one
+            //is still cooling down then so is everything behind it.
+            if(ea->reuse_delay_ms && now - freed_at(ea, idx) < ea->reuse_delay_ms){
+                return -1;
+            }
+            if(atomic_compare_exchange_weak_explicit(&ea->deq_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                atomic_store_explicit(&slot->seq, pos + ea->mask + 1, memory_order_release);
+                return idx;
+            }
+        } else if(dif < 0){
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ea->deq_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Slow path: look through the bitmap for a number that is neither in use nor
+ * cooling down.  This is only needed when the ring looks empty although numbers
+ * have been released, which happens when a releasing thread is preempted in the
+ * middle of appending to the ring, or when the range is nearly exhausted.
+ * The ring entry of a number taken this way becomes stale and is dropped when
+ * it reaches the head of the ring.
+ */
+static int64_t scan_free(EXT_ALLOC *ea, uint32_t now) {
+    _Atomic uint64_t *in_use = IN_USE(ea);
+    uint32_t limit = atomic_load(&ea->fresh);
+    if(limit > ea->count){
+        limit = ea->count;
+    }
+    for(uint32_t w = 0; w * 64 < limit; w++){
+        //Acquire pairs with the release in ext_alloc_put(), so a number seen free
+        //has its release time visible.
+        uint64_t free_bits = ~atomic_load_explicit(&in_use[w], memory_order_acquire);
+        while(free_bits){
+            uint32_t idx = w * 64 + __builtin_ctzll(free_bits);
+            free_bits &= free_bits - 1;
+            if(idx >= limit){
+                break;
+            }
+            if(ea->reuse_delay_ms && now - freed_at(ea, idx) < ea->reuse_delay_ms){
+                continue;
+            }
+            if(!bit_test_and_set(in_use, idx)){
+                return idx;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Create an extension allocator.
+ *
+ * @param first  The first extension number in the range (must be positive).
+ * @param count  The number of extensions in the range.
+ * @param reuse_delay_ms  Minimum time, in milliseconds, that a released extension
+ * stays unassigned before it can be handed out again (0 for immediate reuse).
+ * @return the new allocator, or NULL if the parameters are invalid or memory
+ * could not be allocated.
+ */
+EXT_ALLOC *ext_alloc_create(int first, int count, int reuse_delay_ms) {
+    if(first <= 0 || count <= 0 || reuse_delay_ms < 0){
+        return NULL;
+    }
+    if((long)first + count - 1 > INT32_MAX){
+        return NULL;
+    }
+    uint32_t ring_size = 1;
+    while(ring_size < (uint32_t)count){
+        ring_size <<= 1;
+    }
+    size_t words = ((size_t)count + 63) / 64;
+    size_t off = align_up(sizeof(EXT_ALLOC), CACHE_LINE);
+    size_t in_use_off = off;
+    off += words * sizeof(uint64_t);
+    size_t queued_off = off;
+    off += words * sizeof(uint64_t);
+    size_t freed_at_off = off;
+    off += (size_t)count * sizeof(uint32_t);
+    size_t ring_off = align_up(off, CACHE_LINE);
+    off = ring_off + (size_t)ring_size * sizeof(EXT_SLOT);
+
+    EXT_ALLOC *ea = aligned_alloc(CACHE_LINE, align_up(off, CACHE_LINE));
+    if(ea == NULL){
+        return NULL;
+    }
+    memset(ea, 0, ring_off);
+    ea->first = first;
+    ea->count = count;
+    ea->mask = ring_size - 1;
+    ea->reuse_delay_ms = reuse_delay_ms;
+    ea->in_use_off = in_use_off;
+    ea->queued_off = queued_off;
+    ea->freed_at_off = freed_at_off;
+    ea->ring_off = ring_off;
+    atomic_init(&ea->used, 0);
+    atomic_init(&ea->fresh, 0);
+    atomic_init(&ea->enq_pos, 0);
+    atomic_init(&ea->deq_pos, 0);
+    EXT_SLOT *ring = RING(ea);
+    for(uint32_t i = 0; i < ring_size; i++){
+        atomic_init(&ring[i].seq, i);
+        ring[i].idx = 0;
+    }
+    debug("Extension allocator: %d..%d, reuse delay %d ms", first, first + count - 1, reuse_delay_ms);
+    return ea;
+}
+
+/*
+ * Free an extension allocator.  Extensions that are still in use are simply forgotten.
+ */
+void ext_alloc_destroy(EXT_ALLOC *ea) {
+    free(ea);
+}
+
+/*
+ * Allocate an extension number.
+ * The least recently released number whose reuse delay has elapsed is preferred;
+ * otherwise a number that has never been used is taken.
+ *
+ * @param ea  The allocator.
+ * @return the extension number, or -1 if every number in the range is either in use
+ * or still within its reuse delay.
+ */
+int ext_alloc_get(EXT_ALLOC *ea) {
+    if(ea == NULL){
+        return -1;
+    }
+    uint32_t now = ea->reuse_delay_ms ? now_ms() : 0;
+    int64_t idx;
+    while((idx = ring_pop(ea, now)) >= 0){
+        bit_test_and_clear(QUEUED(ea), idx);
+        //The number may have been claimed explicitly while it sat in the ring,
+        //in which case the ring entry is stale and we just drop it.
+        if(!bit_test_and_set(IN_USE(ea), idx)){
+            atomic_fetch_add(&ea->used, 1);
+            return ea->first + (int)idx;
+        }
+    }
+    uint32_t fresh = atomic_load(&ea->fresh);
+    while(fresh < ea->count){
+        if(!atomic_compare_exchange_weak(&ea->fresh, &fresh, fresh + 1)){
+            continue;
+        }
+        if(!bit_test_and_set(IN_USE(ea), fresh)){
+            atomic_fetch_add(&ea->used, 1);
+            return ea->first + (int)fresh;
+        }
+        fresh = atomic_load(&ea->fresh);
+    }
+    if((idx = scan_free(ea, now)) >= 0){
+        atomic_fetch_add(&ea->used, 1);
+        return ea->first + (int)idx;
+    }
+    return -1;
+}
+
+/*
+ * Allocate a specific extension number, e.g. one that a client is known to have
+ * had before.  This ignores the reuse delay.
+ *
+ * @param ea  The allocator.
+ * @param ext  The extension number wanted.
+ * @return 0 if the number was allocated, -1 if it is out of range or already in use.
+ */
+int ext_alloc_claim(EXT_ALLOC *ea, int ext) {
+    if(!ext_alloc_owns(ea, ext)){
+        return -1;
+    }
+    uint32_t idx = ext - ea->first;
+    if(bit_test_and_set(IN_USE(ea), idx)){
+        return -1;
+    }
+    atomic_fetch_add(&ea->used, 1);
+    return 0;
+}
+
+/*
+ * Release an extension number.
+ *
+ * @param ea  The allocator.
+ * @param ext  The extension number being released.
+ * @return 0 if successful, -1 if the number is out of range or was not in use.
+ */
+int ext_alloc_put(EXT_ALLOC *ea, int ext) {
+    if(!ext_alloc_owns(ea, ext)){
+        return -1;
+    }
+    uint32_t idx = ext - ea->first;
+    if(!bit_test(IN_USE(ea), idx)){
+        return -1;
+    }
+    //Stamp the release time before the number can be seen free, or scan_free()
+    //could find it with the previous stamp and hand it out without cooling down.
+    if(ea->reuse_delay_ms){
+        atomic_store_explicit(&FREED_AT(ea)[idx], now_ms(), memory_order_relaxed);
+    }
+    if(!bit_test_and_clear(IN_USE(ea), idx)){
+        return -1;
+    }
+    atomic_fetch_sub(&ea->used, 1);
+    //If an entry for this number is still waiting in the ring (it was claimed while
+    //queued), that entry will serve for this release too.
+    if(!bit_test_and_set(QUEUED(ea), idx)){
+        ring_push(ea, idx);
+    }
+    return 0;
+}
+
+/*
+ * Determine whether an extension number lies within the allocator's range.
+ */
+int ext_alloc_owns(EXT_ALLOC *ea, int ext) {
+    if(ea == NULL){
+        return 0;
+    }
+    return ext >= ea->first && (uint32_t)(ext - ea->first) < ea->count;
+}
+
+/*
+ * Determine whether an extension number is currently allocated.
+ */
+int ext_alloc_in_use(EXT_ALLOC *ea, int ext) {
+    if(!ext_alloc_owns(ea, ext)){
+        return 0;
+    }
+    return bit_test(IN_USE(ea), ext - ea->first);
+}
+
+/*
+ * Get the number of extensions currently allocated.
+ */
+int ext_alloc_used(EXT_ALLOC *ea) {
+    if(ea == NULL){
+        return 0;
+    }
+    return atomic_load(&ea->used);
+}
@@ -0,0 +1,257 @@
+/*
+ * Hazard pointers (see hazard.h).
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "hazard.h"
+
+/*
+ * The slots of one thread.  Records are never freed: a thread that exits
+ * leaves its record, cleared, for the next thread to start.
+ */
+typedef struct hazard_record {
+    _Atomic(void *) slots[HAZARD_SLOTS];  //Written only by the owning thread
+    struct hazard_record *next;            //Next on the list of all records
+    struct hazard_record *next_free;       //Next on the free list, guarded by free_mutex
+} HAZARD_RECORD;
+
+typedef struct hazard_retired {
+    void *ptr;
+    HAZARD_FREE_FN *fn;
+    struct hazard_retired *next;
+} HAZARD_RETIRED;
+
+static _Atomic(HAZARD_RECORD *) all_records;
+static HAZARD_RECORD *free_records;
+static sem_t free_mutex;
+static pthread_key_t record_key;
+static pthread_once_t hazard_once = PTHREAD_ONCE_INIT;
+static __thread HAZARD_RECORD *my_record;
+
+static HAZARD_RETIRED *retired;        //Waiting to be freed, guarded by retired_mutex
+static long num_pending;
+static sem_t retired_mutex;
+static atomic_long num_threads, num_retired, num_freed, num_scans;
+
+static void hazard_record_release(void *arg) {
+    HAZARD_RECORD *record = arg;
+    for(int i = 0; i < HAZARD_SLOTS; i++){
+        atomic_store(&record->slots[i], NULL);
+    }
+    sem_wait(&free_mutex);
+    record->next_free = free_records;
+    free_records = record;
+    sem_post(&free_mutex);
+}
+
+static void hazard_setup(void) {
+    sem_init(&free_mutex, 0, 1);
+    sem_init(&retired_mutex, 0, 1);
+    pthread_key_create(&record_key, hazard_record_release);
+}
+
+/*
+ * Give the calling thread a record, reusing one left by an exited thread if possible.
+ */
+static HAZARD_RECORD *hazard_record_get(void) {
+    pthread_once(&hazard_once, hazard_setup);
+    sem_wait(&free_mutex);
+    HAZARD_RECORD *record = free_records;
+    if(record != NULL){
+        free_records = record->next_free;
+    }
+    sem_post(&free_mutex);
+    if(record == NULL){
+        record = calloc(1, sizeof(HAZARD_RECORD));
+        if(record == NULL){
+            return NULL;
+        }
+        HAZARD_RECORD *first = atomic_load(&all_records);
+        do {
+            record->next = first;
+        } while(!atomic_compare_exchange_weak(&all_records, &first, record));
+        atomic_fetch_add(&num_threads, 1);
+    }
+    pthread_setspecific(record_key, record);
+    my_record = record;
+    return record;
+}
+
+/*
+ * Publish a pointer in one of the calling thread's slots, so that it isn't
+ * freed until the slot is cleared.  The pointer must still be alive when this
+ * is called (reached through a link the caller holds the lock of, say): a
+ * slot only keeps memory from being freed, it can't bring it back.
+ *
+ * @param slot  The slot (HAZARD_PEER, ...).
+ * @param ptr  The pointer.
+ * @return 0 if successful, -1 if the thread couldn't be given any slots.
+ */
+int hazard_protect(int slot, void *ptr) {
+    HAZARD_RECORD *record = my_record;
+    if(record == NULL && (record = hazard_record_get()) == NULL){
+        return -1;
+    }
+    //Sequentially consistent, so that anyone retiring it after this sees it
+    atomic_store(&record->slots[slot], ptr);
+    return 0;
+}
+
+/*
+ * Clear one of the calling thread's slots.
+ */
+void hazard_clear(int slot) {
+    HAZARD_RECORD *record = my_record;
+    if(record != NULL){
+        atomic_store_explicit(&record->slots[slot], NULL, memory_order_release);
+    }
+}
+
+static int hazard_compare(const void *a, const void *b) {
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Whether any thread has a pointer in one of its slots.
+ */
+static int hazard_published(void *ptr) {
+    for(HAZARD_RECORD *record = atomic_load(&all_records); record != NULL; record = record->next){
+        for(int i = 0; i < HAZARD_SLOTS; i++){
+            if(atomic_load(&record->slots[i]) == ptr){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Free whatever on a list of retired pointers is in nobody's slot, and put the
+ * rest back to wait for the next scan.
+ */
+static void hazard_scan(HAZARD_RETIRED *list) {
+    atomic_fetch_add(&num_scans, 1);
+    //Records added after this can only be protecting pointers that are still alive
+    HAZARD_RECORD *first = atomic_load(&all_records);
+    long capacity = 1;
+    for(HAZARD_RECORD *record = first; record != NULL; record = record->next){
+        capacity += HAZARD_SLOTS;
+    }
+    uintptr_t *published = malloc(capacity * sizeof(uintptr_t));
+    long count = 0;
+    if(published != NULL){
+        for(HAZARD_RECORD *record = first; record != NULL; record = record->next){
+            for(int i = 0; i < HAZARD_SLOTS; i++){
+                void *ptr = atomic_load(&record->slots[i]);
+                if(ptr != NULL){
+                    published[count++] = (uintptr_t)ptr;
+                }
+            }
+        }
+        qsort(published, count, sizeof(uintptr_t), hazard_compare);
+    }
+    HAZARD_RETIRED *kept = NULL, *kept_tail = NULL;
+    long num_kept = 0;
+    while(list != NULL){
+        HAZARD_RETIRED *entry = list;
+        list = entry->next;
+        uintptr_t key = (uintptr_t)entry->ptr;
+        int in_use = published != NULL ? bsearch(&key, published, count, sizeof(uintptr_t), hazard_compare) != NULL
+                                        : hazard_published(entry->ptr);
+        if(in_use){
+            entry->next = kept;
+            if(kept == NULL){
+                kept_tail = entry;
+            }
+            kept = entry;
+            num_kept++;
+            continue;
+        }
+        entry->fn(entry->ptr);
+        free(entry);
+        atomic_fetch_add(&num_freed, 1);
+    }
+    free(published);
+    if(kept != NULL){
+        sem_wait(&retired_mutex);
+        kept_tail->next = retired;
+        retired = kept;
+        num_pending += num_kept;
+        sem_post(&retired_mutex);
+    }
+}
+
+/*
+ * Free memory whose last reference has gone, once no thread has it in a slot.
+ *
+ * @param ptr  The memory.
+ * @param fn  The function that frees it, which may be called on any thread.
+ */
+void hazard_retire(void *ptr, HAZARD_FREE_FN *fn) {
+    pthread_once(&hazard_once, hazard_setup);
+    atomic_fetch_add(&num_retired, 1);
+    HAZARD_RETIRED *entry = malloc(sizeof(HAZARD_RETIRED));
+    if(entry == NULL){
+        //Nowhere to keep it, so wait for it here; slots are only ever set briefly
+        while(hazard_published(ptr)){
+            sched_yield();
+        }
+        fn(ptr);
+        atomic_fetch_add(&num_freed, 1);
+        return;
+    }
+    entry->ptr = ptr;
+    entry->fn = fn;
+    HAZARD_RETIRED *list = NULL;
+    sem_wait(&retired_mutex);
+    entry->next = retired;
+    retired = entry;
+    if(++num_pending >= HAZARD_SCAN_AT + 2 * HAZARD_SLOTS * atomic_load(&num_threads)){
+        list = retired;
+        retired = NULL;
+        num_pending = 0;
+    }
+    sem_post(&retired_mutex);
+    if(list != NULL){
+        hazard_scan(list);
+    }
+}
+
+/*
+ * Free whatever retired memory is in nobody's slot now, without waiting for
+ * a batch to build up.
+ */
+void hazard_reclaim(void) {
+    pthread_once(&hazard_once, hazard_setup);
+    sem_wait(&retired_mutex);
+    HAZARD_RETIRED *list = retired;
+    retired = NULL;
+    num_pending = 0;
+    sem_post(&retired_mutex);
+    if(list != NULL){
+        hazard_scan(list);
+    }
+}
+
+/*
+ * Get statistics about hazard pointers.
+ *
+ * @param stats  Filled in with the statistics.
+ * @return 0 if successful, otherwise -1.
+ */
+int hazard_get_stats(HAZARD_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->threads = atomic_load(&num_threads);
+    stats->retired = atomic_load(&num_retired);
+    stats->freed = atomic_load(&num_freed);
+    stats->scans = atomic_load(&num_scans);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Chat history of a call: a pooled ring buffer of recent chats.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <pthread.h>
+
+#include "history.h"
+
+/*
+ * Each chat in the ring is a header giving its length and which of the two TUs
+ * it was sent to, followed by its text.
+ */
+#define HISTORY_ENTRY_HEADER 3
+#define HISTORY_MAX_CHAT (HISTORY_BYTES - HISTORY_ENTRY_HEADER)
+
+/*
+ * Positions count bytes ever added to the ring; the byte at position p is at
+ * buf[p % HISTORY_BYTES].  Everything from tail to head is still there.
+ */
+struct call_history {
+    sem_t mutex; //Chats to the two TUs are added with only their senders locked
+    TU* tus[2];
+    uint64_t head;
+    uint64_t tail; //Start of the oldest chat still in the ring
+    uint64_t mark[2]; //Where each TU's connection dropped, or UINT64_MAX if it hasn't
+    struct call_history* next_free;
+    char buf[HISTORY_BYTES];
+};
+
+static CALL_HISTORY* free_histories;
+static sem_t pool_mutex;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void history_setup(void) {
+    sem_init(&pool_mutex, 0, 1);
+}
+
+/*
+ * Take a history for a call from the pool, adding a slab to it if it is empty.
+ *
+ * @param a  One TU in the call.
+ * @param b  The other.
+ * @return the history, or NULL if memory runs out.
+ */
+CALL_HISTORY *history_get(TU *a, TU *b) {
+    pthread_once(&pool_once, history_setup);
+    sem_wait(&pool_mutex);
+    if(free_histories == NULL){
+        //Slabs are never given back; they stay in the pool for later calls
+        CALL_HISTORY *slab = malloc(HISTORY_SLAB * sizeof(CALL_HISTORY));
+        for(int i = 0; slab != NULL && i < HISTORY_SLAB; i++){
+            sem_init(&slab[i].mutex, 0, 1);
+            slab[i].next_free = free_histories;
+            free_histories = &slab[i];
+        }
+    }
+    CALL_HISTORY *history = free_histories;
+    if(history != NULL){
+        free_histories = history->next_free;
+    }
+    sem_post(&pool_mutex);
+    if(history == NULL){
+        return NULL;
+    }
+    history->tus[0] = a;
+    history->tus[1] = b;
+    history->head = history->tail = 0;
+    history->mark[0] = history->mark[1] = UINT64_MAX;
+    return history;
+}
+
+/*
+ * Give a history back to the pool when its call ends.
+ */
+void history_put(CALL_HISTORY *history) {
+    if(history == NULL){
+        return;
+    }
+    sem_wait(&pool_mutex);
+    history->next_free = free_histories;
+    free_histories = history;
+    sem_post(&pool_mutex);
+}
+
+static int history_side(CALL_HISTORY *history, TU *tu) {
+    return history->tus[1] == tu;
+}
+
+static void history_write(CALL_HISTORY *history, uint64_t pos, const char *src, size_t n) {
+    size_t off = pos % HISTORY_BYTES, first = HISTORY_BYTES - off;
+    if(first > n){
+        first = n;
+    }
+    memcpy(history->buf + off, src, first);
+    memcpy(history->buf, src + first, n - first);
+}
+
+static void history_read(CALL_HISTORY *history, uint64_t pos, char *dst, size_t n) {
+    size_t off = pos % HISTORY_BYTES, first = HISTORY_BYTES - off;
+    if(first > n){
+        first = n;
+    }
+    memcpy(dst, history->buf + off, first);
+    memcpy(dst + first, history->buf, n - first);
+}
+
+static size_t history_entry(CALL_HISTORY *history, uint64_t pos, int *side) {
+    unsigned char header[HISTORY_ENTRY_HEADER];
+    history_read(history, pos, (char *)header, sizeof(header));
+    *side = header[2];
+    return header[0] | (header[1] << 8);
+}
+
+/*
+ * Record a chat sent over a call, pushing the oldest ones out if need be.
+ * Must be called with the sender locked.
+ *
+ * @param history  The call's history.
+ * @param to  The TU the chat was sent to.
+ * @param msg  The chat.
+ * @param len  Its length; only the last HISTORY_MAX_CHAT bytes are kept.
+ */
+void history_add(CALL_HISTORY *history, TU *to, const char *msg, size_t len) {
+    if(history == NULL){
+        return;
+    }
+    if(len > HISTORY_MAX_CHAT){
+        msg += len - HISTORY_MAX_CHAT;
+        len = HISTORY_MAX_CHAT;
+    }
+    size_t need = HISTORY_ENTRY_HEADER + len;
+    sem_wait(&history->mutex);
+    while(history->head + need - history->tail > HISTORY_BYTES){
+        int side;
+        history->tail += HISTORY_ENTRY_HEADER + history_entry(history, history->tail, &side);
+    }
+    unsigned char header[HISTORY_ENTRY_HEADER] = { len & 0xff, len >> 8, history_side(history, to) };
+    history_write(history, history->head, (char *)header, sizeof(header));
+    history_write(history, history->head + HISTORY_ENTRY_HEADER, msg, len);
+    history->head += need;
+    sem_post(&history->mutex);
+}
+
+/*
+ * Note that a TU's connection has dropped, so that the chats sent to it from
+ * now on can be replayed.  Must be called with the TU locked.
+ */
+void history_mark(CALL_HISTORY *history, TU *tu) {
+    if(history != NULL){
+        sem_wait(&history->mutex);
+        history->mark[history_side(history, tu)] = history->head;
+        sem_post(&history->mutex);
+    }
+}
+
+/*
+ * Get the chats sent to a TU since its connection dropped, as the "CHAT" lines
+ * it would have been sent, and forget that it dropped.  If more arrived than the
+ * ring holds, only the latest are there.  Must be called with the TU locked.
+ *
+ * @param history  The call's history.
+ * @param tu  The TU.
+ * @param len  Set to the length of what is returned.
+ * @return the lines, in a buffer the caller must free, or NULL if there are none.
+ */
+char *history_missed(CALL_HISTORY *history, TU *tu, size_t *len) {
+    *len = 0;
+    if(history == NULL){
+        return NULL;
+    }
+    int me = history_side(history, tu);
+    sem_wait(&history->mutex);
+    uint64_t from = history->mark[me];
+    history->mark[me] = UINT64_MAX;
+    if(from == UINT64_MAX || from >= history->head){
+        sem_post(&history->mutex);
+        return NULL;
+    }
+    if(from < history->tail){
+        from = history->tail;
+    }
+    //Each chat of ours becomes "CHAT " + text + "\n", in place of its header
+    size_t size = 0;
+    int side;
+    for(uint64_t pos = from; pos < history->head; pos += HISTORY_ENTRY_HEADER + history_entry(history, pos, &side)){
+        size_t n = history_entry(history, pos, &side);
+        if(side == me){
+            size += n + 6;
+        }
+    }
+    char *buf = size > 0 ? malloc(size) : NULL;
+    if(buf == NULL){
+        sem_post(&history->mutex);
+        return NULL;
+    }
+    for(uint64_t pos = from; pos < history->head; ){
+        size_t n = history_entry(history, pos, &side);
+        if(side == me){
+            memcpy(buf + *len, "CHAT ", 5);
+            history_read(history, pos + HISTORY_ENTRY_HEADER, buf + *len + 5, n);
+            buf[*len + 5 + n] = '\n';
+            *len += n + 6;
+        }
+        pos += HISTORY_ENTRY_HEADER + n;
+    }
+    sem_post(&history->mutex);
+    return buf;
+}
@@ -0,0 +1,414 @@
+/*
+ * Hunt groups: one extension ringing whichever of several TUs is free.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "hunt.h"
+#include "acd.h"
+#include "config.h"
+#include "debug.h"
+
+/*
+ * A member is on exactly one of its group's lists at a time, except briefly
+ * while it joins.  Both lists are circular with the group holding a sentinel
+ * node, so a member can be moved from one to the other without searching.
+ */
+struct hunt_member {
+    HUNT_GROUP* group;
+    TU* tu;
+    struct hunt_member* prev;
+    struct hunt_member* next;
+    int idle; //Which list it is on
+};
+
+struct hunt_group {
+    sem_t mutex; //Protects everything below it
+    HUNT_MEMBER idle; //Members on hook, longest idle first
+    HUNT_MEMBER busy; //Everyone else
+    int num_members; //Including any that are still joining
+    int num_idle;
+    int closed; //Set when the last member leaves; the group can't be joined after that
+    long calls, busy_calls;
+    int ext;
+    PBX* pbx;
+    ACD_QUEUE* queue; //Callers waiting for a member to be free, if queueing is on
+    _Atomic int refs; //One for the table while the group is open, one for each member
+    struct hunt_group* next; //Next in the same bucket of the table
+};
+
+/*
+ * Open groups are found by extension in a small hash table, which is only
+ * looked at to find the group, never while picking a member.
+ * The lock order is TU, then call queue, then group, then table.
+ */
+#define HUNT_BUCKETS 256
+
+static HUNT_GROUP* hunt_table[HUNT_BUCKETS];
+static sem_t hunt_table_mutex;
+static pthread_once_t hunt_once = PTHREAD_ONCE_INIT;
+
+static void hunt_setup(void) {
+    sem_init(&hunt_table_mutex, 0, 1);
+}
+
+static HUNT_GROUP **hunt_bucket(int ext) {
+    return &hunt_table[(unsigned int)ext % HUNT_BUCKETS];
+}
+
+static void hunt_ref(HUNT_GROUP *group) {
+    atomic_fetch_add(&group->refs, 1);
+}
+
+void hunt_unref(HUNT_GROUP *group) {
+    if(group == NULL){
+        return;
+    }
+    if(atomic_fetch_sub(&group->refs, 1) == 1){
+        acd_queue_unref(group->queue);
+        sem_destroy(&group->mutex);
+        free(group);
+    }
+}
+
+int hunt_extension(HUNT_GROUP *group) {
+    return group->ext;
+}
+
+static void hunt_unlink(HUNT_MEMBER *member) {
+    if(member->next != NULL){
+        member->prev->next = member->next;
+        member->next->prev = member->prev;
+        member->next = member->prev = NULL;
+        if(member->idle){
+            member->group->num_idle--;
+        }
+    }
+}
+
+static void hunt_append(HUNT_MEMBER *list, HUNT_MEMBER *member) {
+    member->prev = list->prev;
+    member->next = list;
+    list->prev->next = member;
+    list->prev = member;
+}
+
+/*
+ * Move a member to the end of its idle or busy list.
+ * Called by its TU whenever it goes on or off hook, with the TU locked.
+ *
+ * @param member  The member.
+ * @param idle  Nonzero if the TU is now on hook.
+ */
+void hunt_member_set_idle(HUNT_MEMBER *member, int idle) {
+    HUNT_GROUP *group = member->group;
+    sem_wait(&group->mutex);
+    hunt_unlink(member);
+    member->idle = idle;
+    hunt_append(idle ? &group->idle : &group->busy, member);
+    if(idle){
+        group->num_idle++;
+        if(group->queue != NULL && acd_waiting(group->queue) > 0){
+            acd_kick(group->queue);
+        }
+    }
+    sem_post(&group->mutex);
+}
+
+/*
+ * Take the member that has been on hook the longest, and send it to the back
+ * of the idle list so that whoever asks next is given somebody else.
+ * Must be called with the group locked.
+ *
+ * @return the member, or NULL if nobody is on hook.
+ */
+static HUNT_MEMBER *hunt_next_idle(HUNT_GROUP *group) {
+    HUNT_MEMBER *member = group->idle.next;
+    if(member == &group->idle){
+        return NULL;
+    }
+    hunt_unlink(member);
+    member->idle = 1;
+    hunt_append(&group->idle, member);
+    group->num_idle++;
+    return member;
+}
+
+/*
+ * Find a member free to take a call from the group's queue.
+ */
+static TU *hunt_pick_idle(void *owner) {
+    HUNT_GROUP *group = owner;
+    sem_wait(&group->mutex);
+    HUNT_MEMBER *member = group->closed ? NULL : hunt_next_idle(group);
+    TU *tu = member ? member->tu : NULL;
+    if(tu != NULL){
+        tu_ref(tu, "Picked from hunt group queue");
+    }
+    sem_post(&group->mutex);
+    return tu;
+}
+
+/*
+ * Take the group out of the table once its last member has left.
+ * Must be called with the group locked.
+ *
+ * @return 1 if the group was closed, so the table's reference must be dropped.
+ */
+static int hunt_close(HUNT_GROUP *group) {
+    if(group->closed || group->num_members > 0){
+        return 0;
+    }
+    group->closed = 1;
+    sem_wait(&hunt_table_mutex);
+    HUNT_GROUP **prev = hunt_bucket(group->ext);
+    while(*prev != NULL && *prev != group){
+        prev = &(*prev)->next;
+    }
+    if(*prev == group){
+        *prev = group->next;
+    }
+    sem_post(&hunt_table_mutex);
+    pbx_release_extension(group->pbx, group->ext);
+    return 1;
+}
+
+/*
+ * Drop the table's reference to a group that hunt_close() has closed, after
+ * sending anybody still queued for it away with a busy signal.
+ * Must be called with the group unlocked.
+ */
+static void hunt_release(HUNT_GROUP *group) {
+    acd_queue_close(group->queue);
+    hunt_unref(group);
+}
+
+/*
+ * Add a TU to a group.  The TU puts itself on the right list once it knows
+ * it is a member, since only it can tell whether it is on hook.
+ * If it can't join, it is sent a notification of its current state instead.
+ *
+ * @return 0 if the TU joined, otherwise -1.
+ */
+static int hunt_add(HUNT_GROUP *group, TU *tu) {
+    HUNT_MEMBER *member = calloc(1, sizeof(HUNT_MEMBER));
+    if(member == NULL){
+        tu_join_hunt(tu, NULL, -1);
+        return -1;
+    }
+    member->group = group;
+    member->tu = tu;
+    sem_wait(&group->mutex);
+    if(group->closed){
+        sem_post(&group->mutex);
+        free(member);
+        tu_join_hunt(tu, NULL, -1);
+        return -1;
+    }
+    group->num_members++;
+    sem_post(&group->mutex);
+    hunt_ref(group);
+    if(tu_join_hunt(tu, member, group->ext) == 0){
+        return 0;
+    }
+    //Already in a group; it has been told its state
+    sem_wait(&group->mutex);
+    group->num_members--;
+    int closed = hunt_close(group);
+    sem_post(&group->mutex);
+    free(member);
+    if(closed){
+        hunt_release(group);
+    }
+    hunt_unref(group);
+    return -1;
+}
+
+/*
+ * Create a hunt group on a new extension, with a TU as its first member.
+ * A TU can only be in one group; if it already is, or no extension is
+ * available, there is no effect other than a notification of its current state.
+ *
+ * @param pbx  The PBX to take the group's extension from.
+ * @param tu  The TU creating the group.
+ * @return the group's extension if the TU is now its member, otherwise -1.
+ */
+int hunt_create(PBX *pbx, TU *tu) {
+    if(pbx == NULL || tu == NULL){
+        return -1;
+    }
+    pthread_once(&hunt_once, hunt_setup);
+    HUNT_GROUP *group = calloc(1, sizeof(HUNT_GROUP));
+    int ext = group ? pbx_reserve_extension(pbx) : -1;
+    if(ext < 0){
+        free(group);
+        tu_join_hunt(tu, NULL, -1);
+        return -1;
+    }
+    sem_init(&group->mutex, 0, 1);
+    group->idle.next = group->idle.prev = &group->idle;
+    group->busy.next = group->busy.prev = &group->busy;
+    group->ext = ext;
+    group->pbx = pbx;
+    atomic_init(&group->refs, 1);
+    if(pbx_config.queue_calls){
+        group->queue = acd_queue_create(hunt_pick_idle, group);
+    }
+
+    sem_wait(&hunt_table_mutex);
+    HUNT_GROUP **bucket = hunt_bucket(ext);
+    group->next = *bucket;
+    *bucket = group;
+    sem_post(&hunt_table_mutex);
+
+    //Our own reference, since a TU already in a group leaves hunt_add() to close and release it
+    hunt_ref(group);
+    int joined = hunt_add(group, tu) == 0;
+    sem_wait(&group->mutex);
+    int closed = hunt_close(group); //In case the TU wasn't able to join
+    sem_post(&group->mutex);
+    if(closed){
+        hunt_release(group);
+    }
+    hunt_unref(group);
+    return joined ? ext : -1;
+}
+
+/*
+ * Find an open hunt group by extension.
+ *
+ * @param ext  The extension.
+ * @return the group, with a reference that the caller must release with
+ * hunt_unref(), or NULL if there is no open group on that extension.
+ */
+HUNT_GROUP *hunt_lookup(int ext) {
+    pthread_once(&hunt_once, hunt_setup);
+    sem_wait(&hunt_table_mutex);
+    HUNT_GROUP *group = *hunt_bucket(ext);
+    while(group != NULL && group->ext != ext){
+        group = group->next;
+    }
+    if(group != NULL){
+        hunt_ref(group);
+    }
+    sem_post(&hunt_table_mutex);
+    return group;
+}
+
+/*
+ * Add a TU to the hunt group on an extension.
+ * If there is no such group, or the TU is already in a group, there is no
+ * effect other than a notification of the TU's current state.
+ *
+ * @param ext  The extension of the group.
+ * @param tu  The TU joining.
+ * @return 0 if the TU is now a member of the group, otherwise -1.
+ */
+int hunt_join(int ext, TU *tu) {
+    if(tu == NULL){
+        return -1;
+    }
+    HUNT_GROUP *group = hunt_lookup(ext);
+    if(group == NULL){
+        tu_join_hunt(tu, NULL, -1);
+        return -1;
+    }
+    int ret = hunt_add(group, tu);
+    hunt_unref(group);
+    return ret;
+}
+
+/*
+ * Take a TU out of its hunt group, if it is in one, closing the group if it
+ * was the last member.  Called when the TU is unregistered.
+ *
+ * @param tu  The TU leaving.
+ * @return 0 if the TU was a member of a group, otherwise -1.
+ */
+int hunt_leave(TU *tu) {
+    //Once the TU has let go of the member it won't move it between lists again
+    HUNT_MEMBER *member = tu_leave_hunt(tu);
+    if(member == NULL){
+        return -1;
+    }
+    HUNT_GROUP *group = member->group;
+    sem_wait(&group->mutex);
+    hunt_unlink(member);
+    group->num_members--;
+    int closed = hunt_close(group);
+    sem_post(&group->mutex);
+    free(member);
+    if(closed){
+        hunt_release(group);
+    }
+    hunt_unref(group);
+    return 0;
+}
+
+/*
+ * Call a hunt group: ring the member that has been on hook the longest.
+ * The chosen member goes to the back of the idle list straight away, so that
+ * callers arriving before it starts ringing are given somebody else.
+ * If nobody is on hook, the caller waits in the group's queue if there is one,
+ * and otherwise dials a busy member and gets a busy signal.
+ *
+ * @param group  The group.
+ * @param tu  The TU calling.
+ * @return 0 if a member was dialed, -1 if the group has closed in the meantime.
+ */
+int hunt_dial(HUNT_GROUP *group, TU *tu) {
+    if(group == NULL || tu == NULL){
+        return -1;
+    }
+    sem_wait(&group->mutex);
+    if(group->closed){
+        sem_post(&group->mutex);
+        return -1;
+    }
+    group->calls++;
+    HUNT_MEMBER *member = hunt_next_idle(group);
+    if(member == NULL){
+        group->busy_calls++;
+        if(group->queue != NULL){
+            sem_post(&group->mutex);
+            tu_wait_queue(tu, group->queue);
+            return 0;
+        }
+        member = group->busy.next;
+    }
+    //The only member may still be joining, in which case nobody can answer: dialing
+    //ourselves gives the busy signal just the same
+    TU *target = member != &group->busy ? member->tu : tu;
+    tu_ref(target, "Dialing hunt group member");
+    sem_post(&group->mutex);
+    tu_dial(tu, target);
+    tu_unref(target, "Done dialing hunt group member");
+    return 0;
+}
+
+/*
+ * Get the counters of a group.
+ *
+ * @param group  The group.
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int hunt_get_stats(HUNT_GROUP *group, HUNT_STATS *stats) {
+    if(group == NULL || stats == NULL){
+        return -1;
+    }
+    sem_wait(&group->mutex);
+    stats->members = group->num_members;
+    stats->idle = group->num_idle;
+    stats->calls = group->calls;
+    stats->busy = group->busy_calls;
+    sem_post(&group->mutex);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Unix domain socket listener, with access control by peer credentials.
+ */
+#define _GNU_SOURCE  //struct ucred
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "local.h"
+#include "debug.h"
+
+static char local_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static uid_t allowed[LOCAL_MAX_ALLOW];
+static int num_allowed;  //0 if anyone who can open the socket may connect
+
+/*
+ * Parse a list of users allowed to connect, of the form "UID[,UID...]".
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int local_parse_allow(const char *spec) {
+    while(*spec != '\0'){
+        char *end;
+        long uid = strtol(spec, &end, 10);
+        if(end == spec || uid < 0 || num_allowed == LOCAL_MAX_ALLOW || (*end != ',' && *end != '\0')){
+            return -1;
+        }
+        allowed[num_allowed++] = (uid_t)uid;
+        spec = *end == ',' ? end + 1 : end;
+    }
+    return num_allowed > 0 ? 0 : -1;
+}
+
+/*
+ * Start listening on a Unix domain socket.
+ *
+ * @param path  Where to put the socket.  Anything but a socket already there
+ * is left alone, and makes this fail.
+ * @param allow  The users allowed to connect ("UID[,UID...]"), or NULL for
+ * anyone who can open the socket.
+ * @return the listening socket, or -1 with errno set.
+ */
+int local_init(const char *path, const char *allow) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(sa.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    num_allowed = 0;
+    if(allow != NULL && local_parse_allow(allow) < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    //A socket left behind by a server that didn't get to clean up
+    struct stat st;
+    if(lstat(path, &st) == 0){
+        if(!S_ISSOCK(st.st_mode)){
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 1024) < 0){
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    strcpy(local_path, path);
+    return fd;
+}
+
+/*
+ * Take over a Unix domain socket that the server this one replaced was
+ * listening on (see upgrade.h), to be treated just like one of our own.
+ *
+ * @param fd  The listening socket.
+ * @param path  Where it is, as given to local_init().
+ * @param allow  The users allowed to connect, as given to local_init().
+ * @return fd if successful, otherwise -1 with errno set.
+ */
+int local_inherit(int fd, const char *path, const char *allow) {
+    if(strlen(path) >= sizeof(local_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    num_allowed = 0;
+    if(allow != NULL && local_parse_allow(allow) < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(local_path, path);
+    return fd;
+}
+
+/*
+ * Remove the socket, so that nobody tries to connect to a server that is gone.
+ */
+void local_fini(void) {
+    if(local_path[0] != '\0'){
+        unlink(local_path);
+        local_path[0] = '\0';
+    }
+}
+
+/*
+ * Tell whether a new connection may be served: anything but a Unix domain
+ * socket may, and so may a Unix domain socket whose peer is running as one
+ * of the allowed users.
+ *
+ * @param fd  The connection.
+ * @return 1 if it may, 0 if it should be closed.
+ */
+int local_peer_allowed(int fd) {
+    if(num_allowed == 0){
+        return 1;
+    }
+    int domain;
+    socklen_t len = sizeof(domain);
+    if(getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 || domain != AF_UNIX){
+        return 1;
+    }
+    struct ucred cred;
+    len = sizeof(cred);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0){
+        return 0;
+    }
+    for(int i = 0; i < num_allowed; i++){
+        if(cred.uid == allowed[i]){
+            return 1;
+        }
+    }
+    debug("Refusing local connection from pid %d, uid %d", (int)cred.pid, (int)cred.uid);
+    return 0;
+}
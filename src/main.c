@@ -1,8 +1,22 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
 
 #include "pbx.h"
 #include "server.h"
+#include "config.h"
+#include "trace.h"
+#include "msglog.h"
+#include "regmap.h"
+#include "cdr.h"
+#include "coro.h"
+#include "local.h"
+#include "ratelimit.h"
+#include "shard.h"
+#include "upgrade.h"
+#include "server_extra.h"
 #include "debug.h"
 #include "csapp.h"
 
@@ -11,8 +25,23 @@ static void terminate(int status);
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-e <first>[-<last>]] [-r <reuse delay ms>] [-c <capacity>]
+ *            [-s <registry shards>] [-t <trace dump file>] [-q] [-m <message log>]
+ *            [-d <CDR file>] [-g <grace s>] [-i <idle s>] [-a <ring s>] [-l] [-u]
+ *            [-U <socket path> [-R <uid>[,<uid>...]]] [-A <conns/s>[/<burst>]]
+ *            [-C <cmds/s>[/<burst>]] [-w <workers>] [-k <registry map>]
+ *
+ * SIGHUP shuts it down; SIGUSR1 upgrades it in place (see upgrade.h).
  */ 
+static void raise_fd_limit(int capacity);
+static int serve_connection(int *connfdp);
+static void *local_accept(void *arg);
+static void admit_coroutine(void *arg);
+static int serve_moved(int fd, const void *input, size_t len);
+
+//How a thread is made for each client, in the default mode
+static pthread_attr_t attr;
+
 
 //Signal Handling (Sighup_handler and volatile flag!)
 volatile int sighup_recieved = 0; 
@@ -26,13 +55,132 @@ int main(int argc, char* argv[]){
 
     //For this portion we will be running getopt in order to get the port number! 
     char* PORT = NULL;  
+    char* trace_path = NULL;
+    char* msglog_path = NULL;
+    char* regmap_path = NULL;
+    char* cdr_path = NULL;
+    char* local_path = NULL;
+    char* local_allow = NULL;
     int cli; 
+    int range_given = 0;
+    int workers = 0;
+    int number;
 
-    while((cli = getopt(argc, argv, "p:"))!= -1){
+    while((cli = getopt(argc, argv, "p:e:r:c:s:t:qm:d:g:i:a:luU:R:A:C:w:k:"))!= -1){
         switch(cli){
             case 'p':  
                 PORT = optarg; 
                 break; 
+            case 'e':
+                //Range of extension numbers to hand out, e.g. -e 100-199
+                if(config_parse_range(optarg, &pbx_config.ext_first, &pbx_config.ext_count) < 0){
+                    fprintf(stderr, "Invalid extension range '%s', expected FIRST-LAST\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                range_given = 1;
+                break;
+            case 'c':
+                //Capacity mode: how many TUs we should be able to hold at once
+                if(config_parse_int(optarg, 1, INT_MAX, &number) < 0 || config_set_capacity(number) < 0){
+                    fprintf(stderr, "Invalid capacity '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                //How long (ms) a released extension stays unassigned before it is reused
+                if(config_parse_int(optarg, 0, INT_MAX, &pbx_config.reuse_delay_ms) < 0){
+                    fprintf(stderr, "Invalid reuse delay '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                //Number of independently locked pieces the registry is split into
+                if(config_parse_int(optarg, 1, PBX_MAX_SHARDS, &pbx_config.shards) < 0){
+                    fprintf(stderr, "Invalid number of shards '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                //Callers to busy phones and hunt groups wait in line instead of getting a busy signal
+                pbx_config.queue_calls = 1;
+                break;
+            case 'g':
+                //How long (seconds) a phone whose connection drops waits to be resumed
+                if(config_parse_int(optarg, 0, INT_MAX / 1000, &number) < 0){
+                    fprintf(stderr, "Invalid grace period '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                pbx_config.resume_grace_ms = number * 1000;
+                break;
+            case 'i':
+                //How long (seconds) a client may send nothing before it is disconnected
+                if(config_parse_int(optarg, 0, INT_MAX / 1000, &number) < 0){
+                    fprintf(stderr, "Invalid idle timeout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                pbx_config.idle_timeout_ms = number * 1000;
+                break;
+            case 'a':
+                //How long (seconds) a phone may ring unanswered before the call is given up
+                if(config_parse_int(optarg, 0, INT_MAX / 1000, &number) < 0){
+                    fprintf(stderr, "Invalid ring timeout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                pbx_config.ring_timeout_ms = number * 1000;
+                break;
+            case 'l':
+                //Serve clients on coroutines, all on one thread, instead of a thread each
+                pbx_config.coroutines = 1;
+                break;
+            case 'u':
+                //As -l, but the coroutines' accepts, reads and writes all go through io_uring
+                pbx_config.io_uring = 1;
+                break;
+            case 'U':
+                //A Unix domain socket to take connections on as well, for clients on this host
+                local_path = optarg;
+                break;
+            case 'R':
+                //Which users may connect to that socket
+                local_allow = optarg;
+                break;
+            case 'A':
+                //How fast any one source address may open connections
+                if(config_parse_rate(optarg, &pbx_config.admit_rate, &pbx_config.admit_burst) < 0){
+                    fprintf(stderr, "Invalid connection rate '%s', expected RATE[/BURST]\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                //How fast any one client may send commands
+                if(config_parse_rate(optarg, &pbx_config.command_rate, &pbx_config.command_burst) < 0){
+                    fprintf(stderr, "Invalid command rate '%s', expected RATE[/BURST]\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                //Run as this many worker processes, each serving its own slice of the extensions
+                if(config_parse_int(optarg, 1, SHARD_MAX_WORKERS, &workers) < 0){
+                    fprintf(stderr, "Invalid number of workers '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                //Where messages left for extensions are kept, so they survive a restart
+                msglog_path = optarg;
+                break;
+            case 'k':
+                //Where registrations are recorded, so clients get their extensions back after a restart
+                regmap_path = optarg;
+                break;
+            case 'd':
+                //Where a record of every call is written
+                cdr_path = optarg;
+                break;
+            case 't':
+                //Where the event trace is written on SIGUSR2 or a crash
+                trace_path = optarg;
+                break;
             default: 
                 fprintf(stderr, "PORT WAS NOT GIVEN, Usage: %s, -p <port>\n", argv[0]); 
                 exit(EXIT_FAILURE); 
@@ -42,6 +190,90 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "PORT WAS NOT GIVEN, Usage: %s, -p <port>\n", argv[0]); 
         exit(EXIT_FAILURE); 
     } 
+    if(local_allow != NULL && local_path == NULL){
+        fprintf(stderr, "-R needs a socket to apply to (-U <path>)\n");
+        exit(EXIT_FAILURE);
+    }
+    //Held phones and the message log belong to one process; workers can't share them
+    if(workers > 0 && (pbx_config.resume_grace_ms > 0 || msglog_path != NULL)){
+        fprintf(stderr, "-g and -m can't be used with -w\n");
+        exit(EXIT_FAILURE);
+    }
+    if(workers > 0 && regmap_path != NULL){
+        fprintf(stderr, "-k can't be used with -w\n");
+        exit(EXIT_FAILURE);
+    }
+    //Without an explicit range there should be an extension for every TU we can hold
+    if(!range_given && pbx_config.capacity > pbx_config.ext_count){
+        pbx_config.ext_count = pbx_config.capacity;
+    }
+    if(workers > pbx_config.ext_count){
+        fprintf(stderr, "Too few extensions for %d workers\n", workers);
+        exit(EXIT_FAILURE);
+    }
+    raise_fd_limit(pbx_config.capacity);
+
+    //SIGUSR1 asks for an upgrade, which a thread of its own waits for; every thread
+    //started from here on has it blocked
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    //Started by an upgrade, we are handed the sockets of the server we replace
+    int upgrading = upgrade_inherited();
+
+    //A client can disconnect while we're writing a notification to it; that should
+    //just make the write fail, not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    //The sockets are opened before anything else, so that workers can share them (a
+    //supervisor that has been upgraded has them already)
+    int localfd = -1;
+    int supervising = shard_inherited(&localfd);
+    if(supervising < 0){
+        fprintf(stderr, "Cannot take over from the old supervisor\n");
+        exit(EXIT_FAILURE);
+    }
+    if(supervising && localfd >= 0 && local_inherit(localfd, local_path, local_allow) < 0){
+        fprintf(stderr, "Invalid local socket '%s' or users '%s'\n", local_path,
+                local_allow != NULL ? local_allow : "");
+        exit(EXIT_FAILURE);
+    }
+    if(!upgrading && !supervising && local_path != NULL && (localfd = local_init(local_path, local_allow)) < 0){
+        fprintf(stderr, "Invalid local socket '%s' or users '%s'\n", local_path,
+                local_allow != NULL ? local_allow : "");
+        terminate(EXIT_FAILURE);
+    }
+    //Each worker gets a socket of its own on the port, and carries on from here on its
+    //own; this process only looks after them
+    int listenfd = upgrading ? -1 : workers > 0 ? shard_start(workers, PORT, argv, localfd) : open_listenfd(PORT); 
+    if(listenfd < 0 && !upgrading){
+        fprintf(stderr, "ERROR OPENING LISTENFD"); 
+        terminate(EXIT_FAILURE); 
+    } 
+    //A worker that is being upgraded is replaced by one serving the same slice
+    if(upgrading && shard_rejoin(workers) < 0){
+        fprintf(stderr, "Cannot take over from the old worker\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //The trace is always being recorded; this just says where it goes when asked for
+    if(trace_init(trace_path) < 0){
+        fprintf(stderr, "Invalid trace file '%s'\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+
+    //Without a file the log is set up in memory when the first message is left (when
+    //upgrading, the server we replace is still using it until we have taken over)
+    if(!upgrading && msglog_path != NULL && msglog_init(msglog_path) < 0){
+        fprintf(stderr, "Invalid message log '%s'\n", msglog_path);
+        exit(EXIT_FAILURE);
+    }
+
+    if(cdr_path != NULL && cdr_init(cdr_path) < 0){
+        fprintf(stderr, "Invalid CDR file '%s'\n", cdr_path);
+        exit(EXIT_FAILURE);
+    }
 
     sigset_t mask; 
     sigemptyset(&mask); 
@@ -60,6 +292,15 @@ int main(int argc, char* argv[]){
     // Perform required initialization of the PBX module.
     debug("Initializing PBX...");
     pbx = pbx_init();
+    if(pbx == NULL){
+        fprintf(stderr, "Failed to initialize PBX\n");
+        exit(EXIT_FAILURE);
+    }
+    //When upgrading, the server we replace carries on recording in it until we take over
+    if(regmap_path != NULL && regmap_init(regmap_path, pbx_config.ext_first, pbx_config.ext_count, !upgrading) < 0){
+        fprintf(stderr, "Invalid registry map '%s'\n", regmap_path);
+        exit(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -72,13 +313,91 @@ int main(int argc, char* argv[]){
     int * connfdp; 
     socklen_t clientlen;  
     struct sockaddr_storage clientaddr; 
-    pthread_t tid;  
+    pthread_attr_init(&attr);
+    if(pbx_config.stack_size != 0){
+        //Large capacity: one thread per client only fits if the stacks are small
+        pthread_attr_setstacksize(&attr, pbx_config.stack_size);
+    }
 
-    int listenfd = open_listenfd(PORT); 
-    if(listenfd < 0){
-        fprintf(stderr, "ERROR OPENING LISTENFD"); 
-        terminate(EXIT_FAILURE); 
-    } 
+    if(upgrading){
+        //If this fails the old server carries on, so nothing of its (its socket file
+        //included) may be touched on the way out
+        if(upgrade_join(pbx, &listenfd, &localfd) < 0){
+            fprintf(stderr, "Cannot take over from the old server\n");
+            exit(EXIT_FAILURE);
+        }
+        if(localfd >= 0 && local_inherit(localfd, local_path, local_allow) < 0){
+            fprintf(stderr, "Invalid local socket '%s' or users '%s'\n", local_path,
+                    local_allow != NULL ? local_allow : "");
+            exit(EXIT_FAILURE);
+        }
+        if(msglog_path != NULL && msglog_init(msglog_path) < 0){
+            fprintf(stderr, "Invalid message log '%s'\n", msglog_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    //Extensions of clients that haven't come back yet are kept out of the allocator,
+    //around the ones of clients we have just taken over
+    int kept = regmap_reserve(pbx);
+    if(kept > 0){
+        fprintf(stderr, "Keeping %d extensions for clients to come back to\n", kept);
+    }
+    if(upgrade_init(argv, listenfd, localfd) < 0){
+        fprintf(stderr, "Warning: cannot be upgraded in place\n");
+    }
+    if(upgrading){
+        //The old server exits as soon as it hears we have its clients
+        int clients = upgrade_resume(serve_moved);
+        UPGRADE_STATS stats;
+        upgrade_get_stats(&stats);
+        fprintf(stderr, "Took over %d clients in %.1f ms\n", clients, stats.cutover_us / 1000.0);
+    }
+    //Clients dialing across from other workers are handed to us from here on (when
+    //upgrading, the old worker has stopped reading its inbox, and what is left is ours)
+    if(shard_serve(pbx, serve_moved) < 0){
+        fprintf(stderr, "Cannot take clients from other workers\n");
+        terminate(EXIT_FAILURE);
+    }
+    if(pbx_config.io_uring){
+        //TCP connections are checked against -A before they are served, as in the accept loop below
+        if(coro_listen(listenfd, admit_coroutine) == 0){
+            if(localfd >= 0 && coro_listen(localfd, pbx_client_coroutine) < 0){
+                fprintf(stderr, "Cannot listen on local socket '%s'\n", local_path);
+                terminate(EXIT_FAILURE);
+            }
+            //The scheduler thread accepts from here on; just wait for SIGHUP
+            sigset_t old;
+            sigprocmask(SIG_BLOCK, &mask, &old);
+            while(!sighup_recieved){
+                sigsuspend(&old);
+            }
+            //The accept in progress holds the socket open until the ring is torn down, after
+            //we exit; shutting it down stops it listening now, so a restart can have the port
+            shutdown(listenfd, SHUT_RDWR);
+            close(listenfd);
+            if(localfd >= 0){
+                shutdown(localfd, SHUT_RDWR);
+                close(localfd);
+            }
+            terminate(EXIT_SUCCESS);
+        }
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+        pbx_config.coroutines = 1;
+    }
+    if(localfd >= 0){
+        //Local clients are accepted on a thread of their own, as TCP ones are on this one
+        pthread_t tid;
+        int *fdp = malloc(sizeof(int));
+        *fdp = localfd;
+        if(pthread_create(&tid, NULL, local_accept, fdp) != 0){
+            fprintf(stderr, "Cannot accept on local socket '%s'\n", local_path);
+            terminate(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+    //Waiting in poll() rather than accept() lets an upgrade stop us between connections
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    upgrade_enter(listenfd);
     volatile sig_atomic_t run = 1; 
     while(run){
         clientlen = sizeof(struct sockaddr_storage); 
@@ -97,29 +416,180 @@ int main(int argc, char* argv[]){
             break; 
         } 
 
+        if(coro_poll(listenfd, -1) < 0){
+            if(errno == EINTR){
+                upgrade_park(listenfd, NULL, 0, 0);
+            }
+            free(connfdp);
+            continue;
+        }
         if ((*connfdp = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen)) < 0){
             //fprintf(stderr, "ERROR accepting new connection!"); 
             free(connfdp); 
             continue; 
         } 
+        //A source opening connections faster than -A allows is cut off before it costs a thread
+        if(!ratelimit_admit((struct sockaddr *)&clientaddr)){
+            close(*connfdp);
+            free(connfdp);
+            continue;
+        }
+        //Notifications are tiny writes that the client is waiting on, so don't let
+        //Nagle hold them back waiting for the ACK of the previous one!
+        int nodelay = 1;
+        setsockopt(*connfdp, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-        if(pthread_create(&tid, NULL, pbx_client_service,connfdp) < 0){
-            free(connfdp); 
-            continue; 
-            //exit(EXIT_FAILURE); 
-        } 
+        serve_connection(connfdp);
     }
     // fprintf(stderr, "You have to finish implementing main() "
 	//     "before the PBX server will function.\n");
     terminate(EXIT_FAILURE);
 }
 
+/*
+ * Serve a new connection on a thread or coroutine of its own, whichever
+ * clients are being served on.
+ *
+ * @param connfdp  A malloc'ed int holding the connection, for the service to free.
+ * @return 0 if successful, otherwise -1, with the connection closed.
+ */
+static int serve_connection(int *connfdp) {
+    //An upgrade waits for it to be served, to stop it
+    upgrade_starting(*connfdp);
+    if(pbx_config.coroutines){
+        if(coro_spawn(pbx_client_coroutine, connfdp) < 0){
+            upgrade_leave(*connfdp);
+            coro_close(*connfdp);
+            free(connfdp);
+            return -1;
+        }
+        return 0;
+    }
+    pthread_t tid;
+    if(pthread_create(&tid, &attr, pbx_client_service, connfdp) != 0){
+        upgrade_leave(*connfdp);
+        coro_close(*connfdp);
+        free(connfdp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Serve a connection handed over by another worker (-w) or by the server this
+ * one has replaced, in whichever way clients are being served, with the input
+ * that came with it read first.
+ *
+ * @return 0 if successful, otherwise -1, with the connection closed.
+ */
+static int serve_moved(int fd, const void *input, size_t len) {
+    if(pbx_config.io_uring && coro_adopt(fd, pbx_client_coroutine, input, len) == 0){
+        return 0;
+    }
+    int *connfdp = malloc(sizeof(int));
+    //Anywhere else the input is put back, for the service's first reads to find
+    if(connfdp == NULL || coro_unread(fd, input, len) < 0){
+        free(connfdp);
+        close(fd);
+        return -1;
+    }
+    *connfdp = fd;
+    return serve_connection(connfdp);
+}
+
+/*
+ * Coroutine function for TCP connections accepted through io_uring (-u),
+ * which checks the source against -A before serving the connection.
+ *
+ * @param arg  A malloc'ed int holding the connection.
+ */
+static void admit_coroutine(void *arg) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(getpeername(*(int *)arg, (struct sockaddr *)&addr, &len) == 0
+       && !ratelimit_admit((struct sockaddr *)&addr)){
+        coro_close(*(int *)arg);
+        free(arg);
+        return;
+    }
+    pbx_client_coroutine(arg);
+}
+
+/*
+ * Thread accepting connections on the local socket until the process exits.
+ *
+ * @param arg  A malloc'ed int holding the listening socket.
+ */
+static void *local_accept(void *arg) {
+    int localfd = *(int *)arg;
+    free(arg);
+    //SIGHUP has to interrupt the main thread's accept, not this one's
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    //As the main thread's: an upgrade has to be able to stop us between connections
+    fcntl(localfd, F_SETFL, fcntl(localfd, F_GETFL) | O_NONBLOCK);
+    upgrade_enter(localfd);
+    while(1){
+        int *connfdp = malloc(sizeof(int));
+        if(connfdp == NULL){
+            continue;
+        }
+        if(coro_poll(localfd, -1) < 0 && errno == EINTR){
+            upgrade_park(localfd, NULL, 0, 0);
+            free(connfdp);
+            continue;
+        }
+        if((*connfdp = accept(localfd, NULL, NULL)) < 0){
+            free(connfdp);
+            if(errno == EINVAL || errno == EBADF){
+                //Shut down
+                break;
+            }
+            continue;
+        }
+        serve_connection(connfdp);
+    }
+    return NULL;
+}
+
+/*
+ * Make sure we can have a descriptor open for every TU, plus a few for ourselves.
+ * Only the soft limit can be raised; if the hard limit is lower we warn and
+ * carry on, and registrations will start failing when accept() does.
+ */
+static void raise_fd_limit(int capacity) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0){
+        return;
+    }
+    rlim_t want = (rlim_t)capacity + 64;
+    if(rl.rlim_cur >= want){
+        return;
+    }
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= want) ? want : rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur < want){
+        fprintf(stderr, "Warning: descriptor limit %lu is below capacity %d\n",
+                (unsigned long)rl.rlim_cur, capacity);
+    }
+}
+
 /*
  * Function called to cleanly shut down the server.
  */
 static void terminate(int status) {
     debug("Shutting down PBX...");
+    //Nobody should find the socket and try to connect while we go (unless
+    //other workers are still using it: the supervisor removes it when they're done)
+    if(shard_worker() < 0){
+        local_fini();
+    }
     pbx_shutdown(pbx);
+    //The calls ended by the shutdown are recorded too
+    cdr_flush();
     debug("PBX server terminating");
     exit(status);
 }
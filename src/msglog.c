@@ -0,0 +1,496 @@
+/*
+ * Store-and-forward messages, kept in a memory-mapped append-only log.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "pbx.h"
+#include "tu_extra.h"
+#include "msglog.h"
+#include "debug.h"
+
+/*
+ * The log file is grown in steps of this size as records are appended.
+ */
+#define MSGLOG_GROW (1024 * 1024)
+
+#define MSGLOG_START sizeof(MSGLOG_FILE_HEADER)
+#define MSGLOG_BUCKETS 256
+
+_Static_assert(sizeof(MSGLOG_RECORD) == 32, "MSGLOG_RECORD is part of the log file format");
+
+/*
+ * The pending messages for one extension: the latest of them, from which the
+ * rest are reached through the records' prev offsets.
+ */
+typedef struct msglog_entry {
+    int ext;
+    int count;
+    uint64_t tail;
+    struct msglog_entry* next;
+} MSGLOG_ENTRY;
+
+/*
+ * A sender waiting for the commit thread to sync its message.
+ */
+typedef struct msglog_waiter {
+    sem_t done;
+    int ret;
+    struct msglog_waiter* next;
+} MSGLOG_WAITER;
+
+static sem_t log_mutex; //Protects everything up to the waiters
+static char* log_base;
+static int log_fd = -1;
+static size_t log_size; //Bytes of the file that may be touched
+static size_t log_end;
+static uint32_t log_generation;
+static size_t dirty_lo, dirty_hi; //Range appended since the last sync
+static MSGLOG_ENTRY* log_index[MSGLOG_BUCKETS];
+static long stored, delivered;
+static _Atomic long pending; //Lets pickups skip the lock when nothing is waiting
+static _Atomic long commits;
+
+static MSGLOG_WAITER* commit_waiters;
+static sem_t commit_mutex;
+static sem_t commit_items;
+
+static const char* log_path;
+static int setup_ret;
+static pthread_once_t msglog_once = PTHREAD_ONCE_INIT;
+
+static void *msglog_commit_thread(void *arg);
+
+static uint32_t msglog_sum(const char *text, size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        h = (h ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return h;
+}
+
+static size_t msglog_record_size(size_t len) {
+    return (sizeof(MSGLOG_RECORD) + len + 7) & ~(size_t)7;
+}
+
+static MSGLOG_RECORD *msglog_record(uint64_t off) {
+    return (MSGLOG_RECORD *)(log_base + off);
+}
+
+static void msglog_dirty(size_t lo, size_t hi) {
+    if(dirty_hi == 0 || lo < dirty_lo){
+        dirty_lo = lo;
+    }
+    if(hi > dirty_hi){
+        dirty_hi = hi;
+    }
+}
+
+/*
+ * Find the entry for an extension, creating it if asked to.
+ * Must be called with the log locked.
+ */
+static MSGLOG_ENTRY *msglog_entry(int ext, int create) {
+    MSGLOG_ENTRY **bucket = &log_index[(unsigned int)ext % MSGLOG_BUCKETS];
+    MSGLOG_ENTRY *entry = *bucket;
+    while(entry != NULL && entry->ext != ext){
+        entry = entry->next;
+    }
+    if(entry == NULL && create && (entry = calloc(1, sizeof(MSGLOG_ENTRY))) != NULL){
+        entry->ext = ext;
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    return entry;
+}
+
+static void msglog_entry_remove(MSGLOG_ENTRY *entry) {
+    MSGLOG_ENTRY **prev = &log_index[(unsigned int)entry->ext % MSGLOG_BUCKETS];
+    while(*prev != entry){
+        prev = &(*prev)->next;
+    }
+    *prev = entry->next;
+    free(entry);
+}
+
+/*
+ * Add a record to the end of the log, growing the file if need be.
+ * Must be called with the log locked.
+ *
+ * @return the offset of the record, or 0 if there is no room.
+ */
+static uint64_t msglog_put(int type, int to, int from, const char *text, size_t len, uint64_t prev) {
+    size_t size = msglog_record_size(len);
+    if(log_end + size > MSGLOG_MAX_SIZE){
+        errno = ENOSPC;
+        return 0;
+    }
+    if(log_end + size > log_size){
+        size_t new_size = (log_end + size + MSGLOG_GROW - 1) / MSGLOG_GROW * MSGLOG_GROW;
+        if(ftruncate(log_fd, new_size) < 0){
+            return 0;
+        }
+        log_size = new_size;
+    }
+    uint64_t off = log_end;
+    MSGLOG_RECORD *rec = msglog_record(off);
+    memcpy(rec + 1, text, len);
+    rec->generation = log_generation;
+    rec->type = type;
+    rec->len = len;
+    rec->sum = msglog_sum(text, len);
+    rec->to = to;
+    rec->from = from;
+    rec->prev = prev;
+    rec->magic = MSGLOG_RECORD_MAGIC;
+    log_end += size;
+    msglog_dirty(off, log_end);
+    return off;
+}
+
+/*
+ * Start the log over once nothing is waiting to be delivered.  Records already
+ * there are left alone, but belong to an older generation from now on.
+ * Must be called with the log locked.
+ */
+static void msglog_rewind(void) {
+    MSGLOG_FILE_HEADER *header = (MSGLOG_FILE_HEADER *)log_base;
+    header->generation = ++log_generation;
+    msglog_dirty(0, MSGLOG_START);
+    if(log_fd < 0){
+        //Nothing will read the old records again, so their memory can go
+        size_t page = sysconf(_SC_PAGESIZE);
+        if(log_end > page){
+            madvise(log_base + page, log_end - page, MADV_DONTNEED);
+        }
+    }
+    log_end = MSGLOG_START;
+}
+
+/*
+ * Rebuild the index from the records of the current generation in the file.
+ */
+static void msglog_recover(void) {
+    uint64_t off = MSGLOG_START;
+    while(off + sizeof(MSGLOG_RECORD) <= log_size){
+        MSGLOG_RECORD *rec = msglog_record(off);
+        size_t size = msglog_record_size(rec->len);
+        if(rec->magic != MSGLOG_RECORD_MAGIC || rec->generation != log_generation || off + size > log_size){
+            break;
+        }
+        MSGLOG_ENTRY *entry = msglog_entry(rec->to, rec->type == MSGLOG_MESSAGE);
+        if(rec->type == MSGLOG_MESSAGE){
+            //A torn write is the end of the log
+            if(entry == NULL || rec->sum != msglog_sum((char *)(rec + 1), rec->len)){
+                break;
+            }
+            entry->tail = off;
+            entry->count++;
+            atomic_fetch_add(&pending, 1);
+        }else if(rec->type == MSGLOG_DELIVERED){
+            if(entry != NULL){
+                atomic_fetch_sub(&pending, entry->count);
+                msglog_entry_remove(entry);
+            }
+        }else{
+            break;
+        }
+        off += size;
+    }
+    log_end = off;
+    debug("Recovered %ld undelivered messages from %s", atomic_load(&pending), log_path);
+}
+
+/*
+ * Open (or create) the log file and map it.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int msglog_open(const char *path) {
+    log_fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if(log_fd < 0 || fstat(log_fd, &st) < 0){
+        return -1;
+    }
+    log_size = st.st_size;
+    int fresh = log_size < MSGLOG_START;
+    if(fresh){
+        if(ftruncate(log_fd, MSGLOG_GROW) < 0){
+            return -1;
+        }
+        log_size = MSGLOG_GROW;
+    }
+    if(log_size > MSGLOG_MAX_SIZE){
+        log_size = MSGLOG_MAX_SIZE;
+    }
+    //Map all the log can ever grow to, so the map never has to move
+    log_base = mmap(NULL, MSGLOG_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, 0);
+    if(log_base == MAP_FAILED){
+        log_base = NULL;
+        return -1;
+    }
+    MSGLOG_FILE_HEADER *header = (MSGLOG_FILE_HEADER *)log_base;
+    if(fresh){
+        memcpy(header->magic, MSGLOG_MAGIC, sizeof(header->magic));
+        header->version = MSGLOG_VERSION;
+        header->generation = 1;
+        msync(log_base, MSGLOG_START, MS_SYNC);
+    }else if(memcmp(header->magic, MSGLOG_MAGIC, sizeof(header->magic)) != 0 || header->version != MSGLOG_VERSION){
+        munmap(log_base, MSGLOG_MAX_SIZE);
+        log_base = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    log_generation = header->generation;
+    msglog_recover();
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, msglog_commit_thread, NULL) != 0){
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+static void msglog_setup(void) {
+    sem_init(&log_mutex, 0, 1);
+    sem_init(&commit_mutex, 0, 1);
+    sem_init(&commit_items, 0, 0);
+    if(log_path != NULL){
+        setup_ret = msglog_open(log_path);
+        if(setup_ret < 0){
+            log_base = NULL;
+        }
+        return;
+    }
+    //No file: the log lives in memory, and pages are only used as it fills
+    log_base = mmap(NULL, MSGLOG_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(log_base == MAP_FAILED){
+        log_base = NULL;
+        setup_ret = -1;
+        return;
+    }
+    log_size = MSGLOG_MAX_SIZE;
+    log_end = MSGLOG_START;
+    log_generation = 1;
+}
+
+/*
+ * Set up the message log.  To keep messages in a file, this must be called
+ * before any message is stored or delivered; otherwise the log is set up in
+ * memory the first time it is needed.
+ *
+ * @param path  The log file, which is created if it doesn't exist, or NULL to
+ * keep the log in memory.
+ * @return 0 if successful, otherwise -1.
+ */
+int msglog_init(const char *path) {
+    log_path = path;
+    pthread_once(&msglog_once, msglog_setup);
+    return setup_ret;
+}
+
+/*
+ * Wait until everything appended so far has been synced to the log file.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int msglog_wait_commit(void) {
+    MSGLOG_WAITER waiter;
+    sem_init(&waiter.done, 0, 0);
+    sem_wait(&commit_mutex);
+    int was_empty = commit_waiters == NULL;
+    waiter.next = commit_waiters;
+    commit_waiters = &waiter;
+    sem_post(&commit_mutex);
+    if(was_empty){
+        sem_post(&commit_items);
+    }
+    sem_wait(&waiter.done);
+    sem_destroy(&waiter.done);
+    return waiter.ret;
+}
+
+/*
+ * Sync whatever has been appended since the last time, then let everyone who
+ * was waiting by the time it started go.  Senders that arrive while a sync is
+ * in progress all share the next one.
+ */
+static void *msglog_commit_thread(void *arg) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    while(1){
+        sem_wait(&commit_items);
+        sem_wait(&commit_mutex);
+        MSGLOG_WAITER *waiters = commit_waiters;
+        commit_waiters = NULL;
+        sem_post(&commit_mutex);
+
+        sem_wait(&log_mutex);
+        size_t lo = dirty_lo, hi = dirty_hi;
+        dirty_lo = dirty_hi = 0;
+        sem_post(&log_mutex);
+        int ret = 0;
+        if(hi > lo){
+            //The map never moves, so the sync doesn't need the lock
+            lo -= lo % page;
+            ret = msync(log_base + lo, hi - lo, MS_SYNC);
+            atomic_fetch_add(&commits, 1);
+        }
+        while(waiters != NULL){
+            MSGLOG_WAITER *waiter = waiters;
+            waiters = waiter->next;
+            waiter->ret = ret;
+            sem_post(&waiter->done);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Leave a message for an extension.  With a log file, this returns once the
+ * message has reached it.
+ *
+ * @param to  The extension the message is for.
+ * @param from  The extension it is from.
+ * @param text  The message.
+ * @return 0 if the message was stored, otherwise -1 (if the log is full, or
+ * the extension already has MSGLOG_MAX_PER_EXT messages waiting).
+ */
+int msglog_append(int to, int from, const char *text) {
+    pthread_once(&msglog_once, msglog_setup);
+    size_t len = strlen(text);
+    if(log_base == NULL || to <= 0 || len == 0 || len > UINT16_MAX){
+        return -1;
+    }
+    sem_wait(&log_mutex);
+    MSGLOG_ENTRY *entry = msglog_entry(to, 1);
+    if(entry == NULL || entry->count >= MSGLOG_MAX_PER_EXT){
+        sem_post(&log_mutex);
+        return -1;
+    }
+    uint64_t off = msglog_put(MSGLOG_MESSAGE, to, from, text, len, entry->tail);
+    if(off == 0){
+        if(entry->count == 0){
+            msglog_entry_remove(entry);
+        }
+        sem_post(&log_mutex);
+        return -1;
+    }
+    entry->tail = off;
+    entry->count++;
+    stored++;
+    atomic_fetch_add(&pending, 1);
+    sem_post(&log_mutex);
+    if(log_fd >= 0){
+        return msglog_wait_commit();
+    }
+    return 0;
+}
+
+/*
+ * Leave a message for an extension on behalf of a TU, and tell its client
+ * whether it was stored.
+ *
+ * @param tu  The TU sending the message.
+ * @param ext  The extension the message is for.
+ * @param text  The message.
+ * @return 0 if the message was stored, otherwise -1.
+ */
+int msglog_send(TU *tu, int ext, const char *text) {
+    if(tu == NULL){
+        return -1;
+    }
+    int ret = msglog_append(ext, tu_extension(tu), text);
+    char line[48];
+    int len = snprintf(line, sizeof(line), "%sSTORED %d\n", ret < 0 ? "NOT " : "", ext);
+    tu_send(tu, line, len);
+    return ret;
+}
+
+/*
+ * Take all the messages waiting for an extension, ready to be sent in one go.
+ * They count as delivered from then on.
+ *
+ * @param ext  The extension.
+ * @param len  Set to the length of what is returned.
+ * @return the messages, oldest first, one "MSG <from>: <text>" line each, in a
+ * buffer the caller must free; or NULL if there are none (or memory runs out,
+ * in which case they stay where they are).
+ */
+char *msglog_take(int ext, size_t *len) {
+    if(atomic_load_explicit(&pending, memory_order_relaxed) == 0){
+        return NULL;
+    }
+    sem_wait(&log_mutex);
+    MSGLOG_ENTRY *entry = msglog_entry(ext, 0);
+    if(entry == NULL){
+        sem_post(&log_mutex);
+        return NULL;
+    }
+    //The chain runs newest first, so find them all before writing any out
+    int count = entry->count;
+    uint64_t *offs = malloc(count * sizeof(uint64_t));
+    size_t size = 0;
+    uint64_t off = entry->tail;
+    for(int i = count - 1; offs != NULL && i >= 0; i--){
+        offs[i] = off;
+        size += msglog_record(off)->len + 24; //"MSG " + extension + ": " + "\n"
+        off = msglog_record(off)->prev;
+    }
+    char *buf = offs != NULL ? malloc(size) : NULL;
+    if(buf == NULL){
+        sem_post(&log_mutex);
+        free(offs);
+        return NULL;
+    }
+    *len = 0;
+    for(int i = 0; i < count; i++){
+        MSGLOG_RECORD *rec = msglog_record(offs[i]);
+        *len += snprintf(buf + *len, size - *len, "MSG %d: %.*s\n", rec->from, rec->len, (char *)(rec + 1));
+    }
+    free(offs);
+    msglog_entry_remove(entry);
+    delivered += count;
+    if(atomic_fetch_sub(&pending, count) == count){
+        msglog_rewind();
+    }else if(msglog_put(MSGLOG_DELIVERED, ext, 0, "", 0, 0) == 0){
+        //Without the record they would be delivered again after a restart
+        debug("No room to record delivery of messages for %d", ext);
+    }
+    sem_post(&log_mutex);
+    if(log_fd >= 0){
+        //Nobody waits for this to reach the disk; it goes with the next sync
+        sem_post(&commit_items);
+    }
+    return buf;
+}
+
+/*
+ * Get the counters of the message log.
+ *
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int msglog_get_stats(MSGLOG_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    pthread_once(&msglog_once, msglog_setup);
+    sem_wait(&log_mutex);
+    stats->stored = stored;
+    stats->delivered = delivered;
+    stats->pending = atomic_load(&pending);
+    stats->commits = atomic_load(&commits);
+    stats->used = log_end;
+    stats->durable = log_fd >= 0;
+    sem_post(&log_mutex);
+    return 0;
+}
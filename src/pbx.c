@@ -4,10 +4,25 @@
 // #include <stdlib.h>
 
 #include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "extalloc.h"
+#include "conf.h"
+#include "hunt.h"
+#include "presence.h"
+#include "resume.h"
+#include "regmap.h"
+#include "tu_extra.h"
+#include "proto.h"
 #include "debug.h"
+#include "hazard.h"
 #include <semaphore.h> 
 #include <sys/socket.h>  
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
 /*
  * Initialize a new PBX.
  *
@@ -32,11 +47,62 @@ typedef struct pbx_node {
     struct pbx_node* prev; 
 }PBX_NODE;  
 
+/*
+ * The registry is split into shards keyed by extension number, each with its own
+ * lock, counters and storage, so that registrations and dials on different
+ * extensions don't all queue up on one lock.  Extension number e in the allocator's
+ * range lives in shard (e - first) % num_shards, at slot (e - first) / num_shards.
+ * Each shard is aligned to a cache line so that neighbouring shards' locks and
+ * counters don't false-share.
+ */
+typedef struct pbx_shard {
+    _Alignas(64) sem_t mutex; //mutex for locking this shard! 
+    TU** slots; //Registered TUs of this shard, indexed by (extension - first) / num_shards
+    PBX_NODE* head; //Head for Linked List Containing This Shard's Telephones Registered Outside The Range!
+    int num_extensions; //Keeping Track of Number of Extensions in this shard!
+    long registrations; //Counters, protected by the mutex like everything else here
+    long dials;
+    long misses; //Dials to an extension nobody is registered on
+}PBX_SHARD;
+
 struct pbx{
-    PBX_NODE* head; //Head for Linked List Containing All Registered Clients/Telephones!
-    sem_t mutex; //mutex for locking! 
-    int num_extensions; //Keeping Track of Number of Extensions!    
+    PBX_SHARD* shards;
+    int num_shards;
+    int first; //Extension number of the first slot (same range as the allocator)
+    int count; //Number of extensions in the range
+    int capacity; //Most TUs that may be registered at once
+    _Atomic int registered; //Registered TUs across all shards, for the capacity check
+    _Atomic int shutting_down; //Set by pbx_shutdown(), which then waits on drained
+    sem_t drained; //Posted when the last TU unregisters during shutdown
+    EXT_ALLOC* extensions; //Hands out extension numbers (lock-free, so it lives outside the shards)
 }; 
+
+/*
+ * Find the shard responsible for an extension number.
+ */
+static PBX_SHARD* pbx_shard(PBX *pbx, int ext) {
+    if(ext_alloc_owns(pbx->extensions, ext)){
+        return &pbx->shards[(ext - pbx->first) % pbx->num_shards];
+    }
+    return &pbx->shards[(unsigned int)ext % pbx->num_shards];
+}
+
+/*
+ * Find the slot for an extension number in the allocator's range, within its shard.
+ */
+static TU** pbx_slot(PBX *pbx, PBX_SHARD* shard, int ext) {
+    return &shard->slots[(ext - pbx->first) / pbx->num_shards];
+}
+
+static void pbx_free(PBX *pbx) {
+    for(int i = 0; i < pbx->num_shards; i++){
+        free(pbx->shards[i].slots);
+    }
+    ext_alloc_destroy(pbx->extensions);
+    free(pbx->shards);
+    free(pbx);
+}
+
 /*
  * Initialize a new PBX.
  *
@@ -44,17 +110,41 @@ struct pbx{
  */
 PBX *pbx_init() { 
     //First we want to malloc space for our PBX 
-    PBX* created_pbx = malloc(sizeof(PBX));  
+    PBX* created_pbx = calloc(1, sizeof(PBX));  
     if(created_pbx == NULL){return NULL;} 
-    //Now we can start initalizing the fields and the mutex! 
-    created_pbx->head = NULL; 
-    created_pbx->num_extensions = 0;  
-
-    if(sem_init(&created_pbx->mutex, 0, 1) != 0){
-        //We failed to initalize our mutext so we should free our pbx and return NULL 
-        free(created_pbx); 
-        return NULL; 
-    } 
+    //Now we can start initalizing the fields and the shards! 
+    created_pbx->capacity = pbx_config.capacity;
+    created_pbx->first = pbx_config.ext_first;
+    created_pbx->count = pbx_config.ext_count;
+    created_pbx->num_shards = pbx_config.shards;
+    atomic_init(&created_pbx->registered, 0);
+    created_pbx->shards = aligned_alloc(_Alignof(PBX_SHARD), created_pbx->num_shards * sizeof(PBX_SHARD));
+    if(created_pbx->shards == NULL){
+        free(created_pbx);
+        return NULL;
+    }
+    memset(created_pbx->shards, 0, created_pbx->num_shards * sizeof(PBX_SHARD));
+    created_pbx->extensions = ext_alloc_create(pbx_config.ext_first, pbx_config.ext_count,
+                                               pbx_config.reuse_delay_ms);
+    if(created_pbx->extensions == NULL){
+        pbx_free(created_pbx);
+        return NULL;
+    }
+    int per_shard = (created_pbx->count + created_pbx->num_shards - 1) / created_pbx->num_shards;
+    for(int i = 0; i < created_pbx->num_shards; i++){
+        PBX_SHARD* shard = &created_pbx->shards[i];
+        shard->slots = calloc(per_shard, sizeof(TU*));
+        if(shard->slots == NULL){
+            pbx_free(created_pbx);
+            return NULL;
+        }
+    }
+    //Only initialize the semaphores once nothing else can fail, so pbx_free() doesn't have to care
+    sem_init(&created_pbx->drained, 0, 0);
+    for(int i = 0; i < created_pbx->num_shards; i++){
+        sem_init(&created_pbx->shards[i].mutex, 0, 1);
+    }
+    debug("PBX with %d shards of %d slots", created_pbx->num_shards, per_shard);
     return created_pbx; 
 }
 // // #endif
@@ -70,35 +160,164 @@ PBX *pbx_init() {
  * @param pbx  The PBX to be shut down.
  */
 
+/*
+ * Shut down the network connections of every TU registered in a range of shards.
+ * Runs on its own thread for each part of the registry.
+ */
+typedef struct shard_range {
+    PBX* pbx;
+    int from;
+    int step;
+}SHARD_RANGE;
+
+static void *pbx_shutdown_shards(void *arg) {
+    SHARD_RANGE* range = arg;
+    PBX* pbx = range->pbx;
+    int per_shard = (pbx->count + pbx->num_shards - 1) / pbx->num_shards;
+    for(int s = range->from; s < pbx->num_shards; s += range->step){
+        PBX_SHARD* shard = &pbx->shards[s];
+        //We need to lock now as we are looking through this shard! 
+        sem_wait(&shard->mutex); //sem_wait is lock, sem_post is unlock! 
+        for(int i = 0; i < per_shard; i++){
+            if(shard->slots[i] != NULL){
+                shutdown(tu_fileno(shard->slots[i]), SHUT_RDWR);
+            }
+        }
+        PBX_NODE* current = shard->head; 
+        while(current != NULL){
+            //We need to shutdown each registered extensions which is in this doubly linked list 
+            //pbx_unregister(pbx, current->telephone);  --> DONT NEED PBX_UNREGISTER HERE, THE SERVICE THREAD DOES IT! 
+            shutdown(tu_fileno(current->telephone), SHUT_RDWR);
+            current = current->next; 
+        } 
+        sem_post(&shard->mutex); 
+    }
+    return NULL;
+}
+
 void pbx_shutdown(PBX *pbx) {
     // TO BE IMPLEMENTED 
     if(pbx == NULL){
         return; 
     } 
-    //We need to lock now as we are ediitng the pbx's! 
-    sem_wait(&pbx->mutex); //sem_wait is lock, sem_post is unlock! 
-    PBX_NODE* current = pbx->head; 
-    while(current != NULL){
-        PBX_NODE* next = current->next; 
-        //sem_post(&pbx->mutex);
-        //We need to shutdown each registered extensions which is in this doubly linked list 
-        if(shutdown(tu_fileno(current->telephone), SHUT_RDWR) == -1){
-            //fprintf(stderr, "ERROR SHUTTING DOWN A REGISTERED TELEPHONE");  
-            //continue; 
-        } 
-        // sem_post(&pbx->mutex);
-        //pbx_unregister(pbx, current->telephone);  --> DONT NEED PBX_UNREGISTER HERE! 
-        //sem_wait(&pbx->mutex);  
-
-        current = next; 
-    } 
-    sem_post(&pbx->mutex); 
-    sem_destroy(&pbx->mutex);  
-    free(pbx); 
+    //Sequentially consistent, like every access to it and to registered: seen by any
+    //registration that locks a shard after the walk below has been through it
+    atomic_store(&pbx->shutting_down, 1);
+    //Walk the shards in parallel, one thread per CPU, each taking every n-th shard
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads < 1){
+        nthreads = 1;
+    }
+    if(nthreads > pbx->num_shards){
+        nthreads = pbx->num_shards;
+    }
+    pthread_t tids[nthreads];
+    SHARD_RANGE ranges[nthreads];
+    for(int i = 0; i < nthreads; i++){
+        ranges[i] = (SHARD_RANGE){ .pbx = pbx, .from = i, .step = nthreads };
+        if(pthread_create(&tids[i], NULL, pbx_shutdown_shards, &ranges[i]) != 0){
+            tids[i] = 0;
+            pbx_shutdown_shards(&ranges[i]);
+        }
+    }
+    for(int i = 0; i < nthreads; i++){
+        if(tids[i] != 0){
+            pthread_join(tids[i], NULL);
+        }
+    }
+    //Phones held for clients that will now never come back go at once
+    resume_release_all(pbx);
+    //Now wait for the service threads to see EOF and unregister their TUs.  Every
+    //TU counted in registered was counted under its shard lock before the walk took
+    //that lock, and so was shut down; later registrations are refused uncounted.
+    if(atomic_load(&pbx->registered) > 0){
+        sem_wait(&pbx->drained);
+    }
+    //The last one out may still be in pbx_gone(), under its shard lock
+    for(int i = 0; i < pbx->num_shards; i++){
+        sem_wait(&pbx->shards[i].mutex);
+        sem_post(&pbx->shards[i].mutex);
+    }
+    //Every TU has been let go of, so those still waiting for a batch can be freed now
+    hazard_reclaim();
+    for(int i = 0; i < pbx->num_shards; i++){
+        sem_destroy(&pbx->shards[i].mutex);
+    }
+    sem_destroy(&pbx->drained);
+    pbx_free(pbx);
     // abort();
 }
 // #endif
 
+/*
+ * Put a TU into the registry under an extension number that has already been
+ * reserved, without telling anybody.
+ * Extensions in the allocator's range go straight into their slot; anything
+ * else is kept on the linked list.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int pbx_insert(PBX *pbx, TU *tu, int ext) {
+    PBX_NODE* node = NULL;
+    if(!ext_alloc_owns(pbx->extensions, ext)){
+        node = malloc(sizeof(PBX_NODE)); 
+        if(node == NULL){
+            return -1; 
+        } 
+    }
+    PBX_SHARD* shard = pbx_shard(pbx, ext);
+    sem_wait(&shard->mutex); //LOCK Since we are about to edit the registry! 
+    //Counted under the shard lock, so that pbx_shutdown()'s walk either finds the
+    //TU here or has set shutting_down before we look at it
+    if(atomic_load(&pbx->shutting_down)){
+        sem_post(&shard->mutex);
+        free(node);
+        return -1;
+    }
+    if(atomic_fetch_add(&pbx->registered, 1) >= pbx->capacity){
+        atomic_fetch_sub(&pbx->registered, 1);
+        sem_post(&shard->mutex);
+        free(node);
+        return -1;
+    }
+    if(node == NULL){
+        *pbx_slot(pbx, shard, ext) = tu;
+    }else{
+        node->next = shard->head; //Adding to front of list!   
+        node->prev = NULL; 
+        node->telephone = tu;
+        if(shard->head != NULL){
+            shard->head->prev = node; 
+        }
+        shard->head = node;  
+    }
+    shard->num_extensions++; 
+    shard->registrations++;
+    sem_post(&shard->mutex); //UNLOCK!
+    return 0;
+}
+
+/*
+ * Add a TU to the registry under an extension number that has already been
+ * reserved, and notify the client of its extension.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int pbx_add(PBX *pbx, TU *tu, int ext) {
+    if(pbx_insert(pbx, tu, ext) < 0){
+        return -1;
+    }
+    //Recorded for the server that comes after this one, before the client hears its number
+    uint64_t token;
+    if(regmap_enabled() && resume_token(tu, &token) == 0){
+        regmap_store(ext, token);
+    }
+    //Now we need to just set the extension and make sure to increase the refernce of the TU  
+    //We will need to lock in tu_ref for this I THINK! -> THIS WAS WRONG, WE DO NOT NEED TO LOCK IN TU_REF
+    tu_set_extension(tu, ext); 
+    return 0;
+}
+
 /*
  * Register a telephone unit with a PBX at a specified extension number.
  * This amounts to "plugging a telephone unit into the PBX".
@@ -122,39 +341,33 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
     if(tu == NULL){
         return -1; 
     } 
-    if(pbx->num_extensions >= PBX_MAX_EXTENSIONS){
-        return -1; 
-    } 
-
-    PBX_NODE* node = malloc(sizeof(PBX_NODE)); 
-    if(node == NULL){
-        //sem_post(&pbx->mutex);  
-        return -1; 
-    } 
-    sem_wait(&pbx->mutex); //LOCK Since we are about to edit the critical doubly linked list! 
-    node->next = pbx->head; //Adding to front of list!   
-    node->prev = NULL; 
-    node->telephone = tu;
-    if(pbx->head != NULL){
-        pbx->head->prev = node; 
+    //Extensions inside the allocator's range have to be reserved there so they are
+    //not handed out to anyone else. Ones outside it are the caller's business.
+    int claimed = 0;
+    if(atomic_load(&pbx->shutting_down)){
+        return -1;
+    }
+    if(ext_alloc_owns(pbx->extensions, ext)){
+        if(ext_alloc_claim(pbx->extensions, ext) < 0){
+            return -1;
+        }
+        claimed = 1;
+    }
+    if(pbx_add(pbx, tu, ext) < 0){
+        if(claimed){
+            ext_alloc_put(pbx->extensions, ext);
+        }
+        return -1;
     }
-    pbx->head = node;  
-    pbx->num_extensions++; 
-    sem_post(&pbx->mutex); //UNLOCK!
-
-    //Now we need to just set the extension and make sure to increase the refernce of the TU  
-    //We will need to lock in tu_ref for this I THINK! -> THIS WAS WRONG, WE DO NOT NEED TO LOCK IN TU_REF
-    //tu_ref(tu, "REGISTERING TU!"); 
-    tu_set_extension(tu, ext); 
-
-    // pbx->num_extensions++; 
-    // sem_post(&pbx->mutex); //UNLOCK!
     return 0; 
 
     //abort();
 }
 // // #endif
 
+static int pbx_remove(PBX *pbx, TU *tu, int ext);
+static void pbx_gone(PBX *pbx, int ext);
+
 /*
  * Unregister a TU from a PBX.
  * This amounts to "unplugging a telephone unit from the PBX".
@@ -177,39 +390,99 @@ int pbx_unregister(PBX *pbx, TU *tu) {
     if(tu == NULL){
         return -1; 
     } 
-    sem_wait(&pbx->mutex); 
-
-    PBX_NODE* current = pbx->head; 
-    while(current != NULL){
-        if(current->telephone == tu){
-            //We hangup and we decrement the reference!  
-
-            //Updating Linked List since we are freeing this telephone! 
-            if(current->prev != NULL){ 
-                current->prev->next = current->next; 
-            }else{
-                pbx->head = current->next; 
-            } 
-            if(current->next != NULL){
-                current->next->prev = current->prev; 
-            } 
-            pbx->num_extensions--;  
-            PBX_NODE* freeing = current;  
-
-            sem_post(&pbx->mutex);   
-
-            tu_hangup(tu); 
-            tu_unref(tu, "UNREGISTERING PHONE!");  
-
-            free(freeing);  
-            return 0; 
+    int ext = tu_extension(tu);
+    if(pbx_remove(pbx, tu, ext) < 0){
+        return -1;
+    }
+
+    //We hangup and we decrement the reference!  
+    //Out of its hunt group first, so the hangup can't make it look free to callers
+    hunt_leave(tu);
+    tu_close_queue(tu);
+    tu_hangup(tu); 
+    //Watchers see it go after its last transition, and before the number can be
+    //handed to a new phone, whose registration they would see next
+    presence_publish(ext, PRESENCE_UNREGISTERED);
+    presence_forget(tu);
+    resume_forget(tu);
+    //Phones unplugged by a shutdown get their numbers back when the server starts again
+    if(!pbx->shutting_down){
+        regmap_clear(ext);
+    }
+    ext_alloc_put(pbx->extensions, ext);
+    tu_unref(tu, "UNREGISTERING PHONE!");  
+    pbx_gone(pbx, ext);
+    return 0; 
+}
+// #endif
+
+/*
+ * Take a TU out of the registry.
+ *
+ * @return 0 if successful, -1 if it wasn't registered.
+ */
+static int pbx_remove(PBX *pbx, TU *tu, int ext) {
+    PBX_NODE* freeing = NULL;
+    PBX_SHARD* shard = pbx_shard(pbx, ext);
+    sem_wait(&shard->mutex); 
+
+    if(ext_alloc_owns(pbx->extensions, ext) && *pbx_slot(pbx, shard, ext) == tu){
+        *pbx_slot(pbx, shard, ext) = NULL;
+    }else{
+        PBX_NODE* current = shard->head; 
+        while(current != NULL && current->telephone != tu){
+            current = current->next;
+        } 
+        if(current == NULL){
+            sem_post(&shard->mutex);  
+            return -1; 
+        }
+        //Updating Linked List since we are freeing this telephone! 
+        if(current->prev != NULL){ 
+            current->prev->next = current->next; 
+        }else{
+            shard->head = current->next; 
         } 
+        if(current->next != NULL){
+            current->next->prev = current->prev; 
+        } 
+        freeing = current;  
+    }
+    shard->num_extensions--;  
+    sem_post(&shard->mutex);   
+    free(freeing);  
+    return 0;
+}
+
+/*
+ * Count a TU out of the registry once it is gone.
+ */
+static void pbx_gone(PBX *pbx, int ext) {
+    //The last one out lets pbx_shutdown() know it can free everything.  Under the
+    //shard lock, which pbx_shutdown() takes before freeing, so that it can't free
+    //the PBX between the count reaching 0 and shutting_down being looked at here
+    PBX_SHARD* shard = pbx_shard(pbx, ext);
+    sem_wait(&shard->mutex);
+    if(atomic_fetch_sub(&pbx->registered, 1) == 1 && atomic_load(&pbx->shutting_down)){
+        sem_post(&pbx->drained);
+    }
+    sem_post(&shard->mutex);
+}
+
+/*
+ * Find the TU registered at an extension, with its shard locked.
+ */
+static TU* pbx_find(PBX *pbx, PBX_SHARD* shard, int ext) {
+    //Numbers in the allocator's range are a direct index, only the rest need a search
+    if(ext_alloc_owns(pbx->extensions, ext)){
+        return *pbx_slot(pbx, shard, ext);
+    }
+    PBX_NODE* current = shard->head; 
+    while(current != NULL && tu_extension(current->telephone) != ext){
         current = current->next;
     } 
-    sem_post(&pbx->mutex);  
-    return -1; 
+    return current != NULL ? current->telephone : NULL;
 }
-// #endif
 
 /*
  * Use the PBX to initiate a call from a specified TU to a specified extension.
@@ -229,21 +502,428 @@ int pbx_dial(PBX *pbx, TU *tu, int ext) {
         return -1; 
     } 
 
-    sem_wait(&pbx->mutex); 
+    PBX_SHARD* shard = pbx_shard(pbx, ext);
+    sem_wait(&shard->mutex); 
+    shard->dials++;
 
-    PBX_NODE* current = pbx->head; 
-    while(current != NULL){
-        if(tu_extension(current->telephone) == ext){ 
-            sem_post(&pbx->mutex);  
-            tu_dial(tu, current->telephone); 
-            return 0; 
-        } 
-        current = current->next;
-    } 
-    sem_post(&pbx->mutex);  
+    TU* target = pbx_find(pbx, shard, ext);
+    if(target != NULL){
+        //Hold a reference so the target can't be freed by a concurrent unregister mid-dial
+        tu_ref(target, "Dialing TU from PBX");
+        sem_post(&shard->mutex);  
+        tu_dial(tu, target); 
+        tu_unref(target, "Done dialing TU from PBX");
+        return 0; 
+    }
+    shard->misses++;
+    sem_post(&shard->mutex);  
+    //Not a phone, but it might be a conference bridge, in which case dialing it joins
+    CONF_BRIDGE* bridge = conf_lookup(ext);
+    if(bridge != NULL){
+        int joined = conf_join(bridge, tu);
+        conf_unref(bridge);
+        if(joined == 0){
+            return 0;
+        }
+    }
+    //Or a hunt group, which picks one of its phones to ring
+    HUNT_GROUP* group = hunt_lookup(ext);
+    if(group != NULL){
+        int dialed = hunt_dial(group, tu);
+        hunt_unref(group);
+        if(dialed == 0){
+            return 0;
+        }
+    }
     tu_dial(tu, NULL);  
     /*according to TU DIAL SPECIFICATIONS ->  If the caller of this function was unable to determine a target TU 
     to be called, it will pass NULL as the target TU*/
     return -1; 
 }
-// #endif
\ No newline at end of file
+// #endif
+
+/*
+ * Register a telephone unit with a PBX at an extension number chosen by the PBX.
+ * The extension is taken from the PBX's extension allocator, as configured by
+ * pbx_config, rather than being derived from the TU's file descriptor.
+ * Otherwise this behaves like pbx_register().
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU to be registered.
+ * @return the assigned extension number if registration succeeds, otherwise -1.
+ */
+int pbx_register_auto(PBX *pbx, TU *tu) {
+    if(pbx == NULL || tu == NULL){
+        return -1;
+    }
+    if(atomic_load(&pbx->shutting_down)){
+        return -1;
+    }
+    int ext = ext_alloc_get(pbx->extensions);
+    if(ext < 0){
+        debug("No extension available for TU on fd %d", tu_fileno(tu));
+        return -1;
+    }
+    if(pbx_add(pbx, tu, ext) < 0){
+        ext_alloc_put(pbx->extensions, ext);
+        return -1;
+    }
+    return ext;
+}
+
+/*
+ * Add up the per-shard counters of a PBX.
+ *
+ * @param pbx  The PBX.
+ * @param stats  Filled in with the totals.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_get_stats(PBX *pbx, PBX_STATS *stats) {
+    if(pbx == NULL || stats == NULL){
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->shards = pbx->num_shards;
+    for(int i = 0; i < pbx->num_shards; i++){
+        PBX_SHARD* shard = &pbx->shards[i];
+        sem_wait(&shard->mutex);
+        stats->registered += shard->num_extensions;
+        stats->registrations += shard->registrations;
+        stats->dials += shard->dials;
+        stats->misses += shard->misses;
+        if(shard->num_extensions > stats->max_shard){
+            stats->max_shard = shard->num_extensions;
+        }
+        sem_post(&shard->mutex);
+    }
+    return 0;
+}
+
+/*
+ * Take an extension number from the PBX's allocator for something other than a
+ * registered TU (such as a conference bridge), so that no TU will be given it.
+ *
+ * @param pbx  The PBX.
+ * @return the extension number, or -1 if none is available.
+ */
+int pbx_reserve_extension(PBX *pbx) {
+    if(pbx == NULL){
+        return -1;
+    }
+    return ext_alloc_get(pbx->extensions);
+}
+
+/*
+ * Give back an extension number taken with pbx_reserve_extension().
+ *
+ * @param pbx  The PBX.
+ * @param ext  The extension number.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_release_extension(PBX *pbx, int ext) {
+    if(pbx == NULL){
+        return -1;
+    }
+    return ext_alloc_put(pbx->extensions, ext);
+}
+
+/*
+ * Find the TU registered at an extension.
+ *
+ * @param pbx  The PBX.
+ * @param ext  The extension number.
+ * @return the TU, with a reference the caller must release, or NULL if no TU
+ * is registered there.
+ */
+TU *pbx_lookup(PBX *pbx, int ext) {
+    if(pbx == NULL){
+        return NULL;
+    }
+    PBX_SHARD* shard = pbx_shard(pbx, ext);
+    sem_wait(&shard->mutex);
+    TU* tu = pbx_find(pbx, shard, ext);
+    if(tu != NULL){
+        tu_ref(tu, "Looked up in PBX");
+    }
+    sem_post(&shard->mutex);
+    return tu;
+}
+
+/*
+ * Hold a registered TU whose connection has dropped instead of unregistering
+ * it, if sessions can be resumed (see resume.h).
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU.
+ * @return 0 if the TU is held, in which case its connection may be closed and
+ * it must not be unregistered; otherwise -1, and it should be unregistered.
+ */
+int pbx_hold(PBX *pbx, TU *tu) {
+    if(pbx == NULL || tu == NULL || pbx_config.resume_grace_ms <= 0 || pbx->shutting_down){
+        return -1;
+    }
+    uint64_t token;
+    if(resume_token(tu, &token) < 0 || tu_hold(tu) < 0){
+        return -1;
+    }
+    if(resume_hold(pbx, tu, pbx_config.resume_grace_ms) < 0){
+        return -1;
+    }
+    //pbx_shutdown() may have let go of the held phones just before this one was added
+    if(pbx->shutting_down && resume_claim(token) == tu){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Resume a held TU from a new connection that hasn't registered a TU: the held
+ * TU takes the connection, with its extension, state and call as they are,
+ * and its client is sent its state and the chats it missed.  Nobody else is
+ * told anything, since as far as they know the TU never went away.
+ *
+ * @param pbx  The PBX.
+ * @param fd  The file descriptor of the new connection.
+ * @param token  The token the client gave.
+ * @return the TU the connection now belongs to, or NULL if the token isn't that
+ * of a held TU (the connection is left alone).
+ */
+TU *pbx_rebind(PBX *pbx, int fd, uint64_t token) {
+    if(pbx == NULL || pbx->shutting_down){
+        return NULL;
+    }
+    TU *held = resume_claim(token);
+    if(held != NULL){
+        //A new connection always starts out speaking text
+        tu_rebind(held, fd, PROTO_TEXT);
+    }
+    return held;
+}
+
+/*
+ * Register a TU at an extension claimed with regmap_claim() for its client's
+ * token, which the TU is given.
+ *
+ * @return 0 if successful, otherwise -1, and the extension is given up.
+ */
+static int pbx_add_kept(PBX *pbx, TU *tu, int ext, uint64_t token) {
+    if(resume_keep(tu, token) < 0 || pbx_add(pbx, tu, ext) < 0){
+        resume_forget(tu);
+        regmap_clear(ext);
+        ext_alloc_put(pbx->extensions, ext);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Register a TU for a new connection whose client has come back after a
+ * restart, at the extension it had before (see regmap.h), with the token it
+ * had.  Its client is notified as usual.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The new TU.
+ * @param token  The token the client gave.
+ * @return the extension, or -1 if none was kept for that token.
+ */
+int pbx_register_kept(PBX *pbx, TU *tu, uint64_t token) {
+    if(pbx == NULL || tu == NULL || pbx->shutting_down){
+        return -1;
+    }
+    int ext = regmap_claim(token);
+    if(ext < 0 || pbx_add_kept(pbx, tu, ext, token) < 0){
+        return -1;
+    }
+    return ext;
+}
+
+/*
+ * Move a connection whose TU is on hook to a new TU at the extension kept for
+ * its client since before a restart, unregistering the one it had.
+ *
+ * @return the new TU, or NULL if nothing was kept for the token (and nothing
+ * has changed).
+ */
+static TU *pbx_resume_kept(PBX *pbx, TU *tu, uint64_t token) {
+    //A phone that is in the middle of anything keeps its number
+    if(!regmap_enabled() || pbx->shutting_down || tu_get_state(tu) != TU_ON_HOOK){
+        return NULL;
+    }
+    int ext = regmap_claim(token);
+    if(ext < 0){
+        return NULL;
+    }
+    //Nothing for the old phone reaches the client from here on
+    int proto = tu_get_proto(tu);
+    int fd = tu_detach(tu);
+    TU *kept = tu_init(fd);
+    if(kept != NULL){
+        TU_SNAPSHOT as = { .ext = -1, .state = TU_ON_HOOK, .proto = proto };
+        tu_restore(kept, &as);
+    }
+    if(kept == NULL || pbx_add_kept(pbx, kept, ext, token) < 0){
+        tu_unref(kept, "Kept extension not registered");
+        tu_rebind(tu, fd, proto);
+        return NULL;
+    }
+    pbx_unregister(pbx, tu);
+    return kept;
+}
+
+/*
+ * Resume a held TU from a new connection, which has registered a TU of its own.
+ *   If the token is that of a held TU, the connection's TU is quietly
+ *     unregistered and the connection handed to the held TU, whose client is
+ *     sent its state and the chats it missed.
+ *   If it is the token of an extension kept since before a restart (see
+ *     regmap.h), and the connection's TU is on hook, a new TU is registered
+ *     there for the connection, and the old one is quietly unregistered.
+ *   Otherwise the connection's TU carries on as it was, and its client is told
+ *     "NOT RESUMED".
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU of the new connection.
+ * @param token  The token the client gave.
+ * @return the TU the connection now belongs to.
+ */
+TU *pbx_resume(PBX *pbx, TU *tu, uint64_t token) {
+    TU *held = resume_claim(token);
+    if(held == NULL && (held = pbx_resume_kept(pbx, tu, token)) != NULL){
+        return held;
+    }
+    if(held == NULL){
+        tu_send(tu, "NOT RESUMED\n", 12);
+        return tu;
+    }
+    int proto = tu_get_proto(tu);
+    int fd = tu_detach(tu);
+    pbx_unregister(pbx, tu);
+    tu_rebind(held, fd, proto);
+    return held;
+}
+
+/*
+ * Register a TU for a client handed over by another worker (see shard.h),
+ * which had its extension there and has been taken off hook already.  The TU
+ * goes straight into TU_DIAL_TONE under that extension, and neither its client
+ * nor anybody else is told anything.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The new TU.
+ * @param ext  The extension it had.
+ * @param proto  What its connection speaks (PROTO_TEXT or PROTO_BINARY).
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_adopt(PBX *pbx, TU *tu, int ext, int proto) {
+    if(pbx == NULL || tu == NULL || pbx->shutting_down){
+        return -1;
+    }
+    tu_adopt(tu, ext, proto);
+    return pbx_insert(pbx, tu, ext);
+}
+
+/*
+ * Unregister a TU whose client is being handed over to another worker (see
+ * shard.h), quietly: no hangup, no presence and no giving back its extension,
+ * which goes with the client.  The TU must be in TU_DIAL_TONE, with its
+ * connection already taken away with tu_detach().
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_move_out(PBX *pbx, TU *tu) {
+    if(pbx == NULL || tu == NULL){
+        return -1;
+    }
+    int ext = tu_extension(tu);
+    if(pbx_remove(pbx, tu, ext) < 0){
+        return -1;
+    }
+    hunt_leave(tu);
+    tu_close_queue(tu);
+    presence_forget(tu);
+    resume_forget(tu);
+    tu_unref(tu, "Moved to another worker");
+    pbx_gone(pbx, ext);
+    return 0;
+}
+
+/*
+ * Keep an extension number in the PBX's range from being handed out, because
+ * a client that has it is being served somewhere else.
+ *
+ * @param pbx  The PBX.
+ * @param ext  The extension number.
+ * @return 0 if successful, -1 if it is taken already or out of range.
+ */
+int pbx_claim_extension(PBX *pbx, int ext) {
+    if(pbx == NULL){
+        return -1;
+    }
+    return ext_alloc_claim(pbx->extensions, ext);
+}
+
+/*
+ * Call a function on every registered TU, one shard at a time, with that
+ * shard locked (so the function may lock the TU, but mustn't touch the
+ * registry).
+ *
+ * @param pbx  The PBX.
+ * @param fn  The function, given each TU and arg.
+ * @param arg  Passed to fn.
+ * @return 0 if fn was called on every TU, -1 if it stopped early.
+ */
+int pbx_for_each(PBX *pbx, PBX_VISIT_FN *fn, void *arg) {
+    int per_shard = (pbx->count + pbx->num_shards - 1) / pbx->num_shards;
+    for(int s = 0; s < pbx->num_shards; s++){
+        PBX_SHARD* shard = &pbx->shards[s];
+        int ret = 0;
+        sem_wait(&shard->mutex);
+        for(int i = 0; i < per_shard && ret >= 0; i++){
+            if(shard->slots[i] != NULL){
+                ret = fn(shard->slots[i], arg);
+            }
+        }
+        for(PBX_NODE* node = shard->head; node != NULL && ret >= 0; node = node->next){
+            ret = fn(node->telephone, arg);
+        }
+        sem_post(&shard->mutex);
+        if(ret < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Register a new TU quietly as the one a snapshot was taken of by the server
+ * this one has replaced (see upgrade.h), under the same extension and in the
+ * same state.  Its call, if it was in one, is put back separately, with
+ * tu_restore_call().
+ *
+ * @param pbx  The PBX.
+ * @param tu  The new TU.
+ * @param snap  The snapshot.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_restore(PBX *pbx, TU *tu, const TU_SNAPSHOT *snap) {
+    if(pbx == NULL || tu == NULL){
+        return -1;
+    }
+    int claimed = 0;
+    if(ext_alloc_owns(pbx->extensions, snap->ext)){
+        if(ext_alloc_claim(pbx->extensions, snap->ext) < 0){
+            return -1;
+        }
+        claimed = 1;
+    }
+    tu_restore(tu, snap);
+    if(pbx_insert(pbx, tu, snap->ext) < 0){
+        if(claimed){
+            ext_alloc_put(pbx->extensions, snap->ext);
+        }
+        return -1;
+    }
+    return 0;
+}
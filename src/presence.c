@@ -0,0 +1,387 @@
+/*
+ * Presence: coalesced notifications of other extensions' states.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "presence.h"
+#include "debug.h"
+
+/*
+ * Longest line sent to a watcher: "WATCH <ext> <state>\n".
+ */
+#define PRESENCE_LINE_MAX 48
+
+typedef struct watcher WATCHER;
+
+/*
+ * One TU watching one extension.  It is on the chain of its extension's bucket
+ * (guarded by the bucket's lock), on its watcher's list of subscriptions, and,
+ * when there is a state its watcher hasn't been sent yet, on the watcher's
+ * dirty list (both guarded by the watcher's lock).
+ */
+typedef struct subscription {
+    WATCHER* watcher;
+    int ext;
+    int state; //Latest state of the extension
+    int dirty;
+    struct subscription* next;
+    struct subscription* next_of_watcher;
+    struct subscription* next_dirty;
+} SUBSCRIPTION;
+
+struct watcher {
+    TU* tu;
+    sem_t mutex; //Protects the lists and flags below
+    SUBSCRIPTION* subs;
+    SUBSCRIPTION* dirty;
+    int num_dirty;
+    int queued; //On the presence thread's list
+    int closed; //Its TU has gone away
+    _Atomic int refs; //One for the watcher table, one while queued
+    char* out; //What the last write couldn't send; only touched by the presence thread
+    size_t out_len, out_off;
+    struct watcher* next; //Next in the same bucket of the watcher table
+    struct watcher* next_queued;
+};
+
+/*
+ * Subscriptions are found by extension in a table with a lock per bucket, since
+ * every TU transition looks there.  Watchers are found by TU in a second table,
+ * which is only used to subscribe and when a watcher goes away.
+ * The lock order is TU, then subscription bucket, then watcher, then the
+ * presence thread's list.
+ */
+#define PRESENCE_BUCKETS 1024
+#define WATCHER_BUCKETS 256
+
+typedef struct presence_bucket {
+    sem_t mutex;
+    SUBSCRIPTION* head;
+} PRESENCE_BUCKET;
+
+static PRESENCE_BUCKET presence_table[PRESENCE_BUCKETS];
+static WATCHER* watcher_table[WATCHER_BUCKETS];
+static sem_t watcher_table_mutex;
+static _Atomic int num_subscriptions; //Lets transitions skip the table when nobody watches
+static _Atomic int num_watchers; //Lets unregistration skip the watcher table
+
+static WATCHER* queued_head;
+static sem_t queued_mutex;
+static sem_t queued_items;
+static pthread_once_t presence_once = PTHREAD_ONCE_INIT;
+
+static void *presence_thread(void *arg);
+
+static void presence_setup(void) {
+    for(int i = 0; i < PRESENCE_BUCKETS; i++){
+        sem_init(&presence_table[i].mutex, 0, 1);
+    }
+    sem_init(&watcher_table_mutex, 0, 1);
+    sem_init(&queued_mutex, 0, 1);
+    sem_init(&queued_items, 0, 0);
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, presence_thread, NULL) != 0){
+        //Watchers then only get the answer to "watch" itself
+        debug("Presence thread could not be started");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static PRESENCE_BUCKET *presence_bucket(int ext) {
+    return &presence_table[(unsigned int)ext % PRESENCE_BUCKETS];
+}
+
+static WATCHER **watcher_bucket(TU *tu) {
+    return &watcher_table[((uintptr_t)tu / 64) % WATCHER_BUCKETS];
+}
+
+static void watcher_unref(WATCHER *w) {
+    if(atomic_fetch_sub(&w->refs, 1) == 1){
+        tu_unref(w->tu, "Watcher gone");
+        sem_destroy(&w->mutex);
+        free(w->out);
+        free(w);
+    }
+}
+
+static const char *presence_state_name(int state) {
+    return state == PRESENCE_UNREGISTERED ? "UNREGISTERED" : tu_state_names[state];
+}
+
+static int presence_line(char *buf, int ext, int state) {
+    return snprintf(buf, PRESENCE_LINE_MAX, "WATCH %d %s\n", ext, presence_state_name(state));
+}
+
+/*
+ * Put a watcher on the presence thread's list, if it isn't already.
+ * Must be called with the watcher locked.
+ */
+static void watcher_queue(WATCHER *w) {
+    if(w->queued){
+        return;
+    }
+    w->queued = 1;
+    atomic_fetch_add(&w->refs, 1);
+    sem_wait(&queued_mutex);
+    int was_empty = queued_head == NULL;
+    w->next_queued = queued_head;
+    queued_head = w;
+    sem_post(&queued_mutex);
+    if(was_empty){
+        sem_post(&queued_items);
+    }
+}
+
+/*
+ * Record a new state for an extension, to be sent to everyone watching it.
+ * Called on every TU transition, with the TU locked; when nobody is watching
+ * anything it returns straight away.
+ *
+ * @param ext  The extension.
+ * @param state  Its new TU_STATE, or PRESENCE_UNREGISTERED.
+ */
+void presence_publish(int ext, int state) {
+    if(atomic_load_explicit(&num_subscriptions, memory_order_relaxed) == 0 || ext < 0){
+        return;
+    }
+    PRESENCE_BUCKET *bucket = presence_bucket(ext);
+    sem_wait(&bucket->mutex);
+    for(SUBSCRIPTION *sub = bucket->head; sub != NULL; sub = sub->next){
+        if(sub->ext != ext){
+            continue;
+        }
+        WATCHER *w = sub->watcher;
+        sem_wait(&w->mutex);
+        if(!w->closed){
+            //Only the latest state is kept, however many changes there are before it is sent
+            sub->state = state;
+            if(!sub->dirty){
+                sub->dirty = 1;
+                sub->next_dirty = w->dirty;
+                w->dirty = sub;
+                w->num_dirty++;
+            }
+            watcher_queue(w);
+        }
+        sem_post(&w->mutex);
+    }
+    sem_post(&bucket->mutex);
+}
+
+/*
+ * Find the watcher for a TU, creating it if need be.
+ *
+ * @return the watcher, or NULL if memory runs out.
+ */
+static WATCHER *watcher_get(TU *tu) {
+    sem_wait(&watcher_table_mutex);
+    WATCHER **bucket = watcher_bucket(tu);
+    WATCHER *w = *bucket;
+    while(w != NULL && w->tu != tu){
+        w = w->next;
+    }
+    if(w == NULL && (w = calloc(1, sizeof(WATCHER))) != NULL){
+        w->tu = tu;
+        tu_ref(tu, "Watching");
+        sem_init(&w->mutex, 0, 1);
+        atomic_init(&w->refs, 1);
+        atomic_fetch_add(&num_watchers, 1);
+        w->next = *bucket;
+        *bucket = w;
+    }
+    sem_post(&watcher_table_mutex);
+    return w;
+}
+
+/*
+ * Subscribe a TU to the state of an extension, and send it the current state.
+ * Watching the same extension twice just sends the current state again.
+ *
+ * @param pbx  The PBX the extension is registered with.
+ * @param tu  The TU watching.
+ * @param ext  The extension to watch.
+ * @return 0 if successful, otherwise -1.
+ */
+int presence_watch(PBX *pbx, TU *tu, int ext) {
+    if(pbx == NULL || tu == NULL){
+        return -1;
+    }
+    pthread_once(&presence_once, presence_setup);
+    char line[PRESENCE_LINE_MAX];
+    if(ext <= 0){
+        tu_send(tu, line, presence_line(line, ext, PRESENCE_UNREGISTERED));
+        return -1;
+    }
+    WATCHER *w = watcher_get(tu);
+    SUBSCRIPTION *sub = w ? calloc(1, sizeof(SUBSCRIPTION)) : NULL;
+    if(sub == NULL){
+        return -1;
+    }
+    sub->watcher = w;
+    sub->ext = ext;
+    //Subscribe first, so a change after the state is read below is not missed
+    PRESENCE_BUCKET *bucket = presence_bucket(ext);
+    sem_wait(&bucket->mutex);
+    SUBSCRIPTION *old = bucket->head;
+    while(old != NULL && (old->ext != ext || old->watcher != w)){
+        old = old->next;
+    }
+    if(old == NULL){
+        sem_wait(&w->mutex);
+        sub->next_of_watcher = w->subs;
+        w->subs = sub;
+        sem_post(&w->mutex);
+        sub->next = bucket->head;
+        bucket->head = sub;
+        atomic_fetch_add(&num_subscriptions, 1);
+    }
+    sem_post(&bucket->mutex);
+    if(old != NULL){
+        free(sub);
+    }
+
+    int state = PRESENCE_UNREGISTERED;
+    TU *target = pbx_lookup(pbx, ext);
+    if(target != NULL){
+        state = tu_get_state(target);
+        tu_unref(target, "Done reading state for watcher");
+    }
+    tu_send(tu, line, presence_line(line, ext, state));
+    return 0;
+}
+
+/*
+ * Cancel all the subscriptions of a TU.  Called when it is unregistered.
+ *
+ * @param tu  The TU.
+ */
+void presence_forget(TU *tu) {
+    if(tu == NULL || atomic_load(&num_watchers) == 0){
+        return;
+    }
+    sem_wait(&watcher_table_mutex);
+    WATCHER **prev = watcher_bucket(tu);
+    while(*prev != NULL && (*prev)->tu != tu){
+        prev = &(*prev)->next;
+    }
+    WATCHER *w = *prev;
+    if(w != NULL){
+        *prev = w->next;
+        atomic_fetch_sub(&num_watchers, 1);
+    }
+    sem_post(&watcher_table_mutex);
+    if(w == NULL){
+        return;
+    }
+    sem_wait(&w->mutex);
+    w->closed = 1;
+    SUBSCRIPTION *subs = w->subs;
+    w->subs = w->dirty = NULL;
+    w->num_dirty = 0;
+    sem_post(&w->mutex);
+    //Once it is off its bucket's chain, nobody else can reach a subscription
+    while(subs != NULL){
+        SUBSCRIPTION *sub = subs;
+        subs = sub->next_of_watcher;
+        PRESENCE_BUCKET *bucket = presence_bucket(sub->ext);
+        sem_wait(&bucket->mutex);
+        SUBSCRIPTION **p = &bucket->head;
+        while(*p != NULL && *p != sub){
+            p = &(*p)->next;
+        }
+        if(*p == sub){
+            *p = sub->next;
+        }
+        sem_post(&bucket->mutex);
+        atomic_fetch_sub(&num_subscriptions, 1);
+        free(sub);
+    }
+    watcher_unref(w);
+}
+
+/*
+ * Tell how many subscriptions there are, over all the watchers.
+ */
+int presence_subscriptions(void) {
+    return atomic_load(&num_subscriptions);
+}
+
+/*
+ * Send a watcher whatever is left over from last time, then the latest state of
+ * every extension that has changed since.  Only called by the presence thread.
+ * If the connection can't take it all, the rest waits for the next round.
+ */
+static void watcher_flush(WATCHER *w) {
+    sem_wait(&w->mutex);
+    if(w->closed){
+        //Its connection may already be closed, and the descriptor reused
+        sem_post(&w->mutex);
+        return;
+    }
+    if(w->out_off == w->out_len){
+        if(w->num_dirty == 0){
+            sem_post(&w->mutex);
+            return;
+        }
+        char *buf = realloc(w->out, (size_t)w->num_dirty * PRESENCE_LINE_MAX);
+        if(buf == NULL){
+            watcher_queue(w); //Try again next time
+            sem_post(&w->mutex);
+            return;
+        }
+        w->out = buf;
+        w->out_len = w->out_off = 0;
+        for(SUBSCRIPTION *sub = w->dirty; sub != NULL; sub = sub->next_dirty){
+            sub->dirty = 0;
+            w->out_len += presence_line(w->out + w->out_len, sub->ext, sub->state);
+        }
+        w->dirty = NULL;
+        w->num_dirty = 0;
+    }
+    sem_post(&w->mutex);
+    ssize_t n = tu_send(w->tu, w->out + w->out_off, w->out_len - w->out_off);
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        w->out_off = w->out_len; //The connection is gone; its thread will clean up
+        return;
+    }
+    w->out_off += n > 0 ? n : 0;
+    if(w->out_off < w->out_len){
+        sem_wait(&w->mutex);
+        watcher_queue(w);
+        sem_post(&w->mutex);
+    }
+}
+
+static void *presence_thread(void *arg) {
+    while(1){
+        sem_wait(&queued_items);
+        //Let changes pile up, so each watcher gets them all in one go
+        usleep(PRESENCE_INTERVAL_MS * 1000);
+        sem_wait(&queued_mutex);
+        WATCHER *list = queued_head;
+        queued_head = NULL;
+        sem_post(&queued_mutex);
+        while(list != NULL){
+            WATCHER *w = list;
+            list = w->next_queued;
+            sem_wait(&w->mutex);
+            w->queued = 0;
+            sem_post(&w->mutex);
+            watcher_flush(w);
+            watcher_unref(w);
+        }
+    }
+    return NULL;
+}
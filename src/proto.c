@@ -0,0 +1,125 @@
+/*
+ * Binary framing: filling in event headers and reading command frames.
+ */
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+#include "coro.h"
+#include "upgrade.h"
+
+/*
+ * Fill in the header of an event to send to a binary client.
+ *
+ * @param ev  The header.
+ * @param kind  PROTO_EV_STATE, PROTO_EV_CHAT or PROTO_EV_TEXT.
+ * @param state  The TU_STATE, for PROTO_EV_STATE.
+ * @param ext  The extension to show, or 0 for none.
+ * @param len  Bytes of payload that will follow.
+ */
+void proto_event(PROTO_EVENT *ev, int kind, int state, int ext, size_t len) {
+    ev->kind = kind;
+    ev->state = state;
+    ev->len = htons(len);
+    ev->ext = htonl(ext > 0 ? ext : 0);
+}
+
+/*
+ * Read exactly len bytes, however many reads that takes.
+ *
+ * @param got  How many have been read already, kept up to date so that a read
+ * that is interrupted can be carried on with.
+ * @return 0 if successful, -1 if the connection ended first, or -2 if the
+ * read was interrupted (see coro_interrupt()).
+ */
+static int proto_read_full(int fd, void *buf, size_t len, size_t *got) {
+    while(*got < len){
+        ssize_t n = coro_read(fd, (char *)buf + *got, len - *got);
+        if(n < 0 && errno == EINTR){
+            return -2;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        *got += n;
+    }
+    return 0;
+}
+
+/*
+ * Stop for an upgrade partway through a frame (see upgrade_park()).  What
+ * goes along with the connection is the frame as it would be read again: its
+ * header, with the length of just the payload kept and what is still to come,
+ * and the payload kept so far.
+ *
+ * @param cmd  The header, in host byte order.
+ * @param kept  Bytes of payload read and kept.
+ * @param left  Bytes of payload still to come, beyond those.
+ * @return 0 to carry on reading, or -1 if the connection is to be dropped.
+ */
+static int proto_park(int fd, const PROTO_CMD *cmd, const char *payload, size_t kept, size_t left) {
+    char frame[sizeof(PROTO_CMD) + PROTO_MAX_PAYLOAD + 1];
+    PROTO_CMD wire = *cmd;
+    wire.len = htons(kept + left);
+    wire.ext = htonl(cmd->ext);
+    if(kept > sizeof(frame) - sizeof(wire)){
+        return -1;
+    }
+    memcpy(frame, &wire, sizeof(wire));
+    memcpy(frame + sizeof(wire), payload, kept);
+    return upgrade_park(fd, frame, sizeof(wire) + kept, 0);
+}
+
+/*
+ * Read the next command frame from a binary client.  The header's fields come
+ * back in host byte order, and the payload NUL terminated.  Any payload beyond
+ * size - 1 bytes is read and dropped.
+ *
+ * @param fd  The connection.
+ * @param cmd  Filled in with the header.
+ * @param payload  Filled in with the payload.
+ * @param size  Size of payload, at least 1.
+ * @return the number of bytes of payload kept, or -1 if the connection ended.
+ */
+ssize_t proto_read_cmd(int fd, PROTO_CMD *cmd, char *payload, size_t size) {
+    size_t got = 0;
+    int ret;
+    //Interrupted to stop for an upgrade, the bytes read so far go along with the connection
+    while((ret = proto_read_full(fd, cmd, sizeof(*cmd), &got)) == -2){
+        if(upgrade_park(fd, cmd, got, 0) < 0){
+            return -1;
+        }
+    }
+    if(ret < 0){
+        return -1;
+    }
+    cmd->len = ntohs(cmd->len);
+    cmd->ext = ntohl(cmd->ext);
+    size_t keep = cmd->len < size - 1 ? cmd->len : size - 1;
+    got = 0;
+    while((ret = proto_read_full(fd, payload, keep, &got)) == -2){
+        if(proto_park(fd, cmd, payload, got, cmd->len - got) < 0){
+            return -1;
+        }
+    }
+    if(ret < 0){
+        return -1;
+    }
+    payload[keep] = '\0';
+    char skip[256];
+    for(size_t left = cmd->len - keep; left > 0; ){
+        size_t n = left < sizeof(skip) ? left : sizeof(skip);
+        got = 0;
+        while((ret = proto_read_full(fd, skip, n, &got)) == -2){
+            if(proto_park(fd, cmd, payload, keep, left - got) < 0){
+                return -1;
+            }
+        }
+        if(ret < 0){
+            return -1;
+        }
+        left -= n;
+    }
+    return keep;
+}
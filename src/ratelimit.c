@@ -0,0 +1,211 @@
+/*
+ * Token buckets for admission control (-A) and command rate limiting (-C).
+ */
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+#include "config.h"
+#include "debug.h"
+
+_Static_assert((RATELIMIT_SETS & (RATELIMIT_SETS - 1)) == 0, "RATELIMIT_SETS must be a power of 2");
+
+typedef struct rl_bucket {
+    uint64_t key;
+    uint64_t last_ms;    //When it was last refilled; 0 if the bucket is unused
+    int64_t tokens;      //Thousandths of a token
+} RL_BUCKET;
+
+typedef struct rl_table {
+    RL_BUCKET buckets[RATELIMIT_SETS * RATELIMIT_WAYS];
+    sem_t locks[RATELIMIT_STRIPES];
+} RL_TABLE;
+
+static RL_TABLE sources;
+static RL_TABLE connections;
+static pthread_once_t ratelimit_once = PTHREAD_ONCE_INIT;
+static atomic_long num_admitted, num_refused, num_commands, num_throttled, num_evicted;
+
+static void ratelimit_setup(void) {
+    for(int i = 0; i < RATELIMIT_STRIPES; i++){
+        sem_init(&sources.locks[i], 0, 1);
+        sem_init(&connections.locks[i], 0, 1);
+    }
+}
+
+static uint64_t ratelimit_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    //Never 0, which marks an unused bucket
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+/*
+ * Spread keys over the sets, so that neighbouring addresses and descriptors
+ * don't all land in the same few.
+ */
+static uint64_t ratelimit_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/*
+ * Find the bucket for a key in its set, or give it one.  Must be called with
+ * the set's stripe locked.
+ */
+static RL_BUCKET *ratelimit_bucket(RL_TABLE *table, size_t set, uint64_t key, int burst) {
+    RL_BUCKET *ways = &table->buckets[set * RATELIMIT_WAYS];
+    RL_BUCKET *oldest = &ways[0];
+    for(int i = 0; i < RATELIMIT_WAYS; i++){
+        if(ways[i].last_ms != 0 && ways[i].key == key){
+            return &ways[i];
+        }
+        if(ways[i].last_ms < oldest->last_ms){
+            oldest = &ways[i];
+        }
+    }
+    if(oldest->last_ms != 0){
+        atomic_fetch_add(&num_evicted, 1);
+    }
+    oldest->key = key;
+    oldest->last_ms = 0;
+    oldest->tokens = (int64_t)burst * 1000;
+    return oldest;
+}
+
+/*
+ * Take a token from a key's bucket, after refilling it for the time since it
+ * was last used.
+ *
+ * @param table  The table the bucket is in.
+ * @param key  What is being limited.
+ * @param rate  Tokens added a second.
+ * @param burst  Most tokens the bucket holds.
+ * @return 1 if there was a token to take, 0 if not.
+ */
+static int ratelimit_take(RL_TABLE *table, uint64_t key, int rate, int burst) {
+    pthread_once(&ratelimit_once, ratelimit_setup);
+    uint64_t now = ratelimit_now_ms();
+    size_t set = ratelimit_hash(key) & (RATELIMIT_SETS - 1);
+    sem_t *lock = &table->locks[set % RATELIMIT_STRIPES];
+    sem_wait(lock);
+    RL_BUCKET *b = ratelimit_bucket(table, set, key, burst);
+    if(b->last_ms != 0 && now > b->last_ms){
+        //A token a second per unit of rate is a thousandth of a token a millisecond
+        b->tokens += (int64_t)(now - b->last_ms) * rate;
+        if(b->tokens > (int64_t)burst * 1000){
+            b->tokens = (int64_t)burst * 1000;
+        }
+    }
+    b->last_ms = now;
+    int ok = b->tokens >= 1000;
+    if(ok){
+        b->tokens -= 1000;
+    }
+    sem_post(lock);
+    return ok;
+}
+
+/*
+ * Decide whether a new connection may be served, as it is accepted.
+ *
+ * @param addr  The address it came from.
+ * @return 1 if it may, 0 if its source has gone over the -A limit and it
+ * should be closed.
+ */
+int ratelimit_admit(const struct sockaddr *addr) {
+    if(pbx_config.admit_rate <= 0 || addr == NULL){
+        return 1;
+    }
+    uint64_t key;
+    if(addr->sa_family == AF_INET){
+        key = ntohl(((struct sockaddr_in *)addr)->sin_addr.s_addr);
+    }else if(addr->sa_family == AF_INET6){
+        const struct in6_addr *a6 = &((struct sockaddr_in6 *)addr)->sin6_addr;
+        if(IN6_IS_ADDR_V4MAPPED(a6)){
+            uint32_t v4;
+            memcpy(&v4, &a6->s6_addr[12], sizeof(v4));
+            key = ntohl(v4);
+        }else{
+            //The /64 prefix, with the top bit set so it can't be taken for an IPv4 address
+            memcpy(&key, a6->s6_addr, sizeof(key));
+            key |= (uint64_t)1 << 63;
+        }
+    }else{
+        return 1;
+    }
+    if(ratelimit_take(&sources, key, pbx_config.admit_rate, pbx_config.admit_burst)){
+        atomic_fetch_add(&num_admitted, 1);
+        return 1;
+    }
+    atomic_fetch_add(&num_refused, 1);
+    debug("Refusing connection: source over its limit");
+    return 0;
+}
+
+/*
+ * Start a new connection off with a full bucket of commands, rather than
+ * whatever an earlier connection with the same descriptor left behind.
+ *
+ * @param fd  The connection.
+ */
+void ratelimit_connected(int fd) {
+    if(pbx_config.command_rate <= 0){
+        return;
+    }
+    pthread_once(&ratelimit_once, ratelimit_setup);
+    uint64_t key = (uint64_t)fd;
+    size_t set = ratelimit_hash(key) & (RATELIMIT_SETS - 1);
+    sem_t *lock = &connections.locks[set % RATELIMIT_STRIPES];
+    sem_wait(lock);
+    RL_BUCKET *b = ratelimit_bucket(&connections, set, key, pbx_config.command_burst);
+    b->tokens = (int64_t)pbx_config.command_burst * 1000;
+    b->last_ms = ratelimit_now_ms();
+    sem_post(lock);
+}
+
+/*
+ * Decide whether a command from a client may be carried out.
+ *
+ * @param fd  The client's connection.
+ * @return 1 if it may, 0 if the connection has gone over the -C limit and
+ * the command should be refused.
+ */
+int ratelimit_command(int fd) {
+    if(pbx_config.command_rate <= 0){
+        return 1;
+    }
+    if(ratelimit_take(&connections, (uint64_t)fd, pbx_config.command_rate, pbx_config.command_burst)){
+        atomic_fetch_add(&num_commands, 1);
+        return 1;
+    }
+    atomic_fetch_add(&num_throttled, 1);
+    return 0;
+}
+
+/*
+ * Get counts of what the limits have let through and held back.
+ *
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int ratelimit_get_stats(RATELIMIT_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->admitted = atomic_load(&num_admitted);
+    stats->refused = atomic_load(&num_refused);
+    stats->commands = atomic_load(&num_commands);
+    stats->throttled = atomic_load(&num_throttled);
+    stats->evicted = atomic_load(&num_evicted);
+    return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Extensions kept across a restart, in a memory-mapped file (see regmap.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+
+#include "regmap.h"
+#include "pbx_extra.h"
+#include "timer.h"
+#include "debug.h"
+
+_Static_assert(sizeof(REGMAP_FILE_HEADER) == 32, "REGMAP_FILE_HEADER is part of the file format");
+_Static_assert(sizeof(REGMAP_ENTRY) == 16, "REGMAP_ENTRY is part of the file format");
+
+static char* map;                   //NULL unless -k was given
+static size_t map_size;
+static REGMAP_FILE_HEADER* header;
+static REGMAP_ENTRY* entries;
+static _Atomic uint32_t* slots;     //The index
+static uint32_t index_mask;
+static int index_bits;
+static uint32_t this_run;
+static PBX* regmap_pbx;             //Whose allocator the kept extensions are held in
+static atomic_long num_kept, num_claimed, num_expired, num_unindexed;
+
+/*
+ * The fields of an entry, which are shared with whoever maps the file next.
+ */
+static _Atomic uint64_t *entry_token(uint32_t off) {
+    return (_Atomic uint64_t *)&entries[off].token;
+}
+
+static _Atomic uint32_t *entry_run(uint32_t off) {
+    return (_Atomic uint32_t *)&entries[off].run;
+}
+
+/*
+ * Where a token's probes of the index start (tokens are random, but only the
+ * top bits of a Fibonacci hash are used so that no bits are favoured).
+ */
+static uint32_t regmap_home(uint64_t token) {
+    return (uint32_t)((token * 0x9e3779b97f4a7c15ULL) >> (64 - index_bits));
+}
+
+/*
+ * Index an extension under its token.
+ *
+ * @return 0 if successful, -1 if there was no room within REGMAP_MAX_PROBES.
+ */
+static int regmap_index_add(uint64_t token, uint32_t off) {
+    uint32_t home = regmap_home(token);
+    for(int i = 0; i < REGMAP_MAX_PROBES; i++){
+        _Atomic uint32_t *slot = &slots[(home + i) & index_mask];
+        uint32_t was = atomic_load(slot);
+        //Slots left by phones that have gone are reused
+        if((was == 0 || was == REGMAP_GONE) && atomic_compare_exchange_strong(slot, &was, off + 1)){
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void regmap_index_remove(uint64_t token, uint32_t off) {
+    uint32_t home = regmap_home(token);
+    for(int i = 0; i < REGMAP_MAX_PROBES; i++){
+        _Atomic uint32_t *slot = &slots[(home + i) & index_mask];
+        uint32_t was = atomic_load(slot);
+        if(was == 0){
+            return;
+        }
+        //Not back to 0: that would cut short the probes of tokens indexed past it
+        if(was == off + 1 && atomic_compare_exchange_strong(slot, &was, REGMAP_GONE)){
+            return;
+        }
+    }
+}
+
+/*
+ * The offset of the extension with a token, or -1 if none has it.  Whatever
+ * the index says is checked against the entry it points to.
+ */
+static int64_t regmap_index_find(uint64_t token) {
+    uint32_t home = regmap_home(token);
+    for(int i = 0; i < REGMAP_MAX_PROBES; i++){
+        uint32_t was = atomic_load(&slots[(home + i) & index_mask]);
+        if(was == 0){
+            break;
+        }
+        if(was != REGMAP_GONE && was - 1 < (uint32_t)header->count
+           && atomic_load(entry_token(was - 1)) == token){
+            return was - 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Map the file, making it afresh if it doesn't hold a map for this range of
+ * extensions.
+ *
+ * @param path  The file.
+ * @param first  The first extension in the range.
+ * @param count  How many extensions there are.
+ * @param new_run  Whether this is a new run of the server, which keeps what
+ * was registered before, rather than one taking over from the server that was
+ * recording it (see upgrade.h).
+ * @return 0 if successful, otherwise -1.
+ */
+int regmap_init(const char *path, int first, int count, int new_run) {
+    if(map != NULL || path == NULL || count <= 0){
+        return -1;
+    }
+    uint32_t index_size = 1;
+    int bits = 0;
+    while(index_size < 2 * (uint32_t)count){
+        index_size <<= 1;
+        bits++;
+    }
+    size_t size = sizeof(REGMAP_FILE_HEADER) + (size_t)count * sizeof(REGMAP_ENTRY)
+                  + (size_t)index_size * sizeof(uint32_t);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0){
+        return -1;
+    }
+    struct stat st;
+    REGMAP_FILE_HEADER old;
+    int valid = fstat(fd, &st) == 0 && (size_t)st.st_size == size
+                && pread(fd, &old, sizeof(old), 0) == sizeof(old)
+                && memcmp(old.magic, REGMAP_MAGIC, sizeof(old.magic)) == 0
+                && old.version == REGMAP_VERSION && old.first == first && old.count == count
+                && old.index_size == index_size;
+    //Emptied by the kernel rather than by writing every page of it
+    if(!valid && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)){
+        close(fd);
+        return -1;
+    }
+    char *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED){
+        return -1;
+    }
+    header = (REGMAP_FILE_HEADER *)m;
+    if(!valid){
+        memcpy(header->magic, REGMAP_MAGIC, sizeof(header->magic));
+        header->version = REGMAP_VERSION;
+        header->first = first;
+        header->count = count;
+        header->index_size = index_size;
+    }
+    if(new_run && ++header->run == 0){
+        header->run = 1;
+    }
+    this_run = header->run;
+    entries = (REGMAP_ENTRY *)(m + sizeof(REGMAP_FILE_HEADER));
+    slots = (_Atomic uint32_t *)(m + sizeof(REGMAP_FILE_HEADER) + (size_t)count * sizeof(REGMAP_ENTRY));
+    index_mask = index_size - 1;
+    index_bits = bits > 0 ? bits : 1;
+    map_size = size;
+    map = m;
+    debug("Registry map '%s', run %u", path, this_run);
+    return 0;
+}
+
+/*
+ * Unmap the file, leaving it as it is.
+ */
+void regmap_fini(void) {
+    if(map != NULL){
+        munmap(map, map_size);
+        map = NULL;
+    }
+}
+
+/*
+ * Whether registrations are being recorded (-k).
+ */
+int regmap_enabled(void) {
+    return map != NULL;
+}
+
+/*
+ * Timer function giving up the extensions nobody came back for.
+ */
+static int regmap_expire(void *arg) {
+    for(uint32_t off = 0; off < (uint32_t)header->count; off++){
+        uint32_t run = atomic_load(entry_run(off));
+        uint64_t token = atomic_load(entry_token(off));
+        //Taken from under a client that is claiming it at this moment, it stays theirs
+        if(token == 0 || run == this_run || !atomic_compare_exchange_strong(entry_run(off), &run, this_run)){
+            continue;
+        }
+        atomic_store(entry_token(off), 0);
+        regmap_index_remove(token, off);
+        pbx_release_extension(regmap_pbx, header->first + off);
+        atomic_fetch_add(&num_expired, 1);
+    }
+    return 0;
+}
+
+/*
+ * Keep the extensions that were registered before the server started out of
+ * the PBX's allocator, for their clients to come back to, until
+ * REGMAP_KEEP_MS from now.  Must be called before anybody is registered,
+ * apart from clients taken over in an upgrade.
+ *
+ * @param pbx  The PBX.
+ * @return how many extensions are kept.
+ */
+int regmap_reserve(PBX *pbx) {
+    if(map == NULL){
+        return 0;
+    }
+    regmap_pbx = pbx;
+    int kept = 0;
+    for(uint32_t off = 0; off < (uint32_t)header->count; off++){
+        uint64_t token = atomic_load(entry_token(off));
+        if(token == 0 || atomic_load(entry_run(off)) == this_run){
+            continue;
+        }
+        if(pbx_claim_extension(pbx, header->first + off) < 0){
+            atomic_store(entry_token(off), 0);
+            regmap_index_remove(token, off);
+            continue;
+        }
+        kept++;
+    }
+    atomic_fetch_add(&num_kept, kept);
+    if(kept > 0 && timer_arm(REGMAP_KEEP_MS, regmap_expire, NULL) == 0){
+        //No timer: they are kept until claimed
+        debug("Kept extensions will not expire");
+    }
+    return kept;
+}
+
+/*
+ * Record the token of a phone registered at an extension.  Only stores into
+ * the map.
+ *
+ * @param ext  The extension.
+ * @param token  The phone's token.
+ */
+void regmap_store(int ext, uint64_t token) {
+    if(map == NULL || ext < header->first || ext - header->first >= header->count || token == 0){
+        return;
+    }
+    uint32_t off = ext - header->first;
+    //Claimed from before: it is recorded already
+    if(atomic_load(entry_token(off)) == token){
+        atomic_store(entry_run(off), this_run);
+        return;
+    }
+    atomic_store(entry_run(off), this_run);
+    atomic_store(entry_token(off), token);
+    if(regmap_index_add(token, off) < 0){
+        atomic_store(entry_token(off), 0);
+        atomic_fetch_add(&num_unindexed, 1);
+    }
+}
+
+/*
+ * Forget the phone at an extension, which has been unregistered.
+ *
+ * @param ext  The extension.
+ */
+void regmap_clear(int ext) {
+    if(map == NULL || ext < header->first || ext - header->first >= header->count){
+        return;
+    }
+    uint32_t off = ext - header->first;
+    uint64_t token = atomic_exchange(entry_token(off), 0);
+    if(token != 0){
+        regmap_index_remove(token, off);
+    }
+}
+
+/*
+ * Claim the extension kept for a client that has come back with its token.
+ * The extension is already taken in the allocator, and is the caller's to
+ * register the client's new phone at (or to give up with regmap_clear() and
+ * pbx_release_extension()).
+ *
+ * @param token  The token the client gave.
+ * @return the extension, or -1 if none was kept for that token.
+ */
+int regmap_claim(uint64_t token) {
+    if(map == NULL || token == 0){
+        return -1;
+    }
+    int64_t off = regmap_index_find(token);
+    if(off < 0){
+        return -1;
+    }
+    uint32_t run = atomic_load(entry_run(off));
+    if(run == this_run || !atomic_compare_exchange_strong(entry_run(off), &run, this_run)){
+        return -1;
+    }
+    atomic_fetch_add(&num_claimed, 1);
+    return header->first + off;
+}
+
+/*
+ * Get statistics about the extensions kept across a restart.
+ *
+ * @param stats  Filled in with the statistics.
+ * @return 0 if successful, otherwise -1.
+ */
+int regmap_get_stats(REGMAP_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->kept = atomic_load(&num_kept);
+    stats->claimed = atomic_load(&num_claimed);
+    stats->expired = atomic_load(&num_expired);
+    stats->unindexed = atomic_load(&num_unindexed);
+    return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * Resume tokens, and phones held for their clients to come back.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "pbx.h"
+#include "resume.h"
+#include "debug.h"
+
+#define RESUME_BUCKETS 256
+
+/*
+ * The token of a TU, found by token on one chain and by TU on the other.  An
+ * entry holds a reference to its TU only while it is held.
+ */
+typedef struct resume_entry {
+    uint64_t token;
+    TU* tu;
+    PBX* pbx; //Set while held
+    uint64_t deadline_ms;
+    struct resume_entry* next_by_token;
+    struct resume_entry* next_by_tu;
+} RESUME_ENTRY;
+
+static RESUME_ENTRY* by_token[RESUME_BUCKETS];
+static RESUME_ENTRY* by_tu[RESUME_BUCKETS];
+static sem_t resume_mutex;
+static _Atomic int num_tokens;
+static _Atomic int num_held;
+static pthread_once_t resume_once = PTHREAD_ONCE_INIT;
+
+static void *resume_thread(void *arg);
+
+static void resume_setup(void) {
+    sem_init(&resume_mutex, 0, 1);
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, resume_thread, NULL) != 0){
+        //Held phones then stay held until their clients come back or the server shuts down
+        debug("Resume thread could not be started");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static uint64_t resume_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static RESUME_ENTRY **token_bucket(uint64_t token) {
+    return &by_token[token % RESUME_BUCKETS];
+}
+
+static RESUME_ENTRY **tu_bucket(TU *tu) {
+    return &by_tu[((uintptr_t)tu / 64) % RESUME_BUCKETS];
+}
+
+/*
+ * Take an entry off both chains.  Must be called with the table locked.
+ */
+static void resume_unlink(RESUME_ENTRY *entry) {
+    atomic_fetch_sub(&num_tokens, 1);
+    RESUME_ENTRY **p = token_bucket(entry->token);
+    while(*p != entry){
+        p = &(*p)->next_by_token;
+    }
+    *p = entry->next_by_token;
+    p = tu_bucket(entry->tu);
+    while(*p != entry){
+        p = &(*p)->next_by_tu;
+    }
+    *p = entry->next_by_tu;
+}
+
+static RESUME_ENTRY *resume_find_tu(TU *tu) {
+    RESUME_ENTRY *entry = *tu_bucket(tu);
+    while(entry != NULL && entry->tu != tu){
+        entry = entry->next_by_tu;
+    }
+    return entry;
+}
+
+static RESUME_ENTRY *resume_find_token(uint64_t token) {
+    RESUME_ENTRY *entry = *token_bucket(token);
+    while(entry != NULL && entry->token != token){
+        entry = entry->next_by_token;
+    }
+    return entry;
+}
+
+/*
+ * Get the resume token of a TU, making one up the first time.
+ * Never blocks for long, so it may be called with TUs locked.
+ *
+ * @param tu  The TU.
+ * @param token  Set to its token.
+ * @return 0 if successful, otherwise -1.
+ */
+int resume_token(TU *tu, uint64_t *token) {
+    pthread_once(&resume_once, resume_setup);
+    sem_wait(&resume_mutex);
+    RESUME_ENTRY *entry = resume_find_tu(tu);
+    if(entry == NULL && (entry = calloc(1, sizeof(RESUME_ENTRY))) != NULL){
+        do {
+            if(getrandom(&entry->token, sizeof(entry->token), GRND_NONBLOCK) != sizeof(entry->token)){
+                //Not guessable, but at least unique
+                entry->token = ((uint64_t)rand() << 32) ^ resume_now_ms() ^ (uintptr_t)tu;
+            }
+        } while(entry->token == 0 || resume_find_token(entry->token) != NULL);
+        entry->tu = tu;
+        entry->next_by_token = *token_bucket(entry->token);
+        *token_bucket(entry->token) = entry;
+        entry->next_by_tu = *tu_bucket(tu);
+        *tu_bucket(tu) = entry;
+        atomic_fetch_add(&num_tokens, 1);
+    }
+    if(entry != NULL){
+        *token = entry->token;
+    }
+    sem_post(&resume_mutex);
+    return entry != NULL ? 0 : -1;
+}
+
+/*
+ * Give a TU a token it had before, instead of making one up (see regmap.h).
+ *
+ * @param tu  The TU, which has no token yet.
+ * @param token  The token.
+ * @return 0 if successful, -1 if the TU has a token already or another has
+ * this one.
+ */
+int resume_keep(TU *tu, uint64_t token) {
+    if(token == 0){
+        return -1;
+    }
+    pthread_once(&resume_once, resume_setup);
+    RESUME_ENTRY *entry = calloc(1, sizeof(RESUME_ENTRY));
+    if(entry == NULL){
+        return -1;
+    }
+    sem_wait(&resume_mutex);
+    if(resume_find_tu(tu) != NULL || resume_find_token(token) != NULL){
+        sem_post(&resume_mutex);
+        free(entry);
+        return -1;
+    }
+    entry->token = token;
+    entry->tu = tu;
+    entry->next_by_token = *token_bucket(token);
+    *token_bucket(token) = entry;
+    entry->next_by_tu = *tu_bucket(tu);
+    *tu_bucket(tu) = entry;
+    atomic_fetch_add(&num_tokens, 1);
+    sem_post(&resume_mutex);
+    return 0;
+}
+
+/*
+ * Hold a registered TU whose connection has dropped, for its client to resume.
+ * The PBX's reference to the TU is kept until it is resumed, or the grace
+ * period runs out and it is unregistered.
+ *
+ * @param pbx  The PBX the TU is registered with.
+ * @param tu  The TU.
+ * @param grace_ms  How long to hold it.
+ * @return 0 if it is held, otherwise -1 (if it never had a token).
+ */
+int resume_hold(PBX *pbx, TU *tu, int grace_ms) {
+    pthread_once(&resume_once, resume_setup);
+    sem_wait(&resume_mutex);
+    RESUME_ENTRY *entry = resume_find_tu(tu);
+    if(entry != NULL){
+        entry->pbx = pbx;
+        entry->deadline_ms = resume_now_ms() + grace_ms;
+        atomic_fetch_add(&num_held, 1);
+    }
+    sem_post(&resume_mutex);
+    return entry != NULL ? 0 : -1;
+}
+
+/*
+ * Take back a held TU by its token.
+ *
+ * @param token  The token.
+ * @return the TU, which is no longer held and keeps its token, or NULL if no
+ * TU with that token is held.
+ */
+TU *resume_claim(uint64_t token) {
+    if(token == 0 || atomic_load(&num_held) == 0){
+        return NULL;
+    }
+    sem_wait(&resume_mutex);
+    RESUME_ENTRY *entry = resume_find_token(token);
+    TU *tu = NULL;
+    if(entry != NULL && entry->pbx != NULL){
+        tu = entry->tu;
+        entry->pbx = NULL;
+        atomic_fetch_sub(&num_held, 1);
+    }
+    sem_post(&resume_mutex);
+    return tu;
+}
+
+/*
+ * Forget the token of a TU when it is unregistered.
+ */
+void resume_forget(TU *tu) {
+    if(atomic_load(&num_tokens) == 0){
+        return; //Nobody ever got one, so don't touch the lock
+    }
+    sem_wait(&resume_mutex);
+    RESUME_ENTRY *entry = resume_find_tu(tu);
+    if(entry != NULL){
+        resume_unlink(entry);
+        if(entry->pbx != NULL){
+            atomic_fetch_sub(&num_held, 1);
+        }
+    }
+    sem_post(&resume_mutex);
+    free(entry);
+}
+
+/*
+ * Take every held TU whose time is up (or every one, if now is UINT64_MAX) off
+ * the table, for them to be unregistered.
+ *
+ * @return a list of their entries, linked by next_by_token.
+ */
+static RESUME_ENTRY *resume_expire(uint64_t now) {
+    RESUME_ENTRY *expired = NULL;
+    sem_wait(&resume_mutex);
+    for(int i = 0; i < RESUME_BUCKETS && atomic_load(&num_held) > 0; i++){
+        RESUME_ENTRY *entry = by_token[i];
+        while(entry != NULL){
+            RESUME_ENTRY *next = entry->next_by_token;
+            if(entry->pbx != NULL && entry->deadline_ms <= now){
+                resume_unlink(entry);
+                atomic_fetch_sub(&num_held, 1);
+                entry->next_by_token = expired;
+                expired = entry;
+            }
+            entry = next;
+        }
+    }
+    sem_post(&resume_mutex);
+    return expired;
+}
+
+static void resume_unregister(RESUME_ENTRY *expired) {
+    while(expired != NULL){
+        RESUME_ENTRY *entry = expired;
+        expired = entry->next_by_token;
+        debug("Held TU %p was not resumed in time", entry->tu);
+        pbx_unregister(entry->pbx, entry->tu);
+        free(entry);
+    }
+}
+
+static void *resume_thread(void *arg) {
+    while(1){
+        usleep(RESUME_TICK_MS * 1000);
+        if(atomic_load(&num_held) > 0){
+            resume_unregister(resume_expire(resume_now_ms()));
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Unregister every held TU at once, when the server shuts down.
+ */
+void resume_release_all(PBX *pbx) {
+    if(atomic_load(&num_held) == 0){
+        return;
+    }
+    resume_unregister(resume_expire(UINT64_MAX));
+}
@@ -4,15 +4,281 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include "debug.h"
 #include "pbx.h"
+#include "pbx_extra.h"
 #include "server.h"
+#include "server_extra.h"
+#include "conf.h"
+#include "hunt.h"
+#include "presence.h"
+#include "msglog.h"
+#include "config.h"
+#include "resume.h"
+#include "regmap.h"
+#include "timer.h"
+#include "coro.h"
+#include "proto.h"
+#include "local.h"
+#include "ratelimit.h"
+#include "shard.h"
+#include "upgrade.h"
+#include "tu_extra.h"
 #include "csapp.h" 
+#include <time.h>
+#include <stdatomic.h>
+#include <endian.h>
 /*
  * Thread function for the thread that handles interaction with a client TU.
  * This is called after a network connection has been made via the main server
  * thread and a new thread has been created to handle the connection.
  */
+static char *tu_extra_command_names[] = TU_EXTRA_COMMAND_NAMES;
+
+/*
+ * What the idle timer of a connection needs to know, kept on the stack of its
+ * service thread, which cancels the timer before it returns.
+ */
+typedef struct client_idle {
+    int fd;
+    uint32_t timer;                  //The timer, 0 if there is none
+    _Atomic uint64_t last_active_ms; //When the client last sent a command
+} CLIENT_IDLE;
+
+static uint64_t pbx_client_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Idle timer of a connection: rather than being re-armed on every command, it
+ * fires once per timeout and arms itself again for whatever is left of it, so
+ * a busy client costs a clock read per command.  A client that has been quiet
+ * for the whole timeout is shut out; its service thread then sees EOF and
+ * unplugs (or holds) its phone as usual.
+ */
+static int pbx_client_idle(void *arg) {
+    CLIENT_IDLE *idle = arg;
+    uint64_t quiet = pbx_client_now_ms() - atomic_load(&idle->last_active_ms);
+    if(quiet < (uint64_t)pbx_config.idle_timeout_ms){
+        return pbx_config.idle_timeout_ms - quiet;
+    }
+    debug("Connection %d has been idle for %lu ms", idle->fd, (unsigned long)quiet);
+    shutdown(idle->fd, SHUT_RDWR);
+    return 0;
+}
+
+/*
+ * See whether a new connection opens with "resume <token>" for a held TU, and
+ * if so hand the connection to that TU instead of registering a new one; or
+ * for an extension kept since before a restart (see regmap.h), and if so
+ * register a new TU there.  The line is only taken off the connection if it
+ * resumes something; otherwise it is left for the service loop, which answers
+ * it once a new TU is registered.
+ *
+ * @param fd  The new connection.
+ * @return the resumed TU, or NULL if a new one should be registered.
+ */
+static TU *pbx_client_resume(int fd) {
+    if(pbx_config.resume_grace_ms <= 0 && !regmap_enabled()){
+        return NULL;
+    }
+    char line[64];
+    ssize_t n = coro_peek(fd, line, sizeof(line) - 1, RESUME_PEEK_MS);
+    if(n <= 0){
+        return NULL;
+    }
+    line[n] = '\0';
+    char *eol = strchr(line, '\n');
+    size_t name_len = strlen(tu_extra_command_names[TU_RESUME_CMD - TU_EXTRA_CMD_FIRST]);
+    if(eol == NULL || strncmp(line, tu_extra_command_names[TU_RESUME_CMD - TU_EXTRA_CMD_FIRST], name_len) != 0 || line[name_len] != ' '){
+        return NULL;
+    }
+    char* end;
+    unsigned long long token = strtoull(line + name_len, &end, 16);
+    if(*end != '\r' && *end != '\n'){
+        return NULL;
+    }
+    TU* held = pbx_rebind(pbx, fd, token);
+    if(held == NULL && regmap_enabled() && (held = tu_init(fd)) != NULL
+       && pbx_register_kept(pbx, held, token) < 0){
+        tu_unref(held, "No extension kept");
+        held = NULL;
+    }
+    if(held != NULL){
+        //Only now is the line ours to take
+        coro_read(fd, line, eol - line + 1);
+    }
+    return held;
+}
+
+static void pbx_client_serve(int connfdp);
+
+/*
+ * Parse the extension number a command is given, after any spaces: a number
+ * from 1 to INT_MAX, followed by the end of the line, or by a space if more
+ * may follow it.
+ *
+ * @param arg  The command's argument.
+ * @param rest  Set to whatever follows the extension, past any spaces, or NULL
+ * if nothing may follow it.
+ * @return the extension, or -1 if there isn't a valid one.
+ */
+int pbx_client_extension(char *arg, char **rest) {
+    while(*arg == ' '){arg++;}
+    char* end;
+    errno = 0;
+    long val = strtol(arg, &end, 10);
+    //Checked before the cast, which would otherwise wrap 4294967297 round to 1
+    int valid = end != arg && errno != ERANGE && val > 0 && val <= INT_MAX;
+    if(rest != NULL){
+        valid = valid && (*end == '\0' || *end == ' ');
+        while(*end == ' '){end++;}
+        *rest = end;
+    }else{
+        valid = valid && *end == '\0';
+    }
+    return valid ? (int)val : -1;
+}
+
+/*
+ * Add a byte read from a text client to the command line being put together.
+ * A \r is skipped.  Whatever doesn't fit in the line is dropped, up to the
+ * newline, so the end of a line that is too long is never taken for a command
+ * of its own; the start of it is still carried out, a chat being cut short.
+ *
+ * @param line  The line so far, PBX_CLIENT_LINE_MAX bytes.
+ * @param len  The length of the line so far, updated.
+ * @param c  The byte.
+ * @return 1 if that was the newline, with the line NUL terminated, otherwise 0.
+ */
+int pbx_client_line(char *line, size_t *len, char c) {
+    if(c == '\n'){
+        line[*len] = '\0';
+        return 1;
+    }
+    if(c != '\r' && *len < PBX_CLIENT_LINE_MAX - 1){
+        line[(*len)++] = c;
+    }
+    return 0;
+}
+
+/*
+ * Close a client's connection once its service is done with it.
+ */
+static void pbx_client_close(int fd) {
+    //Before the descriptor can be reused by a connection an upgrade has to wait for
+    upgrade_leave(fd);
+    coro_close(fd);
+}
+
+/*
+ * Hand a client over to the worker serving the extension it has dialed, if
+ * that is another one (see shard.h).
+ *
+ * @param telephone  The client's TU.
+ * @param fd  The connection.
+ * @param ext  The extension dialed.
+ * @param hops  How many times this dial has been handed on already.
+ * @param idle  The connection's idle timer, which is cancelled first.
+ * @return 1 if the client has gone, 0 if it stays and the dial should be
+ * carried out here.
+ */
+static int pbx_client_move(TU *telephone, int fd, int ext, int hops, CLIENT_IDLE *idle) {
+    if(shard_route(telephone, ext, hops) < 0){
+        return 0;
+    }
+    //It mustn't fire on the descriptor once it has been closed and maybe reused
+    timer_cancel_wait(idle->timer);
+    idle->timer = 0;
+    if(shard_move(pbx, telephone, fd, ext, hops) == 0){
+        return 1;
+    }
+    if(pbx_config.idle_timeout_ms > 0){
+        idle->timer = timer_arm(pbx_config.idle_timeout_ms, pbx_client_idle, idle);
+    }
+    return 0;
+}
+
+/*
+ * The service loop for a client that has switched to binary framing (see
+ * proto.h), which runs until the connection ends.  Each command is carried
+ * out just as its text form would be, with its extension and text read from
+ * fixed places in the frame rather than parsed out of a line.
+ *
+ * @param telephone  The client's TU.
+ * @param fd  The connection.
+ * @param idle  The connection's idle timer.
+ * @return the TU the client ends up with (another one, if it resumed a held
+ * phone), or NULL if it has been handed to another worker.
+ */
+static TU *pbx_client_binary(TU *telephone, int fd, CLIENT_IDLE *idle) {
+    tu_set_binary(telephone);
+    PROTO_CMD cmd;
+    char payload[PROTO_MAX_PAYLOAD + 1];
+    ssize_t len;
+    while((len = proto_read_cmd(fd, &cmd, payload, sizeof(payload))) >= 0){
+        if(idle->timer != 0){
+            atomic_store_explicit(&idle->last_active_ms, pbx_client_now_ms(), memory_order_relaxed);
+        }
+        if(!ratelimit_command(fd)){
+            tu_send(telephone, "THROTTLED\n", 10);
+            continue;
+        }
+        //Extension 0 (or one too big to be real) is no extension, as an unparseable one is in text
+        int ext = cmd.ext > 0 && cmd.ext <= INT32_MAX ? (int)cmd.ext : -1;
+        switch(cmd.cmd){
+            case TU_PICKUP_CMD:
+                tu_pickup(telephone);
+                break;
+            case TU_HANGUP_CMD:
+                tu_hangup(telephone);
+                break;
+            case TU_DIAL_CMD:
+                if(pbx_client_move(telephone, fd, ext, 0, idle)){
+                    return NULL;
+                }
+                pbx_dial(pbx, telephone, ext);
+                break;
+            case TU_CHAT_CMD:
+                tu_chat(telephone, payload);
+                break;
+            case TU_CONF_CMD:
+                conf_create(pbx, telephone);
+                break;
+            case TU_HUNT_CMD:
+                if(cmd.ext == 0){
+                    hunt_create(pbx, telephone);
+                }else{
+                    hunt_join(ext, telephone);
+                }
+                break;
+            case TU_WATCH_CMD:
+                presence_watch(pbx, telephone, ext);
+                break;
+            case TU_MSG_CMD:
+                msglog_send(telephone, ext, payload);
+                break;
+            case TU_RESUME_CMD: {
+                uint64_t token = 0;
+                if(len == sizeof(token)){
+                    memcpy(&token, payload, sizeof(token));
+                    token = be64toh(token);
+                }
+                telephone = pbx_resume(pbx, telephone, token);
+                break;
+            }
+            default:
+                //Unknown commands are ignored, as they are in text
+                break;
+        }
+    }
+    return telephone;
+}
+
 //#if 0
 void *pbx_client_service(void *arg) {
     // TO BE IMPLEMENTED  
@@ -35,41 +301,131 @@ void *pbx_client_service(void *arg) {
     int connfdp = *((int *)arg); 
     pthread_detach(pthread_self());  
     free(arg); //This was malloced in our main.c as connfdp! 
-    //Initializing new TU
-    TU* telephone = tu_init(connfdp);   
-    //Registering TU 
-    pbx_register(pbx, telephone, connfdp);  
+    pbx_client_serve(connfdp);
+    return NULL;
+}
+
+/*
+ * Coroutine function for a coroutine that handles interaction with a client TU
+ * (with -l, instead of a thread).  It runs the same service loop as a thread
+ * does; coro_read() switches to other coroutines while the client is quiet.
+ *
+ * @param arg  Pointer to the file descriptor of the connection, malloc'ed by
+ * main.c, which is freed here.
+ */
+void pbx_client_coroutine(void *arg) {
+    if(arg == NULL){
+        return;
+    }
+    int connfdp = *((int *)arg);
+    free(arg);
+    pbx_client_serve(connfdp);
+}
+
+/*
+ * The service loop for a client connection, run on whichever thread or
+ * coroutine was set up for it.  Closes the connection before returning.
+ *
+ * @param connfdp  The connection.
+ */
+static void pbx_client_serve(int connfdp) {
+    upgrade_enter(connfdp);
+    //A local client running as someone not allowed in is turned away before it has a TU
+    if(!local_peer_allowed(connfdp)){
+        pbx_client_close(connfdp);
+        return;
+    }
+    ratelimit_connected(connfdp);
+    //A client handed over by another worker arrives with its phone off hook and a number to dial
+    TU* telephone;
+    int dial = -1;
+    int hops = 0;
+    int adopted = shard_adopt(pbx, connfdp, &telephone, &dial, &hops);
+    if(adopted < 0){
+        pbx_client_close(connfdp);
+        return;
+    }
+    //So does one taken over from the server this one replaced, with its phone as it was
+    int fresh = 0;
+    if(telephone == NULL && upgrade_adopt(connfdp, &telephone, &fresh)){
+        adopted = 1;
+    }
+    //A client coming back to a held phone carries on with it, without a new TU
+    if(telephone == NULL){
+        telephone = pbx_client_resume(connfdp);
+    }
+    if(telephone == NULL){
+        //Initializing new TU
+        telephone = tu_init(connfdp);   
+        if(telephone == NULL){
+            pbx_client_close(connfdp);
+            return;
+        }
+        //Registering TU, the PBX picks the extension number now rather than us using the fd!
+        if(pbx_register_auto(pbx, telephone) < 0){
+            tu_unref(telephone, "Registration failed");
+            pbx_client_close(connfdp);
+            return;
+        }
+    }
     //Now we can write the service loop! 
 
     //Setting up Buffers Before Entering While Loop 
     //One Buffer to Parse Commands and One Buffer For Chat MSGs + size_t to hold size of chat_msg (Going to use strncpy!)  
     //NEED TO DOUBLE CHECK BEHAVIOR OF DEMO WITH DIAL W/O SPACE! 
-    char cmd_buffer[1024]; 
-    char* chat_msg_buffer = NULL;  
-    size_t chat_msg_length = 0;  
+    char cmd_buffer[PBX_CLIENT_LINE_MAX]; 
+
+    //Dead clients that never close their end are shut out after a while, if asked
+    CLIENT_IDLE idle = { .fd = connfdp };
+    atomic_init(&idle.last_active_ms, pbx_client_now_ms());
+    if(pbx_config.idle_timeout_ms > 0){
+        idle.timer = timer_arm(pbx_config.idle_timeout_ms, pbx_client_idle, &idle);
+    }
 
-    while(1){
+    int eof = 0; //Set once the client has gone away, so we can unregister!
+    int first_byte = !adopted || fresh; //A binary client says so with its very first byte
+    int binary = adopted && tu_get_proto(telephone) == PROTO_BINARY;
+    if(dial > 0 && pbx_client_move(telephone, connfdp, dial, hops, &idle)){
+        //Handed on again: the extension moved while the client was on its way
+        eof = 1;
+        telephone = NULL;
+    }else if(dial > 0){
+        pbx_dial(pbx, telephone, dial);
+    }
+    while(!eof && !binary){
         //Need to 0 out our cmd_buffer (I could calloc it but that would require me to rmbr to free!) 
         memset(cmd_buffer, 0, sizeof(cmd_buffer));  
         //Now we need to read character by character until we hit what we need!  
         size_t total_read = 0; 
         char character; 
-        while(total_read < sizeof(cmd_buffer) - 1){ 
-            size_t curr_char = read(connfdp, &character, 1);  
-            //Checking Stream for end!  
+        while(1){ 
+            ssize_t curr_char = coro_read(connfdp, &character, 1);  
+            //Checking Stream for end! (read returns -1 on error, which a size_t never saw)
+            //Interrupted to stop for an upgrade, which the line read so far goes along with
+            if(curr_char < 0 && errno == EINTR && upgrade_park(connfdp, cmd_buffer, total_read, first_byte) == 0){
+                continue;
+            }
             if (curr_char <= 0){
+                eof = 1;
                 break; 
             }  
+            if(first_byte && (unsigned char)character == PROTO_MAGIC){
+                binary = 1;
+                break;
+            }
+            first_byte = 0;
             //Since we are reading byte by byte, I need to check for \n to break and \r I need to skip
-            if(character == '\n'){
+            if(pbx_client_line(cmd_buffer, &total_read, character)){
                 break; 
             } 
-            if(character == '\r'){
-                continue; 
-            } 
-            cmd_buffer[total_read++] = character; 
         } 
         cmd_buffer[total_read] = '\0'; 
+        if(binary){
+            break;
+        }
+        if(idle.timer != 0){
+            atomic_store_explicit(&idle.last_active_ms, pbx_client_now_ms(), memory_order_relaxed);
+        }
 
         //Now that we have what we read into our cmd_buffer as well as the total_number of bytes read we can use this! 
         // if(total_read <= 0){
@@ -84,6 +440,11 @@ void *pbx_client_service(void *arg) {
         if(total_read == 0){
             continue; 
         }  
+        //A client going over -C is told so, and the command goes no further
+        if(!ratelimit_command(connfdp)){
+            tu_send(telephone, "THROTTLED\n", 10);
+            continue;
+        }
         //Now we have to handle each case, TU_DIAL, TU_CHAT, TU_HANGUP, TU_PICKUP  
         //TU_PICKUP! 
         if(strcmp(cmd_buffer, tu_command_names[TU_PICKUP_CMD]) == 0){
@@ -100,42 +461,76 @@ void *pbx_client_service(void *arg) {
             if(*start_extension != ' '){
                 continue; 
             }
-            while(*start_extension == ' '){start_extension++;}   
                 //We check if it's a number! Otherwise we pass in -1 to PBX_DIAL and we'll make it return -1 if it sees that! 
-                int num_flag = 0;  
-                int ext = 0;
-                char* end; 
-                long val = strtol(start_extension, &end, 10); 
-                if (*end != '\0' || val <= 0) { 
-                    num_flag = -1; 
-                }
-                if(num_flag == -1){
-                    ext = -1; //We will pass this into PBX_DIAL and check for it! 
-                }else{
-                    ext = (int)val; 
+                int ext = pbx_client_extension(start_extension, NULL);
+                //Unless it is being served by another worker, which the client moves to
+                if(pbx_client_move(telephone, connfdp, ext, 0, &idle)){
+                    telephone = NULL;
+                    break;
                 }
                 if(pbx_dial(pbx, telephone, ext)< 0){ 
                     // break; This break statement broke my code/ended the connection when it shouldnt! 
                 }
         } 
         else if(strncmp(cmd_buffer, tu_command_names[TU_CHAT_CMD], strlen(tu_command_names[TU_CHAT_CMD])) == 0){ 
-            //This is when we use chat_msg_buffer! 
+            //The message is already NUL terminated in cmd_buffer, so it is passed straight
+            //through instead of being copied into a malloc'ed buffer for every chat!
             char* chat_msg = cmd_buffer + 4;  
             while(*chat_msg == ' '){chat_msg++;}    
-            free(chat_msg_buffer); 
-            chat_msg_buffer = NULL; 
-            chat_msg_length = 0;  
-            chat_msg_length = strlen(chat_msg) + 1; 
-            chat_msg_buffer = malloc(chat_msg_length); 
-            strncpy(chat_msg_buffer, chat_msg, chat_msg_length); 
-            chat_msg_buffer[chat_msg_length-1] = '\0'; 
-            tu_chat(telephone, chat_msg_buffer); 
+            tu_chat(telephone, chat_msg); 
+        }
+        //Conference: set up a bridge that others can join by dialing its extension
+        else if(strcmp(cmd_buffer, tu_extra_command_names[TU_CONF_CMD - TU_EXTRA_CMD_FIRST]) == 0){
+            conf_create(pbx, telephone);
+        }
+        //Hunt groups: "hunt" starts one with us in it, "hunt <ext>" joins an existing one
+        else if(strcmp(cmd_buffer, tu_extra_command_names[TU_HUNT_CMD - TU_EXTRA_CMD_FIRST]) == 0){
+            hunt_create(pbx, telephone);
+        }
+        else if(strncmp(cmd_buffer, tu_extra_command_names[TU_HUNT_CMD - TU_EXTRA_CMD_FIRST], 4) == 0 && cmd_buffer[4] == ' '){
+            hunt_join(pbx_client_extension(cmd_buffer + 4, NULL), telephone);
+        }
+        //Presence: "watch <ext>" sends us that extension's state now and whenever it changes
+        else if(strncmp(cmd_buffer, tu_extra_command_names[TU_WATCH_CMD - TU_EXTRA_CMD_FIRST], 5) == 0 && cmd_buffer[5] == ' '){
+            presence_watch(pbx, telephone, pbx_client_extension(cmd_buffer + 5, NULL));
         }
+        //Messages: "msg <ext> <text>" leaves a message to be delivered when that extension next picks up
+        else if(strncmp(cmd_buffer, tu_extra_command_names[TU_MSG_CMD - TU_EXTRA_CMD_FIRST], 3) == 0 && cmd_buffer[3] == ' '){
+            char* text;
+            int ext = pbx_client_extension(cmd_buffer + 3, &text);
+            msglog_send(telephone, ext, text);
+        }
+        //Resume: "resume <token>" takes back a phone held since its connection dropped
+        else if(strncmp(cmd_buffer, tu_extra_command_names[TU_RESUME_CMD - TU_EXTRA_CMD_FIRST], 6) == 0 && cmd_buffer[6] == ' '){
+            char* start_token = cmd_buffer + 6;
+            while(*start_token == ' '){start_token++;}
+            char* end;
+            unsigned long long token = strtoull(start_token, &end, 16);
+            telephone = pbx_resume(pbx, telephone, (*end != '\0' || end == start_token) ? 0 : token);
+        }
+    }
+    if(binary && telephone != NULL){
+        //Frames from here on, until the client goes away
+        telephone = pbx_client_binary(telephone, connfdp, &idle);
+    }
+    //Before the descriptor is closed and can be reused, and before idle goes away
+    timer_cancel_wait(idle.timer);
+    if(telephone == NULL){
+        //Handed to another worker, connection and all
+        return;
+    }
+    //The phone may be held for its client to come back
+    if(pbx_hold(pbx, telephone) == 0){
+        pbx_client_close(connfdp);
+        return;
     }
-    free(chat_msg_buffer); 
-    close(connfdp);  
+    //Unregistered first, so its last notifications can't go to a new connection given the same descriptor
+    int ext = tu_extension(telephone);
     pbx_unregister(pbx, telephone); 
+    //Its number goes back to the worker it came from, if it moved here
+    shard_release(pbx, ext);
+    pbx_client_close(connfdp);  
     //tu_unref(telephone, "ENDED Server/Thread!");  //Maybe I want to move this into pbx_unregister! 
-    return NULL;  
+    return;  
 }
 
@@ -0,0 +1,972 @@
+/*
+ * Worker processes (-w), each serving a slice of the extensions, and the
+ * handing over of clients between them.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netdb.h>
+
+#include "shard.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "config.h"
+#include "coro.h"
+#include "local.h"
+#include "upgrade.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define SHARD_MOVE 1      //Here is a client, already off hook, that dialed one of yours
+#define SHARD_RELEASE 2   //A client of one of your extensions has gone
+
+/*
+ * What goes through a worker's inbox.  A MOVE carries the connection as
+ * SCM_RIGHTS and the input read ahead of the dial after the message.
+ */
+typedef struct shard_msg {
+    int type;
+    int ext;      //The client's extension
+    int dial;     //MOVE: the extension it dialed
+    int proto;    //MOVE: what its connection speaks
+    int hops;     //MOVE: how many times the dial has been handed on
+    int from;     //RELEASE: the worker the client was at
+} SHARD_MSG;
+
+/*
+ * A connection that has come in through the inbox, waiting for the thread or
+ * coroutine started for it to pick it up with shard_adopt().
+ */
+typedef struct shard_pending {
+    struct shard_pending* next;
+    int fd;
+    SHARD_MSG msg;
+} SHARD_PENDING;
+
+/*
+ * Memory shared by the supervisor and all the workers, in a memfd so that it
+ * can be handed on when either is upgraded.
+ */
+typedef struct shard_shared {
+    _Atomic pid_t successor[SHARD_MAX_WORKERS];  //Set by a worker that has been upgraded, for the supervisor
+    _Atomic uint8_t location[];                  //Per extension: 0 if at home, else 1 + the worker it is at
+} SHARD_SHARED;
+
+static int num_workers;             //0 unless running as workers
+static int shard_me = -1;           //Which worker this is
+static int shard_first;             //The whole range of extensions, over all the workers
+static int shard_total;
+static int shard_per;               //Extensions in each worker's slice (the last may have more)
+static int shared_fd = -1;
+static SHARD_SHARED* shared;
+static _Atomic uint8_t* location;   //shared->location
+static int inbox[SHARD_MAX_WORKERS][2];
+static int listeners[SHARD_MAX_WORKERS];   //Each worker's socket on the port
+static pid_t pids[SHARD_MAX_WORKERS];
+static struct timespec started[SHARD_MAX_WORKERS];
+static pid_t shard_parent;          //In a worker started by an upgrade: the worker it took over from
+
+//In the supervisor: how to start itself again when upgraded
+static char shard_path[PATH_MAX];
+static char** shard_argv;
+static int shard_localfd = -1;
+static int inherited;               //It has been, and has the workers it had before
+
+static PBX* shard_pbx;
+static SHARD_SERVE_FN* shard_serve_fn;
+static SHARD_PENDING* pending;
+static sem_t pending_mutex;
+static atomic_long num_moved_out, num_moved_in, num_released, num_dropped;
+
+/*
+ * The worker whose slice an extension is in, or -1 if it isn't in any.
+ */
+static int shard_home(int ext) {
+    if(ext < shard_first || ext - shard_first >= shard_total){
+        return -1;
+    }
+    int k = (ext - shard_first) / shard_per;
+    return k < num_workers ? k : num_workers - 1;
+}
+
+/*
+ * The worker an extension is being served by, or -1 if it isn't in the range.
+ */
+static int shard_where(int ext) {
+    int home = shard_home(ext);
+    if(home < 0){
+        return -1;
+    }
+    int at = atomic_load(&location[ext - shard_first]);
+    return at != 0 ? at - 1 : home;
+}
+
+/*
+ * Record that an extension is being served by a worker.
+ */
+static void shard_locate(int ext, int worker) {
+    atomic_store(&location[ext - shard_first], shard_home(ext) == worker ? 0 : worker + 1);
+}
+
+/*
+ * Send a message to a worker's inbox, with a connection and the input that
+ * goes with it if fd isn't -1.  Doesn't wait for room unless a connection
+ * is being sent, which would otherwise be lost.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int shard_send(int to, SHARD_MSG *msg, const void *carry, size_t len, int fd) {
+    struct iovec iov[2] = {{msg, sizeof(*msg)}, {(void *)carry, len}};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = len > 0 ? 2 : 1;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    if(fd >= 0){
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    ssize_t n;
+    do{
+        n = sendmsg(inbox[to][1], &mh, fd >= 0 ? MSG_NOSIGNAL : MSG_NOSIGNAL | MSG_DONTWAIT);
+    }while(n < 0 && errno == EINTR);
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * Give an extension whose client was being served here back to its home.
+ */
+static void shard_give_back(PBX *pbx, int ext) {
+    int home = shard_home(ext);
+    if(home == shard_me){
+        shard_locate(ext, home);
+        pbx_release_extension(pbx, ext);
+        return;
+    }
+    SHARD_MSG msg = { .type = SHARD_RELEASE, .ext = ext, .from = shard_me };
+    shard_send(home, &msg, NULL, 0, -1);
+}
+
+/*
+ * Forget a connection that came in through the inbox.
+ *
+ * @return 0 if it is one of those, with msg filled in with what came with it,
+ * otherwise -1.
+ */
+static int shard_unpend(int fd, SHARD_MSG *msg) {
+    sem_wait(&pending_mutex);
+    SHARD_PENDING **pp = &pending;
+    while(*pp != NULL && (*pp)->fd != fd){
+        pp = &(*pp)->next;
+    }
+    SHARD_PENDING *p = *pp;
+    if(p != NULL){
+        *pp = p->next;
+    }
+    sem_post(&pending_mutex);
+    if(p == NULL){
+        return -1;
+    }
+    *msg = p->msg;
+    free(p);
+    return 0;
+}
+
+/*
+ * A connection has been handed to us: remember what came with it, and start
+ * serving it.
+ */
+static void shard_moved_in(SHARD_MSG *msg, int fd, const void *carry, size_t len) {
+    SHARD_PENDING *p = malloc(sizeof(SHARD_PENDING));
+    if(p == NULL){
+        close(fd);
+        atomic_fetch_add(&num_dropped, 1);
+        shard_give_back(shard_pbx, msg->ext);
+        return;
+    }
+    p->fd = fd;
+    p->msg = *msg;
+    sem_wait(&pending_mutex);
+    p->next = pending;
+    pending = p;
+    sem_post(&pending_mutex);
+    if(shard_serve_fn(fd, carry, len) < 0){
+        SHARD_MSG gone;
+        shard_unpend(fd, &gone);
+        atomic_fetch_add(&num_dropped, 1);
+        shard_give_back(shard_pbx, msg->ext);
+    }
+}
+
+/*
+ * Thread reading a worker's inbox until the process exits (or stops for an
+ * upgrade, when what is left in it is the new process's to read).
+ */
+static void *shard_inbox(void *arg) {
+    //SIGHUP is for the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    static char carry[SHARD_MAX_CARRY];
+    int in = inbox[shard_me][0];
+    while(1){
+        //Waiting in poll() rather than recvmsg() lets an upgrade stop us between messages
+        if(coro_poll(in, -1) < 0){
+            if(errno != EINTR){
+                break;
+            }
+            upgrade_park(in, NULL, 0, 0);
+            continue;
+        }
+        SHARD_MSG msg;
+        struct iovec iov[2] = {{&msg, sizeof(msg)}, {carry, sizeof(carry)}};
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = 2;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(in, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if(n < 0){
+            if(errno == EINTR || errno == EAGAIN){
+                continue;
+            }
+            break;
+        }
+        int fd = -1;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        if(cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS){
+            memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+        }
+        if((size_t)n < sizeof(msg) || shard_home(msg.ext) < 0){
+            if(fd >= 0){
+                close(fd);
+            }
+            continue;
+        }
+        if(msg.type == SHARD_MOVE && fd >= 0){
+            shard_moved_in(&msg, fd, carry, n - sizeof(msg));
+        }else if(msg.type == SHARD_RELEASE && shard_home(msg.ext) == shard_me){
+            //Unless it has moved on again since (or come home) in the meantime
+            uint8_t at = msg.from + 1;
+            if(atomic_compare_exchange_strong(&location[msg.ext - shard_first], &at, 0)){
+                pbx_release_extension(shard_pbx, msg.ext);
+                atomic_fetch_add(&num_released, 1);
+            }
+        }else if(fd >= 0){
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Become worker k: its slice becomes the range of extensions that pbx_init()
+ * gives its allocator.
+ */
+static void shard_become(int k) {
+    shard_me = k;
+    pbx_config.ext_first = shard_first + k * shard_per;
+    pbx_config.ext_count = k == num_workers - 1 ? shard_total - k * shard_per : shard_per;
+    sem_init(&pending_mutex, 0, 1);
+}
+
+/*
+ * Map the memory shared between the supervisor and the workers.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int shard_map(void) {
+    size_t size = sizeof(SHARD_SHARED) + shard_total;
+    struct stat st;
+    //One upgraded to with a different range would read past the end of it
+    if(fstat(shared_fd, &st) < 0 || (size_t)st.st_size != size){
+        return -1;
+    }
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0);
+    if(shared == MAP_FAILED){
+        shared = NULL;
+        return -1;
+    }
+    location = shared->location;
+    return 0;
+}
+
+/*
+ * Fork worker k.
+ *
+ * @return 0 in the worker, 1 in the supervisor, -1 if the fork failed.
+ */
+static int shard_fork(int k) {
+    pid_t pid = fork();
+    if(pid < 0){
+        return -1;
+    }
+    if(pid == 0){
+        //Nobody would be left to restart us, or to give back our numbers
+        prctl(PR_SET_PDEATHSIG, SIGHUP);
+        shard_become(k);
+        for(int i = 0; i < num_workers; i++){
+            if(i != k){
+                close(inbox[i][0]);
+                close(listeners[i]);
+            }
+        }
+        return 0;
+    }
+    pids[k] = pid;
+    clock_gettime(CLOCK_MONOTONIC, &started[k]);
+    return 1;
+}
+
+/*
+ * A worker has died: give back the extensions of the clients that had moved
+ * to it, as it would have done when they went.
+ */
+static void shard_reap(int k) {
+    for(int i = 0; i < shard_total; i++){
+        if(atomic_load(&location[i]) == k + 1){
+            SHARD_MSG msg = { .type = SHARD_RELEASE, .ext = shard_first + i, .from = k };
+            shard_send(shard_home(shard_first + i), &msg, NULL, 0, -1);
+        }
+    }
+}
+
+/*
+ * Start the binary now at the path the supervisor was started from in its
+ * place, in the same process, with the same arguments and the workers it is
+ * supervising described in its environment.  Returns only if it can't.
+ */
+static void shard_reexec(void) {
+    size_t size = 128 + num_workers * 64;
+    char *var = malloc(size);
+    if(var == NULL){
+        return;
+    }
+    int len = snprintf(var, size, "%d,%d,%d,%d,%d,%d", num_workers, shard_first, shard_total, shard_per,
+                       shared_fd, shard_localfd);
+    for(int k = 0; k < num_workers; k++){
+        len += snprintf(var + len, size - len, ",%d,%d,%d,%d", (int)pids[k], inbox[k][0], inbox[k][1],
+                        listeners[k]);
+    }
+    setenv(SHARD_SUPERVISOR_ENV, var, 1);
+    free(var);
+    //The rest were made without FD_CLOEXEC, for the workers
+    if(shard_localfd >= 0){
+        fcntl(shard_localfd, F_SETFD, 0);
+    }
+    execv(shard_path, shard_argv);
+    if(shard_localfd >= 0){
+        fcntl(shard_localfd, F_SETFD, FD_CLOEXEC);
+    }
+    unsetenv(SHARD_SUPERVISOR_ENV);
+    fprintf(stderr, "Cannot upgrade the supervisor: %s\n", strerror(errno));
+}
+
+/*
+ * Supervise the workers: start again any that dies, and pass SIGHUP and
+ * SIGUSR1 on to them all.  Signals are blocked on entry, and waited for here.
+ *
+ * A worker that has been upgraded leaves its successor to us (we are a
+ * subreaper), and once one has, the new binary evidently works, and the
+ * supervisor is upgraded too, by starting it in its own place.
+ *
+ * Returns only in a worker that has been started again.
+ */
+static void shard_supervise(sigset_t *set, sigset_t *old) {
+    int running = 0;
+    for(int k = 0; k < num_workers; k++){
+        if(pids[k] > 0){
+            running++;
+        }
+    }
+    int upgrading = 0;
+    while(running > 0){
+        siginfo_t info;
+        int sig = sigwaitinfo(set, &info);
+        if(sig == SIGUSR1){
+            //Each worker upgrades itself, and may refuse to (see upgrade.h)
+            for(int k = 0; k < num_workers; k++){
+                if(pids[k] > 0){
+                    kill(pids[k], SIGUSR1);
+                }
+            }
+            upgrading = 1;
+            continue;
+        }
+        if(sig == SIGHUP || sig == SIGINT){
+            for(int k = 0; k < num_workers; k++){
+                if(pids[k] > 0){
+                    kill(pids[k], SIGHUP);
+                }
+            }
+            while(waitpid(-1, NULL, 0) > 0 || errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        if(sig != SIGCHLD){
+            continue;
+        }
+        int status, upgraded = 0;
+        pid_t pid;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+            int k = 0;
+            while(k < num_workers && pids[k] != pid){
+                k++;
+            }
+            if(k == num_workers){
+                continue;
+            }
+            pids[k] = 0;
+            pid_t next = atomic_exchange(&shared->successor[k], 0);
+            if(next > 0){
+                fprintf(stderr, "Worker %d (pid %d) upgraded, now pid %d\n", k, (int)pid, (int)next);
+                pids[k] = next;
+                clock_gettime(CLOCK_MONOTONIC, &started[k]);
+                upgraded = 1;
+                continue;
+            }
+            running--;
+            if(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS){
+                //Told to go by somebody else: not a crash
+                continue;
+            }
+            fprintf(stderr, "Worker %d (pid %d) died, restarting it\n", k, (int)pid);
+            shard_reap(k);
+            //One that keeps dying straight away isn't restarted in a tight loop
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - started[k].tv_sec) * 1000 + (now.tv_nsec - started[k].tv_nsec) / 1000000;
+            usleep((ms < 1000 ? 1000 : SHARD_RESTART_MS) * 1000);
+            int forked = shard_fork(k);
+            if(forked == 0){
+                sigprocmask(SIG_SETMASK, old, NULL);
+                return;
+            }
+            if(forked > 0){
+                running++;
+            }
+        }
+        //Not before every worker that has gone has been seen to
+        if(upgraded && upgrading){
+            upgrading = 0;
+            shard_reexec();
+        }
+    }
+    local_fini();
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Open a listening socket on a port that other sockets can listen on as well
+ * (SO_REUSEPORT), the kernel spreading the connections between them.  As
+ * open_listenfd() otherwise.
+ *
+ * @return the socket, or -1 if it can't be opened.
+ */
+static int shard_listen(char *port) {
+    struct addrinfo hints, *list, *p;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &list) != 0){
+        return -1;
+    }
+    int fd = -1;
+    for(p = list; p != NULL; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if(bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, LISTENQ) == 0){
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/*
+ * Read the next number of a list separated by commas.
+ *
+ * @return 0 if there is one, otherwise -1.
+ */
+static int shard_next(char **p, int *n) {
+    char *end;
+    errno = 0;
+    long v = strtol(*p, &end, 10);
+    if(end == *p || errno != 0 || v < INT_MIN || v > INT_MAX || (*end != ',' && *end != '\0')){
+        return -1;
+    }
+    *n = v;
+    *p = *end == ',' ? end + 1 : end;
+    return 0;
+}
+
+/*
+ * Tell whether this process is a supervisor that has been upgraded, and if
+ * so pick up what it was supervising, for shard_start() to carry on with.
+ * Must be called before anything else is opened.
+ *
+ * @param localfd  Set to the local socket (-U) the workers share, if there is one.
+ * @return 1 if it is, 0 if it isn't, -1 if what it was handed makes no sense.
+ */
+int shard_inherited(int *localfd) {
+    char *env = getenv(SHARD_SUPERVISOR_ENV);
+    if(env == NULL){
+        return 0;
+    }
+    //Not for the workers, nor for anything they start
+    char *p = strdup(env);
+    unsetenv(SHARD_SUPERVISOR_ENV);
+    char *list = p;
+    if(p == NULL || shard_next(&p, &num_workers) < 0 || num_workers < 1 || num_workers > SHARD_MAX_WORKERS
+       || shard_next(&p, &shard_first) < 0 || shard_next(&p, &shard_total) < 0
+       || shard_next(&p, &shard_per) < 0 || shard_next(&p, &shared_fd) < 0
+       || shard_next(&p, &shard_localfd) < 0){
+        free(list);
+        return -1;
+    }
+    for(int k = 0; k < num_workers; k++){
+        int pid;
+        if(shard_next(&p, &pid) < 0 || shard_next(&p, &inbox[k][0]) < 0 || shard_next(&p, &inbox[k][1]) < 0
+           || shard_next(&p, &listeners[k]) < 0){
+            free(list);
+            return -1;
+        }
+        pids[k] = pid;
+        clock_gettime(CLOCK_MONOTONIC, &started[k]);
+    }
+    free(list);
+    if(shard_map() < 0){
+        return -1;
+    }
+    if(shard_localfd >= 0){
+        fcntl(shard_localfd, F_SETFD, FD_CLOEXEC);
+    }
+    *localfd = shard_localfd;
+    inherited = 1;
+    return 1;
+}
+
+/*
+ * Split into worker processes, each with a listening socket of its own on
+ * the port.  Must be called before any threads have been started (and after
+ * any other listening sockets, which the workers share, have been opened),
+ * with pbx_config.ext_first and ext_count giving the whole range.
+ *
+ * The supervisor keeps every worker's socket open, so that connections the
+ * kernel gives to one that has died wait for it to be started again.  One
+ * that has been upgraded (shard_inherited()) goes back to supervising the
+ * workers it had.
+ *
+ * @param workers  How many workers.
+ * @param port  The port to listen on.
+ * @param argv  The arguments the server was started with, to start the
+ * supervisor again with when it is upgraded.
+ * @param localfd  The local socket (-U), or -1.
+ * @return in each worker, its listening socket, with pbx_config set up for
+ * its slice; -1 if the workers can't be started.  The process that called it
+ * stays behind to supervise them, and exits when they have all gone.
+ */
+int shard_start(int workers, char *port, char *argv[], int localfd) {
+    if(workers < 1 || workers > SHARD_MAX_WORKERS || pbx_config.ext_count < workers){
+        return -1;
+    }
+    //The new binary is whatever is at the same path by then
+    ssize_t len = readlink("/proc/self/exe", shard_path, sizeof(shard_path) - 1);
+    if(len <= 0 || len == sizeof(shard_path) - 1){
+        return -1;
+    }
+    shard_path[len] = '\0';
+    shard_argv = argv;
+    //Workers that have been upgraded are handed to us, not to init
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    //After an upgrade they are blocked already; SIGUSR1 stays blocked in the workers
+    sigdelset(&old, SIGHUP);
+    sigdelset(&old, SIGINT);
+    sigdelset(&old, SIGCHLD);
+    if(inherited){
+        if(workers != num_workers || pbx_config.ext_first != shard_first || pbx_config.ext_count != shard_total){
+            return -1;
+        }
+        //Workers that went while we were being started again are seen to at once
+        kill(getpid(), SIGCHLD);
+        shard_supervise(&set, &old);
+        return listeners[shard_me];
+    }
+    //Sockets with SO_REUSEPORT would quietly share the port with another server
+    //already on it; one without it can't
+    int probe = open_listenfd(port);
+    if(probe < 0){
+        return -1;
+    }
+    close(probe);
+    num_workers = workers;
+    shard_first = pbx_config.ext_first;
+    shard_total = pbx_config.ext_count;
+    shard_per = shard_total / workers;
+    shard_localfd = localfd;
+    //memfd_create() itself needs _GNU_SOURCE, which csapp.h can't be compiled with
+    shared_fd = syscall(SYS_memfd_create, "pbx-shard", 0);
+    if(shared_fd < 0 || ftruncate(shared_fd, sizeof(SHARD_SHARED) + shard_total) < 0 || shard_map() < 0){
+        return -1;
+    }
+    for(int k = 0; k < workers; k++){
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, inbox[k]) < 0 || (listeners[k] = shard_listen(port)) < 0){
+            return -1;
+        }
+    }
+    for(int k = 0; k < workers; k++){
+        int forked = shard_fork(k);
+        if(forked == 0){
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            return listeners[k];
+        }
+        if(forked < 0){
+            for(int i = 0; i < k; i++){
+                kill(pids[i], SIGKILL);
+            }
+            return -1;
+        }
+    }
+    shard_supervise(&set, &old);
+    return listeners[shard_me];
+}
+
+/*
+ * In a process started by the upgrade of a worker, become the worker it
+ * takes over from.  Must be called before pbx_init(), with pbx_config set up
+ * as for shard_start(); the rest comes with shard_import().
+ *
+ * @param workers  How many workers.
+ * @return 1 if this is a worker, 0 if it isn't, -1 if it can't be one.
+ */
+int shard_rejoin(int workers) {
+    const char *env = getenv(SHARD_WORKER_ENV);
+    if(env == NULL){
+        return 0;
+    }
+    int k = atoi(env);
+    unsetenv(SHARD_WORKER_ENV);
+    if(workers < 1 || workers > SHARD_MAX_WORKERS || pbx_config.ext_count < workers || k < 0 || k >= workers){
+        return -1;
+    }
+    num_workers = workers;
+    shard_first = pbx_config.ext_first;
+    shard_total = pbx_config.ext_count;
+    shard_per = shard_total / workers;
+    shard_parent = getppid();
+    shard_become(k);
+    return 1;
+}
+
+/*
+ * Get what a worker hands on to the process started by its upgrade, for
+ * shard_import(): the shared memory, its inbox, and the way into every
+ * worker's inbox.
+ *
+ * @param fds  Filled in with the descriptors.
+ * @param size  Room there is in it.
+ * @return how many there are (none if not running as workers), or -1 if
+ * they don't fit.
+ */
+int shard_export(int *fds, int size) {
+    if(shard_me < 0){
+        return 0;
+    }
+    if(size < num_workers + 2){
+        return -1;
+    }
+    fds[0] = shared_fd;
+    fds[1] = inbox[shard_me][0];
+    for(int i = 0; i < num_workers; i++){
+        fds[2 + i] = inbox[i][1];
+    }
+    return num_workers + 2;
+}
+
+/*
+ * Take what shard_export() gave in the worker we take over from.
+ *
+ * @param fds  The descriptors.
+ * @param nfds  How many there are.
+ * @return 0 if successful, otherwise -1.
+ */
+int shard_import(const int *fds, int nfds) {
+    if(shard_me < 0){
+        return nfds == 0 ? 0 : -1;
+    }
+    if(nfds != num_workers + 2){
+        return -1;
+    }
+    shared_fd = fds[0];
+    if(shard_map() < 0){
+        return -1;
+    }
+    inbox[shard_me][0] = fds[1];
+    for(int i = 0; i < num_workers; i++){
+        inbox[i][1] = fds[2 + i];
+    }
+    return 0;
+}
+
+/*
+ * In a worker that has been upgraded and is about to exit, tell the
+ * supervisor which process serves its slice from now on.
+ *
+ * @param pid  The process it has handed everything to.
+ */
+void shard_upgraded(pid_t pid) {
+    if(shard_me >= 0){
+        atomic_store(&shared->successor[shard_me], pid);
+    }
+}
+
+/*
+ * Start taking connections handed over by other workers, in a worker whose
+ * PBX has been initialized.  Does nothing if not running as workers.  In
+ * one started by an upgrade, only once the clients it took over are being
+ * served and the worker it took over from is exiting.
+ *
+ * @param pbx  The worker's PBX.
+ * @param serve  How to serve each connection.
+ * @return 0 if successful, otherwise -1.
+ */
+int shard_serve(PBX *pbx, SHARD_SERVE_FN *serve) {
+    if(shard_me < 0){
+        return 0;
+    }
+    shard_pbx = pbx;
+    shard_serve_fn = serve;
+    if(shard_parent > 0){
+        //It goes as soon as it has been told we have taken over, leaving us to the supervisor
+        for(int i = 0; i < UPGRADE_DONE_MS && getppid() == shard_parent; i++){
+            usleep(1000);
+        }
+        prctl(PR_SET_PDEATHSIG, SIGHUP);
+    }
+    //A worker that has been started again finds some of its numbers still out with clients
+    int first = pbx_config.ext_first;
+    for(int ext = first; ext < first + pbx_config.ext_count; ext++){
+        if(atomic_load(&location[ext - shard_first]) != 0){
+            pbx_claim_extension(pbx, ext);
+        }
+    }
+    //An upgrade waits for the inbox to stop being read
+    upgrade_enter(inbox[shard_me][0]);
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, shard_inbox, NULL) != 0){
+        upgrade_leave(inbox[shard_me][0]);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * Tell which worker this is.
+ *
+ * @return its index, or -1 if not running as workers (or in the supervisor).
+ */
+int shard_worker(void) {
+    return shard_me;
+}
+
+/*
+ * Decide whether a dial should be carried out by another worker.
+ *
+ * @param tu  The TU dialing.
+ * @param ext  The extension it is dialing.
+ * @param hops  How many times this dial has been handed on already.
+ * @return the worker that is serving ext, if that isn't this one and tu can
+ * be moved there; otherwise -1, and the dial should be carried out here.
+ */
+int shard_route(TU *tu, int ext, int hops) {
+    if(shard_me < 0 || hops >= SHARD_MAX_HOPS || shard_home(tu_extension(tu)) < 0){
+        return -1;
+    }
+    int to = shard_where(ext);
+    if(to < 0 || to == shard_me || tu_get_state(tu) != TU_DIAL_TONE){
+        return -1;
+    }
+    return to;
+}
+
+/*
+ * Close a connection that has been handed on (or lost on the way), after
+ * its service has been told it is over, before its descriptor can be reused
+ * by a connection an upgrade would have to wait for.
+ */
+static void shard_close(int fd) {
+    upgrade_leave(fd);
+    close(fd);
+}
+
+/*
+ * Hand a client that has dialed an extension being served by another worker
+ * over to that worker, which will carry out the dial.  The TU goes away
+ * without anyone being told; the connection goes with the input that was
+ * read from it ahead of the dial, and is closed here.  Must be called on the
+ * thread or coroutine serving the connection, with nothing else (such as an
+ * idle timer) still using it.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The client's TU.
+ * @param fd  Its connection.
+ * @param ext  The extension it dialed.
+ * @param hops  How many times this dial has been handed on already.
+ * @return 0 if the client is no longer ours (if it couldn't be handed over
+ * after all, it has been disconnected), or -1 if it should stay and the dial
+ * be carried out here.
+ */
+int shard_move(PBX *pbx, TU *tu, int fd, int ext, int hops) {
+    int to = shard_route(tu, ext, hops);
+    if(to < 0){
+        return -1;
+    }
+    int x = tu_extension(tu);
+    SHARD_MSG msg = { .type = SHARD_MOVE, .ext = x, .dial = ext, .proto = tu_get_proto(tu),
+                      .hops = hops + 1, .from = shard_me };
+    char carry[SHARD_MAX_CARRY];
+    ssize_t len = coro_release(fd, carry, sizeof(carry));
+    if(len < 0){
+        //It can be neither served here any more nor sent on
+        pbx_unregister(pbx, tu);
+        shard_release(pbx, x);
+        shard_close(fd);
+        atomic_fetch_add(&num_dropped, 1);
+        return 0;
+    }
+    tu_detach(tu);
+    pbx_move_out(pbx, tu);
+    shard_locate(x, to);
+    if(shard_send(to, &msg, carry, len, fd) < 0){
+        shard_locate(x, shard_me);
+        shard_close(fd);
+        atomic_fetch_add(&num_dropped, 1);
+        shard_give_back(pbx, x);
+        return 0;
+    }
+    shard_close(fd);
+    atomic_fetch_add(&num_moved_out, 1);
+    return 0;
+}
+
+/*
+ * Take over a client handed to us by another worker, if a new connection
+ * is one of those: register it quietly under its extension, still in
+ * TU_DIAL_TONE.
+ *
+ * @param pbx  The PBX.
+ * @param fd  The connection.
+ * @param tu  Set to its TU, if it was handed to us and could be registered.
+ * @param dial  Set to the extension it dialed, for the caller to dial.
+ * @param hops  Set to how many times that dial has been handed on.
+ * @return 1 if it has been taken over, 0 if it is just a new connection,
+ * or -1 if it was handed over but can't be served (the caller should close it).
+ */
+int shard_adopt(PBX *pbx, int fd, TU **tu, int *dial, int *hops) {
+    *tu = NULL;
+    SHARD_MSG msg;
+    if(shard_me < 0 || shard_unpend(fd, &msg) < 0){
+        return 0;
+    }
+    //If we died with it on its way here, its number has been given back already
+    if(shard_where(msg.ext) != shard_me){
+        atomic_fetch_add(&num_dropped, 1);
+        return -1;
+    }
+    TU *t = tu_init(fd);
+    if(t == NULL || pbx_adopt(pbx, t, msg.ext, msg.proto) < 0){
+        if(t != NULL){
+            tu_unref(t, "Could not be adopted");
+        }
+        atomic_fetch_add(&num_dropped, 1);
+        shard_give_back(pbx, msg.ext);
+        return -1;
+    }
+    *tu = t;
+    *dial = msg.dial;
+    *hops = msg.hops;
+    atomic_fetch_add(&num_moved_in, 1);
+    return 1;
+}
+
+/*
+ * A client has disconnected and its TU has been unregistered: if it had
+ * moved here from its home worker, give its extension back there.  (At
+ * home, pbx_unregister() has done that already.)
+ *
+ * @param pbx  The PBX.
+ * @param ext  The client's extension.
+ */
+void shard_release(PBX *pbx, int ext) {
+    if(shard_me < 0){
+        return;
+    }
+    int home = shard_home(ext);
+    if(home >= 0 && home != shard_me){
+        shard_give_back(pbx, ext);
+    }
+}
+
+/*
+ * Get counts of the clients that have moved between workers.
+ *
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int shard_get_stats(SHARD_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->workers = num_workers;
+    stats->worker = shard_me;
+    stats->moved_out = atomic_load(&num_moved_out);
+    stats->moved_in = atomic_load(&num_moved_in);
+    stats->released = atomic_load(&num_released);
+    stats->dropped = atomic_load(&num_dropped);
+    return 0;
+}
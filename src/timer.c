@@ -0,0 +1,424 @@
+/*
+ * Hierarchical timer wheel, serviced by a thread of its own.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "timer.h"
+#include "debug.h"
+
+#define TIMER_BITS 6
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_INDEX_BITS 20
+#define TIMER_INDEX_MASK ((1u << TIMER_INDEX_BITS) - 1)
+#define TIMER_NO_SLOT 0xffff
+
+_Static_assert(TIMER_SLOTS == 1 << TIMER_BITS, "TIMER_SLOTS must be 1 << TIMER_BITS");
+_Static_assert(TIMER_MAX_TIMERS <= TIMER_INDEX_MASK, "Timer indexes must fit in a handle");
+
+/*
+ * Timers live in one array and are linked by index, so that a handle can name
+ * one with its index and a generation, and the array can grow without leaving
+ * anyone holding a stale pointer.  Index 0 is never used, so 0 means none.
+ */
+typedef struct timer_node {
+    uint32_t prev;
+    uint32_t next;         //Also links the free list
+    uint32_t handle;       //While armed or running, otherwise 0
+    uint16_t gen;          //Generation of the next handle for this node
+    uint16_t slot;         //List the timer is on (level * TIMER_SLOTS + slot), or TIMER_NO_SLOT
+    uint8_t doomed;        //Cancelled while its callback was running
+    uint64_t expires;      //Tick it fires on
+    TIMER_FN* fn;
+    void* arg;
+} TIMER_NODE;
+
+static TIMER_NODE* nodes;
+static uint32_t num_nodes;     //Size of the array
+static uint32_t free_nodes;    //Head of the free list
+static uint32_t heads[TIMER_LEVELS * TIMER_SLOTS];
+static uint64_t wheel_tick;    //Next tick to be processed
+static uint32_t running;       //Handle of the timer whose callback is running, if any
+static int paused;             //Nothing is to fire until timer_resume()
+static long num_armed, num_fired, num_cancelled, num_cascaded;
+
+static sem_t timer_mutex;
+static sem_t wake;             //Posted when the first timer is armed on an empty wheel
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static int timer_thread_ok;
+static pthread_t timer_tid;
+
+static void *timer_thread(void *arg);
+
+static void timer_setup(void) {
+    sem_init(&timer_mutex, 0, 1);
+    sem_init(&wake, 0, 0);
+    if(pthread_create(&timer_tid, NULL, timer_thread, NULL) != 0){
+        debug("Timer thread could not be started");
+        return;
+    }
+    pthread_detach(timer_tid);
+    timer_thread_ok = 1;
+}
+
+static uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t timer_now_tick(void) {
+    return timer_now_ms() / TIMER_TICK_MS;
+}
+
+/*
+ * Put a timer on the list for when it expires, relative to the tick being
+ * processed.  Must be called with the wheel locked.
+ */
+static void timer_insert(uint32_t i) {
+    TIMER_NODE *node = &nodes[i];
+    uint64_t delta = node->expires > wheel_tick ? node->expires - wheel_tick : 0;
+    if(delta >= (uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)){
+        //Beyond the top level it would come round early, so it waits as long as it can
+        delta = ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+        node->expires = wheel_tick + delta;
+    }
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_BITS * (level + 1))){
+        level++;
+    }
+    uint64_t expires = delta > 0 ? node->expires : wheel_tick;
+    uint16_t slot = level * TIMER_SLOTS + ((expires >> (TIMER_BITS * level)) & TIMER_MASK);
+    node->slot = slot;
+    node->prev = 0;
+    node->next = heads[slot];
+    if(heads[slot] != 0){
+        nodes[heads[slot]].prev = i;
+    }
+    heads[slot] = i;
+}
+
+static void timer_unlink(uint32_t i) {
+    TIMER_NODE *node = &nodes[i];
+    if(node->prev != 0){
+        nodes[node->prev].next = node->next;
+    }else{
+        heads[node->slot] = node->next;
+    }
+    if(node->next != 0){
+        nodes[node->next].prev = node->prev;
+    }
+    node->slot = TIMER_NO_SLOT;
+}
+
+/*
+ * Take a node off the free list, growing the array if it is empty.
+ * Must be called with the wheel locked.
+ *
+ * @return its index, or 0 if there is no room.
+ */
+static uint32_t timer_alloc(void) {
+    if(free_nodes == 0){
+        uint32_t n = num_nodes == 0 ? 1024 : num_nodes * 2;
+        if(n > TIMER_MAX_TIMERS + 1){
+            n = TIMER_MAX_TIMERS + 1;
+        }
+        if(n <= num_nodes){
+            return 0;
+        }
+        TIMER_NODE *grown = realloc(nodes, n * sizeof(TIMER_NODE));
+        if(grown == NULL){
+            return 0;
+        }
+        memset(grown + num_nodes, 0, (n - num_nodes) * sizeof(TIMER_NODE));
+        nodes = grown;
+        //Hand out low indexes first, and never index 0
+        for(uint32_t i = n - 1; i >= (num_nodes > 0 ? num_nodes : 1); i--){
+            nodes[i].next = free_nodes;
+            free_nodes = i;
+        }
+        num_nodes = n;
+    }
+    uint32_t i = free_nodes;
+    free_nodes = nodes[i].next;
+    return i;
+}
+
+static void timer_free(uint32_t i) {
+    TIMER_NODE *node = &nodes[i];
+    node->handle = 0;
+    node->gen = (node->gen + 1) & ((1 << (32 - TIMER_INDEX_BITS)) - 1);
+    node->doomed = 0;
+    node->next = free_nodes;
+    free_nodes = i;
+    num_armed--;
+}
+
+/*
+ * The tick a timer armed now for so many milliseconds fires on: the first one
+ * that starts no earlier than that, and never one the wheel has already
+ * started processing.
+ */
+static uint64_t timer_expiry(int ms) {
+    if(ms > TIMER_MAX_MS){
+        ms = TIMER_MAX_MS;
+    }
+    uint64_t tick = (timer_now_ms() + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    return tick > wheel_tick ? tick : wheel_tick + 1;
+}
+
+/*
+ * Arm a timer.
+ *
+ * @param ms  How long from now it fires.
+ * @param fn  The function to call when it does, with the wheel's thread.
+ * @param arg  The argument to pass it.
+ * @return the timer's handle, or 0 if it couldn't be armed.
+ */
+uint32_t timer_arm(int ms, TIMER_FN *fn, void *arg) {
+    pthread_once(&timer_once, timer_setup);
+    if(!timer_thread_ok || fn == NULL){
+        return 0;
+    }
+    sem_wait(&timer_mutex);
+    uint32_t i = timer_alloc();
+    if(i == 0){
+        sem_post(&timer_mutex);
+        return 0;
+    }
+    int was_empty = num_armed == 0;
+    if(was_empty && running == 0){
+        //The thread stopped ticking when the wheel emptied; carry on from now
+        wheel_tick = timer_now_tick();
+    }
+    TIMER_NODE *node = &nodes[i];
+    node->handle = ((uint32_t)node->gen << TIMER_INDEX_BITS) | i;
+    node->fn = fn;
+    node->arg = arg;
+    node->doomed = 0;
+    node->expires = timer_expiry(ms);
+    timer_insert(i);
+    num_armed++;
+    uint32_t handle = node->handle;
+    sem_post(&timer_mutex);
+    if(was_empty){
+        sem_post(&wake);
+    }
+    return handle;
+}
+
+/*
+ * Get the handle of the timer whose callback is running, from inside that
+ * callback, so that it can tell whether it is still the timer its owner wants.
+ *
+ * @return the handle, or 0 if called from anywhere else.
+ */
+uint32_t timer_running(void) {
+    return timer_thread_ok && pthread_equal(pthread_self(), timer_tid) ? running : 0;
+}
+
+/*
+ * Find the node a handle names, if it is still that timer.
+ * Must be called with the wheel locked.
+ */
+static TIMER_NODE *timer_find(uint32_t handle) {
+    uint32_t i = handle & TIMER_INDEX_MASK;
+    if(handle == 0 || i >= num_nodes || nodes[i].handle != handle){
+        return NULL;
+    }
+    return &nodes[i];
+}
+
+/*
+ * Cancel a timer, if it hasn't fired yet.  Never waits, so it may be called
+ * with locks held that the timer's callback takes.
+ *
+ * @param handle  The timer's handle.
+ * @return 0 if the timer was cancelled and its callback will not run; -1 if its
+ * callback has run or is running now (it will not be armed again).
+ */
+int timer_cancel(uint32_t handle) {
+    if(handle == 0){
+        return -1;
+    }
+    sem_wait(&timer_mutex);
+    TIMER_NODE *node = timer_find(handle);
+    if(node == NULL || node->slot == TIMER_NO_SLOT){
+        if(node != NULL){
+            node->doomed = 1;
+        }
+        sem_post(&timer_mutex);
+        return -1;
+    }
+    timer_unlink(handle & TIMER_INDEX_MASK);
+    timer_free(handle & TIMER_INDEX_MASK);
+    num_cancelled++;
+    sem_post(&timer_mutex);
+    return 0;
+}
+
+/*
+ * Cancel a timer and, if its callback is running, wait for it to finish, so
+ * that whatever the callback uses may be freed as soon as this returns.
+ * Must not be called with locks held that the callback takes.
+ *
+ * @param handle  The timer's handle.
+ */
+void timer_cancel_wait(uint32_t handle) {
+    if(handle == 0 || timer_cancel(handle) == 0){
+        return;
+    }
+    while(1){
+        sem_wait(&timer_mutex);
+        int busy = timer_find(handle) != NULL;
+        sem_post(&timer_mutex);
+        if(!busy){
+            return;
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * Move the timers in one slot of a higher level down to where they now belong.
+ * Must be called with the wheel locked.
+ */
+static void timer_cascade(int level, int index) {
+    uint16_t slot = level * TIMER_SLOTS + index;
+    uint32_t i = heads[slot];
+    heads[slot] = 0;
+    while(i != 0){
+        uint32_t next = nodes[i].next;
+        timer_insert(i);
+        num_cascaded++;
+        i = next;
+    }
+}
+
+/*
+ * Process the next tick: cascade if the first level has gone round, then fire
+ * everything in its slot.  Must be called with the wheel locked, which is let
+ * go of while each callback runs.
+ */
+static void timer_run_tick(void) {
+    int index = wheel_tick & TIMER_MASK;
+    if(index == 0){
+        for(int level = 1; level < TIMER_LEVELS; level++){
+            int i = (wheel_tick >> (TIMER_BITS * level)) & TIMER_MASK;
+            timer_cascade(level, i);
+            if(i != 0){
+                break;
+            }
+        }
+    }
+    uint32_t i;
+    while((i = heads[index]) != 0){
+        if(paused){
+            //The rest of the slot fires once we are resumed
+            return;
+        }
+        timer_unlink(i);
+        TIMER_FN *fn = nodes[i].fn;
+        void *arg = nodes[i].arg;
+        running = nodes[i].handle;
+        sem_post(&timer_mutex);
+        int again = fn(arg);
+        sem_wait(&timer_mutex);
+        running = 0;
+        num_fired++;
+        //The array may have grown while we weren't looking
+        if(again > 0 && !nodes[i].doomed){
+            nodes[i].expires = timer_expiry(again);
+            timer_insert(i);
+        }else{
+            timer_free(i);
+        }
+    }
+    wheel_tick++;
+}
+
+static void *timer_thread(void *arg) {
+    sem_wait(&timer_mutex);
+    while(1){
+        if(paused){
+            sem_post(&timer_mutex);
+            usleep(TIMER_TICK_MS * 1000);
+            sem_wait(&timer_mutex);
+            continue;
+        }
+        if(num_armed == 0){
+            sem_post(&timer_mutex);
+            sem_wait(&wake);
+            sem_wait(&timer_mutex);
+            continue;
+        }
+        uint64_t now = timer_now_tick();
+        while(wheel_tick <= now && num_armed > 0 && !paused){
+            timer_run_tick();
+        }
+        uint64_t next = wheel_tick;
+        sem_post(&timer_mutex);
+        struct timespec ts = {
+            .tv_sec = next * TIMER_TICK_MS / 1000,
+            .tv_nsec = (next * TIMER_TICK_MS % 1000) * 1000000
+        };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        sem_wait(&timer_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Stop timers from firing, waiting for a callback that is running to finish,
+ * until timer_resume().  Timers can still be armed and cancelled meanwhile;
+ * any that come due fire late, once the wheel is resumed.  Must not be called
+ * from a timer's callback.
+ */
+void timer_pause(void) {
+    pthread_once(&timer_once, timer_setup);
+    while(1){
+        sem_wait(&timer_mutex);
+        paused = 1;
+        int busy = running != 0;
+        sem_post(&timer_mutex);
+        if(!busy){
+            return;
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * Let timers fire again after timer_pause().
+ */
+void timer_resume(void) {
+    pthread_once(&timer_once, timer_setup);
+    sem_wait(&timer_mutex);
+    paused = 0;
+    sem_post(&timer_mutex);
+}
+
+/*
+ * Get the counters of the timer wheel.
+ *
+ * @param stats  Filled in with the counters.
+ * @return 0 if successful, otherwise -1.
+ */
+int timer_get_stats(TIMER_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    pthread_once(&timer_once, timer_setup);
+    sem_wait(&timer_mutex);
+    stats->armed = num_armed;
+    stats->fired = num_fired;
+    stats->cancelled = num_cancelled;
+    stats->cascaded = num_cascaded;
+    sem_post(&timer_mutex);
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Event trace: per-thread rings of TU state transitions.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+_Static_assert((TRACE_RING_EVENTS & (TRACE_RING_EVENTS - 1)) == 0, "TRACE_RING_EVENTS must be a power of two");
+_Static_assert(sizeof(TRACE_EVENT) == 32, "TRACE_EVENT is part of the dump file format");
+
+/*
+ * Rings are never freed: every ring ever created stays on the all_rings list so a
+ * dump can reach it without locking.  When its thread exits, a ring goes on the
+ * free list and is handed to the next thread that starts recording, so there are
+ * never more rings than the most threads that were recording at once.
+ */
+typedef struct trace_ring {
+    struct trace_ring *next;       //Next on the list of all rings
+    struct trace_ring *next_free;  //Next on the free list, guarded by free_mutex
+    _Atomic int32_t tid;
+    _Atomic uint64_t head;         //Written only by the owning thread
+    TRACE_EVENT events[TRACE_RING_EVENTS];
+} TRACE_RING;
+
+static _Atomic(TRACE_RING *) all_rings;
+static TRACE_RING *free_rings;
+static sem_t free_mutex;
+static pthread_key_t ring_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread TRACE_RING *my_ring;
+
+static _Atomic uint32_t last_call_id;
+static char dump_path[PATH_MAX] = "pbx.trace";
+
+static void trace_ring_release(void *arg) {
+    TRACE_RING *ring = arg;
+    atomic_store(&ring->tid, 0);
+    sem_wait(&free_mutex);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    sem_post(&free_mutex);
+}
+
+static void trace_setup(void) {
+    sem_init(&free_mutex, 0, 1);
+    pthread_key_create(&ring_key, trace_ring_release);
+}
+
+/*
+ * Give the calling thread a ring, reusing one left by an exited thread if possible.
+ */
+static TRACE_RING *trace_ring_get(void) {
+    pthread_once(&trace_once, trace_setup);
+    sem_wait(&free_mutex);
+    TRACE_RING *ring = free_rings;
+    if(ring != NULL){
+        free_rings = ring->next_free;
+    }
+    sem_post(&free_mutex);
+    if(ring == NULL){
+        ring = calloc(1, sizeof(TRACE_RING));
+        if(ring == NULL){
+            return NULL;
+        }
+        TRACE_RING *first = atomic_load(&all_rings);
+        do {
+            ring->next = first;
+        } while(!atomic_compare_exchange_weak(&all_rings, &first, ring));
+    }
+    atomic_store(&ring->tid, (int32_t)syscall(SYS_gettid));
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/*
+ * Record a TU state transition in the calling thread's ring.
+ *
+ * @param ext  The extension of the TU that changed state.
+ * @param old_state  The state it was in.
+ * @param new_state  The state it is now in.
+ * @param cmd  The TU_COMMAND that caused the transition.
+ * @param peer_ext  The extension of the TU's peer, or -1 if it has none.
+ * @param call_id  The call the transition belongs to, or 0 if none.
+ */
+void trace_event(int ext, int old_state, int new_state, int cmd, int peer_ext, uint32_t call_id) {
+    TRACE_RING *ring = my_ring;
+    if(ring == NULL && (ring = trace_ring_get()) == NULL){
+        return;
+    }
+    //Only this thread writes the ring, so the slot can be filled in place and
+    //published by advancing head
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    TRACE_EVENT *ev = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ev->ts_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    ev->tid = ring->tid;
+    ev->ext = ext;
+    ev->peer_ext = peer_ext;
+    ev->call_id = call_id;
+    ev->old_state = old_state;
+    ev->new_state = new_state;
+    ev->cmd = cmd;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Get an identifier for a new call.
+ *
+ * @return a nonzero call id.
+ */
+uint32_t trace_new_call_id(void) {
+    uint32_t id;
+    //0 means "no call", so skip it when the counter wraps
+    while((id = atomic_fetch_add_explicit(&last_call_id, 1, memory_order_relaxed) + 1) == 0);
+    return id;
+}
+
+/*
+ * Get the last call id handed out, so that a server taking over from this
+ * one (see upgrade.h) can carry on after it.
+ */
+uint32_t trace_last_call_id(void) {
+    return atomic_load(&last_call_id);
+}
+
+/*
+ * Carry on handing out call ids after the last one another server handed out.
+ *
+ * @param last  That call id.
+ */
+void trace_resume_call_ids(uint32_t last) {
+    atomic_store(&last_call_id, last);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while(len > 0){
+        ssize_t n = write(fd, p, len);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Write the contents of every ring to a file.
+ * Only async-signal-safe calls are made, so this may be called from a signal
+ * handler.  Events being recorded while the dump is taken may come out torn.
+ *
+ * @param fd  The file descriptor to write to.
+ * @return 0 if successful, otherwise -1.
+ */
+int trace_dump(int fd) {
+    //Rings are only ever added at the front, so the list from here on is fixed
+    TRACE_RING *first = atomic_load(&all_rings);
+    TRACE_FILE_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.event_size = sizeof(TRACE_EVENT);
+    hdr.ring_events = TRACE_RING_EVENTS;
+    for(TRACE_RING *ring = first; ring != NULL; ring = ring->next){
+        hdr.num_rings++;
+    }
+    if(write_all(fd, &hdr, sizeof(hdr)) < 0){
+        return -1;
+    }
+    for(TRACE_RING *ring = first; ring != NULL; ring = ring->next){
+        TRACE_RING_HEADER rh = {
+            .tid = atomic_load(&ring->tid),
+            .head = atomic_load_explicit(&ring->head, memory_order_acquire)
+        };
+        if(write_all(fd, &rh, sizeof(rh)) < 0 || write_all(fd, ring->events, sizeof(ring->events)) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Dump the trace to the file given to trace_init(), replacing its contents.
+ * Async-signal-safe.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int trace_dump_file(void) {
+    int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return -1;
+    }
+    int ret = trace_dump(fd);
+    close(fd);
+    return ret;
+}
+
+static void trace_dump_handler(int sig) {
+    int saved_errno = errno;
+    trace_dump_file();
+    errno = saved_errno;
+}
+
+static void trace_crash_handler(int sig) {
+    trace_dump_file();
+    //The handler was reset to the default when it was entered, so this kills us
+    //the way the original signal would have
+    raise(sig);
+}
+
+/*
+ * Set the dump file and install the handlers that write it: SIGUSR2 dumps the
+ * trace and carries on, and a crash (SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT)
+ * dumps it before the process dies.
+ *
+ * @param path  The file to dump to, or NULL for "pbx.trace" in the current directory.
+ * @return 0 if successful, otherwise -1.
+ */
+int trace_init(const char *path) {
+    if(path != NULL){
+        if(strlen(path) >= sizeof(dump_path)){
+            return -1;
+        }
+        strcpy(dump_path, path);
+    }
+    pthread_once(&trace_once, trace_setup);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = trace_dump_handler;
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGUSR2, &sa, NULL) < 0){
+        return -1;
+    }
+    int crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    sa.sa_handler = trace_crash_handler;
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for(size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++){
+        if(sigaction(crash_signals[i], &sa, NULL) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -2,12 +2,470 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 
 #include "pbx.h"
 #include "debug.h"
+#include "server.h"
+#include "server_extra.h"
+#include "tu_extra.h"
+#include "conf.h"
+#include "hunt.h"
+#include "acd.h"
+#include "config.h"
+#include "trace.h"
+#include "presence.h"
+#include "msglog.h"
+#include "cdr.h"
+#include "history.h"
+#include "resume.h"
+#include "regmap.h"
+#include "timer.h"
+#include "coro.h"
+#include "proto.h"
+#include "hazard.h"
 #include <semaphore.h> 
 #include <sys/socket.h>  
-#include <stdlib.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#define CACHE_LINE 64
+
+/*
+ * The fields touched on every state transition (the lock, the state and the peer
+ * link) sit together on the first cache line, and everything that is written once
+ * at setup (fd, extension and its preformatted text) sits on the second line, so a
+ * thread locking one TU never invalidates the line another thread is reading out
+ * of its neighbour.
+ */
+struct tu{ 
+    //Hot: written on every transition
+    _Alignas(CACHE_LINE) sem_t mutex;   
+    TU* _Atomic peer;       //Holds a reference to it; read by threads locking the pair (see tu_lock_peer())
+    TU_STATE state; 
+    _Atomic int ref_count; 
+    uint32_t call_id;       //Call this TU is part of (for the trace), 0 if none
+    uint32_t ring_timer;    //Timer that gives up on the call if this TU rings too long, 0 if none
+    CDR* cdr;               //Record of that call, shared with the peer, if CDRs are kept
+    //Cold: written once when the TU is set up
+    _Alignas(CACHE_LINE) int fd; 
+    int extension;  
+    uint8_t ext_len;        //Length of ext_str
+    //Sharing a byte: once the TU is in use, both only change with the mutex and the output lock held
+    uint8_t unplugged : 1;  //Unregistered, so nobody may queue for it any more
+    uint8_t proto : 1;      //PROTO_TEXT, or PROTO_BINARY once its client has asked for frames
+    char ext_str[14];       //" <extension>\n", preformatted for notifications (" -2147483648\n" at most)
+    CONF_BRIDGE* bridge;    //Conference bridge the TU is connected to, if any
+    HUNT_MEMBER* hunt;      //Membership of a hunt group, if any
+    ACD_QUEUE* queue;       //Callers waiting for this TU to be free, once anyone has
+    ACD_WAITER* waiting;    //Place in the queue this TU is waiting in, if any
+    CALL_HISTORY* history;  //Recent chats of its call, shared with the peer, while calls can be resumed
+};
+
+_Static_assert(offsetof(struct tu, peer) < CACHE_LINE && offsetof(struct tu, cdr) < CACHE_LINE,
+               "TU hot fields spill out of the first cache line");
+_Static_assert(offsetof(struct tu, fd) == CACHE_LINE, "TU cold fields must start on their own cache line");
+_Static_assert(sizeof(struct tu) == 2 * CACHE_LINE, "TU must occupy exactly two cache lines");
+
+/*
+ * Writes to a TU's connection are made under an output lock, and so are changes
+ * to which connection that is (fd and proto, which are also only changed with
+ * the TU's own mutex held, so either lock is enough to read them).  A thread
+ * writing to a TU it doesn't have locked (a chat to its peer, a conference
+ * relay) only needs the output lock, which is taken last and never held while
+ * waiting for anything else, so it can be taken with any TUs locked.  There is
+ * no room for it in struct tu, so the locks are striped over TUs by address.
+ */
+#define TU_OUT_LOCKS 256
+
+/*
+ * Longest a line that has started going out to a client may take to finish
+ * (see tu_send()), the output lock being held meanwhile.
+ */
+#define TU_FINISH_MS 200
+
+static sem_t tu_out_locks[TU_OUT_LOCKS];
+static pthread_once_t tu_out_once = PTHREAD_ONCE_INIT;
+
+static void tu_out_setup(void) {
+    for(int i = 0; i < TU_OUT_LOCKS; i++){
+        sem_init(&tu_out_locks[i], 0, 1);
+    }
+}
+
+static sem_t *tu_out(TU *tu) {
+    return &tu_out_locks[(uintptr_t)tu / sizeof(struct tu) % TU_OUT_LOCKS];
+}
+
+/*
+ * Write to the connection of a TU, under its output lock.
+ */
+static ssize_t tu_writev(TU *tu, const struct iovec *iov, int cnt, int flags) {
+    sem_wait(tu_out(tu));
+    ssize_t n = coro_writev(tu->fd, iov, cnt, flags);
+    int saved_errno = errno;
+    sem_post(tu_out(tu));
+    errno = saved_errno;
+    return n;
+}
+
+/*
+ * Two TUs are always locked in address order, so that two threads locking the
+ * same pair (each starting from its own TU) can't deadlock.
+ */
+static void tu_lock_both(TU *a, TU *b) {
+    if(a > b){
+        TU *t = a;
+        a = b;
+        b = t;
+    }
+    sem_wait(&a->mutex);
+    sem_wait(&b->mutex);
+}
+
+/*
+ * States of a TU, as a set for tu_lock_peer().
+ */
+#define TU_IN(state) (1u << (state))
+
+/*
+ * Lock a TU, and its peer too if the TU is in one of the given states (those in
+ * which the caller may change the state of both), in address order.  A peer at
+ * a lower address can only be waited for once the TU's own lock is let go, and
+ * then the call may end and the peer's last reference go before we get it; so
+ * the peer is kept in a hazard pointer (see hazard.h) meanwhile, or by a
+ * reference of our own if there is no slot free, and the TU is checked to have
+ * the same peer once both are locked.
+ *
+ * @param tu  The TU.
+ * @param states  The states it needs its peer locked in, as TU_IN() bits.
+ * @return its peer, locked along with it, or NULL if it has none or isn't in
+ * one of those states (only the TU is locked).  What the TU was doing may have
+ * changed by the time this returns.
+ */
+static TU *tu_lock_peer(TU *tu, unsigned states) {
+    sem_wait(&tu->mutex);
+    TU *peer;
+    while((peer = tu->peer) != NULL){
+        if(!(states & TU_IN(tu->state))){
+            return NULL;
+        }
+        if(tu < peer){
+            sem_wait(&peer->mutex);
+            return peer;
+        }
+        int held = hazard_protect(HAZARD_PEER, peer) < 0;
+        if(held){
+            tu_ref(peer, "Waiting to lock peer");
+        }
+        sem_post(&tu->mutex);
+        sem_wait(&peer->mutex);
+        sem_wait(&tu->mutex);
+        //Once both are locked, a peer still linked holds the reference that keeps it
+        int linked = tu->peer == peer;
+        if(!linked){
+            sem_post(&peer->mutex);
+        }
+        if(held){
+            tu_unref(peer, "Locked peer");
+        }else{
+            hazard_clear(HAZARD_PEER);
+        }
+        if(linked){
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+static void tu_unlock_peer(TU *tu, TU *peer) {
+    if(peer != NULL){
+        sem_post(&peer->mutex);
+    }
+    sem_post(&tu->mutex);
+}
+
+/*
+ * Write a line of text to the client of a TU (queueing it, if it is served
+ * through io_uring), framed if the client speaks binary.  Must be called with
+ * the TU's mutex held.
+ */
+static void tu_write(TU *tu, const void *buf, size_t len) {
+    if(tu->proto == PROTO_BINARY){
+        PROTO_EVENT ev;
+        proto_event(&ev, PROTO_EV_TEXT, 0, 0, len);
+        struct iovec iov[2] = {{&ev, sizeof(ev)}, {(void *)buf, len}};
+        tu_writev(tu, iov, 2, 0);
+        return;
+    }
+    struct iovec iov = { (void *)buf, len };
+    tu_writev(tu, &iov, 1, 0);
+}
+
+/*
+ * Send a state notification to a binary client, as one frame.
+ */
+static void tu_notify_binary(TU *tu, TU_STATE state, int ext) {
+    PROTO_EVENT ev;
+    proto_event(&ev, PROTO_EV_STATE, state, ext, 0);
+    struct iovec iov = { &ev, sizeof(ev) };
+    tu_writev(tu, &iov, 1, 0);
+}
+
+/*
+ * Send a state notification to the client of a TU, in a single write.
+ * Must be called with the TU's mutex held.
+ *
+ * @param tu  The TU whose client is to be notified.
+ * @param state  The state to report.
+ * @param of  The TU whose extension follows the state name, or NULL for none.
+ */
+static void tu_notify(TU *tu, TU_STATE state, TU *of) {
+    if(tu->proto == PROTO_BINARY){
+        tu_notify_binary(tu, state, of != NULL ? of->extension : 0);
+        return;
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = (char *)tu_state_names[state];
+    iov[0].iov_len = strlen(tu_state_names[state]);
+    if(of != NULL){
+        iov[1].iov_base = of->ext_str;
+        iov[1].iov_len = of->ext_len;
+    } else {
+        iov[1].iov_base = "\n";
+        iov[1].iov_len = 1;
+    }
+    tu_writev(tu, iov, 2, 0);
+}
+
+/*
+ * Send a state notification naming an extension that isn't a TU's (a bridge).
+ * Must be called with the TU's mutex held.
+ */
+static void tu_notify_ext(TU *tu, TU_STATE state, int ext) {
+    if(tu->proto == PROTO_BINARY){
+        tu_notify_binary(tu, state, ext);
+        return;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%s %d\n", tu_state_names[state], ext);
+    tu_write(tu, buf, len);
+}
+
+/*
+ * Send a notification of a TU's current state, for a command that had no
+ * effect, with the extension that goes with the state: its own on hook, and
+ * its peer's or its bridge's when connected.
+ * Must be called with the TU's mutex held.
+ */
+static void tu_notify_current(TU *tu) {
+    if(tu->state == TU_CONNECTED && tu->bridge != NULL){
+        tu_notify_ext(tu, tu->state, conf_extension(tu->bridge));
+        return;
+    }
+    tu_notify(tu, tu->state, tu->state == TU_ON_HOOK ? tu : tu->state == TU_CONNECTED ? tu->peer : NULL);
+}
+
+static int tu_ring_timeout(void *arg);
+
+/*
+ * Give a TU that has started ringing a timer that gives up on the call if it
+ * isn't answered in time, if there is a time limit.
+ * Must be called with the TU's mutex held.
+ */
+static void tu_arm_ring_timer(TU *tu) {
+    if(pbx_config.ring_timeout_ms <= 0){
+        return;
+    }
+    tu_ref(tu, "Ring timer armed");
+    tu->ring_timer = timer_arm(pbx_config.ring_timeout_ms, tu_ring_timeout, tu);
+    if(tu->ring_timer == 0){
+        tu_unref(tu, "Ring timer could not be armed");
+    }
+}
+
+/*
+ * Change the state of a TU, recording the transition in the trace, letting
+ * its hunt group and anyone queued for it know if it has gone on or off hook,
+ * and publishing the new state to anyone watching its extension.  A TU that
+ * starts ringing gets a timer that gives up on the call if it isn't answered
+ * in time (holding a reference to the TU until it fires or is cancelled).
+ * Must be called with the TU's mutex held, and while tu->peer is still the
+ * peer the transition concerns.
+ *
+ * @param tu  The TU changing state.
+ * @param state  The new state.
+ * @param cmd  The command that caused the change.
+ */
+static void tu_set_state(TU *tu, TU_STATE state, int cmd) {
+    int peer_ext = tu->peer ? tu->peer->extension : tu->bridge ? conf_extension(tu->bridge) : -1;
+    trace_event(tu->extension, tu->state, state, cmd, peer_ext, tu->call_id);
+    if(state == TU_ON_HOOK && tu->state != TU_ON_HOOK && tu->queue != NULL && acd_waiting(tu->queue) > 0){
+        acd_kick(tu->queue);
+    }
+    if(tu->hunt != NULL && (tu->state == TU_ON_HOOK) != (state == TU_ON_HOOK)){
+        hunt_member_set_idle(tu->hunt, state == TU_ON_HOOK);
+    }
+    if(state == TU_RINGING && tu->state != TU_RINGING){
+        tu_arm_ring_timer(tu);
+    }else if(state != TU_RINGING && tu->ring_timer != 0){
+        //If it has already fired, its callback will find nothing to do and let go of the TU
+        if(timer_cancel(tu->ring_timer) == 0){
+            tu_unref(tu, "Ring timer cancelled");
+        }
+        tu->ring_timer = 0;
+    }
+    presence_publish(tu->extension, state);
+    tu->state = state;
+}
+
+/*
+ * Send the client of a TU any messages left for its extension, in one write.
+ * Must be called with the TU's mutex held.
+ */
+static void tu_deliver_messages(TU *tu) {
+    size_t len;
+    char *buf = msglog_take(tu->extension, &len);
+    if(buf != NULL){
+        tu_write(tu, buf, len);
+        free(buf);
+    }
+}
+
+/*
+ * Give the client of a TU that has just been registered the token it can
+ * resume its session with if its connection drops (see resume.h).
+ * Must be called with the TU's mutex held.
+ */
+static void tu_offer_resume(TU *tu) {
+    uint64_t token;
+    if(resume_token(tu, &token) == 0){
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "RESUME %016llx\n", (unsigned long long)token);
+        tu_write(tu, buf, len);
+    }
+}
+
+/*
+ * Tell the client of a queued caller its position in the queue.
+ * Must be called with the TU's mutex held.
+ */
+static void tu_notify_position(TU *tu, int position) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "QUEUED %d\n", position);
+    tu_write(tu, buf, len);
+}
+
+/*
+ * Find somebody to take a call from a TU's own queue: the TU itself, which is
+ * checked for being on hook when the caller is actually connected.
+ */
+static TU *tu_pick_self(void *owner) {
+    TU *tu = owner;
+    tu_ref(tu, "Picked from queue");
+    return tu;
+}
+
+/*
+ * Put a caller that has just found its target busy into a queue, in the
+ * TU_BUSY_SIGNAL state, and tell it its position.
+ * Must be called with the caller's mutex held.
+ *
+ * @return 0 if the caller was queued, -1 if the queue has closed.
+ */
+static int tu_wait_locked(TU *tu, ACD_QUEUE *queue) {
+    int position;
+    ACD_WAITER *waiter = acd_enqueue(queue, tu, &position);
+    if(waiter == NULL){
+        return -1;
+    }
+    tu->waiting = waiter;
+    tu_set_state(tu, TU_BUSY_SIGNAL, TU_DIAL_CMD);
+    tu_notify_position(tu, position);
+    return 0;
+}
+
+/*
+ * A caller has dialed a target that isn't free: give it the busy signal or,
+ * with call queueing turned on, queue it for the target.
+ * Must be called with both mutexes held.
+ */
+static void tu_busy(TU *tu, TU *target) {
+    if(pbx_config.queue_calls && !target->unplugged){
+        if(target->queue == NULL){
+            target->queue = acd_queue_create(tu_pick_self, target);
+        }
+        if(target->queue != NULL && tu_wait_locked(tu, target->queue) == 0){
+            return;
+        }
+    }
+    tu_set_state(tu, TU_BUSY_SIGNAL, TU_DIAL_CMD);
+    tu_notify(tu, TU_BUSY_SIGNAL, NULL);
+}
+
+/*
+ * Ring a free target from a caller.
+ * Must be called with both mutexes held.
+ */
+static void tu_start_call(TU *tu, TU *target) {
+    tu->peer = target; 
+    target->peer = tu;  
+    tu->call_id = target->call_id = trace_new_call_id();
+    tu->cdr = target->cdr = cdr_begin(tu->call_id, tu->extension, target->extension);
+    tu_set_state(tu, TU_RING_BACK, TU_DIAL_CMD);  
+    tu_set_state(target, TU_RINGING, TU_DIAL_CMD); 
+    tu_ref(tu, "Set Reference to TU From Peer when Dialing!"); 
+    tu_ref(target, "Set Reference to TU From Peer when Dialing!");
+    tu_notify(tu, TU_RING_BACK, NULL); 
+    tu_notify(target, TU_RINGING, NULL); 
+}
+
+/*
+ * Hang up a TU that is ringing: it goes on hook and its caller gets the dial tone.
+ * Must be called with both mutexes held (see tu_lock_peer()), which are released.
+ */
+static void tu_hangup_ringing(TU *tu, TU *peer) {
+    tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD); 
+    tu_set_state(peer, TU_DIAL_TONE, TU_HANGUP_CMD); 
+    tu->peer = NULL;  
+    peer->peer = NULL;  
+    tu->call_id = peer->call_id = 0;
+    cdr_end(tu->cdr);
+    tu->cdr = peer->cdr = NULL;
+    tu_unref(tu, "UNREFERNCING TU FROM HANGUP");  
+    tu_unref(peer, "UNREFERNCING TU FROM HANGUP"); 
+    tu_notify(tu, TU_ON_HOOK, tu);
+    tu_notify(peer, TU_DIAL_TONE, NULL); 
+    sem_post(&tu->mutex);  
+    sem_post(&peer->mutex);
+}
+
+/*
+ * Give up on a call that has been ringing too long, as if the phone ringing had
+ * been hung up.  Runs on the timer thread.
+ */
+static int tu_ring_timeout(void *arg) {
+    TU *tu = arg;
+    uint32_t handle = timer_running();
+    TU *peer = tu_lock_peer(tu, TU_IN(TU_RINGING));
+    //The TU may have stopped ringing, and even started again, while we waited for it
+    if(tu->ring_timer == handle && tu->state == TU_RINGING && peer != NULL){
+        tu->ring_timer = 0;
+        tu_hangup_ringing(tu, peer);
+    }else{
+        tu_unlock_peer(tu, peer);
+    }
+    tu_unref(tu, "Ring timer fired");
+    return 0;
+}
+
 /*
  * Initialize a TU
  *
@@ -15,25 +473,28 @@
  * @return  The TU, newly initialized and in the TU_ON_HOOK state, if initialization
  * was successful, otherwise NULL.
  */ 
-struct tu{ 
-    TU* peer;  
-    TU_STATE state; 
-    sem_t mutex;   
-    int fd; 
-    int extension;  
-    volatile int ref_count; 
-};
-
 // #if 0
 TU *tu_init(int fd) {
     // TO BE IMPLEMENTED 
-    TU* tu = malloc(sizeof(TU));  
+    pthread_once(&tu_out_once, tu_out_setup);
+    TU* tu = aligned_alloc(CACHE_LINE, sizeof(TU));  
     if(tu == NULL){return NULL;} 
     tu->fd = fd; 
     tu->extension = -1; 
+    tu->ext_len = snprintf(tu->ext_str, sizeof(tu->ext_str), " %d\n", -1);
     tu->state = TU_ON_HOOK;  
     tu->peer = NULL; 
-    tu->ref_count = 0; 
+    tu->call_id = 0;
+    tu->ring_timer = 0;
+    tu->cdr = NULL;
+    tu->bridge = NULL;
+    tu->hunt = NULL;
+    tu->queue = NULL;
+    tu->waiting = NULL;
+    tu->unplugged = 0;
+    tu->proto = PROTO_TEXT;
+    tu->history = NULL;
+    atomic_init(&tu->ref_count, 0); 
     if(sem_init(&tu->mutex, 0, 1) != 0){ 
         free(tu); 
         return NULL;
@@ -54,18 +515,26 @@ TU *tu_init(int fd) {
 void tu_ref(TU *tu, char *reason) { 
     //If locking and unlocking causes problems here get rid of it!  
     if(tu == NULL) return; 
-    //sem_wait(&tu->mutex); 
-    //Since tu_ref count is a volatile flag we must increment it in an interesting way 
-    int new_ref = tu->ref_count; 
-    new_ref += 1; 
-    tu->ref_count = new_ref;  
+    //The count is atomic, so peers on other threads can take references without the lock
+    int new_ref = atomic_fetch_add(&tu->ref_count, 1) + 1; 
+    (void)new_ref; //Only read by debug()
     debug("Increasing ref count because %s for TU %d (%d -> %d)", reason, tu->extension, new_ref-1, new_ref); 
     //sem_post(&tu->mutex); 
 }
 // #endif
 
 /*
- * Decrement the reference count on a TU, freeing it if the count becomes 0.
+ * Free a TU that nobody can be looking at any more.
+ */
+static void tu_free(void *arg) {
+    TU *tu = arg;
+    sem_destroy(&tu->mutex);
+    free(tu);
+}
+
+/*
+ * Decrement the reference count on a TU, freeing it if the count becomes 0
+ * (once no thread is waiting to lock it as a peer, see tu_lock_peer()).
  *
  * @param tu  The TU whose reference count is to be decremented
  * @param reason  A string describing the reason why the count is being decremented
@@ -74,19 +543,12 @@ void tu_ref(TU *tu, char *reason) {
 // #if 0
 void tu_unref(TU *tu, char *reason) {  
     if(tu == NULL) return;  
-    //Again we will be locking and unlocking the TU in here as this seems safest! 
-    //sem_wait(&tu->mutex); 
-    int new_ref = tu->ref_count; 
-    new_ref -= 1; 
-    tu->ref_count = new_ref; 
+    int new_ref = atomic_fetch_sub(&tu->ref_count, 1) - 1; 
     debug("Decreasing ref count because %s for TU %d (%d -> %d)", reason, tu->extension, new_ref+1, new_ref); 
-    if(tu->ref_count == 0){
-        //sem_post(&tu->mutex); 
-        if(tu->peer){
-            tu->peer->peer = NULL; //To be safe, we should make sure that if this had a peer it's reference to this is gone
-        }
-        sem_destroy(&tu->mutex); 
-        free(tu); 
+    if(new_ref == 0){
+        //A peer holds a reference, so there is none left to unlink from here
+        acd_queue_unref(tu->queue);
+        hazard_retire(tu, tu_free);
         return; 
     } 
     //sem_post(&tu->mutex); 
@@ -131,9 +593,24 @@ int tu_extension(TU *tu) {
 }
 // #endif
 
+/*
+ * Get the current state of a TU.
+ *
+ * @param tu  The TU.
+ * @return its state, as of the moment it was looked at.
+ */
+TU_STATE tu_get_state(TU *tu) {
+    sem_wait(&tu->mutex);
+    TU_STATE state = tu->state;
+    sem_post(&tu->mutex);
+    return state;
+}
+
 /*
  * Set the extension number for a TU.
- * A notification is set to the client of the TU.
+ * A notification is set to the client of the TU, followed by its resume token
+ * if sessions can be resumed or registrations are kept (see regmap.h), and any
+ * messages left for the extension.
  * This function should be called at most once one any particular TU.
  *
  * @param tu  The TU whose extension is being set.
@@ -144,7 +621,13 @@ int tu_set_extension(TU *tu, int ext) {
     if(tu == NULL){return -1;} 
     sem_wait(&tu->mutex);  
     tu->extension = ext; 
-    dprintf(tu->fd, "%s %d\n", tu_state_names[tu->state], ext); 
+    tu->ext_len = snprintf(tu->ext_str, sizeof(tu->ext_str), " %d\n", ext);
+    tu_set_state(tu, tu->state, TU_CONNECT_CMD);
+    tu_notify(tu, tu->state, tu); 
+    if(pbx_config.resume_grace_ms > 0 || regmap_enabled()){
+        tu_offer_resume(tu);
+    }
+    tu_deliver_messages(tu);
     sem_post(&tu->mutex); 
     return 0; 
 }
@@ -195,19 +678,14 @@ int tu_dial(TU *tu, TU *target) {
     //Case 1:   
     if(tu->state != TU_DIAL_TONE){
         //No effect so print current state! 
-        if(tu->state == TU_ON_HOOK){
-            dprintf(tu->fd, "%s %d\n", tu_state_names[tu->state], tu->extension);
-            sem_post(&tu->mutex); 
-            return 0; 
-        }
-        dprintf(tu->fd, "%s\n", tu_state_names[tu->state]); 
+        tu_notify_current(tu);
         sem_post(&tu->mutex);  
         return 0; 
     }  
     //Case 2:
     if(target == NULL){
-        tu->state = TU_ERROR; 
-        dprintf(tu->fd, "%s\n", tu_state_names[TU_ERROR]); 
+        tu_set_state(tu, TU_ERROR, TU_DIAL_CMD); 
+        tu_notify(tu, TU_ERROR, NULL); 
         sem_post(&tu->mutex); 
         return -1; 
     } 
@@ -215,40 +693,35 @@ int tu_dial(TU *tu, TU *target) {
     sem_post(&tu->mutex); 
     if(tu == target){
         sem_wait(&tu->mutex); 
-        tu->state = TU_BUSY_SIGNAL; 
-        dprintf(tu->fd, "%s\n", tu_state_names[TU_BUSY_SIGNAL]); 
+        tu_set_state(tu, TU_BUSY_SIGNAL, TU_DIAL_CMD); 
+        tu_notify(tu, TU_BUSY_SIGNAL, NULL); 
         sem_post(&tu->mutex); 
         return 0;
     } 
-    // TU* first = (tu < target) ? tu: target; 
-    // TU* second = (tu < target) ? target: tu;   
-    sem_wait(&tu->mutex); 
-    sem_wait(&target->mutex);   
+    tu_lock_both(tu, target);
+    if(tu->state != TU_DIAL_TONE){
+        //Called or hung up while it wasn't locked
+        tu_notify_current(tu);
+        sem_post(&target->mutex);
+        sem_post(&tu->mutex);
+        return 0;
+    }
     //Case 4:
     if(target->state != TU_ON_HOOK){
-        tu->state = TU_BUSY_SIGNAL; 
-        dprintf(tu->fd, "%s\n",tu_state_names[TU_BUSY_SIGNAL]);  
+        tu_busy(tu, target);
         sem_post(&target->mutex);
         sem_post(&tu->mutex); 
         return 0;
     }  
     //Case 5: 
     if(target->peer){
-        tu->state = TU_BUSY_SIGNAL; 
-        dprintf(tu->fd, "%s\n",tu_state_names[TU_BUSY_SIGNAL]);  
+        tu_busy(tu, target);
         sem_post(&target->mutex);
         sem_post(&tu->mutex); 
         return 0;
     } 
     //Last Case of normal ring back! 
-    tu->state = TU_RING_BACK;  
-    target->state = TU_RINGING; 
-    tu->peer = target; 
-    target->peer = tu;  
-    tu_ref(tu, "Set Reference to TU From Peer when Dialing!"); 
-    tu_ref(target, "Set Reference to TU From Peer when Dialing!");
-    dprintf(tu->fd, "%s\n",tu_state_names[TU_RING_BACK]); 
-    dprintf(target->fd, "%s\n",tu_state_names[TU_RINGING]); 
+    tu_start_call(tu, target);
     sem_post(&target->mutex); 
     sem_post(&tu->mutex);  
     return 0; 
@@ -267,7 +740,8 @@ int tu_dial(TU *tu, TU *target) {
  *
  * In all cases, a notification of the resulting state of the specified TU is sent to
  * to the associated network client.  If a peer TU has changed state, then its client
- * is also notified of its new state.
+ * is also notified of its new state.  A TU that goes off hook is then sent any
+ * messages left for it (see msglog.h).
  *
  * @param tu  The TU that is to be picked up.
  * @return 0 if successful, -1 if any error occurs that results in the originating
@@ -277,56 +751,54 @@ int tu_dial(TU *tu, TU *target) {
 int tu_pickup(TU *tu) {
     // TO BE IMPLEMENTED 
     if(tu == NULL){return -1;} 
-    sem_wait(&tu->mutex); 
+    //Only answering a call changes the peer; otherwise it is only named
+    TU* peer = tu_lock_peer(tu, TU_IN(TU_RINGING));
     //Neither Ringing or ON_HOOK we ignore 
     if(tu->state != TU_ON_HOOK && tu->state != TU_RINGING){ 
+        if(tu->state == TU_CONNECTED && tu->bridge != NULL){
+            tu_notify_ext(tu, tu->state, conf_extension(tu->bridge));
+            tu_unlock_peer(tu, peer);
+            return 0;
+        }
         if(tu->state == TU_CONNECTED){
-            dprintf(tu->fd, "%s %d\n",tu_state_names[tu->state], tu->peer->extension);  
-            sem_post(&tu->mutex);  
+            tu_notify(tu, tu->state, tu->peer);  
+            tu_unlock_peer(tu, peer);  
             return 0; 
         }
-        dprintf(tu->fd, "%s\n",tu_state_names[tu->state]);  
-        sem_post(&tu->mutex); 
+        tu_notify(tu, tu->state, NULL);  
+        tu_unlock_peer(tu, peer); 
         return 0; 
     } 
     //TU_ON_HOOK -> DIAL  
     if(tu->state == TU_ON_HOOK){
-        tu->state = TU_DIAL_TONE; 
-        dprintf(tu->fd, "%s\n",tu_state_names[TU_DIAL_TONE]);   
-        sem_post(&tu->mutex); 
+        tu_set_state(tu, TU_DIAL_TONE, TU_PICKUP_CMD); 
+        tu_notify(tu, TU_DIAL_TONE, NULL);   
+        tu_deliver_messages(tu);
+        tu_unlock_peer(tu, peer); 
         return 0;
     }  
-    // if(tu->state != TU_RINGING){
-    //     dprintf(tu->fd, "%s\n",tu_state_names[tu->state]);  
-    //     sem_post(&tu->mutex); 
-    //     return 0; 
-    // }   
-    TU* peer = tu->peer;  
     if(peer == NULL){ 
+        //We somehow got into an error
         sem_post(&tu->mutex); 
         return -1; 
     }
-    sem_post(&tu->mutex);
-    //IF NOT TU_RINING MAKE SURE WE RETURN 0 SINCE NO EFFECT   
-    // TU* first = (tu < target) ? tu: target; 
-    // TU* second = (tu < target) ? target: tu;    
-    sem_wait(&tu->mutex); 
-    sem_wait(&peer->mutex); 
-    if(tu->state != TU_RINGING || tu->peer != peer){
-        //We somehow got into an error, free locks  
-        sem_post(&peer->mutex); 
-        sem_post(&tu->mutex); 
-        return -1; 
-    } 
     //Now we can deal with TU Ringing and connecting to a peer!  
-    tu->state = TU_CONNECTED; 
-    peer->state = TU_CONNECTED; 
-    dprintf(tu->fd, "%s %d\n",tu_state_names[TU_CONNECTED], peer->fd);   
-    dprintf(peer->fd, "%s %d\n",tu_state_names[TU_CONNECTED], tu->fd);   
+    tu_set_state(tu, TU_CONNECTED, TU_PICKUP_CMD); 
+    tu_set_state(peer, TU_CONNECTED, TU_PICKUP_CMD); 
+    cdr_answer(tu->cdr);
+    tu_notify(tu, TU_CONNECTED, peer);   
+    tu_notify(peer, TU_CONNECTED, tu);   
+    if(pbx_config.resume_grace_ms > 0){
+        tu->history = peer->history = history_get(tu, peer);
+        if(peer->fd < 0){
+            //Held since before the call was answered, so everything from now on was missed
+            history_mark(peer->history, peer);
+        }
+    }
+    tu_deliver_messages(tu);
     sem_post(&peer->mutex); 
     sem_post(&tu->mutex);  
     return 0; 
-    abort();
 }
 // #endif
 
@@ -356,19 +828,34 @@ int tu_hangup(TU *tu) {
     if(tu == NULL){
         return -1; 
     }
-    sem_wait(&tu->mutex);  
-    TU* peer = tu->peer; 
+    TU* peer = tu_lock_peer(tu, TU_IN(TU_CONNECTED) | TU_IN(TU_RINGING) | TU_IN(TU_RING_BACK));
+    if(tu->state == TU_CONNECTED && tu->bridge != NULL){
+        //Leaving a conference; the bridge is told once we've let go of our lock
+        CONF_BRIDGE* bridge = tu->bridge;
+        tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD);
+        tu->bridge = NULL;
+        tu->call_id = 0;
+        tu_notify(tu, TU_ON_HOOK, tu);
+        tu_unlock_peer(tu, peer);
+        conf_leave(bridge, tu);
+        conf_unref(bridge);
+        return 0;
+    }
     if(tu->state == TU_CONNECTED){
         if(peer != NULL){
-            sem_wait(&peer->mutex); 
-            tu->state = TU_ON_HOOK; 
-            peer->state = TU_DIAL_TONE; 
+            tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD); 
+            tu_set_state(peer, TU_DIAL_TONE, TU_HANGUP_CMD); 
             tu->peer = NULL; 
             peer->peer = NULL;   
+            tu->call_id = peer->call_id = 0;
+            cdr_end(tu->cdr);
+            tu->cdr = peer->cdr = NULL;
+            history_put(tu->history);
+            tu->history = peer->history = NULL;
             tu_unref(tu, "UNREFERNCING TU FROM HANGUP");  
             tu_unref(peer, "UNREFERNCING TU FROM HANGUP"); 
-            dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-            dprintf(peer->fd, "%s\n", tu_state_names[TU_DIAL_TONE]);
+            tu_notify(tu, TU_ON_HOOK, tu);
+            tu_notify(peer, TU_DIAL_TONE, NULL);
             sem_post(&peer->mutex);
             sem_post(&tu->mutex); 
             return 0;
@@ -376,31 +863,23 @@ int tu_hangup(TU *tu) {
     } 
     if(tu->state == TU_RINGING){ 
         if(peer != NULL){
-        sem_wait(&peer->mutex); 
-        tu->state = TU_ON_HOOK; 
-        tu->peer = NULL;  
-        peer->peer = NULL;  
-        tu_unref(tu, "UNREFERNCING TU FROM HANGUP");  
-        tu_unref(peer, "UNREFERNCING TU FROM HANGUP"); 
-        peer->state = TU_DIAL_TONE; 
-        dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-        dprintf(peer->fd, "%s\n", tu_state_names[TU_DIAL_TONE]); 
-        sem_post(&tu->mutex);  
-        sem_post(&peer->mutex);
-        return 0; 
+            tu_hangup_ringing(tu, peer);
+            return 0; 
         } 
     }
     if(tu->state == TU_RING_BACK){
         if(peer != NULL) {
-            sem_wait(&peer->mutex);
-            tu->state = TU_ON_HOOK;
-            peer->state = TU_ON_HOOK;
+            tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD);
+            tu_set_state(peer, TU_ON_HOOK, TU_HANGUP_CMD);
             tu->peer = NULL;
             peer->peer = NULL; 
+            tu->call_id = peer->call_id = 0;
+            cdr_end(tu->cdr);
+            tu->cdr = peer->cdr = NULL;
              tu_unref(tu, "UNREFERNCING TU FROM HANGUP");  
             tu_unref(peer, "UNREFERNCING TU FROM HANGUP"); 
-            dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-            dprintf(peer->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], peer->extension);
+            tu_notify(tu, TU_ON_HOOK, tu);
+            tu_notify(peer, TU_ON_HOOK, peer);
             sem_post(&peer->mutex);
             sem_post(&tu->mutex); 
             return 0; 
@@ -408,32 +887,39 @@ int tu_hangup(TU *tu) {
     } 
     if(tu->state == TU_DIAL_TONE){
         tu->peer = NULL; 
-        tu->state = TU_ON_HOOK;
-        dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-        sem_post(&tu->mutex); 
+        tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD);
+        tu_notify(tu, TU_ON_HOOK, tu);
+        tu_unlock_peer(tu, peer); 
         return 0; 
     }
     if(tu->state == TU_BUSY_SIGNAL){
         tu->peer = NULL; 
-        tu->state = TU_ON_HOOK;
-        dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-        sem_post(&tu->mutex); 
+        if(tu->waiting != NULL){
+            //Giving up on a queue
+            acd_remove(tu->waiting, 0);
+            acd_waiter_free(tu->waiting);
+            tu->waiting = NULL;
+        }
+        tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD);
+        tu_notify(tu, TU_ON_HOOK, tu);
+        tu_unlock_peer(tu, peer); 
         return 0; 
     }
     if(tu->state == TU_ERROR){
         tu->peer = NULL; 
-        tu->state = TU_ON_HOOK;
-        dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-        sem_post(&tu->mutex); 
+        tu_set_state(tu, TU_ON_HOOK, TU_HANGUP_CMD);
+        tu_notify(tu, TU_ON_HOOK, tu);
+        tu_unlock_peer(tu, peer); 
         return 0; 
     } 
     if(tu->state == TU_ON_HOOK){
         tu->peer = NULL; //Shouldn't have a peer anyways 
         //State won't change 
-        dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension);
-        sem_post(&tu->mutex); 
+        tu_notify(tu, TU_ON_HOOK, tu);
+        tu_unlock_peer(tu, peer); 
         return 0; 
     }
+    tu_unlock_peer(tu, peer);
     return 0; 
     // TO BE IMPLEMENTED
 } 
@@ -457,25 +943,597 @@ int tu_hangup(TU *tu) {
 int tu_chat(TU *tu, char *msg) { 
     // TO BE IMPLEMENTED 
     if(tu == NULL) return -1;
+    //The peer is only written to, so it isn't locked: while we are, it stays linked
+    //(and referenced), its extension never changes, and its connection only changes
+    //under its output lock
     sem_wait(&tu->mutex);
-    if(tu->state != TU_CONNECTED || tu->peer == NULL) { 
+    TU *peer = tu->peer;
+    if(tu->state == TU_CONNECTED && tu->bridge != NULL){
+        //The bridge locks its members while fanning out, so ours must be released first
+        CONF_BRIDGE* bridge = tu->bridge;
+        conf_ref(bridge);
+        tu_notify_ext(tu, tu->state, conf_extension(bridge));
+        sem_post(&tu->mutex);
+        int ret = conf_chat(bridge, tu, msg);
+        conf_unref(bridge);
+        return ret;
+    }
+    if(tu->state != TU_CONNECTED || peer == NULL) { 
         if(tu->state == TU_ON_HOOK){
-            dprintf(tu->fd, "%s %d\n", tu_state_names[TU_ON_HOOK], tu->extension); 
+            tu_notify(tu, TU_ON_HOOK, tu); 
             sem_post(&tu->mutex); 
             return -1;
         }
-        dprintf(tu->fd, "%s\n", tu_state_names[tu->state]);
+        tu_notify(tu, tu->state, NULL);
         sem_post(&tu->mutex);
         return -1;
     }
-    TU *peer = tu->peer;
-    sem_wait(&peer->mutex); 
     if(msg == NULL) msg = "";
-    dprintf(peer->fd, "CHAT %s\n", msg);
-    dprintf(tu->fd, "%s %d\n", tu_state_names[tu->state], peer->fd);
+    size_t len = strlen(msg);
+    //Kept along with the write, so that a connection being held or resumed has either both or neither
+    sem_wait(tu_out(peer));
+    if(peer->proto == PROTO_BINARY){
+        PROTO_EVENT ev;
+        proto_event(&ev, PROTO_EV_CHAT, 0, 0, len);
+        struct iovec iov[2] = {{&ev, sizeof(ev)}, {msg, len}};
+        coro_writev(peer->fd, iov, 2, 0);
+    }else{
+        struct iovec iov[3] = {{"CHAT ", 5}, {msg, len}, {"\n", 1}};
+        coro_writev(peer->fd, iov, 3, 0);
+    }
+    history_add(tu->history, peer, msg, len);
+    sem_post(tu_out(peer));
+    cdr_chat(tu->cdr, len);
+    tu_notify(tu, tu->state, peer);
     sem_post(&tu->mutex);
-    sem_post(&peer->mutex);
     return 0;
 }
 // #endif
- 
\ No newline at end of file
+ 
+/*
+ * Send text to a binary client as one frame, without waiting for room unless
+ * part of the frame has gone already, in which case the rest has to follow
+ * before anything else can.  Must be called with the TU's output lock held.
+ *
+ * @return len if the frame was sent, otherwise -1 with errno set.
+ */
+static ssize_t tu_send_frame(TU *tu, const void *buf, size_t len) {
+    PROTO_EVENT ev;
+    proto_event(&ev, PROTO_EV_TEXT, 0, 0, len);
+    struct iovec iov[2] = {{&ev, sizeof(ev)}, {(void *)buf, len}};
+    ssize_t n = coro_writev(tu->fd, iov, 2, CORO_NOWAIT);
+    if(n < 0){
+        return -1;
+    }
+    size_t left = sizeof(ev) + len - n;
+    while(left > 0){
+        //Only a short frame is ever left over, so waiting for room is brief
+        size_t done = sizeof(ev) + len - left;
+        struct iovec rest[2];
+        int cnt = 0;
+        if(done < sizeof(ev)){
+            rest[cnt++] = (struct iovec){ (char *)&ev + done, sizeof(ev) - done };
+            done = sizeof(ev);
+        }
+        rest[cnt++] = (struct iovec){ (char *)buf + (done - sizeof(ev)), len - (done - sizeof(ev)) };
+        n = coro_writev(tu->fd, rest, cnt, 0);
+        if(n <= 0){
+            return -1;
+        }
+        left -= n;
+    }
+    return len;
+}
+
+/*
+ * Send the rest of what a write that didn't wait for room only sent some of,
+ * with the TU's output lock held all the while.  A client that hasn't taken
+ * it all within TU_FINISH_MS is cut off, rather than left with part of it.
+ *
+ * @return len if it has all gone, otherwise -1 with errno set.
+ */
+static ssize_t tu_finish(TU *tu, const char *buf, size_t len, size_t sent) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(sent < len){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = TU_FINISH_MS - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        struct pollfd pfd = { .fd = tu->fd, .events = POLLOUT };
+        if(left <= 0 || (poll(&pfd, 1, left) < 0 && errno != EINTR)){
+            //Its service sees the connection end, and unregisters it
+            shutdown(tu->fd, SHUT_RDWR);
+            errno = EPIPE;
+            return -1;
+        }
+        ssize_t n = send(tu->fd, buf + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            return -1;
+        }
+        sent += n > 0 ? n : 0;
+    }
+    return len;
+}
+
+/*
+ * Send bytes on the network connection underlying a TU without waiting for room,
+ * in between its notifications.  Used to relay conference chats.  On a
+ * connection served through io_uring they are queued like its notifications.
+ *
+ * @param tu  The TU.
+ * @param buf  The bytes to send.
+ * @param len  The number of bytes.
+ * @return the number of bytes sent, or -1 with errno set (to EAGAIN if the
+ * connection can't take any more right now).  Once some of the bytes have
+ * gone, the rest are sent before anything else can be written to the
+ * connection (see tu_finish()), so a client never gets half a chat line with
+ * a notification in the middle of it.  To a binary client, the bytes go as
+ * one PROTO_EV_TEXT frame, all of them or none.
+ */
+ssize_t tu_send(TU *tu, const void *buf, size_t len) {
+    if(tu == NULL){
+        errno = EINVAL;
+        return -1;
+    }
+    //Only the output lock, so a relay never waits for the member's transitions
+    sem_wait(tu_out(tu));
+    if(tu->unplugged){
+        //Its connection is about to be closed, and the descriptor may be reused
+        sem_post(tu_out(tu));
+        errno = EPIPE;
+        return -1;
+    }
+    if(tu->proto == PROTO_BINARY){
+        ssize_t n = tu_send_frame(tu, buf, len);
+        int saved_errno = errno;
+        sem_post(tu_out(tu));
+        errno = saved_errno;
+        return n;
+    }
+    //Not a socket (tests write to files and pipes), this is just a write
+    struct iovec iov = { (void *)buf, len };
+    ssize_t n = coro_writev(tu->fd, &iov, 1, CORO_NOWAIT);
+    if(n > 0 && (size_t)n < len){
+        n = tu_finish(tu, buf, len, n);
+    }
+    int saved_errno = errno;
+    sem_post(tu_out(tu));
+    errno = saved_errno;
+    return n;
+}
+
+/*
+ * Connect a TU to a conference bridge.
+ *   If the TU is not in the TU_DIAL_TONE state, then there is no effect.
+ *   Otherwise the TU goes to the TU_CONNECTED state, connected to the bridge
+ *     rather than to a peer TU (this holds a reference to the bridge until the
+ *     TU hangs up).
+ * In all cases, a notification of the resulting state of the TU is sent to the
+ * associated network client, giving the bridge's extension if it is connected.
+ * Called by the bridge, with the bridge locked.
+ *
+ * @param tu  The TU joining the bridge.
+ * @param bridge  The bridge.
+ * @return 0 if the TU was connected, otherwise -1.
+ */
+int tu_join_bridge(TU *tu, CONF_BRIDGE *bridge) {
+    if(tu == NULL || bridge == NULL){
+        return -1;
+    }
+    sem_wait(&tu->mutex);
+    if(tu->state != TU_DIAL_TONE){
+        tu_notify_current(tu);
+        sem_post(&tu->mutex);
+        return -1;
+    }
+    conf_ref(bridge);
+    tu->bridge = bridge;
+    tu->call_id = conf_call_id(bridge);
+    tu_set_state(tu, TU_CONNECTED, TU_CONF_CMD);
+    tu_notify_ext(tu, TU_CONNECTED, conf_extension(bridge));
+    sem_post(&tu->mutex);
+    return 0;
+}
+
+/*
+ * Make a TU a member of a hunt group.
+ *   If the TU is already a member of a group, or member is NULL, there is no
+ *     effect other than a notification of its current state.
+ *   Otherwise the TU takes the membership and puts itself on the group's idle
+ *     or busy list according to its state, and its client is told the group's
+ *     extension as "HUNT <ext>".
+ * Called by the group, without the group locked.
+ *
+ * @param tu  The TU joining the group.
+ * @param member  The membership, or NULL if the TU can't join.
+ * @param group_ext  The extension of the group.
+ * @return 0 if the TU took the membership, otherwise -1.
+ */
+int tu_join_hunt(TU *tu, HUNT_MEMBER *member, int group_ext) {
+    if(tu == NULL){
+        return -1;
+    }
+    sem_wait(&tu->mutex);
+    if(member == NULL || tu->hunt != NULL){
+        tu_notify_current(tu);
+        sem_post(&tu->mutex);
+        return -1;
+    }
+    tu->hunt = member;
+    hunt_member_set_idle(member, tu->state == TU_ON_HOOK);
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "HUNT %d\n", group_ext);
+    tu_write(tu, buf, len);
+    sem_post(&tu->mutex);
+    return 0;
+}
+
+/*
+ * Give up a TU's membership of a hunt group.  Once this returns, the TU no
+ * longer tells the group about its state changes.
+ *
+ * @param tu  The TU.
+ * @return the membership, for the group to dispose of, or NULL if the TU
+ * wasn't in a group.
+ */
+HUNT_MEMBER *tu_leave_hunt(TU *tu) {
+    if(tu == NULL){
+        return NULL;
+    }
+    sem_wait(&tu->mutex);
+    HUNT_MEMBER *member = tu->hunt;
+    tu->hunt = NULL;
+    sem_post(&tu->mutex);
+    return member;
+}
+
+/*
+ * Put a TU that has dialed a hunt group with nobody free into the group's queue.
+ *   If the TU is not in the TU_DIAL_TONE state, then there is no effect.
+ *   Otherwise it goes to the TU_BUSY_SIGNAL state, queued, and is told its
+ *     position as "QUEUED <position>" (or just the busy signal if the queue
+ *     has closed).
+ *
+ * @param tu  The calling TU.
+ * @param queue  The queue.
+ * @return 0 if the TU was queued, otherwise -1.
+ */
+int tu_wait_queue(TU *tu, ACD_QUEUE *queue) {
+    if(tu == NULL || queue == NULL){
+        return -1;
+    }
+    sem_wait(&tu->mutex);
+    if(tu->state != TU_DIAL_TONE){
+        tu_notify_current(tu);
+        sem_post(&tu->mutex);
+        return -1;
+    }
+    int ret = tu_wait_locked(tu, queue);
+    if(ret < 0){
+        tu_set_state(tu, TU_BUSY_SIGNAL, TU_DIAL_CMD);
+        tu_notify(tu, TU_BUSY_SIGNAL, NULL);
+    }
+    sem_post(&tu->mutex);
+    //Somebody may have become free while nobody was queued to notice
+    if(ret == 0){
+        acd_kick(queue);
+    }
+    return ret;
+}
+
+/*
+ * Connect a queued caller to a target that was free a moment ago, as if the
+ * caller had just dialed it: the caller goes to TU_RING_BACK and the target
+ * to TU_RINGING, and both clients are notified.  Called by the queue thread.
+ *
+ * @param caller  The caller at the head of the queue.
+ * @param target  The TU to connect it to.
+ * @param queue  The queue the caller is expected to be waiting in.
+ * @return 0 if the call was set up, 1 if the caller is no longer waiting in
+ * the queue, or -1 if the target is not free after all.
+ */
+int tu_connect_waiting(TU *caller, TU *target, ACD_QUEUE *queue) {
+    if(caller == NULL || target == NULL || caller == target){
+        return -1;
+    }
+    tu_lock_both(caller, target);
+    if(caller->waiting == NULL || acd_waiter_queue(caller->waiting) != queue){
+        sem_post(&target->mutex);
+        sem_post(&caller->mutex);
+        return 1;
+    }
+    if(target->state != TU_ON_HOOK || target->peer != NULL){
+        sem_post(&target->mutex);
+        sem_post(&caller->mutex);
+        return -1;
+    }
+    acd_remove(caller->waiting, 1);
+    acd_waiter_free(caller->waiting);
+    caller->waiting = NULL;
+    tu_start_call(caller, target);
+    sem_post(&target->mutex);
+    sem_post(&caller->mutex);
+    return 0;
+}
+
+/*
+ * Tell a queued caller its new position in the queue, if it is still waiting there.
+ *
+ * @param tu  The caller.
+ * @param queue  The queue.
+ * @param position  Its position, counting from 1.
+ */
+void tu_notify_queued(TU *tu, ACD_QUEUE *queue, int position) {
+    sem_wait(&tu->mutex);
+    if(tu->waiting != NULL && acd_waiter_queue(tu->waiting) == queue){
+        tu_notify_position(tu, position);
+    }
+    sem_post(&tu->mutex);
+}
+
+/*
+ * Let a queued caller know that the queue it was waiting in has closed, leaving
+ * it with the busy signal.
+ *
+ * @param tu  The caller.
+ * @param queue  The queue.
+ */
+void tu_queue_cancelled(TU *tu, ACD_QUEUE *queue) {
+    sem_wait(&tu->mutex);
+    if(tu->waiting != NULL && acd_waiter_queue(tu->waiting) == queue){
+        acd_waiter_free(tu->waiting);
+        tu->waiting = NULL;
+        tu_notify(tu, tu->state, NULL);
+    }
+    sem_post(&tu->mutex);
+}
+
+/*
+ * Close the queue of callers waiting for a TU, if it has one, giving them the
+ * busy signal.  Called when the TU is unregistered.
+ *
+ * @param tu  The TU.
+ */
+void tu_close_queue(TU *tu) {
+    if(tu == NULL){
+        return;
+    }
+    sem_wait(&tu->mutex);
+    ACD_QUEUE *queue = tu->queue;
+    sem_wait(tu_out(tu));
+    tu->unplugged = 1;
+    sem_post(tu_out(tu));
+    sem_post(&tu->mutex);
+    acd_queue_close(queue);
+}
+
+/*
+ * Hold a TU whose connection has dropped, so that its client can resume it
+ * (see resume.h).  The TU keeps its state and its peer.  From now on nothing
+ * is sent to the old connection, which the caller may close once this returns,
+ * and any chats sent to the TU are kept to be replayed.
+ *
+ * @param tu  The TU.
+ * @return 0 if the TU can be held, or -1 if it is in a conference (whose relay
+ * keeps hold of the connection) or being unregistered, in which case nothing
+ * has changed.
+ */
+int tu_hold(TU *tu) {
+    if(tu == NULL){
+        return -1;
+    }
+    sem_wait(&tu->mutex);
+    if(tu->bridge != NULL || tu->unplugged){
+        sem_post(&tu->mutex);
+        return -1;
+    }
+    sem_wait(tu_out(tu));
+    history_mark(tu->history, tu);
+    tu->fd = -1;
+    sem_post(tu_out(tu));
+    sem_post(&tu->mutex);
+    return 0;
+}
+
+/*
+ * Take the network connection away from a TU, which is about to be unregistered
+ * without its client hearing about it, because the connection is being handed
+ * to a held TU.  Only needed when a client resumes after it has registered.
+ *
+ * @param tu  The TU.
+ * @return the file descriptor of the connection it had.
+ */
+int tu_detach(TU *tu) {
+    sem_wait(&tu->mutex);
+    sem_wait(tu_out(tu));
+    int fd = tu->fd;
+    tu->fd = -1;
+    sem_post(tu_out(tu));
+    sem_post(&tu->mutex);
+    return fd;
+}
+
+/*
+ * Give a held TU a new network connection, and send its client the TU's state
+ * followed by the chats it missed while it had none, in a single write.
+ *
+ * @param tu  The held TU.
+ * @param fd  The file descriptor of the new connection.
+ * @param proto  What the new connection speaks (PROTO_TEXT or PROTO_BINARY).
+ */
+void tu_rebind(TU *tu, int fd, int proto) {
+    sem_wait(&tu->mutex);
+    sem_wait(tu_out(tu));
+    tu->fd = fd;
+    tu->proto = proto;
+    size_t missed_len;
+    char *missed = history_missed(tu->history, tu, &missed_len);
+    if(proto == PROTO_BINARY){
+        int ext = tu->state == TU_CONNECTED && tu->bridge != NULL ? conf_extension(tu->bridge) :
+                  tu->state == TU_ON_HOOK ? tu->extension :
+                  tu->state == TU_CONNECTED && tu->peer != NULL ? tu->peer->extension : 0;
+        PROTO_EVENT ev[2];
+        proto_event(&ev[0], PROTO_EV_STATE, tu->state, ext, 0);
+        proto_event(&ev[1], PROTO_EV_TEXT, 0, 0, missed_len);
+        struct iovec iov[2] = {{ev, sizeof(ev)}, {missed, missed_len}};
+        if(missed != NULL){
+            coro_writev(tu->fd, iov, 2, 0);
+        }else{
+            iov[0].iov_len = sizeof(ev[0]);
+            coro_writev(tu->fd, iov, 1, 0);
+        }
+        free(missed);
+        sem_post(tu_out(tu));
+        sem_post(&tu->mutex);
+        return;
+    }
+    char line[32];
+    int len;
+    if(tu->state == TU_CONNECTED && tu->bridge != NULL){
+        len = snprintf(line, sizeof(line), "%s %d\n", tu_state_names[tu->state], conf_extension(tu->bridge));
+    }else{
+        TU *of = tu->state == TU_ON_HOOK ? tu : tu->state == TU_CONNECTED ? tu->peer : NULL;
+        len = snprintf(line, sizeof(line), "%s%s", tu_state_names[tu->state], of != NULL ? of->ext_str : "\n");
+    }
+    struct iovec iov[2] = {{line, len}, {missed, missed_len}};
+    coro_writev(tu->fd, iov, missed != NULL ? 2 : 1, 0);
+    free(missed);
+    sem_post(tu_out(tu));
+    sem_post(&tu->mutex);
+}
+
+/*
+ * Switch the connection of a TU to binary framing (see proto.h), answering the
+ * client with PROTO_MAGIC so that it knows where the frames start.
+ *
+ * @param tu  The TU.
+ * @return 0 if successful, -1 if it had switched already.
+ */
+int tu_set_binary(TU *tu) {
+    sem_wait(&tu->mutex);
+    if(tu->proto == PROTO_BINARY){
+        sem_post(&tu->mutex);
+        return -1;
+    }
+    //No frame may go out between the switch and the magic
+    sem_wait(tu_out(tu));
+    tu->proto = PROTO_BINARY;
+    unsigned char magic = PROTO_MAGIC;
+    struct iovec iov = { &magic, 1 };
+    coro_writev(tu->fd, &iov, 1, 0);
+    sem_post(tu_out(tu));
+    sem_post(&tu->mutex);
+    return 0;
+}
+
+/*
+ * Tell what the connection of a TU speaks.
+ *
+ * @return PROTO_TEXT or PROTO_BINARY.
+ */
+int tu_get_proto(TU *tu) {
+    sem_wait(&tu->mutex);
+    int proto = tu->proto;
+    sem_post(&tu->mutex);
+    return proto;
+}
+
+/*
+ * Set up a new TU for a client handed over by another worker (see shard.h),
+ * which had its extension there and was in TU_DIAL_TONE when it left.  Nobody
+ * is notified: as far as its client knows, nothing has happened.  Must be
+ * called before the TU is registered.
+ *
+ * @param tu  The new TU.
+ * @param ext  The extension the client had.
+ * @param proto  What its connection speaks (PROTO_TEXT or PROTO_BINARY).
+ */
+void tu_adopt(TU *tu, int ext, int proto) {
+    sem_wait(&tu->mutex);
+    tu->extension = ext;
+    tu->ext_len = snprintf(tu->ext_str, sizeof(tu->ext_str), " %d\n", ext);
+    tu->state = TU_DIAL_TONE;
+    tu->proto = proto;
+    sem_post(&tu->mutex);
+}
+
+/*
+ * Take a snapshot of what a TU is doing, for a new server process to carry on
+ * with (see upgrade.h).  Only a TU on its own or in a call with one other can
+ * be carried over: not one in a conference, a hunt group or a call queue, nor
+ * one held for its client to come back.
+ *
+ * @param tu  The TU.
+ * @param snap  Filled in with the snapshot.
+ * @return 0 if successful, -1 if the TU can't be carried over.
+ */
+int tu_snapshot(TU *tu, TU_SNAPSHOT *snap) {
+    memset(snap, 0, sizeof(*snap));
+    sem_wait(&tu->mutex);
+    if(tu->bridge != NULL || tu->hunt != NULL || tu->waiting != NULL || tu->fd < 0){
+        sem_post(&tu->mutex);
+        return -1;
+    }
+    snap->ext = tu->extension;
+    snap->fd = tu->fd;
+    snap->peer = tu->peer != NULL ? tu->peer->extension : 0;
+    snap->call_id = tu->call_id;
+    snap->state = tu->state;
+    snap->proto = tu->proto;
+    if(tu->cdr != NULL){
+        snap->has_cdr = 1;
+        snap->cdr = *tu->cdr;
+    }
+    sem_post(&tu->mutex);
+    //Its client keeps the identity it would come back with after a restart
+    if(regmap_enabled() && resume_token(tu, &snap->token) < 0){
+        snap->token = 0;
+    }
+    return 0;
+}
+
+/*
+ * Set up a new TU as the one a snapshot was taken of, without its call (see
+ * tu_restore_call()).  Nobody is notified.  Must be called before the TU is
+ * registered.
+ *
+ * @param tu  The new TU.
+ * @param snap  The snapshot.
+ */
+void tu_restore(TU *tu, const TU_SNAPSHOT *snap) {
+    sem_wait(&tu->mutex);
+    tu->extension = snap->ext;
+    tu->ext_len = snprintf(tu->ext_str, sizeof(tu->ext_str), " %d\n", snap->ext);
+    tu->state = snap->state;
+    tu->proto = snap->proto;
+    sem_post(&tu->mutex);
+    if(snap->token != 0){
+        resume_keep(tu, snap->token);
+    }
+}
+
+/*
+ * Put two TUs set up with tu_restore() back in the call they were in, with
+ * the same call id and record, and a ring timer started afresh for whichever
+ * of them is ringing.  Nobody is notified.
+ *
+ * @param tu  One of the TUs.
+ * @param peer  The other.
+ * @param snap  The snapshot tu was set up from.
+ */
+void tu_restore_call(TU *tu, TU *peer, const TU_SNAPSHOT *snap) {
+    tu_lock_both(tu, peer);
+    tu->peer = peer;
+    peer->peer = tu;
+    tu->call_id = peer->call_id = snap->call_id;
+    tu->cdr = peer->cdr = snap->has_cdr ? cdr_resume(&snap->cdr) : NULL;
+    tu_ref(tu, "Call carried over");
+    tu_ref(peer, "Call carried over");
+    if(tu->state == TU_RINGING){
+        tu_arm_ring_timer(tu);
+    }
+    if(peer->state == TU_RINGING){
+        tu_arm_ring_timer(peer);
+    }
+    sem_post(&peer->mutex);
+    sem_post(&tu->mutex);
+}
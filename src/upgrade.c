@@ -0,0 +1,843 @@
+/*
+ * Upgrading the server in place: handing the sockets, the clients and what
+ * their TUs are doing to a new process of the server (see upgrade.h).
+ */
+#define _GNU_SOURCE  //close_range
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "upgrade.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "config.h"
+#include "coro.h"
+#include "timer.h"
+#include "trace.h"
+#include "cdr.h"
+#include "msglog.h"
+#include "presence.h"
+#include "shard.h"
+#include "debug.h"
+
+extern char **environ;
+
+/*
+ * Where each connection's service is, as far as an upgrade is concerned.
+ */
+#define SLOT_FREE 0       //No service
+#define SLOT_STARTING 1   //Accepted, its thread or coroutine not yet running
+#define SLOT_SERVING 2
+#define SLOT_PARKED 3     //Stopped between commands for an upgrade (upgrade_park())
+
+/*
+ * What is known about a connection, in a table indexed by its descriptor.
+ * In the old process, a parked service's input is on its own stack, where it
+ * stays until the process exits or the service carries on.  In the new one,
+ * a client taken over waits here for its service to pick up its TU.
+ */
+typedef struct upgrade_slot {
+    _Atomic int state;
+    uint8_t fresh;
+    char* input;          //Old: the service's own input, then what had been read ahead
+    uint32_t len;         //Old: bytes of both; new: bytes of input taken over
+    TU* tu;               //New: the TU, until its service adopts it
+    int32_t peer;         //New: the extension of its peer, 0 if none
+} UPGRADE_SLOT;
+
+/*
+ * The TUs collected for a snapshot.
+ */
+typedef struct upgrade_take {
+    TU_SNAPSHOT* snaps;
+    int count;
+    int size;
+} UPGRADE_TAKE;
+
+static pthread_once_t upgrade_once = PTHREAD_ONCE_INIT;
+static UPGRADE_SLOT* slots;         //NULL unless an upgrade can happen (or has)
+static int num_slots;
+static _Atomic int num_active;      //Services STARTING or SERVING
+static _Atomic int parking;         //Services are to stop at the next upgrade_park()
+
+static char upgrade_path[PATH_MAX];   //The binary we were started from
+static char** upgrade_argv;
+static int listen_fds[2] = {-1, -1};
+static atomic_long num_started, num_refused;
+
+//In the new process: the socket to the old one and the clients taken over
+static int upgrade_fd = -1;
+static int* taken;
+static UPGRADE_CLIENT* taken_clients;
+static int num_taken = -1;
+static uint64_t stopped_ns;
+static long cutover_us;
+
+/*
+ * Make the table of connections, with room for every descriptor we can have.
+ */
+static void upgrade_setup(void) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY){
+        return;
+    }
+    slots = calloc(rl.rlim_cur, sizeof(UPGRADE_SLOT));
+    num_slots = slots != NULL ? (int)rl.rlim_cur : 0;
+}
+
+static UPGRADE_SLOT *upgrade_slot(int fd) {
+    return slots != NULL && fd >= 0 && fd < num_slots ? &slots[fd] : NULL;
+}
+
+static uint64_t upgrade_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Note that a connection has been accepted and its service is being started,
+ * so that an upgrade waits for it to stop too.
+ *
+ * @param fd  The connection.
+ */
+void upgrade_starting(int fd) {
+    UPGRADE_SLOT *slot = upgrade_slot(fd);
+    if(slot != NULL){
+        atomic_store(&slot->state, SLOT_STARTING);
+        atomic_fetch_add(&num_active, 1);
+    }
+}
+
+/*
+ * Note that the service of a connection (or a loop accepting on a listening
+ * socket) is running, and has to stop before an upgrade can go ahead.
+ *
+ * @param fd  The connection.
+ */
+void upgrade_enter(int fd) {
+    UPGRADE_SLOT *slot = upgrade_slot(fd);
+    if(slot == NULL){
+        return;
+    }
+    //Counted already if it was started with upgrade_starting()
+    if(atomic_exchange(&slot->state, SLOT_SERVING) == SLOT_FREE){
+        atomic_fetch_add(&num_active, 1);
+    }
+}
+
+/*
+ * Note that the service of a connection is over, before the connection is
+ * closed and its descriptor can be reused.
+ *
+ * @param fd  The connection.
+ */
+void upgrade_leave(int fd) {
+    UPGRADE_SLOT *slot = upgrade_slot(fd);
+    if(slot != NULL && atomic_exchange(&slot->state, SLOT_FREE) != SLOT_FREE){
+        atomic_fetch_sub(&num_active, 1);
+    }
+}
+
+/*
+ * Called by a service whose read was interrupted (EINTR), to stop between
+ * commands if an upgrade is under way.  Its connection goes to the new
+ * process with the input given (what the service had read of the command it
+ * was reading) followed by whatever had been read ahead, and the service
+ * never returns.  If the upgrade is called off it carries on from where it
+ * was, and anything read ahead is read again.
+ *
+ * @param fd  The connection.
+ * @param prefix  The service's own input, read from the connection.
+ * @param len  How much of it there is.
+ * @param fresh  Nothing at all has been read from the connection yet.
+ * @return 0 if the service should carry on, or -1 if the connection has to be
+ * dropped (too much was read ahead to go along with it).
+ */
+int upgrade_park(int fd, const void *prefix, size_t len, int fresh) {
+    UPGRADE_SLOT *slot = upgrade_slot(fd);
+    if(slot == NULL || !atomic_load(&parking)){
+        return 0;
+    }
+    char input[UPGRADE_MAX_INPUT];
+    if(len > sizeof(input)){
+        return -1;
+    }
+    memcpy(input, prefix, len);
+    ssize_t n = coro_release(fd, input + len, sizeof(input) - len);
+    if(n < 0){
+        return -1;
+    }
+    slot->input = input;
+    slot->len = len + n;
+    slot->fresh = fresh;
+    atomic_store(&slot->state, SLOT_PARKED);
+    atomic_fetch_sub(&num_active, 1);
+    coro_park();
+    //Called off
+    atomic_store(&slot->state, SLOT_SERVING);
+    atomic_fetch_add(&num_active, 1);
+    slot->input = NULL;
+    return coro_rejoin(fd, input + len, n) < 0 ? -1 : 0;
+}
+
+/*
+ * Why an upgrade can't be done now, or NULL if it can.
+ */
+static const char *upgrade_refusal(void) {
+    if(pbx_config.resume_grace_ms > 0){
+        return "phones are held for clients to come back to (-g)";
+    }
+    if(presence_subscriptions() > 0){
+        return "extensions are being watched";
+    }
+    MSGLOG_STATS ms;
+    if(msglog_get_stats(&ms) == 0 && !ms.durable && ms.pending > 0){
+        return "messages are waiting in a log kept only in memory";
+    }
+    return NULL;
+}
+
+/*
+ * Send one message, with descriptors.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int upgrade_send(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    union {
+        char buf[CMSG_SPACE(UPGRADE_BATCH * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    if(nfds > 0){
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    ssize_t n;
+    do{
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    }while(n < 0 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Receive one message, waiting no longer than timeout_ms for it.  Descriptors
+ * that come with it are put in fds if it isn't NULL, and closed otherwise.
+ *
+ * @param nfds  Set to how many descriptors came.
+ * @return the length of the message, or -1 if none came (or it wasn't one of ours).
+ */
+static ssize_t upgrade_recv(int sock, int timeout_ms, void *buf, size_t size, int *fds, int *nfds) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    int ready;
+    do{
+        ready = poll(&pfd, 1, timeout_ms);
+    }while(ready < 0 && errno == EINTR);
+    if(ready <= 0){
+        return -1;
+    }
+    struct iovec iov = {buf, size};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    union {
+        char buf[CMSG_SPACE(UPGRADE_BATCH * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do{
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    }while(n < 0 && errno == EINTR);
+    int got = 0;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if(n > 0 && cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS){
+        got = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < got; i++){
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if(fds != NULL){
+                fds[i] = fd;
+            }else{
+                close(fd);
+            }
+        }
+    }
+    if(nfds != NULL){
+        *nfds = got;
+    }
+    UPGRADE_MSG *msg = buf;
+    if(n < (ssize_t)sizeof(UPGRADE_MSG) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+       || msg->magic != UPGRADE_MAGIC || msg->version != UPGRADE_VERSION){
+        return -1;
+    }
+    return n;
+}
+
+static void upgrade_header(UPGRADE_MSG *msg, int type) {
+    memset(msg, 0, sizeof(*msg));
+    msg->magic = UPGRADE_MAGIC;
+    msg->version = UPGRADE_VERSION;
+    msg->type = type;
+}
+
+/*
+ * Start the new server, as a child of this one, with its end of a socketpair
+ * to us named in its environment.
+ *
+ * @param sock  Set to our end.
+ * @return the child's pid, or -1 if it couldn't be started.
+ */
+static pid_t upgrade_spawn(int *sock) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+        return -1;
+    }
+    //Everything the child needs is made before the fork: only a few system calls are safe after it
+    char var[64], worker[64];
+    snprintf(var, sizeof(var), "%s=%d", UPGRADE_ENV, sv[1]);
+    snprintf(worker, sizeof(worker), "%s=%d", SHARD_WORKER_ENV, shard_worker());
+    size_t n = 0;
+    while(environ[n] != NULL){
+        n++;
+    }
+    char **envp = malloc((n + 3) * sizeof(char *));
+    if(envp == NULL){
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    size_t k = 0;
+    for(size_t i = 0; i < n; i++){
+        if(strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0){
+            envp[k++] = environ[i];
+        }
+    }
+    envp[k++] = var;
+    //A worker's successor becomes the same worker (see shard.h)
+    if(shard_worker() >= 0){
+        envp[k++] = worker;
+    }
+    envp[k] = NULL;
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pid_t pid = fork();
+    if(pid == 0){
+        //Another SIGUSR1 mustn't kill it before it is ready for one
+        sigprocmask(SIG_SETMASK, &usr1, NULL);
+        fcntl(sv[1], F_SETFD, 0);
+        //Nothing else of ours goes with it: it is sent what it needs
+        if(sv[1] > 3){
+            close_range(3, sv[1] - 1, 0);
+        }
+        close_range(sv[1] + 1, ~0U, 0);
+        execve(upgrade_path, upgrade_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if(pid < 0){
+        close(sv[0]);
+        return -1;
+    }
+    *sock = sv[0];
+    return pid;
+}
+
+/*
+ * Stop accepting and get every service to stop between commands, then pause
+ * the timers, so that nothing changes from here on.
+ *
+ * @return 0 if successful, or -1 if some service didn't stop in time, with
+ * things left for upgrade_unstop() to undo.
+ */
+static int upgrade_stop(void) {
+    atomic_store(&parking, 1);
+    //Under io_uring nobody loops on accept(): the scheduler is told to stop it
+    if(pbx_config.io_uring){
+        for(int i = 0; i < 2; i++){
+            if(listen_fds[i] >= 0){
+                coro_pause_listen(listen_fds[i], 1);
+            }
+        }
+    }
+    coro_interrupt(1);
+    uint64_t deadline = upgrade_now_ns() + (uint64_t)UPGRADE_PARK_MS * 1000000;
+    while(atomic_load(&num_active) > 0){
+        if(upgrade_now_ns() > deadline){
+            return -1;
+        }
+        usleep(100);
+    }
+    timer_pause();
+    return 0;
+}
+
+/*
+ * Let everything carry on as before an upgrade that has been called off.
+ */
+static void upgrade_unstop(void) {
+    timer_resume();
+    atomic_store(&parking, 0);
+    coro_interrupt(0);
+    if(pbx_config.io_uring){
+        for(int i = 0; i < 2; i++){
+            if(listen_fds[i] >= 0){
+                coro_pause_listen(listen_fds[i], 0);
+            }
+        }
+    }
+}
+
+/*
+ * Add a TU to a snapshot, if it and its service are in a state to be
+ * handed over.
+ */
+static int upgrade_take(TU *tu, void *arg) {
+    UPGRADE_TAKE *take = arg;
+    if(take->count == take->size){
+        int size = take->size > 0 ? take->size * 2 : 256;
+        TU_SNAPSHOT *snaps = realloc(take->snaps, size * sizeof(TU_SNAPSHOT));
+        if(snaps == NULL){
+            return -1;
+        }
+        take->snaps = snaps;
+        take->size = size;
+    }
+    TU_SNAPSHOT *snap = &take->snaps[take->count];
+    if(tu_snapshot(tu, snap) < 0){
+        return -1;
+    }
+    UPGRADE_SLOT *slot = upgrade_slot(snap->fd);
+    if(slot == NULL || atomic_load(&slot->state) != SLOT_PARKED){
+        return -1;
+    }
+    take->count++;
+    return 0;
+}
+
+/*
+ * Send everything to the new server once everyone has stopped, and wait for
+ * it to say it has taken it all over.
+ *
+ * @return NULL if it has, otherwise why not.
+ */
+static const char *upgrade_hand_over(int sock, uint64_t stopped) {
+    UPGRADE_TAKE take = { NULL, 0, 0 };
+    if(pbx_for_each(pbx, upgrade_take, &take) < 0){
+        free(take.snaps);
+        return "someone is in a conference, hunt group or queue";
+    }
+    const char *why = "cannot send to the new server";
+    char *buf = malloc(UPGRADE_BATCH_BYTES);
+    if(buf == NULL){
+        free(take.snaps);
+        return why;
+    }
+    UPGRADE_MSG *msg = (UPGRADE_MSG *)buf;
+    upgrade_header(msg, UPGRADE_STATE);
+    msg->count = take.count;
+    msg->call_id = trace_last_call_id();
+    msg->local = listen_fds[1] >= 0;
+    msg->stopped_ns = stopped;
+    //A worker's sockets to the others go with its own
+    int fds[UPGRADE_BATCH];
+    int base = msg->local ? 2 : 1;
+    memcpy(fds, listen_fds, base * sizeof(int));
+    int shard = shard_export(fds + base, UPGRADE_BATCH - base);
+    if(shard < 0){
+        goto done;
+    }
+    msg->shard = shard;
+    if(upgrade_send(sock, msg, sizeof(*msg), fds, base + shard) < 0){
+        goto done;
+    }
+    //The clients, as many at a time as fit
+    int n = 0;
+    size_t off = sizeof(UPGRADE_MSG);
+    for(int i = 0; i <= take.count; i++){
+        UPGRADE_SLOT *slot = i < take.count ? upgrade_slot(take.snaps[i].fd) : NULL;
+        size_t need = slot != NULL ? sizeof(UPGRADE_CLIENT) + slot->len : 0;
+        if(n > 0 && (slot == NULL || n == UPGRADE_BATCH || off + need > UPGRADE_BATCH_BYTES)){
+            upgrade_header(msg, UPGRADE_CLIENTS);
+            msg->count = n;
+            if(upgrade_send(sock, buf, off, fds, n) < 0){
+                goto done;
+            }
+            n = 0;
+            off = sizeof(UPGRADE_MSG);
+        }
+        if(slot == NULL){
+            break;
+        }
+        UPGRADE_CLIENT client;
+        memset(&client, 0, sizeof(client));
+        client.tu = take.snaps[i];
+        client.input = slot->len;
+        client.fresh = slot->fresh;
+        memcpy(buf + off, &client, sizeof(client));
+        memcpy(buf + off + sizeof(client), slot->input, slot->len);
+        off += need;
+        fds[n++] = take.snaps[i].fd;
+    }
+    UPGRADE_MSG done;
+    if(upgrade_recv(sock, UPGRADE_DONE_MS, &done, sizeof(done), NULL, NULL) < 0 || done.type != UPGRADE_DONE){
+        why = "the new server did not take over";
+        goto done;
+    }
+    why = NULL;
+done:
+    free(buf);
+    free(take.snaps);
+    return why;
+}
+
+/*
+ * Carry out an upgrade.  Doesn't return if it succeeds.
+ *
+ * @return why it didn't.
+ */
+static const char *upgrade_run(void) {
+    const char *why = upgrade_refusal();
+    if(why != NULL){
+        return why;
+    }
+    int sock;
+    pid_t pid = upgrade_spawn(&sock);
+    if(pid < 0){
+        return "cannot start the new server";
+    }
+    UPGRADE_MSG msg;
+    //Nothing is stopped until the new server is ready to take over
+    if(upgrade_recv(sock, UPGRADE_HELLO_MS, &msg, sizeof(msg), NULL, NULL) < 0 || msg.type != UPGRADE_HELLO){
+        why = "the new server did not start";
+    }else{
+        uint64_t stopped = upgrade_now_ns();
+        if(upgrade_stop() < 0){
+            why = "clients did not stop in time";
+        }else if((why = upgrade_hand_over(sock, stopped)) == NULL){
+            //It is the new server's from here on, but the calls that ended are still ours to record
+            debug("Upgraded");
+            shard_upgraded(pid);
+            cdr_flush();
+            _exit(EXIT_SUCCESS);
+        }
+        upgrade_unstop();
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sock);
+    return why;
+}
+
+/*
+ * Thread waiting for SIGUSR1, which every other thread has blocked.
+ */
+static void *upgrade_thread(void *arg) {
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    while(1){
+        int sig;
+        if(sigwait(&usr1, &sig) != 0){
+            continue;
+        }
+        atomic_fetch_add(&num_started, 1);
+        const char *why = upgrade_run();
+        atomic_fetch_add(&num_refused, 1);
+        fprintf(stderr, "Upgrade not done: %s\n", why);
+    }
+    return NULL;
+}
+
+/*
+ * Get ready to be upgraded on SIGUSR1, which must be blocked in every thread
+ * by the time this is called.
+ *
+ * @param argv  The arguments the server was started with, to start the new one
+ * with (from the path the running binary was started from).
+ * @param listenfd  The TCP listening socket.
+ * @param localfd  The local one (-U), or -1.
+ * @return 0 if successful, otherwise -1.
+ */
+int upgrade_init(char *argv[], int listenfd, int localfd) {
+    pthread_once(&upgrade_once, upgrade_setup);
+    if(slots == NULL){
+        return -1;
+    }
+    //The new binary is whatever is at the same path by then
+    ssize_t n = readlink("/proc/self/exe", upgrade_path, sizeof(upgrade_path) - 1);
+    if(n <= 0 || n == sizeof(upgrade_path) - 1){
+        return -1;
+    }
+    upgrade_path[n] = '\0';
+    upgrade_argv = argv;
+    listen_fds[0] = listenfd;
+    listen_fds[1] = localfd;
+    //The thread takes no signals but the one it waits for
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, upgrade_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0){
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * Whether this process was started by an upgrade, to take over from the
+ * server that started it.
+ *
+ * @return 1 if so, otherwise 0.
+ */
+int upgrade_inherited(void) {
+    const char *env = getenv(UPGRADE_ENV);
+    if(env == NULL){
+        return 0;
+    }
+    upgrade_fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    //Not for whatever we start ourselves
+    fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+    return 1;
+}
+
+/*
+ * Register a client taken over, with its input kept for its service.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int upgrade_take_over(PBX *pbx, int fd, const UPGRADE_CLIENT *client, const char *input) {
+    UPGRADE_SLOT *slot = upgrade_slot(fd);
+    if(slot == NULL || slot->tu != NULL){
+        return -1;
+    }
+    TU *tu = tu_init(fd);
+    if(tu == NULL){
+        return -1;
+    }
+    if(pbx_restore(pbx, tu, &client->tu) < 0){
+        tu_unref(tu, "Cannot take over");
+        return -1;
+    }
+    slot->input = client->input > 0 ? malloc(client->input) : NULL;
+    if(client->input > 0 && slot->input == NULL){
+        return -1;
+    }
+    memcpy(slot->input, input, client->input);
+    slot->len = client->input;
+    slot->fresh = client->fresh;
+    slot->tu = tu;
+    slot->peer = client->tu.peer;
+    taken[num_taken] = fd;
+    taken_clients[num_taken++] = *client;
+    return 0;
+}
+
+/*
+ * Put the calls the clients taken over were in back together, once they are
+ * all registered.  Both ends have to agree on who they are talking to.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int upgrade_rejoin_calls(PBX *pbx) {
+    for(int i = 0; i < num_taken; i++){
+        UPGRADE_SLOT *slot = upgrade_slot(taken[i]);
+        if(slot->peer == 0){
+            continue;
+        }
+        int ext = taken_clients[i].tu.ext;
+        TU *peer = pbx_lookup(pbx, slot->peer);
+        if(peer == NULL){
+            return -1;
+        }
+        UPGRADE_SLOT *other = upgrade_slot(tu_fileno(peer));
+        int ok = other != NULL && other->tu == peer && other->peer == ext;
+        //Each call once, from its lower extension
+        if(ok && ext < slot->peer){
+            tu_restore_call(slot->tu, peer, &taken_clients[i].tu);
+        }
+        tu_unref(peer, "Call carried over");
+        if(!ok){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Take over from the server that started this process: tell it we're
+ * ready, then receive its sockets and clients, and register the clients
+ * quietly as they were.  Their services are started with upgrade_resume().
+ * If this fails, the process should exit, and the old server carries on.
+ *
+ * @param pbx  The PBX, already set up.
+ * @param listenfd  Set to the TCP listening socket.
+ * @param localfd  Set to the local one (-U), or -1.
+ * @return how many clients were taken over, or -1 if it failed.
+ */
+int upgrade_join(PBX *pbx, int *listenfd, int *localfd) {
+    pthread_once(&upgrade_once, upgrade_setup);
+    if(slots == NULL || upgrade_fd < 0){
+        return -1;
+    }
+    UPGRADE_MSG msg;
+    upgrade_header(&msg, UPGRADE_HELLO);
+    if(upgrade_send(upgrade_fd, &msg, sizeof(msg), NULL, 0) < 0){
+        return -1;
+    }
+    char *buf = malloc(UPGRADE_BATCH_BYTES);
+    if(buf == NULL){
+        return -1;
+    }
+    int fds[UPGRADE_BATCH];
+    int nfds;
+    UPGRADE_MSG *got = (UPGRADE_MSG *)buf;
+    //The old server may take a while to get its clients to stop
+    ssize_t n = upgrade_recv(upgrade_fd, UPGRADE_PARK_MS + UPGRADE_DONE_MS, buf, UPGRADE_BATCH_BYTES, fds, &nfds);
+    int base = got->local ? 2 : 1;
+    if(n < 0 || got->type != UPGRADE_STATE || (uint32_t)nfds != base + got->shard
+       || shard_import(fds + base, got->shard) < 0){
+        goto fail;
+    }
+    *listenfd = fds[0];
+    *localfd = got->local ? fds[1] : -1;
+    stopped_ns = got->stopped_ns;
+    trace_resume_call_ids(got->call_id);
+    uint32_t total = got->count;
+    taken = malloc((total + 1) * sizeof(int));
+    taken_clients = malloc((total + 1) * sizeof(UPGRADE_CLIENT));
+    if(taken == NULL || taken_clients == NULL){
+        goto fail;
+    }
+    num_taken = 0;
+    while((uint32_t)num_taken < total){
+        n = upgrade_recv(upgrade_fd, UPGRADE_DONE_MS, buf, UPGRADE_BATCH_BYTES, fds, &nfds);
+        if(n < 0 || got->type != UPGRADE_CLIENTS || (uint32_t)nfds != got->count
+           || got->count > total - num_taken){
+            goto fail;
+        }
+        size_t off = sizeof(UPGRADE_MSG);
+        for(int i = 0; i < nfds; i++){
+            UPGRADE_CLIENT client;
+            if(off + sizeof(client) > (size_t)n){
+                goto fail;
+            }
+            memcpy(&client, buf + off, sizeof(client));
+            off += sizeof(client);
+            if(client.input > UPGRADE_MAX_INPUT || off + client.input > (size_t)n
+               || upgrade_take_over(pbx, fds[i], &client, buf + off) < 0){
+                goto fail;
+            }
+            off += client.input;
+        }
+    }
+    if(upgrade_rejoin_calls(pbx) < 0){
+        goto fail;
+    }
+    free(buf);
+    return num_taken;
+fail:
+    free(buf);
+    return -1;
+}
+
+/*
+ * Tell the old server everything has been taken over, so that it exits, and
+ * start serving the clients taken over, each with the input it came with.
+ *
+ * @param serve  Function to serve each with.
+ * @return how many there were.
+ */
+int upgrade_resume(UPGRADE_SERVE_FN *serve) {
+    UPGRADE_MSG msg;
+    upgrade_header(&msg, UPGRADE_DONE);
+    upgrade_send(upgrade_fd, &msg, sizeof(msg), NULL, 0);
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    for(int i = 0; i < num_taken; i++){
+        UPGRADE_SLOT *slot = upgrade_slot(taken[i]);
+        char *input = slot->input;
+        slot->input = NULL;
+        TU *tu;
+        int fresh;
+        //A client that can't be served is unregistered, as if it had gone away
+        if(serve(taken[i], input, slot->len) < 0 && upgrade_adopt(taken[i], &tu, &fresh)){
+            pbx_unregister(pbx, tu);
+        }
+        free(input);
+    }
+    cutover_us = (upgrade_now_ns() - stopped_ns) / 1000;
+    free(taken);
+    free(taken_clients);
+    taken = NULL;
+    taken_clients = NULL;
+    return num_taken;
+}
+
+/*
+ * Called by the service of a connection as it starts, to pick up the TU of a
+ * client taken over from the old server, if the connection is one.
+ *
+ * @param fd  The connection.
+ * @param tu  Set to the client's TU, already registered.
+ * @param fresh  Set to whether nothing had been read from it yet (so that it
+ * can still switch to binary framing).
+ * @return 1 if the connection was taken over, otherwise 0.
+ */
+int upgrade_adopt(int fd, TU **tu, int *fresh) {
+    UPGRADE_SLOT *slot = upgrade_slot(fd);
+    if(slot == NULL || slot->tu == NULL){
+        return 0;
+    }
+    *tu = slot->tu;
+    *fresh = slot->fresh;
+    slot->tu = NULL;
+    return 1;
+}
+
+/*
+ * Get statistics about upgrades.
+ *
+ * @param stats  Filled in with the statistics.
+ * @return 0 if successful, otherwise -1.
+ */
+int upgrade_get_stats(UPGRADE_STATS *stats) {
+    if(stats == NULL){
+        return -1;
+    }
+    stats->started = atomic_load(&num_started);
+    stats->refused = atomic_load(&num_refused);
+    stats->clients = num_taken;
+    stats->cutover_us = cutover_us;
+    return 0;
+}
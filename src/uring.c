@@ -0,0 +1,221 @@
+/*
+ * A minimal io_uring, on the bare system calls.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/*
+ * Set up an io_uring.
+ *
+ * @param ring  The URING to set up.
+ * @param entries  Size of the submission queue (a power of two).
+ * @return 0 if successful, otherwise -1 with errno set (ENOSYS or EPERM
+ * where io_uring isn't available at all).
+ */
+int uring_init(URING *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if(ring->fd < 0){
+        return -1;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)){
+        //Too old to be worth supporting
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if(ring->ring_mem == MAP_FAILED){
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        munmap(ring->ring_mem, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+    char *mem = ring->ring_mem;
+    ring->sq_head = (unsigned *)(mem + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(mem + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(mem + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(mem + params.sq_off.array);
+    ring->cq_head = (unsigned *)(mem + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(mem + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(mem + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(mem + params.cq_off.cqes);
+    //Submission entries are always used in order, so the index array never changes
+    for(unsigned i = 0; i <= ring->sq_mask; i++){
+        ring->sq_array[i] = i;
+    }
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+/*
+ * Tear down an io_uring, cancelling whatever it still has in progress.
+ */
+void uring_fini(URING *ring) {
+    if(ring->bufs != NULL){
+        munmap(ring->bufs, ring->buf_count * sizeof(struct io_uring_buf));
+        free(ring->buf_mem);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_mem, ring->ring_size);
+    close(ring->fd);
+}
+
+/*
+ * Get the next free submission queue entry, cleared, handing over what is
+ * already queued if there is no room.
+ *
+ * @return the entry, or NULL if the queue can't be made to take any more.
+ */
+struct io_uring_sqe *uring_sqe(URING *ring) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+    if(ring->sqe_tail - head > ring->sq_mask){
+        if(uring_submit(ring, 0) < 0){
+            return NULL;
+        }
+        head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+        if(ring->sqe_tail - head > ring->sq_mask){
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Tell how many more submission queue entries can be filled in before what is
+ * queued has to be handed over.
+ */
+unsigned uring_sq_space(URING *ring) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+    return ring->sq_mask + 1 - (ring->sqe_tail - head);
+}
+
+/*
+ * Hand everything queued so far over to the kernel, and wait for completions,
+ * in one system call.
+ *
+ * @param wait  How many completions to wait for (0 not to wait).
+ * @return the number of entries handed over, or -1 with errno set.
+ */
+int uring_submit(URING *ring, unsigned wait) {
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, ring->sqe_tail, memory_order_release);
+    unsigned submit = ring->sqe_tail - atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+    if(submit == 0 && wait == 0){
+        return 0;
+    }
+    int n = sys_io_uring_enter(ring->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if(n < 0 && errno == EINTR){
+        return 0; //Whatever wasn't taken goes next time
+    }
+    return n;
+}
+
+/*
+ * Get the next completion, without waiting.
+ *
+ * @return the completion, or NULL if there are none.  Once it has been dealt
+ * with, uring_cqe_seen() lets the kernel reuse its slot.
+ */
+struct io_uring_cqe *uring_cqe(URING *ring) {
+    unsigned head = *ring->cq_head;
+    if(head == atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire)){
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URING *ring) {
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, *ring->cq_head + 1, memory_order_release);
+}
+
+/*
+ * Give an io_uring a ring of buffers for receives to pick from.
+ *
+ * @param count  Number of buffers (a power of two, at most 32768).
+ * @param size  Size of each.
+ * @return 0 if successful, otherwise -1 with errno set (EINVAL on kernels
+ * without provided buffer rings).
+ */
+int uring_bufs_init(URING *ring, unsigned count, unsigned size) {
+    ring->bufs = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->bufs == MAP_FAILED){
+        ring->bufs = NULL;
+        return -1;
+    }
+    ring->buf_mem = malloc((size_t)count * size);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->bufs;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUF_GROUP;
+    if(ring->buf_mem == NULL || sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        int saved_errno = errno;
+        munmap(ring->bufs, count * sizeof(struct io_uring_buf));
+        free(ring->buf_mem);
+        ring->bufs = NULL;
+        ring->buf_mem = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    for(unsigned bid = 0; bid < count; bid++){
+        uring_buf_put(ring, bid);
+    }
+    return 0;
+}
+
+/*
+ * Get the memory of a provided buffer.
+ */
+char *uring_buf(URING *ring, unsigned bid) {
+    return ring->buf_mem + (size_t)bid * ring->buf_size;
+}
+
+/*
+ * Hand a provided buffer back, for receives to fill again.
+ */
+void uring_buf_put(URING *ring, unsigned bid) {
+    struct io_uring_buf *buf = &ring->bufs->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uintptr_t)uring_buf(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&ring->bufs->tail, ring->buf_tail, memory_order_release);
+}
@@ -0,0 +1,171 @@
+#ifndef __TEST_PHONE_H
+#define __TEST_PHONE_H
+
+/*
+ * Helpers shared by the tests that plug TUs into a PBX in-process and talk to
+ * them over the other end of a socketpair, and by those that talk to a server
+ * over a socket.
+ *
+ * Nothing here sleeps in the hope that output has arrived.  A TU function
+ * writes its notifications before it returns, so drain() only takes what is
+ * there already; anything sent later, from a timer or another thread, is
+ * waited for with wait_for() or get_line(), which poll() with a real timeout.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+
+/*
+ * Longest a test waits for output it expects.  Only reached when the output
+ * never comes, so it is generous.
+ */
+#define TEST_WAIT_MS 5000
+
+/*
+ * A TU on one end of a socketpair; the test is its client, on the other end.
+ */
+typedef struct phone {
+    TU *tu;
+    int ext;
+    int client;
+} PHONE;
+
+/*
+ * Give a phone a TU and a connection, without registering it.
+ */
+static void phone_plug(PHONE *ph) {
+    int sv[2];
+    signal(SIGPIPE, SIG_IGN); // As in the server, see phone_down()
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    ph->client = sv[1];
+    ph->tu = tu_init(sv[0]);
+    cr_assert_not_null(ph->tu);
+}
+
+/*
+ * Plug in a phone and register it on whatever extension the PBX hands out.
+ *
+ * @param sndbuf  Send buffer of the TU's end of the connection, or 0 for the default.
+ */
+static void phone_up_sndbuf(PBX *p, PHONE *ph, int sndbuf) {
+    phone_plug(ph);
+    if(sndbuf > 0)
+        setsockopt(tu_fileno(ph->tu), SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    ph->ext = pbx_register_auto(p, ph->tu);
+    cr_assert(ph->ext > 0, "Registration failed");
+}
+
+static void phone_up(PBX *p, PHONE *ph) {
+    phone_up_sndbuf(p, ph, 0);
+}
+
+static void phone_down(PBX *p, PHONE *ph) {
+    // Hang up the client end first, so that notifications to a connection nobody
+    // has been reading fail instead of waiting for room.
+    int fd = tu_fileno(ph->tu);
+    close(ph->client);
+    pbx_unregister(p, ph->tu);
+    close(fd);
+}
+
+static long test_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait up to a time limit for something to read on a descriptor.
+ *
+ * @return 1 if there is, 0 if the time ran out.
+ */
+static int test_readable(int fd, int ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, ms) > 0;
+}
+
+/*
+ * Read whatever has arrived for a phone already, without waiting for more.
+ */
+static char *drain(PHONE *ph, char *buf, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+    while(len < size - 1 && (n = recv(ph->client, buf + len, size - 1 - len, MSG_DONTWAIT)) > 0){
+        len += n;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/*
+ * Read what arrives for a phone until it includes some text, or TEST_WAIT_MS
+ * has gone by without it.
+ *
+ * @return buf, with everything read, for the caller to check.
+ */
+static char *wait_for(PHONE *ph, char *want, char *buf, size_t size) {
+    size_t len = 0;
+    long deadline = test_now_ms() + TEST_WAIT_MS;
+    buf[0] = '\0';
+    while(strstr(buf, want) == NULL && len < size - 1){
+        long left = deadline - test_now_ms();
+        if(left <= 0 || !test_readable(ph->client, left)){
+            break;
+        }
+        ssize_t n = recv(ph->client, buf + len, size - 1 - len, MSG_DONTWAIT);
+        if(n <= 0){
+            break;
+        }
+        len += n;
+        buf[len] = '\0';
+    }
+    return buf;
+}
+
+/*
+ * See that nothing arrives for a phone for a while.
+ *
+ * @return 1 if nothing did, otherwise 0.
+ */
+static int quiet_for(PHONE *ph, int ms) {
+    return !test_readable(ph->client, ms);
+}
+
+/*
+ * Read a line from a connection, without its newline, waiting up to
+ * TEST_WAIT_MS for each byte.
+ *
+ * @return buf, holding as much of the line as came, empty if nothing did.
+ */
+static char *get_line(int fd, char *buf, size_t size) {
+    size_t n = 0;
+    while(n < size - 1 && test_readable(fd, TEST_WAIT_MS) && read(fd, buf + n, 1) == 1 && buf[n] != '\n'){
+        n++;
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/*
+ * Hang up a connection to a server and wait for the server to close its end,
+ * which it does once it has let go of the client's phone.
+ */
+static void hang_up(int fd) {
+    char buf[256];
+    shutdown(fd, SHUT_WR);
+    while(test_readable(fd, TEST_WAIT_MS) && read(fd, buf, sizeof(buf)) > 0){
+        continue;
+    }
+    close(fd);
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "hunt.h"
+#include "__test_phone.h"
+
+#define SUITE acd_suite
+
+/*
+ * Pick up a caller, dial an extension and return whatever the caller was told.
+ */
+static char *call(PBX *p, PHONE *caller, int ext, char *buf, size_t size) {
+    tu_pickup(caller->tu);
+    drain(caller, buf, size);
+    pbx_dial(p, caller->tu, ext);
+    return drain(caller, buf, size);
+}
+
+/*
+ * Put two phones in a call with each other.
+ */
+static void connect_pair(PBX *p, PHONE *a, PHONE *b) {
+    char buf[512];
+    call(p, a, b->ext, buf, sizeof(buf));
+    tu_pickup(b->tu);
+    drain(a, buf, sizeof(buf));
+    drain(b, buf, sizeof(buf));
+}
+
+Test(SUITE, fifo_test, .timeout = 5) {
+    pbx_config.queue_calls = 1;
+    PBX *p = pbx_init();
+    PHONE target, peer, caller[3];
+    char buf[512];
+    phone_up(p, &target);
+    phone_up(p, &peer);
+    for(int i = 0; i < 3; i++)
+        phone_up(p, &caller[i]);
+    connect_pair(p, &peer, &target);
+
+    // Callers to the busy phone wait in line instead of getting a busy signal.
+    for(int i = 0; i < 3; i++) {
+        char want[32];
+        snprintf(want, sizeof(want), "QUEUED %d\n", i + 1);
+        cr_assert_str_eq(call(p, &caller[i], target.ext, buf, sizeof(buf)), want, "Caller %d got '%s'", i, buf);
+    }
+    // The second caller gives up, so the third moves up.  The queue thread
+    // tells it so, and puts callers through, in its own time.
+    tu_hangup(caller[1].tu);
+    cr_assert_str_eq(wait_for(&caller[2], "QUEUED 2\n", buf, sizeof(buf)), "QUEUED 2\n", "Caller 2 got '%s'", buf);
+
+    // When the target hangs up, it is put straight through to the first in line.
+    tu_hangup(target.tu);
+    cr_assert(strstr(wait_for(&target, "RINGING\n", buf, sizeof(buf)), "RINGING\n"), "Target got '%s'", buf);
+    cr_assert_str_eq(wait_for(&caller[0], "RING BACK\n", buf, sizeof(buf)), "RING BACK\n", "Caller 0 got '%s'", buf);
+    cr_assert_str_eq(wait_for(&caller[2], "QUEUED 1\n", buf, sizeof(buf)), "QUEUED 1\n", "Caller 2 got '%s'", buf);
+    tu_pickup(target.tu);
+    snprintf(buf, sizeof(buf), "CONNECTED %d\n", caller[0].ext);
+    char got[512];
+    cr_assert_str_eq(drain(&target, got, sizeof(got)), buf, "Target got '%s'", got);
+
+    // And then to the next.
+    tu_hangup(target.tu);
+    cr_assert_str_eq(wait_for(&caller[2], "RING BACK\n", buf, sizeof(buf)), "RING BACK\n", "Caller 2 got '%s'", buf);
+
+    tu_hangup(caller[2].tu);
+    tu_hangup(caller[0].tu);
+    for(int i = 0; i < 3; i++)
+        phone_down(p, &caller[i]);
+    phone_down(p, &peer);
+    phone_down(p, &target);
+}
+
+Test(SUITE, target_leaves_test, .timeout = 5) {
+    pbx_config.queue_calls = 1;
+    PBX *p = pbx_init();
+    PHONE target, peer, caller;
+    char buf[512];
+    phone_up(p, &target);
+    phone_up(p, &peer);
+    phone_up(p, &caller);
+    connect_pair(p, &peer, &target);
+    cr_assert_str_eq(call(p, &caller, target.ext, buf, sizeof(buf)), "QUEUED 1\n", "Caller got '%s'", buf);
+
+    // Whoever is still waiting when the target disconnects gets the busy signal after all.
+    phone_down(p, &target);
+    cr_assert_str_eq(drain(&caller, buf, sizeof(buf)), "BUSY SIGNAL\n", "Caller got '%s'", buf);
+    phone_down(p, &caller);
+    phone_down(p, &peer);
+}
+
+Test(SUITE, hunt_group_test, .timeout = 5) {
+    pbx_config.queue_calls = 1;
+    PBX *p = pbx_init();
+    PHONE agent[2], customer[4];
+    char buf[512];
+    for(int i = 0; i < 2; i++)
+        phone_up(p, &agent[i]);
+    for(int i = 0; i < 4; i++)
+        phone_up(p, &customer[i]);
+    int group = hunt_create(p, agent[0].tu);
+    hunt_join(group, agent[1].tu);
+
+    // Two customers ring the agents and two have to wait for one of them.
+    cr_assert(strstr(call(p, &customer[0], group, buf, sizeof(buf)), "RING BACK"), "Customer 0 got '%s'", buf);
+    cr_assert(strstr(call(p, &customer[1], group, buf, sizeof(buf)), "RING BACK"), "Customer 1 got '%s'", buf);
+    cr_assert_str_eq(call(p, &customer[2], group, buf, sizeof(buf)), "QUEUED 1\n", "Customer 2 got '%s'", buf);
+    cr_assert_str_eq(call(p, &customer[3], group, buf, sizeof(buf)), "QUEUED 2\n", "Customer 3 got '%s'", buf);
+
+    // Whichever agent is free first takes the next customer.
+    drain(&agent[1], buf, sizeof(buf));
+    tu_hangup(customer[1].tu);
+    cr_assert(strstr(wait_for(&agent[1], "RINGING\n", buf, sizeof(buf)), "RINGING\n"), "Agent 1 got '%s'", buf);
+    cr_assert_str_eq(wait_for(&customer[2], "RING BACK\n", buf, sizeof(buf)), "RING BACK\n", "Customer 2 got '%s'", buf);
+    cr_assert_str_eq(wait_for(&customer[3], "QUEUED 1\n", buf, sizeof(buf)), "QUEUED 1\n", "Customer 3 got '%s'", buf);
+
+    HUNT_GROUP *g = hunt_lookup(group);
+    HUNT_STATS stats;
+    hunt_get_stats(g, &stats);
+    hunt_unref(g);
+    cr_assert_eq(stats.calls, 4);
+    cr_assert_eq(stats.busy, 2);
+
+    tu_hangup(customer[3].tu);
+    for(int i = 0; i < 4; i++)
+        phone_down(p, &customer[i]);
+    for(int i = 0; i < 2; i++)
+        phone_down(p, &agent[i]);
+}
+
+Test(SUITE, off_by_default_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE target, peer, caller;
+    char buf[512];
+    phone_up(p, &target);
+    phone_up(p, &peer);
+    phone_up(p, &caller);
+    connect_pair(p, &peer, &target);
+    cr_assert_str_eq(call(p, &caller, target.ext, buf, sizeof(buf)), "BUSY SIGNAL\n", "Caller got '%s'", buf);
+    tu_hangup(target.tu);
+    // Nor is anybody put through later, by the queue thread
+    cr_assert(quiet_for(&caller, 100), "Caller got '%s'", drain(&caller, buf, sizeof(buf)));
+    phone_down(p, &caller);
+    phone_down(p, &peer);
+    phone_down(p, &target);
+}
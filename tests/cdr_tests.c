@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "cdr.h"
+#include "__test_phone.h"
+
+#define SUITE cdr_suite
+
+static void temp_path(char *path) {
+    int fd = mkstemp(path);
+    cr_assert(fd >= 0);
+    close(fd);
+    unlink(path);
+}
+
+/*
+ * Read the records of a CDR file, checking its header.
+ *
+ * @return the number of records read into recs.
+ */
+static int read_cdrs(char *path, CDR *recs, int max) {
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f);
+    char line[256];
+    cr_assert_not_null(fgets(line, sizeof(line), f));
+    cr_assert_str_eq(line, CDR_CSV_HEADER);
+    int n = 0;
+    unsigned long long setup, answer, hangup, bytes;
+    while(n < max && fscanf(f, "%u,%d,%d,%llu,%llu,%llu,%u,%llu\n", &recs[n].call_id, &recs[n].caller,
+                            &recs[n].callee, &setup, &answer, &hangup, &recs[n].chats, &bytes) == 8) {
+        recs[n].setup_us = setup;
+        recs[n].answer_us = answer;
+        recs[n].hangup_us = hangup;
+        recs[n].bytes = bytes;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+Test(SUITE, record_test, .timeout = 5) {
+    char path[] = "/tmp/cdr_testXXXXXX";
+    temp_path(path);
+    cr_assert_eq(cdr_init(path), 0);
+    PBX *p = pbx_init();
+    PHONE a, b;
+    phone_up(p, &a);
+    phone_up(p, &b);
+
+    // An answered call with a couple of chats, then one that is given up on while ringing.
+    tu_pickup(a.tu);
+    pbx_dial(p, a.tu, b.ext);
+    tu_pickup(b.tu);
+    tu_chat(a.tu, "hello");
+    tu_chat(b.tu, "hi!");
+    tu_hangup(a.tu);
+    pbx_dial(p, b.tu, a.ext);
+    tu_hangup(b.tu);
+    cr_assert_eq(cdr_flush(), 0);
+
+    CDR recs[4];
+    cr_assert_eq(read_cdrs(path, recs, 4), 2);
+    cr_assert_eq(recs[0].caller, a.ext);
+    cr_assert_eq(recs[0].callee, b.ext);
+    cr_assert_eq(recs[0].chats, 2);
+    cr_assert_eq(recs[0].bytes, 8);
+    cr_assert(recs[0].setup_us <= recs[0].answer_us && recs[0].answer_us <= recs[0].hangup_us);
+    cr_assert_eq(recs[1].caller, b.ext);
+    cr_assert_eq(recs[1].callee, a.ext);
+    cr_assert_eq(recs[1].answer_us, 0);
+    cr_assert_eq(recs[1].chats, 0);
+    cr_assert_neq(recs[0].call_id, recs[1].call_id);
+
+    phone_down(p, &a);
+    phone_down(p, &b);
+    unlink(path);
+}
+
+Test(SUITE, off_by_default_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE a, b;
+    phone_up(p, &a);
+    phone_up(p, &b);
+    tu_pickup(a.tu);
+    pbx_dial(p, a.tu, b.ext);
+    tu_hangup(a.tu);
+    CDR_STATS stats;
+    cdr_get_stats(&stats);
+    cr_assert_eq(stats.recorded, 0);
+    cr_assert_eq(cdr_flush(), -1);
+    phone_down(p, &a);
+    phone_down(p, &b);
+}
+
+static void *burst_thread(void *arg) {
+    int id = *(int *)arg;
+    for(int i = 0; i < 20000; i++)
+        cdr_end(cdr_begin(i, id, i));
+    return NULL;
+}
+
+Test(SUITE, concurrent_test, .timeout = 10) {
+    char path[] = "/tmp/cdr_testXXXXXX";
+    temp_path(path);
+    cr_assert_eq(cdr_init(path), 0);
+
+    // Records from many threads at once all come out whole, or are counted as dropped.
+    pthread_t tid[4];
+    int ids[4];
+    for(int i = 0; i < 4; i++) {
+        ids[i] = i + 1;
+        pthread_create(&tid[i], NULL, burst_thread, &ids[i]);
+    }
+    for(int i = 0; i < 4; i++)
+        pthread_join(tid[i], NULL);
+    cdr_flush();
+    CDR_STATS stats;
+    cdr_get_stats(&stats);
+    cr_assert_eq(stats.recorded, 80000);
+    cr_assert_eq(stats.written + stats.dropped, stats.recorded);
+    cr_assert(stats.batches < stats.written / 10, "%ld writes for %ld records", stats.batches, stats.written);
+
+    CDR *recs = malloc(80000 * sizeof(CDR));
+    int n = read_cdrs(path, recs, 80000);
+    cr_assert_eq(n, stats.written);
+    long seen[5] = {0};
+    for(int i = 0; i < n; i++) {
+        cr_assert(recs[i].caller >= 1 && recs[i].caller <= 4);
+        cr_assert_eq(recs[i].call_id, (uint32_t)recs[i].callee);
+        seen[recs[i].caller]++;
+    }
+    cr_assert_eq(seen[1] + seen[2] + seen[3] + seen[4], n);
+    free(recs);
+    unlink(path);
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "conf.h"
+#include "__test_phone.h"
+
+#define SUITE conf_suite
+
+/*
+ * A phone registered and off hook, ready to join a bridge.
+ */
+static void member_up(PBX *p, PHONE *ph, int sndbuf) {
+    phone_up_sndbuf(p, ph, sndbuf);
+    tu_pickup(ph->tu);
+}
+
+Test(SUITE, fanout_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE ph[4];
+    char buf[512], want[64];
+    for(int i = 0; i < 4; i++)
+        member_up(p, &ph[i], 0);
+    int bridge = conf_create(p, ph[0].tu);
+    cr_assert(bridge > 0, "Bridge was not created");
+    for(int i = 1; i < 4; i++)
+        cr_assert_eq(pbx_dial(p, ph[i].tu, bridge), 0, "Phone %d could not join", i);
+    for(int i = 0; i < 4; i++) {
+        snprintf(want, sizeof(want), "CONNECTED %d\n", bridge);
+        cr_assert(strstr(drain(&ph[i], buf, sizeof(buf)), want), "Phone %d got '%s'", i, buf);
+    }
+
+    tu_chat(ph[1].tu, "hello");
+    snprintf(want, sizeof(want), "CHAT %d: hello\n", ph[1].ext);
+    for(int i = 0; i < 4; i++) {
+        if(i == 1) {
+            snprintf(want, sizeof(want), "CONNECTED %d\n", bridge);
+            cr_assert_str_eq(drain(&ph[i], buf, sizeof(buf)), want, "Sender got '%s'", buf);
+            snprintf(want, sizeof(want), "CHAT %d: hello\n", ph[1].ext);
+        } else {
+            // Written by the sender, or by the relay thread if the connection
+            // couldn't take it at once
+            cr_assert_str_eq(wait_for(&ph[i], want, buf, sizeof(buf)), want, "Phone %d got '%s'", i, buf);
+        }
+    }
+
+    // Once everybody has hung up, the bridge's extension no longer exists.
+    for(int i = 0; i < 4; i++)
+        tu_hangup(ph[i].tu);
+    cr_assert_null(conf_lookup(bridge), "Bridge outlived its members");
+    for(int i = 0; i < 4; i++)
+        phone_down(p, &ph[i]);
+}
+
+#define NMESSAGES 200
+
+static _Atomic long lines_read;
+
+static void *reader(void *arg) {
+    PHONE *ph = arg;
+    char buf[4096];
+    ssize_t n;
+    while((n = read(ph->client, buf, sizeof(buf))) > 0)
+        for(ssize_t i = 0; i < n; i++)
+            lines_read += buf[i] == '\n';
+    return NULL;
+}
+
+Test(SUITE, slow_member_test, .timeout = 10) {
+    PBX *p = pbx_init();
+    PHONE fast, slow, sender;
+    member_up(p, &sender, 0);
+    member_up(p, &fast, 0);
+    member_up(p, &slow, 4096);
+    int bridge = conf_create(p, sender.tu);
+    pbx_dial(p, fast.tu, bridge);
+    pbx_dial(p, slow.tu, bridge);
+    CONF_BRIDGE *b = conf_lookup(bridge);
+    cr_assert_not_null(b);
+
+    char buf[512];
+    drain(&fast, buf, sizeof(buf));
+    pthread_t tid;
+    pthread_create(&tid, NULL, reader, &fast);
+
+    // Nobody ever reads the slow member's connection, so it fills up; the sender
+    // must carry on regardless and a member that keeps up must still get everything.
+    // The sender pauses now and then to let the fast member's reader run, since
+    // on a single CPU it otherwise might not get scheduled during the burst.
+    char msg[256];
+    memset(msg, 'x', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\0';
+    for(int i = 0; i < NMESSAGES; i++) {
+        cr_assert_eq(tu_chat(sender.tu, msg), 0);
+        recv(sender.client, buf, sizeof(buf), MSG_DONTWAIT);
+        for(int j = 0; j < 100 && (i + 1) % (CONF_BACKLOG / 2) == 0 && lines_read <= i; j++)
+            usleep(1000);
+    }
+
+    CONF_STATS stats;
+    conf_get_stats(b, &stats);
+    cr_assert_eq(stats.members, 3);
+    cr_assert_eq(stats.messages, NMESSAGES);
+    cr_assert(stats.dropped > 0, "Slow member never fell behind");
+    cr_assert_eq(stats.sent + stats.queued + stats.dropped, 2 * NMESSAGES);
+
+    // Whatever the fast member's connection couldn't take at once is finished
+    // off by the relay thread.
+    for(int i = 0; i < 500 && lines_read < NMESSAGES; i++)
+        usleep(10000);
+    cr_assert_eq(lines_read, NMESSAGES, "Fast member got %ld of %d chats", (long)lines_read, NMESSAGES);
+
+    phone_down(p, &sender);
+    phone_down(p, &slow);
+    int fd = tu_fileno(fast.tu);
+    pbx_unregister(p, fast.tu);
+    close(fd);
+    pthread_join(tid, NULL);
+    close(fast.client);
+    conf_unref(b);
+}
+
+#define LONG_CHAT 16000
+
+static char slow_buf[2 * LONG_CHAT];
+
+/*
+ * Read a phone's connection, starting only after a while, until its client
+ * is told it is on hook.
+ */
+static void *late_reader(void *arg) {
+    PHONE *ph = arg;
+    size_t len = 0;
+    ssize_t n;
+    usleep(50 * 1000);
+    while(strstr(slow_buf, "ON HOOK") == NULL && len < sizeof(slow_buf) - 1
+          && test_readable(ph->client, TEST_WAIT_MS)
+          && (n = read(ph->client, slow_buf + len, sizeof(slow_buf) - 1 - len)) > 0)
+        len += n;
+    return NULL;
+}
+
+Test(SUITE, whole_line_test, .timeout = 10) {
+    PBX *p = pbx_init();
+    PHONE sender, member;
+    char buf[512], want[64];
+    member_up(p, &sender, 0);
+    member_up(p, &member, 4096);
+    int bridge = conf_create(p, sender.tu);
+    pbx_dial(p, member.tu, bridge);
+    drain(&member, buf, sizeof(buf));
+
+    // A chat longer than the member's connection takes at once goes out in
+    // part; the rest has to follow before anything else is written there.
+    pthread_t tid;
+    pthread_create(&tid, NULL, late_reader, &member);
+    static char msg[LONG_CHAT + 1];
+    memset(msg, 'y', LONG_CHAT);
+    cr_assert_eq(tu_chat(sender.tu, msg), 0);
+    tu_hangup(member.tu);
+    pthread_join(tid, NULL);
+    snprintf(want, sizeof(want), "CHAT %d: ", sender.ext);
+    cr_assert_eq(strncmp(slow_buf, want, strlen(want)), 0, "Got '%.40s'", slow_buf);
+    char *end = slow_buf + strlen(want) + LONG_CHAT;
+    cr_assert_eq(strspn(slow_buf + strlen(want), "y"), LONG_CHAT, "Chat cut short");
+    snprintf(want, sizeof(want), "\nON HOOK %d\n", member.ext);
+    cr_assert_str_eq(end, want);
+
+    phone_down(p, &member);
+    tu_hangup(sender.tu);
+    phone_down(p, &sender);
+}
+
+Test(SUITE, on_hook_test, .timeout = 5) {
+    // With a reuse delay, an extension taken and given back shows as a gap.
+    int delay = pbx_config.reuse_delay_ms;
+    pbx_config.reuse_delay_ms = 60000;
+    PBX *p = pbx_init();
+    PHONE ph;
+    char buf[512], want[64];
+    phone_up(p, &ph);
+    drain(&ph, buf, sizeof(buf));
+
+    // A phone that isn't at dial tone is told where it is, and no extension is
+    // taken for a bridge it couldn't join.
+    cr_assert_eq(conf_create(p, ph.tu), -1, "Bridge created for an on-hook phone");
+    snprintf(want, sizeof(want), "ON HOOK %d\n", ph.ext);
+    cr_assert_str_eq(drain(&ph, buf, sizeof(buf)), want, "Phone got '%s'", buf);
+    int ext = pbx_reserve_extension(p);
+    cr_assert_eq(ext, ph.ext + 1, "Extension %d was used up", ph.ext + 1);
+    pbx_release_extension(p, ext);
+    phone_down(p, &ph);
+    pbx_config.reuse_delay_ms = delay;
+}
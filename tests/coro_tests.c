@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "server.h"
+#include "server_extra.h"
+#include "coro.h"
+#include "__test_phone.h"
+
+#define SUITE coro_suite
+
+#define NUM_ECHO 500
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait for every coroutine to finish.
+ */
+static void wait_done(void) {
+    CORO_STATS stats;
+    for(int i = 0; i < 200; i++){
+        coro_get_stats(&stats);
+        if(stats.running == 0){
+            return;
+        }
+        usleep(10000);
+    }
+    cr_assert_fail("%ld coroutines still running", stats.running);
+}
+
+typedef struct echo {
+    int fd;
+    pthread_t thread;  //The thread it ran on
+} ECHO;
+
+/*
+ * Send back each byte that arrives until the other end closes.
+ */
+static void echo_fn(void *arg) {
+    ECHO *echo = arg;
+    echo->thread = pthread_self();
+    char c;
+    while(coro_read(echo->fd, &c, 1) == 1){
+        c++;
+        write(echo->fd, &c, 1);
+    }
+    close(echo->fd);
+}
+
+Test(SUITE, echo_test, .timeout = 10) {
+    static ECHO echo[NUM_ECHO];
+    int client[NUM_ECHO];
+    signal(SIGPIPE, SIG_IGN);
+    for(int i = 0; i < NUM_ECHO; i++){
+        int sv[2];
+        cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        echo[i].fd = sv[0];
+        client[i] = sv[1];
+        cr_assert_eq(coro_spawn(echo_fn, &echo[i]), 0);
+    }
+    // Every coroutine is waiting at once; they only get on when their input comes.
+    for(int round = 0; round < 3; round++){
+        for(int i = 0; i < NUM_ECHO; i++){
+            char c = 'a' + round;
+            cr_assert_eq(write(client[i], &c, 1), 1);
+        }
+        for(int i = 0; i < NUM_ECHO; i++){
+            char c = 0;
+            cr_assert_eq(read(client[i], &c, 1), 1);
+            cr_assert_eq(c, 'a' + round + 1, "Coroutine %d sent back '%c'", i, c);
+        }
+    }
+    CORO_STATS stats;
+    coro_get_stats(&stats);
+    cr_assert(stats.running >= NUM_ECHO);
+    cr_assert(stats.switches >= NUM_ECHO, "Only %ld switches", stats.switches);
+    for(int i = 0; i < NUM_ECHO; i++){
+        close(client[i]);
+    }
+    wait_done();
+    for(int i = 1; i < NUM_ECHO; i++){
+        cr_assert(pthread_equal(echo[i].thread, echo[0].thread), "Coroutines ran on different threads");
+    }
+    cr_assert(!pthread_equal(echo[0].thread, pthread_self()));
+    cr_assert(!coro_active(), "Not on a coroutine here");
+}
+
+typedef struct waiter {
+    int fd;
+    int timeout_ms;
+    int result;
+    uint64_t took_ms;
+    _Atomic int done;
+} WAITER;
+
+static void poll_fn(void *arg) {
+    WAITER *w = arg;
+    uint64_t start = now_ms();
+    w->result = coro_poll(w->fd, w->timeout_ms);
+    w->took_ms = now_ms() - start;
+    atomic_store(&w->done, 1);
+}
+
+Test(SUITE, poll_test, .timeout = 5) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    // Nothing comes, so the wait runs out.
+    WAITER quiet = { .fd = sv[0], .timeout_ms = 100 };
+    cr_assert_eq(coro_spawn(poll_fn, &quiet), 0);
+    wait_done();
+    cr_assert_eq(quiet.result, 0);
+    cr_assert(quiet.took_ms >= 100 && quiet.took_ms < 300, "Took %lu ms", (unsigned long)quiet.took_ms);
+
+    // Input cuts it short.
+    WAITER busy = { .fd = sv[0], .timeout_ms = 5000 };
+    cr_assert_eq(coro_spawn(poll_fn, &busy), 0);
+    usleep(50000);
+    cr_assert_eq(atomic_load(&busy.done), 0, "Did not wait for input");
+    cr_assert_eq(write(sv[1], "x", 1), 1);
+    wait_done();
+    cr_assert_eq(busy.result, 1);
+    cr_assert(busy.took_ms < 1000, "Took %lu ms", (unsigned long)busy.took_ms);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Start serving a client on a coroutine.
+ *
+ * @return the client's end of the connection.
+ */
+static int client_up(void) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    cr_assert_eq(coro_spawn(pbx_client_coroutine, connfdp), 0);
+    return sv[1];
+}
+
+Test(SUITE, service_test, .timeout = 5) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    char buf[128], want[128];
+    int a = client_up();
+    int b = client_up();
+    int ext_a, ext_b;
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "ON HOOK %d", &ext_a), 1, "Got '%s'", buf);
+    cr_assert_eq(sscanf(get_line(b, buf, sizeof(buf)), "ON HOOK %d", &ext_b), 1, "Got '%s'", buf);
+
+    // The same service loop as a thread runs, one coroutine per client.
+    write(a, "pickup\r\n", 8);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    snprintf(want, sizeof(want), "dial %d\n", ext_b);
+    write(a, want, strlen(want));
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+    write(b, "pickup\n", 7);
+    snprintf(want, sizeof(want), "CONNECTED %d", ext_a);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    snprintf(want, sizeof(want), "CONNECTED %d", ext_b);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+    write(a, "chat hello there\n", 17);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "CHAT hello there");
+
+    // A client going away hangs up its call, as it would on a thread.
+    close(a);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "DIAL TONE");
+    close(b);
+    wait_done();
+    PBX_STATS stats;
+    pbx_get_stats(pbx, &stats);
+    cr_assert_eq(stats.registered, 0);
+}
+
+#define NUM_URING 50
+
+static int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    cr_assert_eq(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    return fd;
+}
+
+Test(SUITE, uring_test, .timeout = 10) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    cr_assert_eq(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    cr_assert_eq(listen(listenfd, NUM_URING), 0);
+    cr_assert_eq(getsockname(listenfd, (struct sockaddr *)&addr, &len), 0);
+    if(coro_listen(listenfd, pbx_client_coroutine) < 0){
+        cr_skip_test("io_uring is not available");
+    }
+    int port = ntohs(addr.sin_port);
+    char buf[128], want[128];
+    int client[NUM_URING], ext[NUM_URING];
+    for(int i = 0; i < NUM_URING; i++){
+        client[i] = connect_to(port);
+        cr_assert_eq(sscanf(get_line(client[i], buf, sizeof(buf)), "ON HOOK %d", &ext[i]), 1, "Got '%s'", buf);
+    }
+
+    // Everyone picks up at once; the answers go out together rather than an enter each.
+    CORO_STATS before, after;
+    coro_get_stats(&before);
+    for(int i = 0; i < NUM_URING; i++){
+        write(client[i], "pickup\n", 7);
+    }
+    for(int i = 0; i < NUM_URING; i++){
+        cr_assert_str_eq(get_line(client[i], buf, sizeof(buf)), "DIAL TONE");
+    }
+    coro_get_stats(&after);
+    cr_assert(after.sends - before.sends >= NUM_URING, "Only %ld sends", after.sends - before.sends);
+    cr_assert(after.enters - before.enters < NUM_URING, "%ld enters for %d commands",
+              after.enters - before.enters, NUM_URING);
+
+    // Calls and chats in pairs, each notification sent to a peer's connection.
+    for(int i = 1; i < NUM_URING; i += 2){
+        write(client[i], "hangup\n", 7);
+        snprintf(want, sizeof(want), "ON HOOK %d", ext[i]);
+        cr_assert_str_eq(get_line(client[i], buf, sizeof(buf)), want);
+    }
+    for(int i = 0; i < NUM_URING; i += 2){
+        snprintf(want, sizeof(want), "dial %d\n", ext[i + 1]);
+        write(client[i], want, strlen(want));
+        cr_assert_str_eq(get_line(client[i], buf, sizeof(buf)), "RING BACK");
+        cr_assert_str_eq(get_line(client[i + 1], buf, sizeof(buf)), "RINGING");
+        write(client[i + 1], "pickup\n", 7);
+        snprintf(want, sizeof(want), "CONNECTED %d", ext[i]);
+        cr_assert_str_eq(get_line(client[i + 1], buf, sizeof(buf)), want);
+        snprintf(want, sizeof(want), "CONNECTED %d", ext[i + 1]);
+        cr_assert_str_eq(get_line(client[i], buf, sizeof(buf)), want);
+    }
+    for(int i = 0; i < NUM_URING; i += 2){
+        write(client[i], "chat hello there\n", 17);
+    }
+    for(int i = 0; i < NUM_URING; i += 2){
+        cr_assert_str_eq(get_line(client[i + 1], buf, sizeof(buf)), "CHAT hello there");
+    }
+
+    for(int i = 0; i < NUM_URING; i++){
+        close(client[i]);
+    }
+    wait_done();
+    PBX_STATS stats;
+    pbx_get_stats(pbx, &stats);
+    cr_assert_eq(stats.registered, 0);
+}
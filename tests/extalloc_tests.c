@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <criterion/criterion.h>
+
+#include "extalloc.h"
+#include "config.h"
+#include "__test_phone.h"
+
+#define SUITE extalloc_suite
+
+Test(SUITE, range_test, .timeout = 5) {
+    EXT_ALLOC *ea = ext_alloc_create(100, 3, 0);
+    cr_assert_not_null(ea, "Allocator creation failed");
+    cr_assert_eq(ext_alloc_get(ea), 100);
+    cr_assert_eq(ext_alloc_get(ea), 101);
+    cr_assert_eq(ext_alloc_get(ea), 102);
+    cr_assert_eq(ext_alloc_get(ea), -1, "Allocated past the end of the range");
+    cr_assert_eq(ext_alloc_used(ea), 3);
+    cr_assert_eq(ext_alloc_put(ea, 101), 0);
+    cr_assert_eq(ext_alloc_put(ea, 101), -1, "Double release was accepted");
+    cr_assert_eq(ext_alloc_put(ea, 99), -1, "Release outside the range was accepted");
+    cr_assert_eq(ext_alloc_get(ea), 101);
+    ext_alloc_destroy(ea);
+}
+
+Test(SUITE, reuse_delay_test, .timeout = 5) {
+    EXT_ALLOC *ea = ext_alloc_create(1, 2, 200);
+    cr_assert_eq(ext_alloc_get(ea), 1);
+    cr_assert_eq(ext_alloc_put(ea, 1), 0);
+    // The released number is still cooling down, so a fresh one is handed out.
+    cr_assert_eq(ext_alloc_get(ea), 2);
+    cr_assert_eq(ext_alloc_get(ea), -1, "Released number reused within its delay");
+    usleep(300000);
+    cr_assert_eq(ext_alloc_get(ea), 1);
+    ext_alloc_destroy(ea);
+}
+
+Test(SUITE, claim_test, .timeout = 5) {
+    EXT_ALLOC *ea = ext_alloc_create(10, 4, 0);
+    cr_assert_eq(ext_alloc_claim(ea, 11), 0);
+    cr_assert_eq(ext_alloc_claim(ea, 11), -1, "Number claimed twice");
+    cr_assert_eq(ext_alloc_claim(ea, 20), -1, "Claim outside the range was accepted");
+    cr_assert(ext_alloc_in_use(ea, 11));
+    cr_assert_eq(ext_alloc_get(ea), 10);
+    cr_assert_eq(ext_alloc_get(ea), 12, "Claimed number was handed out again");
+    // Claim a number while it is waiting in the release queue.
+    cr_assert_eq(ext_alloc_put(ea, 10), 0);
+    cr_assert_eq(ext_alloc_claim(ea, 10), 0);
+    cr_assert_eq(ext_alloc_get(ea), 13);
+    cr_assert_eq(ext_alloc_get(ea), -1);
+    ext_alloc_destroy(ea);
+}
+
+#define NTHREADS 4
+#define NROUNDS 100000
+
+static void *churn(void *arg) {
+    EXT_ALLOC *ea = arg;
+    for(int i = 0; i < NROUNDS; i++) {
+        int ext = ext_alloc_get(ea);
+        if(ext < 0)
+            return (void *)1;
+        if(ext_alloc_put(ea, ext) < 0)
+            return (void *)1;
+    }
+    return NULL;
+}
+
+Test(SUITE, concurrent_test, .timeout = 30) {
+    // Each thread holds at most one number and at most one more can be in the middle
+    // of being released, so twice as many numbers as threads never runs out.
+    EXT_ALLOC *ea = ext_alloc_create(1, 2 * NTHREADS, 0);
+    pthread_t tids[NTHREADS];
+    for(int i = 0; i < NTHREADS; i++)
+        pthread_create(&tids[i], NULL, churn, ea);
+    for(int i = 0; i < NTHREADS; i++) {
+        void *ret;
+        pthread_join(tids[i], &ret);
+        cr_assert_null(ret, "Thread %d failed to allocate or release", i);
+    }
+    cr_assert_eq(ext_alloc_used(ea), 0);
+    ext_alloc_destroy(ea);
+}
+
+Test(SUITE, ten_digit_test, .timeout = 5) {
+    // The widest extensions -e takes still get their notifications whole.
+    int first = pbx_config.ext_first, count = pbx_config.ext_count;
+    pbx_config.ext_first = 2000000000;
+    pbx_config.ext_count = 10;
+    PBX *p = pbx_init();
+    PHONE ph;
+    char buf[64];
+    phone_up(p, &ph);
+    cr_assert_eq(ph.ext, 2000000000);
+    cr_assert_str_eq(drain(&ph, buf, sizeof(buf)), "ON HOOK 2000000000\n");
+    tu_pickup(ph.tu);
+    cr_assert_str_eq(drain(&ph, buf, sizeof(buf)), "DIAL TONE\n");
+    phone_down(p, &ph);
+    pbx_shutdown(p);
+    pbx_config.ext_first = first;
+    pbx_config.ext_count = count;
+}
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "hazard.h"
+#include "__test_phone.h"
+
+#define SUITE hazard_suite
+
+static atomic_int num_freed;
+
+static void count_free(void *ptr) {
+    atomic_fetch_add(&num_freed, 1);
+    free(ptr);
+}
+
+Test(SUITE, retire_test, .timeout = 5) {
+    atomic_store(&num_freed, 0);
+    void *kept = malloc(16), *gone = malloc(16);
+    cr_assert_eq(hazard_protect(HAZARD_PEER, kept), 0);
+    hazard_retire(kept, count_free);
+    hazard_retire(gone, count_free);
+    hazard_reclaim();
+    cr_assert_eq(atomic_load(&num_freed), 1, "Protected memory was freed");
+
+    // Only once its slot is cleared.
+    hazard_clear(HAZARD_PEER);
+    hazard_reclaim();
+    cr_assert_eq(atomic_load(&num_freed), 2);
+    HAZARD_STATS stats;
+    hazard_get_stats(&stats);
+    cr_assert(stats.threads >= 1);
+    cr_assert(stats.freed >= 2);
+}
+
+static void *protect_and_exit(void *arg) {
+    hazard_protect(HAZARD_PEER, arg);
+    return NULL;
+}
+
+Test(SUITE, exit_test, .timeout = 5) {
+    atomic_store(&num_freed, 0);
+    void *ptr = malloc(16);
+    pthread_t tid;
+    pthread_create(&tid, NULL, protect_and_exit, ptr);
+    pthread_join(tid, NULL);
+    // A thread that exits lets go of what it had in its slots.
+    hazard_retire(ptr, count_free);
+    hazard_reclaim();
+    cr_assert_eq(atomic_load(&num_freed), 1);
+}
+
+/*
+ * Read the client's end of a phone's connection and throw it away, so that
+ * nothing written to the phone ever waits for room, until the phone hangs up.
+ */
+static void *discard(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[4096];
+    while(read(fd, buf, sizeof(buf)) > 0){
+        ;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void busy_up(PBX *p, PHONE *ph) {
+    pthread_t tid;
+    phone_up(p, ph);
+    pthread_create(&tid, NULL, discard, (void *)(intptr_t)ph->client);
+    pthread_detach(tid);
+}
+
+/*
+ * The client's end is left to its reader, which closes it once it sees the
+ * phone's end go.
+ */
+static void busy_down(PBX *p, PHONE *ph) {
+    int fd = tu_fileno(ph->tu);
+    pbx_unregister(p, ph->tu);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+#define NUM_ROUNDS 2000
+
+typedef struct side {
+    PBX *pbx;
+    PHONE *self;
+    PHONE *other;
+} SIDE;
+
+/*
+ * Each side keeps chatting to the other, picking up and hanging up, and
+ * calling it back, all at once with the other side doing the same.
+ */
+static void *keep_calling(void *arg) {
+    SIDE *side = arg;
+    for(int i = 0; i < NUM_ROUNDS; i++){
+        switch(rand() % 4){
+        case 0:
+            tu_chat(side->self->tu, "hello");
+            break;
+        case 1:
+            tu_pickup(side->self->tu);
+            break;
+        case 2:
+            tu_hangup(side->self->tu);
+            break;
+        default:
+            tu_pickup(side->self->tu);
+            pbx_dial(side->pbx, side->self->tu, side->other->ext);
+            break;
+        }
+    }
+    tu_hangup(side->self->tu);
+    return NULL;
+}
+
+Test(SUITE, pair_test, .timeout = 30) {
+    PBX *p = pbx_init();
+    PHONE a, b;
+    busy_up(p, &a);
+    busy_up(p, &b);
+    // Locking each other from both ends at once used to be able to deadlock.
+    SIDE sides[2] = {{ p, &a, &b }, { p, &b, &a }};
+    pthread_t tids[2];
+    for(int i = 0; i < 2; i++){
+        pthread_create(&tids[i], NULL, keep_calling, &sides[i]);
+    }
+    for(int i = 0; i < 2; i++){
+        pthread_join(tids[i], NULL);
+    }
+    PBX_STATS stats;
+    pbx_get_stats(p, &stats);
+    cr_assert_eq(stats.registered, 2);
+    busy_down(p, &a);
+    busy_down(p, &b);
+}
+
+typedef struct caller {
+    PBX *pbx;
+    PHONE *phone;
+    int target;
+} CALLER;
+
+static void *call_and_go(void *arg) {
+    CALLER *caller = arg;
+    tu_pickup(caller->phone->tu);
+    pbx_dial(caller->pbx, caller->phone->tu, caller->target);
+    busy_down(caller->pbx, caller->phone);
+    return NULL;
+}
+
+Test(SUITE, gone_test, .timeout = 30) {
+    PBX *p = pbx_init();
+    HAZARD_STATS before, after;
+    hazard_get_stats(&before);
+    // Callers ring a phone and go away while it picks up, so that the last
+    // reference to the caller it is waiting to lock can go meanwhile.
+    for(int i = 0; i < NUM_ROUNDS / 10; i++){
+        PHONE target, caller;
+        busy_up(p, &target);
+        busy_up(p, &caller);
+        CALLER c = { p, &caller, target.ext };
+        pthread_t tid;
+        pthread_create(&tid, NULL, call_and_go, &c);
+        tu_pickup(target.tu);
+        tu_chat(target.tu, "still there?");
+        pthread_join(tid, NULL);
+        busy_down(p, &target);
+    }
+    hazard_reclaim();
+    hazard_get_stats(&after);
+    cr_assert(after.retired - before.retired >= NUM_ROUNDS / 10 * 2);
+    cr_assert_eq(after.freed - before.freed, after.retired - before.retired, "Retired TUs left over");
+    PBX_STATS stats;
+    pbx_get_stats(p, &stats);
+    cr_assert_eq(stats.registered, 0);
+}
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "server.h"
+#include "hunt.h"
+#include "__test_phone.h"
+
+#define SUITE hunt_suite
+
+static int ringing(PHONE *ph) {
+    char buf[512];
+    return strstr(drain(ph, buf, sizeof(buf)), "RINGING\n") != NULL;
+}
+
+/*
+ * Pick up a caller, dial the group and return whatever the caller was told.
+ */
+static char *call(PBX *p, PHONE *caller, int group, char *buf, size_t size) {
+    tu_pickup(caller->tu);
+    drain(caller, buf, size);
+    pbx_dial(p, caller->tu, group);
+    return drain(caller, buf, size);
+}
+
+Test(SUITE, longest_idle_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE agent[3], caller[5];
+    char buf[512], want[32];
+    for(int i = 0; i < 3; i++)
+        phone_up(p, &agent[i]);
+    for(int i = 0; i < 5; i++)
+        phone_up(p, &caller[i]);
+    int group = hunt_create(p, agent[0].tu);
+    cr_assert(group > 0, "Group was not created");
+    snprintf(want, sizeof(want), "HUNT %d\n", group);
+    cr_assert(strstr(drain(&agent[0], buf, sizeof(buf)), want), "Creator got '%s'", buf);
+    for(int i = 1; i < 3; i++) {
+        cr_assert_eq(hunt_join(group, agent[i].tu), 0, "Agent %d could not join", i);
+        cr_assert(strstr(drain(&agent[i], buf, sizeof(buf)), want), "Agent %d got '%s'", i, buf);
+    }
+    cr_assert_eq(hunt_join(group, agent[1].tu), -1, "Joined the same group twice");
+    drain(&agent[1], buf, sizeof(buf));
+    // A member can't start another group either, which is closed again at once.
+    cr_assert_eq(hunt_create(p, agent[0].tu), -1, "Started a second group");
+    cr_assert(!strstr(drain(&agent[0], buf, sizeof(buf)), "HUNT"), "Creator got '%s'", buf);
+
+    // Callers are spread over the agents in the order they became free.
+    for(int i = 0; i < 3; i++) {
+        cr_assert(strstr(call(p, &caller[i], group, buf, sizeof(buf)), "RING BACK"), "Caller %d got '%s'", i, buf);
+        cr_assert(ringing(&agent[i]), "Agent %d is not ringing", i);
+    }
+    cr_assert(strstr(call(p, &caller[3], group, buf, sizeof(buf)), "BUSY SIGNAL"), "Caller 3 got '%s'", buf);
+
+    // Agent 1 is freed before agent 0, so it is next; agent 2 is off hook and is skipped.
+    tu_hangup(caller[1].tu);
+    tu_hangup(caller[0].tu);
+    tu_hangup(caller[2].tu);
+    tu_pickup(agent[2].tu);
+    cr_assert(strstr(call(p, &caller[4], group, buf, sizeof(buf)), "RING BACK"), "Caller 4 got '%s'", buf);
+    cr_assert(ringing(&agent[1]), "Longest idle agent is not ringing");
+    cr_assert(!ringing(&agent[0]), "Agent 0 was rung out of turn");
+
+    HUNT_GROUP *g = hunt_lookup(group);
+    cr_assert_not_null(g);
+    HUNT_STATS stats;
+    hunt_get_stats(g, &stats);
+    hunt_unref(g);
+    cr_assert_eq(stats.members, 3);
+    cr_assert_eq(stats.idle, 1);
+    cr_assert_eq(stats.calls, 5);
+    cr_assert_eq(stats.busy, 1);
+
+    // Once everyone has left, the group's extension no longer exists.
+    for(int i = 0; i < 3; i++)
+        phone_down(p, &agent[i]);
+    cr_assert_null(hunt_lookup(group), "Group outlived its members");
+    tu_hangup(caller[3].tu);
+    cr_assert(strstr(call(p, &caller[3], group, buf, sizeof(buf)), "ERROR"), "Dialing a closed group gave '%s'", buf);
+    for(int i = 0; i < 5; i++)
+        phone_down(p, &caller[i]);
+}
+
+#define NAGENTS 8
+
+static PBX *shared_pbx;
+static int shared_group;
+
+static void *dial_group(void *arg) {
+    PHONE *caller = arg;
+    tu_pickup(caller->tu);
+    pbx_dial(shared_pbx, caller->tu, shared_group);
+    return NULL;
+}
+
+Test(SUITE, concurrent_callers_test, .timeout = 10) {
+    shared_pbx = pbx_init();
+    PHONE agent[NAGENTS], caller[NAGENTS];
+    for(int i = 0; i < NAGENTS; i++) {
+        phone_up(shared_pbx, &agent[i]);
+        phone_up(shared_pbx, &caller[i]);
+    }
+    shared_group = hunt_create(shared_pbx, agent[0].tu);
+    for(int i = 1; i < NAGENTS; i++)
+        hunt_join(shared_group, agent[i].tu);
+
+    // As many callers as agents, all at once: each agent rings exactly once.
+    pthread_t tids[NAGENTS];
+    for(int i = 0; i < NAGENTS; i++)
+        pthread_create(&tids[i], NULL, dial_group, &caller[i]);
+    for(int i = 0; i < NAGENTS; i++)
+        pthread_join(tids[i], NULL);
+    for(int i = 0; i < NAGENTS; i++)
+        cr_assert(ringing(&agent[i]), "Agent %d was not rung", i);
+
+    HUNT_GROUP *g = hunt_lookup(shared_group);
+    HUNT_STATS stats;
+    hunt_get_stats(g, &stats);
+    hunt_unref(g);
+    cr_assert_eq(stats.idle, 0);
+    cr_assert_eq(stats.busy, 0, "A caller found nobody free");
+    for(int i = 0; i < NAGENTS; i++) {
+        phone_down(shared_pbx, &caller[i]);
+        phone_down(shared_pbx, &agent[i]);
+    }
+}
+
+/*
+ * Serve a client on a thread of its own, as the server does.
+ */
+static int client_up(void) {
+    int sv[2];
+    signal(SIGPIPE, SIG_IGN);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, pbx_client_service, connfdp), 0);
+    pthread_detach(tid);
+    return sv[1];
+}
+
+Test(SUITE, too_big_test, .timeout = 5) {
+    pbx = pbx_init();
+    char buf[128], want[128];
+    int a = client_up();
+    int b = client_up();
+    int ea, eb, group;
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "ON HOOK %d", &ea), 1, "Got '%s'", buf);
+    cr_assert_eq(sscanf(get_line(b, buf, sizeof(buf)), "ON HOOK %d", &eb), 1, "Got '%s'", buf);
+    write(a, "hunt\n", 5);
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "HUNT %d", &group), 1, "Got '%s'", buf);
+
+    // A number too big for an extension isn't taken for the one it would wrap round to.
+    snprintf(buf, sizeof(buf), "hunt %ld\n", group + (1L << 32));
+    write(b, buf, strlen(buf));
+    snprintf(want, sizeof(want), "ON HOOK %d", eb);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    snprintf(buf, sizeof(buf), "pickup\ndial %ld\n", ea + (1L << 32));
+    write(b, buf, strlen(buf));
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "ERROR");
+    cr_assert(!test_readable(a, 100), "Extension it wraps round to was rung");
+
+    close(a);
+    close(b);
+    pbx_shutdown(pbx);
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "local.h"
+#include "__test_phone.h"
+
+#define SUITE local_suite
+
+#define LOCAL_PATH "/tmp/pbx_local_test.sock"
+
+static int local_connect(void) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, LOCAL_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert(fd >= 0);
+    cr_assert_eq(connect(fd, (struct sockaddr *)&sa, sizeof(sa)), 0, "Cannot connect");
+    return fd;
+}
+
+/*
+ * Connect to the local socket and serve the connection as main() would.
+ */
+static int client_up(int localfd) {
+    int fd = local_connect();
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = accept(localfd, NULL, NULL);
+    cr_assert(*connfdp >= 0);
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, pbx_client_service, connfdp), 0);
+    pthread_detach(tid);
+    return fd;
+}
+
+Test(SUITE, serve_test, .timeout = 5) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    int localfd = local_init(LOCAL_PATH, NULL);
+    cr_assert(localfd >= 0, "Cannot listen");
+    // A socket left behind is replaced.
+    close(localfd);
+    localfd = local_init(LOCAL_PATH, NULL);
+    cr_assert(localfd >= 0, "Cannot replace a stale socket");
+
+    int fd = client_up(localfd);
+    char buf[64];
+    int ext;
+    cr_assert_eq(sscanf(get_line(fd, buf, sizeof(buf)), "ON HOOK %d", &ext), 1, "Got '%s'", buf);
+    write(fd, "pickup\n", 7);
+    cr_assert_str_eq(get_line(fd, buf, sizeof(buf)), "DIAL TONE");
+
+    close(fd);
+    close(localfd);
+    local_fini();
+    struct stat st;
+    cr_assert_eq(stat(LOCAL_PATH, &st), -1, "Socket left behind");
+    pbx_shutdown(pbx);
+}
+
+Test(SUITE, allow_test, .timeout = 5) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    char allow[64];
+    char buf[64];
+
+    // Somebody else is allowed, so we are turned away.
+    snprintf(allow, sizeof(allow), "%d", (int)getuid() + 1);
+    int localfd = local_init(LOCAL_PATH, allow);
+    cr_assert(localfd >= 0);
+    int fd = client_up(localfd);
+    cr_assert_str_eq(get_line(fd, buf, sizeof(buf)), "", "Served anyway: '%s'", buf);
+    close(fd);
+    close(localfd);
+
+    // We are on the list, so we get in.
+    snprintf(allow, sizeof(allow), "%d,%d", (int)getuid() + 1, (int)getuid());
+    localfd = local_init(LOCAL_PATH, allow);
+    cr_assert(localfd >= 0);
+    fd = client_up(localfd);
+    cr_assert_str_eq(get_line(fd, buf, sizeof(buf)), "ON HOOK 1");
+    close(fd);
+    close(localfd);
+
+    // Connections that aren't local are never checked.
+    int tcp = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert(local_peer_allowed(tcp), "TCP connection turned away");
+    close(tcp);
+    local_fini();
+    pbx_shutdown(pbx);
+}
+
+Test(SUITE, bad_args_test, .timeout = 5) {
+    cr_assert_eq(local_init(LOCAL_PATH, ""), -1, "Empty user list accepted");
+    cr_assert_eq(local_init(LOCAL_PATH, "1,x"), -1, "Bad user list accepted");
+    cr_assert_eq(local_init(LOCAL_PATH, "-1"), -1, "Negative user accepted");
+    // Anything but a socket at the path is left alone.
+    FILE *f = fopen(LOCAL_PATH, "w");
+    cr_assert(f != NULL);
+    fclose(f);
+    cr_assert_eq(local_init(LOCAL_PATH, NULL), -1, "Replaced a file");
+    struct stat st;
+    cr_assert_eq(stat(LOCAL_PATH, &st), 0);
+    cr_assert(S_ISREG(st.st_mode));
+    unlink(LOCAL_PATH);
+}
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "server.h"
+#include "msglog.h"
+#include "__test_phone.h"
+
+#define SUITE msglog_suite
+
+Test(SUITE, offline_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE sender, target;
+    char buf[512], want[512];
+    phone_up(p, &sender);
+    drain(&sender, buf, sizeof(buf));
+
+    // Nobody is at the extension yet, but the messages are kept for it.
+    int ext = PBX_MAX_EXTENSIONS + 100;
+    cr_assert_eq(msglog_send(sender.tu, ext, "hello"), 0);
+    snprintf(want, sizeof(want), "STORED %d\n", ext);
+    cr_assert_str_eq(drain(&sender, buf, sizeof(buf)), want, "Sender got '%s'", buf);
+    cr_assert_eq(msglog_send(sender.tu, ext, "are you there?"), 0);
+    drain(&sender, buf, sizeof(buf));
+
+    // They all arrive, in order, right after the phone that registers there is told its extension.
+    phone_plug(&target);
+    cr_assert_eq(pbx_register(p, target.tu, ext), 0);
+    snprintf(want, sizeof(want), "ON HOOK %d\nMSG %d: hello\nMSG %d: are you there?\n", ext, sender.ext, sender.ext);
+    cr_assert_str_eq(drain(&target, buf, sizeof(buf)), want, "Target got '%s'", buf);
+
+    // And only once.
+    tu_pickup(target.tu);
+    cr_assert_str_eq(drain(&target, buf, sizeof(buf)), "DIAL TONE\n", "Target got '%s'", buf);
+    MSGLOG_STATS stats;
+    msglog_get_stats(&stats);
+    cr_assert_eq(stats.stored, 2);
+    cr_assert_eq(stats.delivered, 2);
+    cr_assert_eq(stats.pending, 0);
+
+    tu_hangup(target.tu);
+    phone_down(p, &target);
+    phone_down(p, &sender);
+}
+
+Test(SUITE, on_hook_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE sender, target;
+    char buf[512], want[512];
+    phone_up(p, &sender);
+    phone_up(p, &target);
+    drain(&target, buf, sizeof(buf));
+
+    // A phone on hook gets its messages when it next picks up, not before.
+    cr_assert_eq(msglog_send(sender.tu, target.ext, "call me"), 0);
+    cr_assert(quiet_for(&target, 100), "Target got '%s'", drain(&target, buf, sizeof(buf)));
+    tu_pickup(target.tu);
+    snprintf(want, sizeof(want), "DIAL TONE\nMSG %d: call me\n", sender.ext);
+    cr_assert_str_eq(drain(&target, buf, sizeof(buf)), want, "Target got '%s'", buf);
+
+    // Messages with nothing in them, or too many for one extension, are refused.
+    drain(&sender, buf, sizeof(buf));
+    cr_assert_eq(msglog_send(sender.tu, target.ext, ""), -1);
+    snprintf(want, sizeof(want), "NOT STORED %d\n", target.ext);
+    cr_assert_str_eq(drain(&sender, buf, sizeof(buf)), want, "Sender got '%s'", buf);
+    for(int i = 0; i < MSGLOG_MAX_PER_EXT; i++)
+        cr_assert_eq(msglog_append(target.ext, sender.ext, "x"), 0);
+    cr_assert_eq(msglog_append(target.ext, sender.ext, "x"), -1);
+
+    tu_hangup(target.tu);
+    phone_down(p, &target);
+    phone_down(p, &sender);
+}
+
+static void *burst_thread(void *arg) {
+    int ext = *(int *)arg;
+    for(int i = 0; i < 50; i++)
+        msglog_append(ext, 1, "burst");
+    return NULL;
+}
+
+Test(SUITE, group_commit_test, .timeout = 10) {
+    char path[] = "/tmp/msglog_testXXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    // A burst of messages from many senders shares syncs.
+    cr_assert_eq(msglog_init(path), 0);
+    pthread_t tid[8];
+    int exts[8];
+    for(int i = 0; i < 8; i++) {
+        exts[i] = 1000 + i;
+        pthread_create(&tid[i], NULL, burst_thread, &exts[i]);
+    }
+    for(int i = 0; i < 8; i++)
+        pthread_join(tid[i], NULL);
+    MSGLOG_STATS stats;
+    msglog_get_stats(&stats);
+    cr_assert_eq(stats.stored, 400);
+    cr_assert(stats.commits < stats.stored, "%ld syncs for %ld messages", stats.commits, stats.stored);
+    size_t len;
+    free(msglog_take(1000, &len));
+    unlink(path);
+}
+
+Test(SUITE, recovery_test, .timeout = 10) {
+    char path[] = "/tmp/msglog_testXXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    // What one server stored, and hadn't delivered, is there for the next.
+    pid_t pid = fork();
+    if(pid == 0) {
+        int ok = msglog_init(path) == 0 && msglog_append(7, 3, "first") == 0 &&
+                 msglog_append(8, 3, "gone") == 0 && msglog_append(7, 4, "second") == 0;
+        size_t len;
+        free(msglog_take(8, &len));
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    cr_assert_eq(msglog_init(path), 0);
+    size_t len;
+    char *msgs = msglog_take(7, &len);
+    cr_assert_not_null(msgs);
+    cr_assert_eq(len, strlen("MSG 3: first\nMSG 4: second\n"));
+    cr_assert(memcmp(msgs, "MSG 3: first\nMSG 4: second\n", len) == 0, "Got '%.*s'", (int)len, msgs);
+    free(msgs);
+    cr_assert_null(msglog_take(8, &len));
+    unlink(path);
+}
+
+Test(SUITE, too_big_test, .timeout = 5) {
+    pbx = pbx_init();
+    PHONE target;
+    phone_up(pbx, &target);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, pbx_client_service, connfdp), 0);
+    char buf[128];
+    get_line(sv[1], buf, sizeof(buf));
+
+    // A number too big for an extension isn't taken for the one it would wrap
+    // round to, and one run into its text isn't a number at all.
+    snprintf(buf, sizeof(buf), "msg %ld hello\n", target.ext + (1L << 32));
+    write(sv[1], buf, strlen(buf));
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "NOT STORED -1");
+    snprintf(buf, sizeof(buf), "msg %dhello\n", target.ext);
+    write(sv[1], buf, strlen(buf));
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "NOT STORED -1");
+    MSGLOG_STATS stats;
+    msglog_get_stats(&stats);
+    cr_assert_eq(stats.pending, 0);
+
+    close(sv[1]);
+    pthread_join(tid, NULL);
+    phone_down(pbx, &target);
+}
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "server.h"
+#include "presence.h"
+#include "__test_phone.h"
+
+#define SUITE presence_suite
+
+static int count_lines(const char *buf) {
+    int lines = 0;
+    for(; *buf != '\0'; buf++)
+        lines += *buf == '\n';
+    return lines;
+}
+
+Test(SUITE, current_state_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE watcher, target;
+    char buf[512], want[64];
+    phone_up(p, &watcher);
+    phone_up(p, &target);
+    drain(&watcher, buf, sizeof(buf));
+
+    // Watching is answered straight away with the current state.
+    cr_assert_eq(presence_watch(p, watcher.tu, target.ext), 0);
+    snprintf(want, sizeof(want), "WATCH %d ON HOOK\n", target.ext);
+    cr_assert_str_eq(drain(&watcher, buf, sizeof(buf)), want, "Watcher got '%s'", buf);
+
+    // Nobody at an extension is reported as such.
+    cr_assert_eq(presence_watch(p, watcher.tu, 9999), 0);
+    cr_assert_str_eq(drain(&watcher, buf, sizeof(buf)), "WATCH 9999 UNREGISTERED\n", "Watcher got '%s'", buf);
+
+    // And a change follows within the interval.
+    tu_pickup(target.tu);
+    snprintf(want, sizeof(want), "WATCH %d DIAL TONE\n", target.ext);
+    cr_assert_str_eq(wait_for(&watcher, want, buf, sizeof(buf)), want, "Watcher got '%s'", buf);
+
+    tu_hangup(target.tu);
+    phone_down(p, &target);
+    phone_down(p, &watcher);
+}
+
+Test(SUITE, coalesce_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE watcher, target;
+    char buf[4096], want[64];
+    phone_up(p, &watcher);
+    phone_up(p, &target);
+    presence_watch(p, watcher.tu, target.ext);
+    drain(&watcher, buf, sizeof(buf));
+
+    // A phone flapping on and off hook costs its watcher a line per interval, not per change.
+    int flaps = 100;
+    for(int i = 0; i < flaps; i++) {
+        tu_pickup(target.tu);
+        tu_hangup(target.tu);
+    }
+    tu_pickup(target.tu);
+    // The state it settles on is sent last, after which the watcher hears no more.
+    snprintf(want, sizeof(want), "WATCH %d DIAL TONE\n", target.ext);
+    wait_for(&watcher, want, buf, sizeof(buf));
+    size_t len = strlen(buf);
+    while(len < sizeof(buf) - 1 && !quiet_for(&watcher, 2 * PRESENCE_INTERVAL_MS))
+        len += strlen(drain(&watcher, buf + len, sizeof(buf) - len));
+    int lines = count_lines(buf);
+    cr_assert(lines >= 1 && lines < flaps / 10, "Watcher got %d lines for %d flaps", lines, flaps);
+    size_t want_len = strlen(want);
+    cr_assert(len >= want_len && strcmp(buf + len - want_len, want) == 0, "Watcher got '%s'", buf);
+
+    tu_hangup(target.tu);
+    phone_down(p, &target);
+    phone_down(p, &watcher);
+}
+
+Test(SUITE, unregister_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE watcher[2], target;
+    char buf[512], want[64];
+    phone_up(p, &target);
+    for(int i = 0; i < 2; i++) {
+        phone_up(p, &watcher[i]);
+        presence_watch(p, watcher[i].tu, target.ext);
+        drain(&watcher[i], buf, sizeof(buf));
+    }
+
+    // A watcher that goes away is simply dropped.
+    phone_down(p, &watcher[1]);
+    // The others see the extension go.
+    int ext = target.ext;
+    phone_down(p, &target);
+    snprintf(want, sizeof(want), "WATCH %d UNREGISTERED\n", ext);
+    cr_assert_str_eq(wait_for(&watcher[0], want, buf, sizeof(buf)), want, "Watcher got '%s'", buf);
+
+    phone_down(p, &watcher[0]);
+}
+
+Test(SUITE, too_big_test, .timeout = 5) {
+    pbx = pbx_init();
+    PHONE target;
+    phone_up(pbx, &target);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, pbx_client_service, connfdp), 0);
+    char buf[128];
+    get_line(sv[1], buf, sizeof(buf));
+
+    // A number too big for an extension isn't taken for the one it would wrap round to.
+    snprintf(buf, sizeof(buf), "watch %ld\n", target.ext + (1L << 32));
+    write(sv[1], buf, strlen(buf));
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "WATCH -1 UNREGISTERED");
+
+    close(sv[1]);
+    pthread_join(tid, NULL);
+    phone_down(pbx, &target);
+}
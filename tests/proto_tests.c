@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "server.h"
+#include "server_extra.h"
+#include "tu_extra.h"
+#include "proto.h"
+#include "__test_phone.h"
+
+#define SUITE proto_suite
+
+static void read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    while(got < len){
+        ssize_t n = read(fd, (char *)buf + got, len - got);
+        cr_assert(n > 0, "Connection ended");
+        got += n;
+    }
+}
+
+/*
+ * Switch a client connection to binary, skipping the text that comes first.
+ */
+static void go_binary(int fd) {
+    unsigned char c = PROTO_MAGIC;
+    cr_assert_eq(write(fd, &c, 1), 1);
+    do{
+        cr_assert_eq(read(fd, &c, 1), 1, "No answer to PROTO_MAGIC");
+    }while(c != PROTO_MAGIC);
+}
+
+static void send_cmd(int fd, int cmd, int ext, const char *payload) {
+    size_t len = payload != NULL ? strlen(payload) : 0;
+    PROTO_CMD frame = { .cmd = cmd, .len = htons(len), .ext = htonl(ext) };
+    cr_assert_eq(write(fd, &frame, sizeof(frame)), sizeof(frame));
+    if(len > 0){
+        cr_assert_eq(write(fd, payload, len), len);
+    }
+}
+
+/*
+ * Read an event, with its fields in host byte order and its payload NUL terminated.
+ */
+static void get_event(int fd, PROTO_EVENT *ev, char *payload, size_t size) {
+    read_full(fd, ev, sizeof(*ev));
+    ev->len = ntohs(ev->len);
+    ev->ext = ntohl(ev->ext);
+    cr_assert(ev->len < size, "Payload of %d bytes", ev->len);
+    read_full(fd, payload, ev->len);
+    payload[ev->len] = '\0';
+}
+
+static void expect_state(int fd, TU_STATE state, int ext) {
+    PROTO_EVENT ev;
+    char payload[256];
+    get_event(fd, &ev, payload, sizeof(payload));
+    cr_assert_eq(ev.kind, PROTO_EV_STATE, "Got event kind %d", ev.kind);
+    cr_assert_eq(ev.state, state, "Got %s, expected %s", tu_state_names[ev.state], tu_state_names[state]);
+    cr_assert_eq(ev.ext, ext, "Got extension %u, expected %d", ev.ext, ext);
+    cr_assert_eq(ev.len, 0);
+}
+
+static int client_up(int *ext) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, pbx_client_service, connfdp), 0);
+    char buf[64];
+    cr_assert_eq(sscanf(get_line(sv[1], buf, sizeof(buf)), "ON HOOK %d", ext), 1, "Got '%s'", buf);
+    return sv[1];
+}
+
+Test(SUITE, call_test, .timeout = 5) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    int ext_a, ext_b;
+    int a = client_up(&ext_a);
+    int b = client_up(&ext_b);
+    char buf[256], want[64];
+    PROTO_EVENT ev;
+
+    // A speaks binary, B text, and each sees the call in its own terms.
+    go_binary(a);
+    send_cmd(a, TU_PICKUP_CMD, 0, NULL);
+    expect_state(a, TU_DIAL_TONE, 0);
+    send_cmd(a, TU_DIAL_CMD, ext_b, NULL);
+    expect_state(a, TU_RING_BACK, 0);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+    write(b, "pickup\n", 7);
+    snprintf(want, sizeof(want), "CONNECTED %d", ext_a);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    expect_state(a, TU_CONNECTED, ext_b);
+
+    send_cmd(a, TU_CHAT_CMD, 0, "hello there");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "CHAT hello there");
+    expect_state(a, TU_CONNECTED, ext_b);
+    write(b, "chat hi back\n", 13);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    get_event(a, &ev, buf, sizeof(buf));
+    cr_assert_eq(ev.kind, PROTO_EV_CHAT);
+    cr_assert_str_eq(buf, "hi back");
+
+    // Unknown commands are ignored, and a bad extension is no extension.
+    send_cmd(a, 99, 0, "whatever");
+    send_cmd(a, TU_HANGUP_CMD, 0, NULL);
+    expect_state(a, TU_ON_HOOK, ext_a);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "DIAL TONE");
+    send_cmd(a, TU_PICKUP_CMD, 0, NULL);
+    expect_state(a, TU_DIAL_TONE, 0);
+    send_cmd(a, TU_DIAL_CMD, 0, NULL);
+    expect_state(a, TU_ERROR, 0);
+
+    close(a);
+    close(b);
+    pbx_shutdown(pbx);
+}
+
+Test(SUITE, frames_test, .timeout = 5) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    TU *tu = tu_init(sv[0]);
+    int ext = pbx_register_auto(pbx, tu);
+    cr_assert(ext > 0);
+    cr_assert_eq(tu_get_proto(tu), PROTO_TEXT);
+
+    // Text until the switch, frames after it.
+    cr_assert_eq(tu_set_binary(tu), 0);
+    cr_assert_eq(tu_set_binary(tu), -1, "Switched twice");
+    cr_assert_eq(tu_get_proto(tu), PROTO_BINARY);
+    char buf[64];
+    unsigned char c;
+    snprintf(buf, sizeof(buf), "ON HOOK %d\n", ext);
+    size_t n = strlen(buf);
+    char got[64];
+    read_full(sv[1], got, n);
+    got[n] = '\0';
+    cr_assert_str_eq(got, buf);
+    read_full(sv[1], &c, 1);
+    cr_assert_eq(c, PROTO_MAGIC);
+
+    tu_pickup(tu);
+    expect_state(sv[1], TU_DIAL_TONE, 0);
+
+    // Anything else goes whole, as text in a frame of its own.
+    cr_assert_eq(tu_send(tu, "QUEUED 3\n", 9), 9);
+    PROTO_EVENT ev;
+    get_event(sv[1], &ev, got, sizeof(got));
+    cr_assert_eq(ev.kind, PROTO_EV_TEXT);
+    cr_assert_str_eq(got, "QUEUED 3\n");
+
+    pbx_unregister(pbx, tu);
+    expect_state(sv[1], TU_ON_HOOK, ext);
+    close(sv[0]);
+    close(sv[1]);
+}
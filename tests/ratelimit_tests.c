@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "config.h"
+#include "ratelimit.h"
+#include "__test_phone.h"
+
+#define SUITE ratelimit_suite
+
+static struct sockaddr *ipv4(struct sockaddr_in *sa, const char *addr) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    inet_pton(AF_INET, addr, &sa->sin_addr);
+    return (struct sockaddr *)sa;
+}
+
+static struct sockaddr *ipv6(struct sockaddr_in6 *sa, const char *addr) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin6_family = AF_INET6;
+    inet_pton(AF_INET6, addr, &sa->sin6_addr);
+    return (struct sockaddr *)sa;
+}
+
+Test(SUITE, admit_test, .timeout = 5) {
+    struct sockaddr_in a, b;
+    struct sockaddr_in6 c, d;
+    cr_assert(ratelimit_admit(ipv4(&a, "10.1.0.1")), "Refused with no limit");
+    cr_assert_eq(config_parse_rate("2/3", &pbx_config.admit_rate, &pbx_config.admit_burst), 0);
+    cr_assert_eq(pbx_config.admit_burst, 3);
+    RATELIMIT_STATS before, after;
+    ratelimit_get_stats(&before);
+
+    // A burst's worth gets in, then no more until the bucket refills.
+    for(int i = 0; i < 3; i++){
+        cr_assert(ratelimit_admit(ipv4(&a, "10.1.0.1")), "Refused connection %d", i);
+    }
+    cr_assert(!ratelimit_admit(ipv4(&a, "10.1.0.1")), "Admitted beyond the burst");
+    cr_assert(ratelimit_admit(ipv4(&b, "10.1.0.2")), "Another source was refused");
+    // The same host, seen over IPv6 as a mapped address, shares the bucket.
+    cr_assert(!ratelimit_admit(ipv6(&c, "::ffff:10.1.0.1")), "Mapped address has its own bucket");
+    usleep(600 * 1000);
+    cr_assert(ratelimit_admit(ipv4(&a, "10.1.0.1")), "Bucket did not refill");
+
+    // IPv6 hosts in the same /64 are one source.
+    for(int i = 0; i < 3; i++){
+        cr_assert(ratelimit_admit(ipv6(&c, "2001:db8::1")), "Refused connection %d", i);
+    }
+    cr_assert(!ratelimit_admit(ipv6(&d, "2001:db8::2")), "Same /64 has its own bucket");
+    cr_assert(ratelimit_admit(ipv6(&d, "2001:db8:0:1::1")), "Another /64 was refused");
+
+    // Local clients aren't limited.
+    struct sockaddr un = { .sa_family = AF_UNIX };
+    for(int i = 0; i < 10; i++){
+        cr_assert(ratelimit_admit(&un));
+    }
+    ratelimit_get_stats(&after);
+    cr_assert_eq(after.refused - before.refused, 3);
+    cr_assert_eq(after.admitted - before.admitted, 9);
+    pbx_config.admit_rate = 0;
+}
+
+Test(SUITE, evict_test, .timeout = 5) {
+    pbx_config.admit_rate = 1;
+    pbx_config.admit_burst = 1;
+    RATELIMIT_STATS before, after;
+    ratelimit_get_stats(&before);
+    // Far more sources than buckets: each still gets its first connection in.
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    int n = RATELIMIT_SETS * RATELIMIT_WAYS * 4;
+    for(int i = 0; i < n; i++){
+        sa.sin_addr.s_addr = htonl(0x0b000000 + i);
+        cr_assert(ratelimit_admit((struct sockaddr *)&sa), "Source %d refused", i);
+    }
+    ratelimit_get_stats(&after);
+    cr_assert_eq(after.refused, before.refused);
+    cr_assert_geq(after.evicted - before.evicted, n - RATELIMIT_SETS * RATELIMIT_WAYS);
+    pbx_config.admit_rate = 0;
+}
+
+Test(SUITE, command_test, .timeout = 5) {
+    signal(SIGPIPE, SIG_IGN);
+    pbx = pbx_init();
+    pbx_config.command_rate = 3;
+    pbx_config.command_burst = 3;
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, pbx_client_service, connfdp), 0);
+    char buf[64], want[64];
+    int ext;
+    cr_assert_eq(sscanf(get_line(sv[1], buf, sizeof(buf)), "ON HOOK %d", &ext), 1);
+    snprintf(want, sizeof(want), "ON HOOK %d", ext);
+    RATELIMIT_STATS before, after;
+    ratelimit_get_stats(&before);
+
+    // All at once: the first three are carried out and the rest refused.
+    char *cmds = "pickup\nhangup\npickup\nhangup\ndial 1\n";
+    write(sv[1], cmds, strlen(cmds));
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), want);
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "THROTTLED");
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), "THROTTLED");
+    ratelimit_get_stats(&after);
+    cr_assert_eq(after.throttled - before.throttled, 2);
+
+    // Given time, the client can carry on where it was.
+    usleep(400 * 1000);
+    write(sv[1], "hangup\n", 7);
+    cr_assert_str_eq(get_line(sv[1], buf, sizeof(buf)), want);
+
+    close(sv[1]);
+    pbx_config.command_rate = 0;
+    pbx_shutdown(pbx);
+}
+
+Test(SUITE, parse_int_test, .timeout = 5) {
+    int n = -1;
+    cr_assert_eq(config_parse_int("42", 1, 100, &n), 0);
+    cr_assert_eq(n, 42);
+    // Anything that isn't just a number in range is refused, and n is left alone.
+    cr_assert_eq(config_parse_int("abc", 1, 100, &n), -1);
+    cr_assert_eq(config_parse_int("", 1, 100, &n), -1);
+    cr_assert_eq(config_parse_int("7x", 1, 100, &n), -1);
+    cr_assert_eq(config_parse_int("0", 1, 100, &n), -1);
+    cr_assert_eq(config_parse_int("101", 1, 100, &n), -1);
+    cr_assert_eq(config_parse_int("99999999999999999999", 0, INT_MAX, &n), -1);
+    cr_assert_eq(config_parse_int("3000000", 0, INT_MAX / 1000, &n), -1);
+    cr_assert_eq(n, 42);
+}
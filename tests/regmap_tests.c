@@ -0,0 +1,198 @@
+/*
+ * restart_test starts the server itself (bin/pbx), so has to be run from the
+ * top of the tree, after it has been built.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "regmap.h"
+#include "resume.h"
+#include "__test_phone.h"
+
+#define SUITE regmap_suite
+
+#define REGMAP_PORT_STR "9983"
+
+/*
+ * Register a phone, and get the token it was given.
+ */
+static unsigned long long token_up(PBX *p, PHONE *ph) {
+    char buf[128];
+    unsigned long long token;
+    int ext;
+    phone_up(p, ph);
+    cr_assert_eq(sscanf(drain(ph, buf, sizeof(buf)), "ON HOOK %d\nRESUME %llx", &ext, &token), 2,
+                 "Got '%s'", buf);
+    return token;
+}
+
+static void map_path(char *path, size_t size) {
+    snprintf(path, size, "/tmp/regmap_test.%d", getpid());
+    unlink(path);
+}
+
+Test(SUITE, map_test, .timeout = 5) {
+    char path[64], buf[128], want[128];
+    map_path(path, sizeof(path));
+    cr_assert_eq(regmap_init(path, pbx_config.ext_first, pbx_config.ext_count, 1), 0);
+    PBX *p = pbx_init();
+    PHONE a, b, c, d;
+    unsigned long long ta = token_up(p, &a);
+    unsigned long long tb = token_up(p, &b);
+    // Unregistered, so there's nothing to come back to.
+    phone_down(p, &b);
+
+    // The server goes away without a's phone being unregistered, and its tokens with it.
+    close(a.client);
+    resume_forget(a.tu);
+    regmap_fini();
+    cr_assert_eq(regmap_init(path, pbx_config.ext_first, pbx_config.ext_count, 1), 0);
+    REGMAP_STATS before, after;
+    regmap_get_stats(&before);
+    PBX *q = pbx_init();
+    cr_assert_eq(regmap_reserve(q), 1);
+    cr_assert_eq(pbx_claim_extension(q, a.ext), -1, "Kept extension handed out");
+    cr_assert_eq(regmap_claim(tb), -1);
+    cr_assert_eq(regmap_claim(ta ^ 1), -1);
+
+    // a's client comes back, and gets its extension and token.
+    phone_plug(&c);
+    cr_assert_eq(pbx_register_kept(q, c.tu, ta), a.ext);
+    snprintf(want, sizeof(want), "ON HOOK %d\nRESUME %016llx\n", a.ext, ta);
+    cr_assert_str_eq(drain(&c, buf, sizeof(buf)), want, "Got '%s'", buf);
+    // Only once.
+    phone_plug(&d);
+    cr_assert_eq(pbx_register_kept(q, d.tu, ta), -1);
+    tu_unref(d.tu, "Not registered");
+    close(d.client);
+    regmap_get_stats(&after);
+    cr_assert_eq(after.kept - before.kept, 1);
+    cr_assert_eq(after.claimed - before.claimed, 1);
+
+    phone_down(q, &c);
+    regmap_fini();
+    unlink(path);
+}
+
+Test(SUITE, range_test, .timeout = 5) {
+    char path[64];
+    map_path(path, sizeof(path));
+    cr_assert_eq(regmap_init(path, pbx_config.ext_first, pbx_config.ext_count, 1), 0);
+    PBX *p = pbx_init();
+    PHONE a;
+    unsigned long long ta = token_up(p, &a);
+    close(a.client);
+    regmap_fini();
+
+    // A map made for other extensions is started afresh.
+    cr_assert_eq(regmap_init(path, pbx_config.ext_first + 1, pbx_config.ext_count, 1), 0);
+    cr_assert_eq(regmap_reserve(p), 0);
+    cr_assert_eq(regmap_claim(ta), -1);
+    regmap_fini();
+    unlink(path);
+}
+
+static pid_t server_pid;
+static char server_map[64];
+
+static int regmap_connect(void) {
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("127.0.0.1", REGMAP_PORT_STR, &hints, &ai) != 0){
+        return -1;
+    }
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+static void start_server(void) {
+    signal(SIGPIPE, SIG_IGN);
+    if((server_pid = fork()) == 0){
+        execl("bin/pbx", "pbx", "-p", REGMAP_PORT_STR, "-k", server_map, NULL);
+        abort();
+    }
+    for(int i = 0; i < 50; i++){
+        int fd = regmap_connect();
+        if(fd >= 0){
+            close(fd);
+            return;
+        }
+        usleep(100 * 1000);
+    }
+    cr_assert_fail("Server did not start");
+}
+
+static void kill_server(void) {
+    if(server_pid > 0 && kill(server_pid, SIGKILL) == 0){
+        waitpid(server_pid, NULL, 0);
+    }
+    server_pid = 0;
+    unlink(server_map);
+}
+
+Test(SUITE, restart_test, .fini = kill_server, .timeout = 30) {
+    char buf[64], want[64];
+    int ea, eb, ec;
+    unsigned long long token;
+    map_path(server_map, sizeof(server_map));
+    start_server();
+    int a = regmap_connect();
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "ON HOOK %d", &ea), 1);
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "RESUME %llx", &token), 1);
+
+    // The server is killed, and started again.
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+    close(a);
+    start_server();
+
+    // Somebody new doesn't get a's extension...
+    int b = regmap_connect();
+    cr_assert_eq(sscanf(get_line(b, buf, sizeof(buf)), "ON HOOK %d", &eb), 1);
+    cr_assert(eb != ea, "Kept extension %d handed out", ea);
+    get_line(b, buf, sizeof(buf));
+
+    // ...which a's client gets back when it comes back.
+    int c = regmap_connect();
+    snprintf(buf, sizeof(buf), "resume %016llx\n", token);
+    write(c, buf, strlen(buf));
+    snprintf(want, sizeof(want), "ON HOOK %d", ea);
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), want);
+    snprintf(want, sizeof(want), "RESUME %016llx", token);
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), want);
+
+    // It works as a phone again.
+    snprintf(buf, sizeof(buf), "pickup\ndial %d\n", eb);
+    write(c, buf, strlen(buf));
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+
+    // A token nobody has is turned down.
+    int d = regmap_connect();
+    write(d, "resume 0123456789abcdef\n", 24);
+    cr_assert_eq(sscanf(get_line(d, buf, sizeof(buf)), "ON HOOK %d", &ec), 1);
+    cr_assert(ec != ea && ec != eb, "Extension %d handed out twice", ec);
+    get_line(d, buf, sizeof(buf));
+    cr_assert_str_eq(get_line(d, buf, sizeof(buf)), "NOT RESUMED");
+    close(b);
+    close(c);
+    close(d);
+}
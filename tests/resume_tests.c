@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "history.h"
+#include "resume.h"
+#include "__test_phone.h"
+
+#define SUITE resume_suite
+
+/*
+ * Get the token a phone was given when it registered.
+ */
+static unsigned long long token_of(PHONE *ph) {
+    char buf[512], want[64];
+    drain(ph, buf, sizeof(buf));
+    snprintf(want, sizeof(want), "ON HOOK %d\nRESUME ", ph->ext);
+    cr_assert_eq(strncmp(buf, want, strlen(want)), 0, "No token in '%s'", buf);
+    return strtoull(buf + strlen(want), NULL, 16);
+}
+
+/*
+ * Put two phones in a call, and get the token the first one was given.
+ */
+static unsigned long long call(PBX *p, PHONE *a, PHONE *b) {
+    char buf[512];
+    unsigned long long token = token_of(a);
+    tu_pickup(a->tu);
+    pbx_dial(p, a->tu, b->ext);
+    tu_pickup(b->tu);
+    drain(b, buf, sizeof(buf));
+    drain(a, buf, sizeof(buf));
+    return token;
+}
+
+/*
+ * The connection of a phone drops, as the server sees it.
+ */
+static void drop(PBX *p, PHONE *ph) {
+    int fd = tu_fileno(ph->tu);
+    close(ph->client);
+    cr_assert_eq(pbx_hold(p, ph->tu), 0, "Phone was not held");
+    close(fd);
+}
+
+Test(SUITE, history_test, .timeout = 5) {
+    TU *a = (TU *)0x1000, *b = (TU *)0x2000;
+    CALL_HISTORY *h = history_get(a, b);
+    cr_assert_not_null(h);
+    size_t len;
+    char *missed;
+
+    // Only chats sent to a TU after its mark come back, and only once.
+    history_add(h, b, "before", 6);
+    history_mark(h, b);
+    history_add(h, b, "one", 3);
+    history_add(h, a, "reply", 5);
+    history_add(h, b, "two", 3);
+    missed = history_missed(h, b, &len);
+    cr_assert_not_null(missed);
+    cr_assert_eq(len, 18);
+    cr_assert_eq(memcmp(missed, "CHAT one\nCHAT two\n", len), 0);
+    free(missed);
+    cr_assert_null(history_missed(h, b, &len));
+    cr_assert_null(history_missed(h, a, &len), "Nothing was marked for the other side");
+
+    // When more arrives than the ring holds, the oldest go.
+    char chat[100];
+    history_mark(h, a);
+    for(int i = 0; i < 200; i++){
+        snprintf(chat, sizeof(chat), "%03d%096d", i, 0);
+        history_add(h, a, chat, strlen(chat));
+    }
+    missed = history_missed(h, a, &len);
+    cr_assert_not_null(missed);
+    int kept = HISTORY_BYTES / (99 + 3);
+    cr_assert_eq(len, kept * (99 + 6), "Got %zu bytes", len);
+    snprintf(chat, sizeof(chat), "CHAT %03d", 200 - kept);
+    cr_assert_eq(memcmp(missed, chat, 8), 0, "Oldest kept is '%.8s'", missed);
+    snprintf(chat, sizeof(chat), "CHAT %03d", 199);
+    cr_assert_eq(memcmp(missed + len - 105, chat, 8), 0);
+    free(missed);
+    history_put(h);
+}
+
+Test(SUITE, replay_test, .timeout = 5) {
+    pbx_config.resume_grace_ms = 2000;
+    PBX *p = pbx_init();
+    PHONE a, b, c;
+    char buf[512], want[512];
+    phone_up(p, &a);
+    phone_up(p, &b);
+    unsigned long long token = call(p, &a, &b);
+    drain(&b, buf, sizeof(buf));
+
+    // The peer carries on chatting, not knowing the other end has gone.
+    drop(p, &a);
+    cr_assert_eq(tu_chat(b.tu, "are you there?"), 0);
+    cr_assert_eq(tu_chat(b.tu, "hello?"), 0);
+    drain(&b, buf, sizeof(buf));
+
+    // A wrong token gets nothing.
+    phone_up(p, &c);
+    drain(&c, buf, sizeof(buf));
+    cr_assert_eq(pbx_resume(p, c.tu, token + 1), c.tu);
+    cr_assert_str_eq(drain(&c, buf, sizeof(buf)), "NOT RESUMED\n", "Got '%s'", buf);
+
+    // The right one gets the call back, and everything missed, in one go.
+    cr_assert_eq(pbx_resume(p, c.tu, token), a.tu);
+    snprintf(want, sizeof(want), "CONNECTED %d\nCHAT are you there?\nCHAT hello?\n", b.ext);
+    cr_assert_str_eq(drain(&c, buf, sizeof(buf)), want, "Got '%s'", buf);
+    cr_assert_eq(tu_chat(a.tu, "sorry"), 0);
+    cr_assert_str_eq(drain(&b, buf, sizeof(buf)), "CHAT sorry\n", "Peer got '%s'", buf);
+
+    // The token can't be used twice.
+    PHONE d;
+    phone_up(p, &d);
+    drain(&d, buf, sizeof(buf));
+    cr_assert_eq(pbx_resume(p, d.tu, token), d.tu);
+}
+
+Test(SUITE, expiry_test, .timeout = 5) {
+    pbx_config.resume_grace_ms = 200;
+    PBX *p = pbx_init();
+    PHONE a, b, c;
+    char buf[512], want[512];
+    phone_up(p, &a);
+    phone_up(p, &b);
+    unsigned long long token = call(p, &a, &b);
+    drain(&b, buf, sizeof(buf));
+    int ext = a.ext;
+    drop(p, &a);
+
+    // Once the grace period is over, the phone is unplugged, hanging up the call.
+    // Its extension is gone by the time the peer hears about it.
+    cr_assert_str_eq(wait_for(&b, "DIAL TONE\n", buf, sizeof(buf)), "DIAL TONE\n", "Peer got '%s'", buf);
+    TU *gone = pbx_lookup(p, ext);
+    cr_assert_null(gone, "Extension %d is still registered", ext);
+
+    phone_up(p, &c);
+    drain(&c, buf, sizeof(buf));
+    cr_assert_eq(pbx_resume(p, c.tu, token), c.tu);
+    snprintf(want, sizeof(want), "NOT RESUMED\n");
+    cr_assert_str_eq(drain(&c, buf, sizeof(buf)), want, "Got '%s'", buf);
+}
+
+Test(SUITE, no_grace_test, .timeout = 5) {
+    PBX *p = pbx_init();
+    PHONE a, b;
+    char buf[512];
+    phone_up(p, &a);
+    phone_up(p, &b);
+    tu_pickup(a.tu);
+    pbx_dial(p, a.tu, b.ext);
+    tu_pickup(b.tu);
+    cr_assert_null(strstr(drain(&a, buf, sizeof(buf)), "RESUME"), "Got '%s'", buf);
+    cr_assert_eq(pbx_hold(p, a.tu), -1, "Held with resume turned off");
+}
+
+Test(SUITE, rebind_test, .timeout = 5) {
+    pbx_config.resume_grace_ms = 2000;
+    PBX *p = pbx_init();
+    PHONE a, b;
+    char buf[512], want[512];
+    phone_up(p, &a);
+    phone_up(p, &b);
+    unsigned long long token = token_of(&a);
+    drain(&b, buf, sizeof(buf));
+
+    // A phone that isn't in a call is held too, and the call it makes goes on without it.
+    tu_pickup(a.tu);
+    pbx_dial(p, a.tu, b.ext);
+    drain(&a, buf, sizeof(buf));
+    drop(p, &a);
+    tu_pickup(b.tu);
+    cr_assert_eq(tu_chat(b.tu, "hi"), 0);
+    drain(&b, buf, sizeof(buf));
+
+    // It comes back on a new connection without registering again.
+    PBX_STATS before, after;
+    pbx_get_stats(p, &before);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(pbx_rebind(p, sv[0], token + 1), NULL);
+    cr_assert_eq(pbx_rebind(p, sv[0], token), a.tu);
+    a.client = sv[1];
+    pbx_get_stats(p, &after);
+    cr_assert_eq(after.registrations, before.registrations);
+    cr_assert_eq(after.registered, before.registered);
+    cr_assert_eq(tu_extension(a.tu), a.ext);
+    snprintf(want, sizeof(want), "CONNECTED %d\nCHAT hi\n", b.ext);
+    cr_assert_str_eq(drain(&a, buf, sizeof(buf)), want, "Got '%s'", buf);
+
+    // Its peer never heard a thing.
+    cr_assert_str_eq(drain(&b, buf, sizeof(buf)), "", "Peer got '%s'", buf);
+    cr_assert_eq(tu_chat(a.tu, "back"), 0);
+    cr_assert_str_eq(drain(&b, buf, sizeof(buf)), "CHAT back\n", "Peer got '%s'", buf);
+
+    // And it can be held again later, with the same token.
+    drop(p, &a);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(pbx_rebind(p, sv[0], token), a.tu);
+    a.client = sv[1];
+    snprintf(want, sizeof(want), "CONNECTED %d\n", b.ext);
+    cr_assert_str_eq(drain(&a, buf, sizeof(buf)), want, "Got '%s'", buf);
+}
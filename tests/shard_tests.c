@@ -0,0 +1,288 @@
+/*
+ * These tests start the server itself (bin/pbx -w 2), so have to be run from
+ * the top of the tree, after it has been built.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_phone.h"
+
+#define SUITE shard_suite
+
+#define SHARD_PORT_STR "9981"
+
+static pid_t server_pid;
+
+static int shard_connect(void) {
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("127.0.0.1", SHARD_PORT_STR, &hints, &ai) != 0){
+        return -1;
+    }
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/*
+ * Start two workers, each with 50 of extensions 1-100.
+ */
+static void start_server(char *mode) {
+    signal(SIGPIPE, SIG_IGN);
+    if((server_pid = fork()) == 0){
+        //Not left running if we are killed
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        execl("bin/pbx", "pbx", "-p", SHARD_PORT_STR, "-w", "2", "-e", "1-100", mode, NULL);
+        abort();
+    }
+    for(int i = 0; i < 50; i++){
+        int fd = shard_connect();
+        if(fd >= 0){
+            close(fd);
+            return;
+        }
+        usleep(100 * 1000);
+    }
+    cr_assert_fail("Server did not start");
+}
+
+static void stop_server(void) {
+    int status;
+    kill(server_pid, SIGHUP);
+    cr_assert_eq(waitpid(server_pid, &status, 0), server_pid);
+    server_pid = 0;
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Server exited with 0x%x", status);
+}
+
+/*
+ * Make sure a server left behind by a failed test is gone (its workers go
+ * with it).
+ */
+static void kill_server(void) {
+    if(server_pid > 0 && kill(server_pid, SIGKILL) == 0){
+        waitpid(server_pid, NULL, 0);
+    }
+    server_pid = 0;
+}
+
+/*
+ * Connect until the connection lands on the worker whose slice holds the
+ * extensions from first to last (which worker gets it is up to the kernel),
+ * and gets extension want, unless that is -1.
+ */
+static int client_on(int first, int last, int want, int *ext) {
+    int others[64];
+    int n = 0;
+    char buf[64];
+    while(n < 64){
+        int fd = shard_connect();
+        cr_assert(fd >= 0, "Cannot connect");
+        cr_assert_eq(sscanf(get_line(fd, buf, sizeof(buf)), "ON HOOK %d", ext), 1, "Got '%s'", buf);
+        if(*ext >= first && *ext <= last && (want < 0 || *ext == want)){
+            //The others' numbers are given back before going on
+            while(n > 0){
+                hang_up(others[--n]);
+            }
+            return fd;
+        }
+        others[n++] = fd;
+    }
+    cr_assert_fail("Never got a connection on the worker with %d-%d (or extension %d)", first, last, want);
+    return -1;
+}
+
+/*
+ * The worker pids, as children of the supervisor.
+ */
+static int workers(pid_t *pids, int max) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)server_pid, (int)server_pid);
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        return 0;
+    }
+    int n = 0;
+    int pid;
+    while(n < max && fscanf(f, "%d", &pid) == 1){
+        pids[n++] = pid;
+    }
+    fclose(f);
+    return n;
+}
+
+static void call_across(char *mode) {
+    start_server(mode);
+    char buf[64], want[64];
+    int ea, eb, ec;
+    int a = client_on(1, 50, -1, &ea);
+    int b = client_on(51, 100, -1, &eb);
+
+    // A dials B in the other worker, and moves there without noticing; the
+    // chat going straight after the dial goes with it.
+    snprintf(buf, sizeof(buf), "pickup\ndial %d\nchat hi\n", eb);
+    write(a, buf, strlen(buf));
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+    write(b, "pickup\n", 7);
+    snprintf(want, sizeof(want), "CONNECTED %d", ea);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    snprintf(want, sizeof(want), "CONNECTED %d", eb);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+    write(a, "chat hello\n", 11);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "CHAT hello");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+    write(b, "hangup\n", 7);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+
+    // When A goes, its number goes back to its own worker, to be handed out again.
+    hang_up(a);
+    int c = client_on(1, 50, ea, &ec);
+    close(b);
+    close(c);
+    stop_server();
+}
+
+Test(SUITE, threads_test, .fini = kill_server, .timeout = 30) {
+    call_across(NULL);
+}
+
+Test(SUITE, coroutine_test, .fini = kill_server, .timeout = 30) {
+    call_across("-l");
+}
+
+Test(SUITE, uring_test, .fini = kill_server, .timeout = 30) {
+    call_across("-u");
+}
+
+Test(SUITE, crash_test, .fini = kill_server, .timeout = 30) {
+    start_server(NULL);
+    char buf[64];
+    int ea, eb;
+    int a = client_on(1, 50, -1, &ea);
+    int b = client_on(51, 100, -1, &eb);
+    snprintf(buf, sizeof(buf), "pickup\ndial %d\n", eb);
+    write(a, buf, strlen(buf));
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+
+    // The worker A has moved to dies, taking A and B with it and nobody else.
+    pid_t pids[2];
+    cr_assert_eq(workers(pids, 2), 2);
+    int c = client_on(1, 50, -1, &ea);
+    pid_t dead = pids[1];
+    kill(dead, SIGKILL);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "", "A still served");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "", "B still served");
+    write(c, "pickup\n", 7);
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), "DIAL TONE");
+
+    // It is started again.  Meanwhile connections the kernel gives it wait
+    // on its socket, which the supervisor keeps open.
+    int n = 0;
+    for(int i = 0; i < 50 && ((n = workers(pids, 2)) < 2 || pids[0] == dead || pids[1] == dead); i++)
+        usleep(100 * 1000);
+    cr_assert(n == 2 && pids[0] != dead && pids[1] != dead, "Worker not restarted");
+    int d = client_on(51, 100, -1, &eb);
+    close(a);
+    close(b);
+    snprintf(buf, sizeof(buf), "dial %d\n", eb);
+    write(c, buf, strlen(buf));
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(d, buf, sizeof(buf)), "RINGING");
+    close(c);
+    close(d);
+    stop_server();
+}
+
+/*
+ * Whether the supervisor has started itself again for an upgrade, which it
+ * does with what it supervises in its environment.
+ */
+static int supervisor_upgraded(void) {
+    char path[64], env[4096];
+    snprintf(path, sizeof(path), "/proc/%d/environ", (int)server_pid);
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        return 0;
+    }
+    size_t n = fread(env, 1, sizeof(env) - 1, f);
+    fclose(f);
+    env[n] = '\0';
+    for(size_t i = 0; i < n; i += strlen(env + i) + 1){
+        if(strncmp(env + i, "PBX_SHARD_SUPERVISOR=", 21) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Test(SUITE, upgrade_test, .fini = kill_server, .timeout = 30) {
+    start_server(NULL);
+    char buf[64], want[64];
+    int ea, eb, ec, ed;
+    int a = client_on(1, 50, -1, &ea);
+    int b = client_on(51, 100, -1, &eb);
+    int c = client_on(1, 50, -1, &ec);
+    snprintf(buf, sizeof(buf), "pickup\ndial %d\n", eb);
+    write(a, buf, strlen(buf));
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+    write(b, "pickup\n", 7);
+    snprintf(want, sizeof(want), "CONNECTED %d", ea);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    snprintf(want, sizeof(want), "CONNECTED %d", eb);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+
+    // SIGUSR1 replaces both workers, and then the supervisor itself.
+    pid_t old[2], pids[2];
+    cr_assert_eq(workers(old, 2), 2);
+    cr_assert(!supervisor_upgraded());
+    cr_assert_eq(kill(server_pid, SIGUSR1), 0);
+    int n = 0;
+    for(int i = 0; i < 50 && ((n = workers(pids, 2)) < 2 || pids[0] == old[0] || pids[0] == old[1]
+                              || pids[1] == old[0] || pids[1] == old[1] || !supervisor_upgraded()); i++)
+        usleep(100 * 1000);
+    cr_assert(n == 2 && pids[0] != old[0] && pids[0] != old[1] && pids[1] != old[0] && pids[1] != old[1],
+              "Workers not upgraded");
+    cr_assert(supervisor_upgraded(), "Supervisor not upgraded");
+
+    // The call A moved across for carries on, and dialing still crosses workers.
+    write(a, "chat hello\n", 11);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "CHAT hello");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+    int d = client_on(51, 100, -1, &ed);
+    snprintf(buf, sizeof(buf), "pickup\ndial %d\n", ed);
+    write(c, buf, strlen(buf));
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(c, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(d, buf, sizeof(buf)), "RINGING");
+
+    // A's number still goes back to its own worker when A goes.
+    write(b, "hangup\n", 7);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    hang_up(a);
+    int e = client_on(1, 50, ea, &ea);
+    close(b);
+    close(c);
+    close(d);
+    close(e);
+    stop_server();
+}
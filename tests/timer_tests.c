@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "timer.h"
+#include "__test_phone.h"
+
+#define SUITE timer_suite
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * A timer that notes when it fired.
+ */
+typedef struct shot {
+    uint64_t due_ms;
+    _Atomic uint64_t fired_ms;
+    _Atomic int times;
+    int again; //Times it asks to be armed again
+} SHOT;
+
+static int shot_fire(void *arg) {
+    SHOT *shot = arg;
+    atomic_store(&shot->fired_ms, now_ms());
+    atomic_fetch_add(&shot->times, 1);
+    return shot->again-- > 0 ? 20 : 0;
+}
+
+static void wait_idle(void) {
+    TIMER_STATS stats;
+    for(int i = 0; i < 500; i++){
+        timer_get_stats(&stats);
+        if(stats.armed == 0){
+            return;
+        }
+        usleep(10000);
+    }
+    cr_assert_fail("Still %ld timers armed", stats.armed);
+}
+
+Test(SUITE, order_test, .timeout = 5) {
+    SHOT shots[3] = {{0}};
+    int delays[3] = { 150, 50, 100 };
+    uint64_t start = now_ms();
+    for(int i = 0; i < 3; i++){
+        shots[i].due_ms = start + delays[i];
+        cr_assert_neq(timer_arm(delays[i], shot_fire, &shots[i]), 0);
+    }
+    wait_idle();
+    for(int i = 0; i < 3; i++){
+        cr_assert_eq(atomic_load(&shots[i].times), 1);
+        cr_assert_geq(shots[i].fired_ms, shots[i].due_ms, "Timer %d fired early", i);
+        cr_assert_lt(shots[i].fired_ms, shots[i].due_ms + 50, "Timer %d fired late", i);
+    }
+    cr_assert_lt(shots[1].fired_ms, shots[2].fired_ms);
+    cr_assert_lt(shots[2].fired_ms, shots[0].fired_ms);
+}
+
+Test(SUITE, rearm_cancel_test, .timeout = 5) {
+    SHOT rearm = { .again = 3 }, gone = {0};
+    timer_arm(10, shot_fire, &rearm);
+    uint32_t handle = timer_arm(50, shot_fire, &gone);
+    cr_assert_eq(timer_cancel(handle), 0);
+    cr_assert_eq(timer_cancel(handle), -1, "Cancelled twice");
+    wait_idle();
+    cr_assert_eq(atomic_load(&rearm.times), 4);
+    cr_assert_eq(atomic_load(&gone.times), 0);
+
+    // A stale handle doesn't cancel whoever has the slot now.
+    SHOT next = {0};
+    timer_arm(20, shot_fire, &next);
+    cr_assert_eq(timer_cancel(handle), -1);
+    wait_idle();
+    cr_assert_eq(atomic_load(&next.times), 1);
+}
+
+/*
+ * Lots of timers, spread over more than one turn of the first level so that
+ * most of them cascade, half of them cancelled.
+ */
+#define MANY 100000
+
+Test(SUITE, many_test, .timeout = 10) {
+    SHOT *shots = calloc(MANY, sizeof(SHOT));
+    uint32_t *handles = calloc(MANY, sizeof(uint32_t));
+    TIMER_STATS before, after;
+    timer_get_stats(&before);
+    uint64_t start = now_ms();
+    for(int i = 0; i < MANY; i++){
+        int ms = 100 + (i * 7919) % 1500;
+        shots[i].due_ms = start + ms;
+        handles[i] = timer_arm(ms, shot_fire, &shots[i]);
+        cr_assert_neq(handles[i], 0, "Timer %d wasn't armed", i);
+    }
+    for(int i = 0; i < MANY; i += 2){
+        cr_assert_eq(timer_cancel(handles[i]), 0, "Timer %d wasn't cancelled", i);
+    }
+    cr_assert_lt(now_ms() - start, 100, "Arming and cancelling took too long");
+    wait_idle();
+    for(int i = 0; i < MANY; i++){
+        cr_assert_eq(atomic_load(&shots[i].times), i % 2, "Timer %d fired %d times", i, shots[i].times);
+        if(i % 2){
+            cr_assert_geq(shots[i].fired_ms, shots[i].due_ms, "Timer %d fired early", i);
+        }
+    }
+    timer_get_stats(&after);
+    cr_assert_eq(after.fired - before.fired, MANY / 2);
+    cr_assert_eq(after.cancelled - before.cancelled, MANY / 2);
+    cr_assert_gt(after.cascaded, before.cascaded);
+    free(shots);
+    free(handles);
+}
+
+Test(SUITE, ring_timeout_test, .timeout = 5) {
+    pbx_config.ring_timeout_ms = 100;
+    PBX *p = pbx_init();
+    PHONE a, b;
+    char buf[512], want[512];
+    phone_up(p, &a);
+    phone_up(p, &b);
+
+    // Answered in time, the call goes on.
+    tu_pickup(a.tu);
+    pbx_dial(p, a.tu, b.ext);
+    tu_pickup(b.tu);
+    drain(&a, buf, sizeof(buf));
+    drain(&b, buf, sizeof(buf));
+    cr_assert(quiet_for(&b, 200), "Got '%s'", drain(&b, buf, sizeof(buf)));
+    tu_hangup(b.tu);
+    tu_hangup(a.tu);
+    drain(&a, buf, sizeof(buf));
+    drain(&b, buf, sizeof(buf));
+
+    // Left ringing, it is given up.
+    tu_pickup(a.tu);
+    pbx_dial(p, a.tu, b.ext);
+    drain(&a, buf, sizeof(buf));
+    drain(&b, buf, sizeof(buf));
+    snprintf(want, sizeof(want), "ON HOOK %d\n", b.ext);
+    cr_assert_str_eq(wait_for(&b, want, buf, sizeof(buf)), want, "Got '%s'", buf);
+    cr_assert_str_eq(wait_for(&a, "DIAL TONE\n", buf, sizeof(buf)), "DIAL TONE\n", "Caller got '%s'", buf);
+    wait_idle();
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "trace.h"
+
+#define SUITE trace_suite
+
+/*
+ * Dump the trace and copy out the events recorded by one thread, oldest first.
+ * Returns the number of events copied.
+ */
+static int events_of_thread(int tid, TRACE_EVENT *out, int max) {
+    FILE *f = tmpfile();
+    cr_assert_not_null(f);
+    cr_assert_eq(trace_dump(fileno(f)), 0, "Dump failed");
+    rewind(f);
+    TRACE_FILE_HEADER hdr;
+    cr_assert_eq(fread(&hdr, sizeof(hdr), 1, f), 1);
+    cr_assert_eq(memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)), 0, "Bad magic");
+    cr_assert_eq(hdr.event_size, sizeof(TRACE_EVENT));
+    cr_assert_eq(hdr.ring_events, TRACE_RING_EVENTS);
+    int n = 0;
+    for(uint32_t r = 0; r < hdr.num_rings; r++){
+        TRACE_RING_HEADER rh;
+        TRACE_EVENT ring[TRACE_RING_EVENTS];
+        cr_assert_eq(fread(&rh, sizeof(rh), 1, f), 1);
+        cr_assert_eq(fread(ring, sizeof(TRACE_EVENT), TRACE_RING_EVENTS, f), TRACE_RING_EVENTS);
+        if(rh.tid != tid)
+            continue;
+        uint64_t start = rh.head > TRACE_RING_EVENTS ? rh.head - TRACE_RING_EVENTS : 0;
+        for(uint64_t i = start; i < rh.head && n < max; i++)
+            out[n++] = ring[i % TRACE_RING_EVENTS];
+    }
+    fclose(f);
+    return n;
+}
+
+Test(SUITE, transitions_test, .timeout = 5) {
+    int fd = open("/dev/null", O_WRONLY);
+    TU *a = tu_init(fd);
+    TU *b = tu_init(fd);
+    tu_set_extension(a, 7);
+    tu_set_extension(b, 8);
+    tu_pickup(a);
+    tu_dial(a, b);
+    tu_pickup(b);
+    tu_hangup(a);
+
+    TRACE_EVENT ev[16];
+    int n = events_of_thread((int)syscall(SYS_gettid), ev, 16);
+    struct { int ext, old_state, new_state, cmd, peer_ext, in_call; } want[] = {
+        {7, TU_ON_HOOK, TU_ON_HOOK, TU_CONNECT_CMD, -1, 0},
+        {8, TU_ON_HOOK, TU_ON_HOOK, TU_CONNECT_CMD, -1, 0},
+        {7, TU_ON_HOOK, TU_DIAL_TONE, TU_PICKUP_CMD, -1, 0},
+        {7, TU_DIAL_TONE, TU_RING_BACK, TU_DIAL_CMD, 8, 1},
+        {8, TU_ON_HOOK, TU_RINGING, TU_DIAL_CMD, 7, 1},
+        {8, TU_RINGING, TU_CONNECTED, TU_PICKUP_CMD, 7, 1},
+        {7, TU_RING_BACK, TU_CONNECTED, TU_PICKUP_CMD, 8, 1},
+        {7, TU_CONNECTED, TU_ON_HOOK, TU_HANGUP_CMD, 8, 1},
+        {8, TU_CONNECTED, TU_DIAL_TONE, TU_HANGUP_CMD, 7, 1},
+    };
+    int nwant = sizeof(want) / sizeof(want[0]);
+    cr_assert_eq(n, nwant, "Expected %d events, got %d", nwant, n);
+    uint32_t call_id = ev[3].call_id;
+    cr_assert_neq(call_id, 0, "Call was not given an id");
+    for(int i = 0; i < n; i++){
+        cr_assert_eq(ev[i].ext, want[i].ext, "Event %d: wrong extension", i);
+        cr_assert_eq(ev[i].old_state, want[i].old_state, "Event %d: wrong old state", i);
+        cr_assert_eq(ev[i].new_state, want[i].new_state, "Event %d: wrong new state", i);
+        cr_assert_eq(ev[i].cmd, want[i].cmd, "Event %d: wrong command", i);
+        cr_assert_eq(ev[i].peer_ext, want[i].peer_ext, "Event %d: wrong peer", i);
+        cr_assert_eq(ev[i].call_id, want[i].in_call ? call_id : 0, "Event %d: wrong call id", i);
+        if(i > 0)
+            cr_assert(ev[i].ts_ns >= ev[i-1].ts_ns, "Event %d is out of order", i);
+    }
+    tu_unref(a, "test done");
+    tu_unref(b, "test done");
+    close(fd);
+}
+
+#define NTHREADS 4
+#define NEVENTS (3 * TRACE_RING_EVENTS + 5)
+
+static void *record(void *arg) {
+    int ext = (int)(long)arg;
+    for(int i = 0; i < NEVENTS; i++)
+        trace_event(ext, TU_ON_HOOK, TU_DIAL_TONE, TU_PICKUP_CMD, -1, i);
+    TRACE_EVENT ev[TRACE_RING_EVENTS];
+    int n = events_of_thread((int)syscall(SYS_gettid), ev, TRACE_RING_EVENTS);
+    // Only the newest events survive, in the order they were recorded.
+    if(n != TRACE_RING_EVENTS)
+        return (void *)1;
+    for(int i = 0; i < n; i++)
+        if(ev[i].ext != ext || ev[i].call_id != (uint32_t)(NEVENTS - TRACE_RING_EVENTS + i))
+            return (void *)1;
+    return NULL;
+}
+
+Test(SUITE, wraparound_test, .timeout = 5) {
+    pthread_t tids[NTHREADS];
+    for(long i = 0; i < NTHREADS; i++)
+        pthread_create(&tids[i], NULL, record, (void *)(i + 1));
+    for(int i = 0; i < NTHREADS; i++) {
+        void *ret;
+        pthread_join(tids[i], &ret);
+        cr_assert_null(ret, "Thread %d's ring did not hold its newest events", i);
+    }
+}
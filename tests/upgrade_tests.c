@@ -0,0 +1,210 @@
+/*
+ * These tests start the server itself (bin/pbx), so have to be run from the
+ * top of the tree, after it has been built.  The new server an upgrade starts
+ * is a child of the old one, so we become its parent when the old one exits.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_phone.h"
+
+#define SUITE upgrade_suite
+
+#define UPGRADE_PORT_STR "9982"
+
+static pid_t server_pid;
+
+static int upgrade_connect(void) {
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("127.0.0.1", UPGRADE_PORT_STR, &hints, &ai) != 0){
+        return -1;
+    }
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+static void start_server(char *mode) {
+    signal(SIGPIPE, SIG_IGN);
+    //The new server is handed to us when the old one exits, rather than to init
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    if((server_pid = fork()) == 0){
+        execl("bin/pbx", "pbx", "-p", UPGRADE_PORT_STR, mode, NULL);
+        abort();
+    }
+    for(int i = 0; i < 50; i++){
+        int fd = upgrade_connect();
+        if(fd >= 0){
+            close(fd);
+            return;
+        }
+        usleep(100 * 1000);
+    }
+    cr_assert_fail("Server did not start");
+}
+
+/*
+ * The child of ours that is a server, other than old (the one an upgrade
+ * started), or -1 if there is none.
+ */
+static pid_t find_server(pid_t old) {
+    DIR *dir = opendir("/proc");
+    pid_t found = -1;
+    struct dirent *de;
+    while(dir != NULL && found < 0 && (de = readdir(dir)) != NULL){
+        char path[64], line[128];
+        int pid = atoi(de->d_name);
+        if(pid <= 0 || pid == old){
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/status", pid);
+        FILE *f = fopen(path, "r");
+        if(f == NULL){
+            continue;
+        }
+        int ppid = -1, is_pbx = 0;
+        while(fgets(line, sizeof(line), f) != NULL){
+            if(strcmp(line, "Name:\tpbx\n") == 0){
+                is_pbx = 1;
+            }
+            sscanf(line, "PPid:\t%d", &ppid);
+        }
+        fclose(f);
+        if(is_pbx && ppid == getpid()){
+            found = pid;
+        }
+    }
+    if(dir != NULL){
+        closedir(dir);
+    }
+    return found;
+}
+
+/*
+ * Upgrade the server: the old one should exit cleanly, leaving the new one.
+ */
+static void upgrade(void) {
+    int status;
+    cr_assert_eq(kill(server_pid, SIGUSR1), 0);
+    cr_assert_eq(waitpid(server_pid, &status, 0), server_pid);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Old server exited with 0x%x", status);
+    pid_t old = server_pid;
+    server_pid = find_server(old);
+    cr_assert(server_pid > 0, "No new server");
+}
+
+static void stop_server(void) {
+    int status;
+    kill(server_pid, SIGHUP);
+    cr_assert_eq(waitpid(server_pid, &status, 0), server_pid);
+    server_pid = 0;
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Server exited with 0x%x", status);
+}
+
+static void kill_server(void) {
+    if(server_pid > 0 && kill(server_pid, SIGKILL) == 0){
+        waitpid(server_pid, NULL, 0);
+    }
+    server_pid = 0;
+}
+
+static void call_through(char *mode) {
+    start_server(mode);
+    char buf[64], want[64];
+    int ea, eb, ec;
+    int a = upgrade_connect();
+    int b = upgrade_connect();
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "ON HOOK %d", &ea), 1);
+    cr_assert_eq(sscanf(get_line(b, buf, sizeof(buf)), "ON HOOK %d", &eb), 1);
+    snprintf(buf, sizeof(buf), "pickup\ndial %d\n", eb);
+    write(a, buf, strlen(buf));
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "RING BACK");
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "RINGING");
+    write(b, "pickup\n", 7);
+    snprintf(want, sizeof(want), "CONNECTED %d", ea);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    snprintf(want, sizeof(want), "CONNECTED %d", eb);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+
+    // Half a command is read before the upgrade, and the rest after it.
+    write(a, "chat hel", 8);
+    usleep(100 * 1000);
+    upgrade();
+    write(a, "lo\n", 3);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), "CHAT hello");
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+
+    // The call carries on, and new clients get numbers nobody has.
+    int c = upgrade_connect();
+    cr_assert_eq(sscanf(get_line(c, buf, sizeof(buf)), "ON HOOK %d", &ec), 1);
+    cr_assert(ec != ea && ec != eb, "Extension %d handed out twice", ec);
+    write(b, "hangup\n", 7);
+    snprintf(want, sizeof(want), "ON HOOK %d", eb);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    close(a);
+    close(b);
+    close(c);
+    stop_server();
+}
+
+Test(SUITE, threads_test, .fini = kill_server, .timeout = 30) {
+    call_through(NULL);
+}
+
+Test(SUITE, coroutine_test, .fini = kill_server, .timeout = 30) {
+    call_through("-l");
+}
+
+Test(SUITE, uring_test, .fini = kill_server, .timeout = 30) {
+    call_through("-u");
+}
+
+Test(SUITE, refused_test, .fini = kill_server, .timeout = 30) {
+    start_server(NULL);
+    char buf[64], want[64];
+    int ea, eb;
+    int a = upgrade_connect();
+    int b = upgrade_connect();
+    cr_assert_eq(sscanf(get_line(a, buf, sizeof(buf)), "ON HOOK %d", &ea), 1);
+    cr_assert_eq(sscanf(get_line(b, buf, sizeof(buf)), "ON HOOK %d", &eb), 1);
+
+    // Nobody can watch an extension in the new server, so there is no upgrade.
+    snprintf(buf, sizeof(buf), "watch %d\n", ea);
+    write(b, buf, strlen(buf));
+    snprintf(want, sizeof(want), "WATCH %d ON HOOK", ea);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+    kill(server_pid, SIGUSR1);
+    usleep(300 * 1000);
+    cr_assert_eq(waitpid(server_pid, NULL, WNOHANG), 0, "Old server exited");
+    write(a, "pickup\n", 7);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), "DIAL TONE");
+    snprintf(want, sizeof(want), "WATCH %d DIAL TONE", ea);
+    cr_assert_str_eq(get_line(b, buf, sizeof(buf)), want);
+
+    // Once the watcher has gone it can be.
+    hang_up(b);
+    upgrade();
+    write(a, "hangup\n", 7);
+    snprintf(want, sizeof(want), "ON HOOK %d", ea);
+    cr_assert_str_eq(get_line(a, buf, sizeof(buf)), want);
+    close(a);
+    stop_server();
+}
@@ -0,0 +1,561 @@
+/*
+ * PBX benchmark.
+ *
+ * In-process mode (the default) links against the PBX and TU modules and drives
+ * them directly, with every TU writing its notifications to /dev/null.  This
+ * measures the cost of registration, dialing and the memory the PBX itself
+ * needs per TU, without being limited by descriptors or the network.
+ *
+ *     bin/pbx_bench [-n <TUs>] [-t <threads>] [-s <registry shards>] [-d <CDR file>]
+ *
+ * With -d, calls are recorded to the given CDR file while they are timed.
+ *
+ * Network mode connects real clients to a running server and measures the same
+ * operations end to end.  If the server's pid is given, its resident and virtual
+ * memory are sampled before and after the clients connect.
+ *
+ *     bin/pbx_bench -p <port> [-n <clients>] [-P <server pid>]
+ *     bin/pbx_bench -U <socket path> [-n <clients>] [-P <server pid>]
+ *
+ * With -U, the clients connect to the server's Unix domain socket instead of
+ * its TCP port.  Either way, the first two clients also time a stream of
+ * chats, kept BENCH_CHAT_WINDOW deep, from one to the other.
+ *
+ * Conference mode puts the given number of TUs, each on its own socketpair with
+ * a thread draining the other ends, on one bridge along with a member whose
+ * connection is never read, and times chats fanned out to all of them.
+ *
+ *     bin/pbx_bench -b <members>
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "config.h"
+#include "conf.h"
+#include "cdr.h"
+
+#define BENCH_CHATS 20000
+#define BENCH_CHAT_WINDOW 16
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read a field such as "VmRSS:" from /proc/<pid>/status, in kB.
+ */
+static long proc_status_kb(pid_t pid, char *field) {
+    char path[64], line[256];
+    long val = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL){
+        if(strncmp(line, field, strlen(field)) == 0){
+            val = strtol(line + strlen(field), NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return val;
+}
+
+static void report(char *what, int n, double secs) {
+    printf("%-28s %9d ops %10.3f s %12.0f ops/s %10.0f ns/op\n",
+           what, n, secs, n / secs, secs * 1e9 / n);
+}
+
+/*
+ * In-process benchmark.  The TUs are divided into one contiguous slice per
+ * thread, and each thread registers, dials and calls only within its slice.
+ */
+typedef struct bench_worker {
+    pthread_t tid;
+    TU **tus;
+    int n;
+    int fd;
+    int failed;
+} BENCH_WORKER;
+
+static void *register_slice(void *arg) {
+    BENCH_WORKER *w = arg;
+    for(int i = 0; i < w->n; i++){
+        w->tus[i] = tu_init(w->fd);
+        if(w->tus[i] == NULL || pbx_register_auto(pbx, w->tus[i]) < 0){
+            w->failed = 1;
+            w->n = i;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *pickup_slice(void *arg) {
+    BENCH_WORKER *w = arg;
+    for(int i = 0; i + 1 < w->n; i += 2){
+        tu_pickup(w->tus[i]);
+    }
+    return NULL;
+}
+
+static void *dial_slice(void *arg) {
+    BENCH_WORKER *w = arg;
+    for(int i = 0; i + 1 < w->n; i += 2){
+        pbx_dial(pbx, w->tus[i], tu_extension(w->tus[i + 1]));
+    }
+    return NULL;
+}
+
+static void *hangup_slice(void *arg) {
+    BENCH_WORKER *w = arg;
+    for(int i = 0; i + 1 < w->n; i += 2){
+        tu_hangup(w->tus[i]);
+    }
+    return NULL;
+}
+
+//Dial from every even TU to the next odd one and go through a complete call
+static void *call_slice(void *arg) {
+    BENCH_WORKER *w = arg;
+    for(int i = 0; i + 1 < w->n; i += 2){
+        TU *a = w->tus[i], *b = w->tus[i + 1];
+        tu_pickup(a);
+        pbx_dial(pbx, a, tu_extension(b));
+        tu_pickup(b);
+        tu_chat(a, "hello");
+        tu_hangup(a);
+        tu_hangup(b);
+    }
+    return NULL;
+}
+
+static void *unregister_slice(void *arg) {
+    BENCH_WORKER *w = arg;
+    for(int i = 0; i < w->n; i++){
+        pbx_unregister(pbx, w->tus[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Run one phase on all workers at once, returning the elapsed time.
+ */
+static double run_phase(BENCH_WORKER *workers, int nthreads, void *(*fn)(void *)) {
+    double t = now_sec();
+    for(int i = 0; i < nthreads; i++){
+        pthread_create(&workers[i].tid, NULL, fn, &workers[i]);
+    }
+    for(int i = 0; i < nthreads; i++){
+        pthread_join(workers[i].tid, NULL);
+    }
+    return now_sec() - t;
+}
+
+static int bench_local(int n, int nthreads, char *cdr_path) {
+    if(config_set_capacity(n) < 0){
+        fprintf(stderr, "Invalid number of TUs: %d\n", n);
+        return -1;
+    }
+    pbx_config.ext_count = n;
+    int devnull = open("/dev/null", O_WRONLY);
+    TU **tus = malloc(n * sizeof(TU *));
+    BENCH_WORKER *workers = calloc(nthreads, sizeof(BENCH_WORKER));
+    if(devnull < 0 || tus == NULL || workers == NULL){
+        perror("setup");
+        return -1;
+    }
+    //Even-sized slices so that calls never cross between threads
+    int per = (n / nthreads) & ~1;
+    for(int i = 0; i < nthreads; i++){
+        workers[i].tus = tus + i * per;
+        workers[i].n = (i == nthreads - 1) ? n - i * per : per;
+        workers[i].fd = devnull;
+    }
+    if(cdr_path != NULL && cdr_init(cdr_path) < 0){
+        fprintf(stderr, "Invalid CDR file '%s'\n", cdr_path);
+        return -1;
+    }
+    long rss0 = proc_status_kb(getpid(), "VmRSS:");
+    pbx = pbx_init();
+    if(pbx == NULL){
+        fprintf(stderr, "pbx_init failed\n");
+        return -1;
+    }
+    long rss1 = proc_status_kb(getpid(), "VmRSS:");
+    printf("%d TUs, %d threads, %d registry shards\n", n, nthreads, pbx_config.shards);
+
+    report("register", n, run_phase(workers, nthreads, register_slice));
+    for(int i = 0; i < nthreads; i++){
+        if(workers[i].failed){
+            fprintf(stderr, "Registration failed in thread %d\n", i);
+            return -1;
+        }
+    }
+    long rss2 = proc_status_kb(getpid(), "VmRSS:");
+
+    //Time pbx_dial on its own, and then a complete pickup/dial/answer/chat/hangup call.
+    int calls = n / 2;
+    run_phase(workers, nthreads, pickup_slice);
+    report("dial", calls, run_phase(workers, nthreads, dial_slice));
+    run_phase(workers, nthreads, hangup_slice);
+    report("call (6 operations)", calls, run_phase(workers, nthreads, call_slice));
+    if(cdr_path != NULL){
+        double t = now_sec();
+        cdr_flush();
+        CDR_STATS cdrs;
+        cdr_get_stats(&cdrs);
+        printf("CDRs: %ld recorded, %ld written in %ld writes, %ld dropped, %.3f s to flush the rest\n",
+               cdrs.recorded, cdrs.written, cdrs.batches, cdrs.dropped, now_sec() - t);
+    }
+    PBX_STATS stats;
+    pbx_get_stats(pbx, &stats);
+    report("unregister", n, run_phase(workers, nthreads, unregister_slice));
+
+    printf("registry: %ld registrations, %ld dials, %ld misses, fullest shard held %d of %d\n",
+           stats.registrations, stats.dials, stats.misses, stats.max_shard, stats.registered);
+    printf("memory: PBX %ld kB, registered TUs %ld kB, %.1f bytes/TU (excluding threads and sockets)\n",
+           rss1 - rss0, rss2 - rss1, (rss2 - rss1) * 1024.0 / n);
+    pbx_shutdown(pbx);
+    free(workers);
+    free(tus);
+    close(devnull);
+    return 0;
+}
+
+/*
+ * Read everything that arrives on the client ends of the conference members.
+ */
+static void *drain_clients(void *arg) {
+    int epfd = *(int *)arg;
+    struct epoll_event events[64];
+    char buf[65536];
+    while(1){
+        int n = epoll_wait(epfd, events, 64, -1);
+        for(int i = 0; i < n; i++){
+            while(read(events[i].data.fd, buf, sizeof(buf)) > 0);
+        }
+    }
+    return NULL;
+}
+
+static int bench_conf(int members) {
+    int chats = 200;
+    if(config_set_capacity(members + 1) < 0){
+        fprintf(stderr, "Invalid number of members: %d\n", members);
+        return -1;
+    }
+    pbx_config.ext_count = members + 2; //One more for the bridge
+    pbx = pbx_init();
+    TU **tus = malloc((members + 1) * sizeof(TU *));
+    int epfd = epoll_create1(0);
+    if(pbx == NULL || tus == NULL || epfd < 0){
+        perror("setup");
+        return -1;
+    }
+    //The last member is the slow one: nothing ever reads its client end
+    int bridge = -1;
+    for(int i = 0; i <= members; i++){
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+            perror("socketpair");
+            return -1;
+        }
+        if(i == members){
+            int sndbuf = 4096;
+            setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        }else{
+            fcntl(sv[1], F_SETFL, O_NONBLOCK);
+            struct epoll_event ev = {.events = EPOLLIN, .data.fd = sv[1]};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, sv[1], &ev);
+        }
+        tus[i] = tu_init(sv[0]);
+        if(tus[i] == NULL || pbx_register_auto(pbx, tus[i]) < 0){
+            fprintf(stderr, "Registration failed\n");
+            return -1;
+        }
+        tu_pickup(tus[i]);
+        if(i == 0){
+            bridge = conf_create(pbx, tus[0]);
+        }else{
+            pbx_dial(pbx, tus[i], bridge);
+        }
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, drain_clients, &epfd);
+    printf("conference of %d members plus 1 that never reads\n", members);
+
+    char msg[64];
+    double t = now_sec();
+    for(int i = 0; i < chats; i++){
+        snprintf(msg, sizeof(msg), "message %d", i);
+        tu_chat(tus[i % members], msg);
+    }
+    double secs = now_sec() - t;
+    report("conference chat", chats, secs);
+    printf("%.0f ns per recipient\n", secs * 1e9 / ((double)chats * members));
+
+    CONF_STATS stats;
+    CONF_BRIDGE *b = conf_lookup(bridge);
+    conf_get_stats(b, &stats);
+    conf_unref(b);
+    printf("deliveries: %ld sent directly, %ld queued for the relay thread, %ld dropped\n",
+           stats.sent, stats.queued, stats.dropped);
+    return 0;
+}
+
+/*
+ * Read one line from a client connection, returning the number of characters.
+ */
+static int read_line(int fd, char *buf, int size) {
+    int len = 0;
+    char c;
+    while(len < size - 1){
+        ssize_t r = read(fd, &c, 1);
+        if(r < 0 && errno == EINTR){
+            continue;
+        }
+        if(r <= 0){
+            return -1;
+        }
+        if(c == '\n'){
+            break;
+        }
+        buf[len++] = c;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Send a command and wait for a reply starting with the given state name.
+ */
+static int command(int fd, char *cmd, char *expect) {
+    char line[256];
+    if(cmd != NULL && write(fd, cmd, strlen(cmd)) < 0){
+        return -1;
+    }
+    do {
+        if(read_line(fd, line, sizeof(line)) < 0){
+            return -1;
+        }
+    } while(strncmp(line, expect, strlen(expect)) != 0);
+    return atoi(line + strlen(expect));
+}
+
+/*
+ * Connect to the server.  Every 20000 connections move to another loopback
+ * source address, so the benchmark isn't limited by ephemeral ports.  With a
+ * path, connect to the server's Unix domain socket instead.
+ */
+static int connect_client(int port, char *path, int i) {
+    if(path != NULL){
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0){
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0){
+        return -1;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i / 20000);
+    if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0){
+        close(fd);
+        return -1;
+    }
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read until count lines have come, in as few reads as they take.  Only for
+ * when nothing more will follow them, since anything that did could be read too.
+ */
+static int skip_lines(int fd, int count) {
+    char buf[4096];
+    while(count > 0){
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if(r < 0 && errno == EINTR){
+            continue;
+        }
+        if(r <= 0){
+            return -1;
+        }
+        for(char *p = buf; (p = memchr(p, '\n', buf + r - p)) != NULL; p++){
+            count--;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Time chats from a to b, which are in a call with each other, with up to
+ * BENCH_CHAT_WINDOW of them sent but not yet seen by b.
+ */
+static int bench_chat(int a, int b) {
+    char msg[80];
+    //Big enough for a line's worth of text, small enough to be typical
+    snprintf(msg, sizeof(msg), "chat %064d\r\n", 0);
+    double t = now_sec();
+    for(int sent = 0; sent < BENCH_CHATS; sent += BENCH_CHAT_WINDOW){
+        for(int i = 0; i < BENCH_CHAT_WINDOW; i++){
+            if(write(a, msg, strlen(msg)) < 0){
+                return -1;
+            }
+        }
+        //Each chat is answered with the sender's state, as every command is
+        if(skip_lines(b, BENCH_CHAT_WINDOW) < 0 || skip_lines(a, BENCH_CHAT_WINDOW) < 0){
+            return -1;
+        }
+    }
+    report("chat", BENCH_CHATS, now_sec() - t);
+    return 0;
+}
+
+/*
+ * Network benchmark against a running server.
+ */
+static int bench_network(int port, char *path, int n, pid_t server) {
+    int *fds = malloc(n * sizeof(int));
+    int *exts = malloc(n * sizeof(int));
+    if(fds == NULL || exts == NULL){
+        return -1;
+    }
+    long rss0 = server ? proc_status_kb(server, "VmRSS:") : -1;
+    long vsz0 = server ? proc_status_kb(server, "VmSize:") : -1;
+
+    double t = now_sec();
+    for(int i = 0; i < n; i++){
+        if((fds[i] = connect_client(port, path, i)) < 0 || (exts[i] = command(fds[i], NULL, "ON HOOK ")) < 0){
+            fprintf(stderr, "Client %d failed to register: %s\n", i, strerror(errno));
+            n = i;
+            break;
+        }
+    }
+    report("connect + register", n, now_sec() - t);
+    if(server){
+        long rss1 = proc_status_kb(server, "VmRSS:");
+        long vsz1 = proc_status_kb(server, "VmSize:");
+        printf("server memory: RSS %ld -> %ld kB (%.1f kB/TU), virtual %ld -> %ld kB (%.1f kB/TU)\n",
+               rss0, rss1, (double)(rss1 - rss0) / n, vsz0, vsz1, (double)(vsz1 - vsz0) / n);
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "dial %d\r\n", exts[1]);
+    if(command(fds[0], "pickup\r\n", "DIAL TONE") < 0 || command(fds[0], buf, "RING BACK") < 0
+       || command(fds[1], NULL, "RINGING") < 0 || command(fds[1], "pickup\r\n", "CONNECTED") < 0
+       || command(fds[0], NULL, "CONNECTED") < 0 || bench_chat(fds[0], fds[1]) < 0
+       || command(fds[0], "hangup\r\n", "ON HOOK") < 0 || command(fds[1], NULL, "DIAL TONE") < 0
+       || command(fds[1], "hangup\r\n", "ON HOOK") < 0){
+        fprintf(stderr, "Chat failed\n");
+    }
+
+    int calls = n / 2;
+    t = now_sec();
+    for(int i = 0; i < calls; i++){
+        int a = fds[2 * i], b = fds[2 * i + 1];
+        snprintf(buf, sizeof(buf), "dial %d\r\n", exts[2 * i + 1]);
+        if(command(a, "pickup\r\n", "DIAL TONE") < 0 || command(a, buf, "RING BACK") < 0
+           || command(b, NULL, "RINGING") < 0 || command(b, "pickup\r\n", "CONNECTED") < 0
+           || command(a, NULL, "CONNECTED") < 0 || command(a, "hangup\r\n", "ON HOOK") < 0
+           || command(b, NULL, "DIAL TONE") < 0 || command(b, "hangup\r\n", "ON HOOK") < 0){
+            fprintf(stderr, "Call %d failed\n", i);
+            calls = i;
+            break;
+        }
+    }
+    if(calls > 0){
+        report("call (pickup..hangup)", calls, now_sec() - t);
+    }
+
+    t = now_sec();
+    for(int i = 0; i < n; i++){
+        close(fds[i]);
+    }
+    report("disconnect", n, now_sec() - t);
+    free(fds);
+    free(exts);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n = 100000;
+    int nthreads = 1;
+    int port = 0;
+    char *path = NULL;
+    int members = 0;
+    pid_t server = 0;
+    char *cdr_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "n:t:s:p:U:P:b:d:")) != -1){
+        switch(opt){
+            case 'n':
+                n = atoi(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 's':
+                pbx_config.shards = atoi(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'U':
+                path = optarg;
+                break;
+            case 'P':
+                server = atoi(optarg);
+                break;
+            case 'b':
+                members = atoi(optarg);
+                break;
+            case 'd':
+                cdr_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n <TUs>] [-t <threads>] [-s <shards>] [-p <port> | -U <path> [-P <server pid>]] [-b <members>] [-d <CDR file>]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(n < 2 || nthreads < 1 || n / nthreads < 2 || pbx_config.shards < 1){
+        fprintf(stderr, "Need at least 2 TUs per thread and at least 1 shard\n");
+        return EXIT_FAILURE;
+    }
+    if(members > 0){
+        return bench_conf(members) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    int ret = port || path ? bench_network(port, path, n, server) : bench_local(n, nthreads, cdr_path);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,696 @@
+/*
+ * Fuzzer for the command parser and the TU state machine.
+ *
+ * Runs the PBX in this process and plugs simulated clients into it over
+ * socketpairs, each served by pbx_client_service() on a thread of its own, as
+ * a connection accepted by main() would be.  Every case sends the clients
+ * arbitrary byte streams and checks each state they are told of against the
+ * transitions tests/script_tester.c allows (next_states), taken over all the
+ * commands, since which command the bytes amount to is for the parser to say.
+ *
+ *     bin/pbx_fuzz [-n <clients>] [-s <seed>] [-t <seconds>] [-c <cases>] [-o <dir>]
+ *         Make up cases until the time (default 10 s, 0 for no limit) or the
+ *         number of cases is up, or one fails.
+ *     bin/pbx_fuzz [-n <clients>] <case file>...
+ *         Run the cases in the files, as saved by a failure.
+ *
+ * Cases are made up from a dictionary of commands, the clients' extensions and
+ * what the parser has to cope with (dial without its space, numbers with junk
+ * after them or too big for an int, stray \r and NUL, lines longer than its
+ * 1024-byte buffer), then mutated byte by byte.  A case is a series of chunks,
+ * each one byte naming the client (modulo -n), two bytes of length (little
+ * endian) and that many bytes for the client to send.  "conf" is left out of
+ * the dictionary, since joining a conference goes straight from DIAL TONE to
+ * CONNECTED, which next_states doesn't have.
+ *
+ * Besides the transitions, each case checks that a client on hook is told its
+ * own extension, that no line is left unterminated or is longer than the
+ * server could have sent, and that once the clients hang up their connections
+ * every TU is unregistered and freed.  What each client sends is also put
+ * through the server's own line and extension parsers (pbx_client_line() and
+ * pbx_client_extension()), which must give back the start of each line sent
+ * and nothing from the rest of one too long, and only accept an extension
+ * that is the number written, not what it wraps round to in an int.  A client
+ * whose first byte is PROTO_MAGIC speaks frames from then on, and isn't
+ * checked.  The first case to fail, or to crash or hang the server, is written
+ * to <dir> (default .) as pbx_fuzz.<seed>.<case>, and the fuzzer exits nonzero.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "server.h"
+#include "server_extra.h"
+#include "proto.h"
+#include "hazard.h"
+#include "__test_includes.h"
+
+#define FUZZ_MAX_CLIENTS 16
+#define FUZZ_MAX_CASE (64 * 1024)
+#define FUZZ_MAX_CHUNK 2048
+#define FUZZ_MAX_LINE 2048       //More than any line the server sends for a 1024-byte command
+#define FUZZ_CASE_SECONDS 20     //A case taking longer than this has hung the server
+#define FUZZ_SETTLE_MS 5000      //How long TUs may take to go once their clients have
+
+#define RESYNC NUM_STATES        //As in script_tester.c
+
+extern int next_states[NUM_STATES][NUM_COMMANDS];
+
+typedef struct fuzz_client {
+    int fd;                  //Our end of the socketpair
+    int ext;
+    TU_STATE state;          //Last state the client was told of
+    size_t sent;             //Bytes sent so far this case
+    atomic_int binary;       //Switched to frames by its first byte, so not checked
+    pthread_t reader;
+    char line[PBX_CLIENT_LINE_MAX];  //The command line as the server puts it together
+    size_t line_len;
+    char sent_line[FUZZ_MAX_CASE];   //And the line as it was sent, less any \r
+    size_t sent_len;
+} FUZZ_CLIENT;
+
+static FUZZ_CLIENT clients[FUZZ_MAX_CLIENTS];
+static int num_clients = 4;
+
+static unsigned char case_buf[FUZZ_MAX_CASE];
+static size_t case_len;
+static char case_path[PATH_MAX];  //Where the case is saved if it fails, set before it runs
+
+static atomic_int failed;
+static char failure[512];
+static atomic_long num_lines, num_transitions;
+
+static uint64_t rng;
+
+static uint32_t fuzz_rand(void) {
+    //xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (rng * 2685821657736338717ULL) >> 32;
+}
+
+/*
+ * Write the case to case_path.  Only async-signal-safe calls, so that it can
+ * be done from a crash.
+ */
+static void fuzz_save(void) {
+    int fd = open(case_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return;
+    }
+    size_t done = 0;
+    while(done < case_len){
+        ssize_t n = write(fd, case_buf + done, case_len - done);
+        if(n <= 0){
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+}
+
+static void fuzz_say(char *what) {
+    write(STDERR_FILENO, what, strlen(what));
+    write(STDERR_FILENO, ", case saved to ", 16);
+    write(STDERR_FILENO, case_path, strlen(case_path));
+    write(STDERR_FILENO, "\n", 1);
+}
+
+static void fuzz_crashed(int sig) {
+    fuzz_save();
+    fuzz_say(sig == SIGALRM ? "Case hung" : "Case crashed");
+    if(sig == SIGALRM){
+        _exit(EXIT_FAILURE);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Record the first violation of the case; the rest are only the same one
+ * carrying on.
+ */
+static void fuzz_fail(FUZZ_CLIENT *c, char *fmt, ...) {
+    int expected = 0;
+    if(!atomic_compare_exchange_strong(&failed, &expected, 1)){
+        return;
+    }
+    int n = snprintf(failure, sizeof(failure), "Client %d (extension %d): ", (int)(c - clients), c->ext);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(failure + n, sizeof(failure) - n, fmt, ap);
+    va_end(ap);
+}
+
+static int fuzz_is_client(int ext) {
+    for(int i = 0; i < num_clients; i++){
+        if(clients[i].ext == ext){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether any command, or messages crossing in transit, could take a TU from
+ * one state to another.
+ */
+static int fuzz_legal(TU_STATE from, TU_STATE to) {
+    for(int cmd = 0; cmd < NUM_COMMANDS; cmd++){
+        if(next_states[from][cmd] & (1 << to | 1 << (to + RESYNC))){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void fuzz_check_line(FUZZ_CLIENT *c, char *line) {
+    atomic_fetch_add(&num_lines, 1);
+    for(int s = 0; s < NUM_STATES; s++){
+        size_t len = strlen(tu_state_names[s]);
+        if(strncmp(line, tu_state_names[s], len) != 0 || (line[len] != '\0' && line[len] != ' ')){
+            continue;
+        }
+        //"RINGING 5" is as wrong as a state that can't follow
+        char *arg = line + len, *end = arg;
+        long ext = -1;
+        if(*arg == ' '){
+            ext = strtol(arg + 1, &end, 10);
+            if(end == arg + 1 || *end != '\0'){
+                fuzz_fail(c, "Bad extension in '%s'", line);
+                return;
+            }
+        }
+        if((s == TU_ON_HOOK || s == TU_CONNECTED) != (*arg == ' ')){
+            fuzz_fail(c, "'%s' %s an extension", line, *arg == ' ' ? "has" : "lacks");
+            return;
+        }
+        if(s == TU_ON_HOOK && ext != c->ext){
+            fuzz_fail(c, "Told '%s'", line);
+            return;
+        }
+        if(s == TU_CONNECTED && ext == c->ext){
+            fuzz_fail(c, "Connected to itself");
+            return;
+        }
+        if(!fuzz_legal(c->state, s)){
+            fuzz_fail(c, "%s -> %s", tu_state_names[c->state], line);
+            return;
+        }
+        atomic_fetch_add(&num_transitions, 1);
+        c->state = s;
+        return;
+    }
+    //CHAT, MSG, WATCH, QUEUED, HUNT, THROTTLED, ... carry no state
+}
+
+static void *fuzz_reader(void *arg) {
+    FUZZ_CLIENT *c = arg;
+    char buf[4096], line[FUZZ_MAX_LINE + 1];
+    size_t len = 0;
+    int too_long = 0;
+    ssize_t n;
+    while((n = read(c->fd, buf, sizeof(buf))) > 0){
+        if(atomic_load(&c->binary)){
+            continue;
+        }
+        for(ssize_t i = 0; i < n; i++){
+            if(buf[i] == '\n'){
+                line[len] = '\0';
+                if(!too_long){
+                    fuzz_check_line(c, line);
+                }
+                len = 0;
+                too_long = 0;
+            } else if(len < FUZZ_MAX_LINE){
+                line[len++] = buf[i];
+            } else if(!too_long){
+                too_long = 1;
+                fuzz_fail(c, "Line longer than %d bytes", FUZZ_MAX_LINE);
+            }
+        }
+    }
+    if(len > 0 && !atomic_load(&c->binary)){
+        line[len] = '\0';
+        fuzz_fail(c, "Unterminated line '%.64s' at end", line);
+    }
+    return NULL;
+}
+
+/*
+ * Plug in a client, and wait to be told its extension.
+ */
+static int fuzz_plug(FUZZ_CLIENT *c) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+        perror("socketpair");
+        return -1;
+    }
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = sv[0];
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, pbx_client_service, connfdp) != 0){
+        fprintf(stderr, "Can't start a service thread\n");
+        free(connfdp);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    c->fd = sv[1];
+    c->sent = 0;
+    c->state = TU_ON_HOOK;
+    c->line_len = 0;
+    c->sent_len = 0;
+    atomic_store(&c->binary, 0);
+    char line[64];
+    size_t len = 0;
+    while(len < sizeof(line) - 1 && read(c->fd, line + len, 1) == 1 && line[len] != '\n'){
+        len++;
+    }
+    line[len] = '\0';
+    if(sscanf(line, "ON HOOK %d", &c->ext) != 1){
+        fprintf(stderr, "Client not registered: '%s'\n", line);
+        return -1;
+    }
+    return pthread_create(&c->reader, NULL, fuzz_reader, c) == 0 ? 0 : -1;
+}
+
+/*
+ * Check the extension the parser makes of a command's argument.  One it
+ * accepts must be the number written there, in range for an int.
+ */
+static void fuzz_check_extension(FUZZ_CLIENT *c, char *arg, int more) {
+    char copy[PBX_CLIENT_LINE_MAX], *rest;
+    strcpy(copy, arg);
+    int ext = pbx_client_extension(copy, more ? &rest : NULL);
+    if(ext == -1){
+        return;
+    }
+    char *end;
+    errno = 0;
+    long val = strtol(arg, &end, 10);
+    if(errno == ERANGE || val <= 0 || val > INT_MAX || ext != val){
+        fuzz_fail(c, "Extension %d made of '%.32s'", ext, arg);
+    }
+}
+
+/*
+ * Put a byte a client sends through the server's line parser, and check each
+ * line it finishes against the line that was sent.
+ */
+static void fuzz_parse(FUZZ_CLIENT *c, char byte) {
+    int done = pbx_client_line(c->line, &c->line_len, byte);
+    if(byte != '\n'){
+        if(byte != '\r'){
+            c->sent_line[c->sent_len++] = byte;
+        }
+        if(done){
+            //What follows would be taken for a command of its own
+            fuzz_fail(c, "Line ended %zu bytes into one that goes on", c->sent_len);
+            c->line_len = 0;
+        }
+        return;
+    }
+    if(!done){
+        fuzz_fail(c, "Newline didn't end the line");
+    }
+    size_t want = c->sent_len < PBX_CLIENT_LINE_MAX - 1 ? c->sent_len : PBX_CLIENT_LINE_MAX - 1;
+    if(c->line_len != want || memcmp(c->line, c->sent_line, want) != 0){
+        fuzz_fail(c, "Parsed '%.32s' of %zu bytes from a line of %zu starting '%.32s'",
+                  c->line, c->line_len, c->sent_len, c->sent_line);
+    }
+    //As pbx_client_serve() matches them
+    static char *with_ext[] = { "dial ", "hunt ", "watch ", "msg " };
+    for(int i = 0; i < (int)(sizeof(with_ext) / sizeof(with_ext[0])); i++){
+        size_t n = strlen(with_ext[i]);
+        if(strncmp(c->line, with_ext[i], n) == 0){
+            fuzz_check_extension(c, c->line + n - 1, i == 3);
+        }
+    }
+    c->line_len = 0;
+    c->sent_len = 0;
+}
+
+static void fuzz_send(FUZZ_CLIENT *c, unsigned char *data, size_t len) {
+    if(len == 0){
+        return;
+    }
+    if(c->sent == 0 && data[0] == PROTO_MAGIC){
+        atomic_store(&c->binary, 1);
+    }
+    c->sent += len;
+    for(size_t i = 0; i < len && !atomic_load(&c->binary); i++){
+        fuzz_parse(c, data[i]);
+    }
+    while(len > 0){
+        ssize_t n = write(c->fd, data, len);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            //The server hung up on it (nothing of it is checked after this)
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * Run the case in case_buf.
+ *
+ * @return 0 if it passed, -1 if it failed, with the reason in failure.
+ */
+static int fuzz_run(void) {
+    atomic_store(&failed, 0);
+    alarm(FUZZ_CASE_SECONDS);
+    HAZARD_STATS before, after;
+    hazard_reclaim();
+    hazard_get_stats(&before);
+    for(int i = 0; i < num_clients; i++){
+        if(fuzz_plug(&clients[i]) < 0){
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t pos = 0;
+    while(pos + 3 <= case_len){
+        FUZZ_CLIENT *c = &clients[case_buf[pos] % num_clients];
+        size_t len = case_buf[pos + 1] | case_buf[pos + 2] << 8;
+        pos += 3;
+        if(len > case_len - pos){
+            len = case_len - pos;
+        }
+        fuzz_send(c, case_buf + pos, len);
+        pos += len;
+    }
+    //Hang up the connections, and let the readers see the last of what comes back
+    for(int i = 0; i < num_clients; i++){
+        shutdown(clients[i].fd, SHUT_WR);
+    }
+    for(int i = 0; i < num_clients; i++){
+        pthread_join(clients[i].reader, NULL);
+        close(clients[i].fd);
+    }
+    //The service threads finish up after the readers have seen them close
+    PBX_STATS stats;
+    int waited = 0;
+    while(pbx_get_stats(pbx, &stats) == 0 && stats.registered > 0 && waited < FUZZ_SETTLE_MS){
+        usleep(1000);
+        waited++;
+    }
+    if(stats.registered > 0 && !atomic_load(&failed)){
+        snprintf(failure, sizeof(failure), "%d TUs still registered after their clients went", stats.registered);
+        atomic_store(&failed, 1);
+    }
+    for(waited = 0; waited < FUZZ_SETTLE_MS; waited++){
+        hazard_reclaim();
+        hazard_get_stats(&after);
+        if(after.freed - before.freed >= num_clients){
+            break;
+        }
+        usleep(1000);
+    }
+    if(after.freed - before.freed < num_clients && !atomic_load(&failed)){
+        snprintf(failure, sizeof(failure), "Only %ld of %d TUs freed after their clients went",
+                 after.freed - before.freed, num_clients);
+        atomic_store(&failed, 1);
+    }
+    alarm(0);
+    return atomic_load(&failed) ? -1 : 0;
+}
+
+/*
+ * Append one item of the dictionary to a chunk.
+ *
+ * @return The number of bytes appended.
+ */
+static size_t fuzz_token(char *out, size_t room) {
+    char tmp[FUZZ_MAX_CHUNK];
+    int ext = clients[fuzz_rand() % num_clients].ext;
+    size_t n = 0;
+    switch(fuzz_rand() % 15){
+        case 0:
+        case 1:
+            n = snprintf(tmp, sizeof(tmp), "pickup\n");
+            break;
+        case 2:
+        case 3:
+            n = snprintf(tmp, sizeof(tmp), "hangup\n");
+            break;
+        case 4:
+        case 5:
+            n = snprintf(tmp, sizeof(tmp), "dial %d\n", ext);
+            break;
+        case 6:
+            n = snprintf(tmp, sizeof(tmp), "chat %.*s\n", (int)(fuzz_rand() % 40), "the quick brown fox jumps over the lazy dog");
+            break;
+        case 7: {
+            //What dial has to turn down, or take anyway
+            static char *dials[] = {
+                "dial\n", "dial%d\n", "dial  %d\n", "dial %d \n", "dial %dx\n", "dial -%d\n",
+                "dial +%d\n", "dial 0%d\n", "dial 0x%d\n", "dial 99999999999999999999\n", "dial \n", "dial %d\r\n"
+            };
+            n = snprintf(tmp, sizeof(tmp), dials[fuzz_rand() % (sizeof(dials) / sizeof(dials[0]))], ext);
+            break;
+        }
+        case 8: {
+            static char *others[] = {
+                "PICKUP\n", " pickup\n", "pickup \n", "pickupx\n", "chat\n", "chatter\n", "chat \n",
+                "hunt\n", "hunt %d\n", "watch %d\n", "watch\n", "msg %d hello\n", "msg %d\n", "msg\n",
+                "resume 0123456789abcdef\n", "resume zz\n", "resume\n"
+            };
+            n = snprintf(tmp, sizeof(tmp), others[fuzz_rand() % (sizeof(others) / sizeof(others[0]))], ext);
+            break;
+        }
+        case 9: {
+            static char *ends[] = { "\n", "\r", "\r\n", "\n\n", " \n", "\r\r\n" };
+            n = snprintf(tmp, sizeof(tmp), "%s", ends[fuzz_rand() % (sizeof(ends) / sizeof(ends[0]))]);
+            break;
+        }
+        case 10:
+            //Around the parser's buffer, with a command at the end that may or may not make it
+            n = 1000 + fuzz_rand() % 48;
+            memset(tmp, "xa "[fuzz_rand() % 3], n);
+            if(fuzz_rand() % 2){
+                memcpy(tmp, "chat ", 5);
+            }
+            n += snprintf(tmp + n, sizeof(tmp) - n, "%s", fuzz_rand() % 2 ? "pickup\n" : "\n");
+            break;
+        case 11:
+            n = snprintf(tmp, sizeof(tmp), "%d", ext);
+            break;
+        case 12: {
+            //Too big for an int, but only by whole multiples of 2^32
+            static char *wrapped[] = { "dial %ld\n", "hunt %ld\n", "watch %ld\n", "msg %ld hello\n" };
+            long big = ext + ((long)(1 + fuzz_rand() % 3) << 32);
+            n = snprintf(tmp, sizeof(tmp), wrapped[fuzz_rand() % (sizeof(wrapped) / sizeof(wrapped[0]))], big);
+            break;
+        }
+        default:
+            //Random bytes, NULs and all
+            n = 1 + fuzz_rand() % 16;
+            for(size_t i = 0; i < n; i++){
+                tmp[i] = fuzz_rand();
+            }
+            break;
+    }
+    if(n > room){
+        n = room;
+    }
+    memcpy(out, tmp, n);
+    return n;
+}
+
+static void fuzz_mutate(unsigned char *data, size_t *len) {
+    int ops = 1 + fuzz_rand() % 4;
+    for(int i = 0; i < ops && *len > 0; i++){
+        size_t at = fuzz_rand() % *len;
+        switch(fuzz_rand() % 4){
+            case 0:
+                data[at] ^= 1 << (fuzz_rand() % 8);
+                break;
+            case 1:
+                if(*len < FUZZ_MAX_CHUNK){
+                    memmove(data + at + 1, data + at, *len - at);
+                    data[at] = fuzz_rand();
+                    (*len)++;
+                }
+                break;
+            case 2:
+                memmove(data + at, data + at + 1, *len - at - 1);
+                (*len)--;
+                break;
+            default: {
+                //Repeat a stretch of it
+                size_t span = 1 + fuzz_rand() % (*len - at);
+                if(*len + span <= FUZZ_MAX_CHUNK){
+                    memmove(data + at + span, data + at, *len - at);
+                    (*len) += span;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Make up a case in case_buf.  The clients must be known (their extensions
+ * are in the dictionary), so this is done after the previous case has
+ * plugged them in; extensions are handed out again in the same order.
+ */
+static void fuzz_make(void) {
+    unsigned char chunk[FUZZ_MAX_CHUNK];
+    int first[FUZZ_MAX_CLIENTS] = { 0 };
+    int chunks = 1 + fuzz_rand() % 32;
+    case_len = 0;
+    for(int i = 0; i < chunks; i++){
+        int who = fuzz_rand() % num_clients;
+        size_t len = 0;
+        int tokens = 1 + fuzz_rand() % 6;
+        for(int t = 0; t < tokens && len < FUZZ_MAX_CHUNK; t++){
+            len += fuzz_token((char *)chunk + len, FUZZ_MAX_CHUNK - len);
+        }
+        if(fuzz_rand() % 4 == 0){
+            fuzz_mutate(chunk, &len);
+        }
+        //Frames are another parser's business
+        if(!first[who] && len > 0){
+            first[who] = 1;
+            if(chunk[0] == PROTO_MAGIC){
+                chunk[0] = ' ';
+            }
+        }
+        if(case_len + 3 + len > FUZZ_MAX_CASE){
+            break;
+        }
+        case_buf[case_len++] = who;
+        case_buf[case_len++] = len & 0xff;
+        case_buf[case_len++] = len >> 8;
+        memcpy(case_buf + case_len, chunk, len);
+        case_len += len;
+    }
+}
+
+static int fuzz_load(char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        perror(path);
+        return -1;
+    }
+    case_len = fread(case_buf, 1, sizeof(case_buf), f);
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = time(NULL);
+    int seconds = 10;
+    long max_cases = 0;
+    char *dir = ".";
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:t:c:o:")) != -1){
+        switch(opt){
+            case 'n':
+                num_clients = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 'c':
+                max_cases = atol(optarg);
+                break;
+            case 'o':
+                dir = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n <clients>] [-s <seed>] [-t <seconds>] [-c <cases>] [-o <dir>] [<case file>...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(num_clients < 2 || num_clients > FUZZ_MAX_CLIENTS){
+        fprintf(stderr, "Need 2 to %d clients\n", FUZZ_MAX_CLIENTS);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int sigs[] = { SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL, SIGALRM };
+    for(int i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++){
+        signal(sigs[i], fuzz_crashed);
+    }
+    pbx = pbx_init();
+    if(pbx == NULL){
+        fprintf(stderr, "Can't start the PBX\n");
+        return EXIT_FAILURE;
+    }
+
+    if(optind < argc){
+        int bad = 0;
+        for(int i = optind; i < argc; i++){
+            snprintf(case_path, sizeof(case_path), "%s", argv[i]);
+            if(fuzz_load(argv[i]) < 0){
+                return EXIT_FAILURE;
+            }
+            if(fuzz_run() < 0){
+                printf("%s: %s\n", argv[i], failure);
+                bad++;
+            } else {
+                printf("%s: passed\n", argv[i]);
+            }
+        }
+        return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    printf("Seed %llu, %d clients\n", (unsigned long long)seed, num_clients);
+    rng = seed ? seed : 1;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    time_t last_report = start.tv_sec;
+    long cases = 0, bytes = 0;
+    //An empty case first, to learn the extensions
+    case_len = 0;
+    snprintf(case_path, sizeof(case_path), "%s/pbx_fuzz.%llu.%ld", dir, (unsigned long long)seed, cases);
+    if(fuzz_run() < 0){
+        printf("Case %ld: %s\n", cases, failure);
+        fuzz_save();
+        return EXIT_FAILURE;
+    }
+    for(cases = 1; max_cases == 0 || cases <= max_cases; cases++){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(seconds > 0 && now.tv_sec - start.tv_sec >= seconds){
+            break;
+        }
+        if(now.tv_sec - last_report >= 5){
+            fprintf(stderr, "%ld cases, %ld bytes, %ld lines, %ld transitions\n", cases - 1, bytes,
+                    atomic_load(&num_lines), atomic_load(&num_transitions));
+            last_report = now.tv_sec;
+        }
+        fuzz_make();
+        bytes += case_len;
+        snprintf(case_path, sizeof(case_path), "%s/pbx_fuzz.%llu.%ld", dir, (unsigned long long)seed, cases);
+        if(fuzz_run() < 0){
+            printf("Case %ld: %s\n", cases, failure);
+            fuzz_save();
+            printf("Saved to %s\n", case_path);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%ld cases, %ld bytes, %ld lines, %ld transitions checked, no failures\n", cases - 1, bytes,
+           atomic_load(&num_lines), atomic_load(&num_transitions));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+ * PBX trace decoder.
+ *
+ * Reads a trace dump written by the server (on SIGUSR2 or a crash, see
+ * include/trace.h) and prints the recorded TU transitions of all threads as one
+ * timeline, oldest first, with times relative to the first event.
+ *
+ *     bin/pbx_trace [-e <extension>] [-c <call id>] <trace file>
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "server_extra.h"
+#include "trace.h"
+
+static int by_time(const void *a, const void *b) {
+    const TRACE_EVENT *x = a, *y = b;
+    return (x->ts_ns > y->ts_ns) - (x->ts_ns < y->ts_ns);
+}
+
+static const char *state_name(int state) {
+    return (state >= TU_ON_HOOK && state <= TU_ERROR) ? tu_state_names[state] : "?";
+}
+
+static char *extra_command_names[] = TU_EXTRA_COMMAND_NAMES;
+
+static const char *command_name(int cmd) {
+    if(cmd >= TU_PICKUP_CMD && cmd <= TU_CHAT_CMD){
+        return tu_command_names[cmd];
+    }
+    int extra = cmd - TU_EXTRA_CMD_FIRST;
+    if(extra >= 0 && extra < (int)(sizeof(extra_command_names) / sizeof(extra_command_names[0]))){
+        return extra_command_names[extra];
+    }
+    return cmd == TU_CONNECT_CMD ? "register" : "?";
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-e <extension>] [-c <call id>] <trace file>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int ext = -1;
+    long call = -1;
+    int opt;
+    while((opt = getopt(argc, argv, "e:c:")) != -1){
+        switch(opt){
+            case 'e':
+                ext = atoi(optarg);
+                break;
+            case 'c':
+                call = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1){
+        usage(argv[0]);
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if(f == NULL){
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    TRACE_FILE_HEADER hdr;
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0){
+        fprintf(stderr, "%s: not a PBX trace\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    if(hdr.version != TRACE_VERSION || hdr.event_size != sizeof(TRACE_EVENT) || hdr.ring_events == 0){
+        fprintf(stderr, "%s: unsupported trace format (version %u, %u-byte events)\n",
+                argv[optind], hdr.version, hdr.event_size);
+        exit(EXIT_FAILURE);
+    }
+
+    //Gather the valid events of every ring into one array and sort it by time
+    size_t max_events = (size_t)hdr.num_rings * hdr.ring_events;
+    TRACE_EVENT *events = malloc((max_events ? max_events : 1) * sizeof(TRACE_EVENT));
+    TRACE_EVENT *ring = malloc(hdr.ring_events * sizeof(TRACE_EVENT));
+    if(events == NULL || ring == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for(uint32_t r = 0; r < hdr.num_rings; r++){
+        TRACE_RING_HEADER rh;
+        if(fread(&rh, sizeof(rh), 1, f) != 1 || fread(ring, sizeof(TRACE_EVENT), hdr.ring_events, f) != hdr.ring_events){
+            fprintf(stderr, "%s: truncated after %u of %u rings\n", argv[optind], r, hdr.num_rings);
+            break;
+        }
+        uint64_t valid = rh.head < hdr.ring_events ? rh.head : hdr.ring_events;
+        for(uint64_t i = 0; i < valid; i++){
+            TRACE_EVENT *ev = &ring[i];
+            if((ext < 0 || ev->ext == ext || ev->peer_ext == ext) && (call < 0 || ev->call_id == call)){
+                events[n++] = *ev;
+            }
+        }
+    }
+    fclose(f);
+    qsort(events, n, sizeof(TRACE_EVENT), by_time);
+
+    printf("%12s %8s %6s %6s %8s  %-9s %s\n", "TIME (ms)", "THREAD", "EXT", "PEER", "CALL", "COMMAND", "TRANSITION");
+    for(size_t i = 0; i < n; i++){
+        TRACE_EVENT *ev = &events[i];
+        char peer[16] = "-", call_id[16] = "-";
+        if(ev->peer_ext >= 0) snprintf(peer, sizeof(peer), "%d", ev->peer_ext);
+        if(ev->call_id != 0) snprintf(call_id, sizeof(call_id), "%u", ev->call_id);
+        printf("%12.6f %8d %6d %6s %8s  %-9s %s -> %s\n",
+               (ev->ts_ns - events[0].ts_ns) / 1e6, ev->tid, ev->ext, peer, call_id,
+               command_name(ev->cmd), state_name(ev->old_state), state_name(ev->new_state));
+    }
+    printf("%zu events from %u thread rings\n", n, hdr.num_rings);
+    free(ring);
+    free(events);
+    return EXIT_SUCCESS;
+}